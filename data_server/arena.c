@@ -0,0 +1,100 @@
+#include "arena.h"
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+static __thread Arena *request_arena;
+
+// Whole pages, since chunks are what mprotect works on
+static size_t regular_chunk_size(const Arena *arena) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = arena->chunk_size ? arena->chunk_size : ARENA_DEFAULT_CHUNK;
+    return (size + page - 1) / page * page;
+}
+
+void arena_init(Arena *arena, size_t chunk_size) {
+    memset(arena, 0, sizeof(*arena));
+    arena->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (size == 0) size = ARENA_ALIGN;
+
+    // Address space only: it takes no memory until committed below
+    if (!arena->base) {
+        void *base = mmap(NULL, ARENA_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) return NULL;
+        arena->base = base;
+    }
+    if (size > ARENA_RESERVE - arena->used) return NULL;
+
+    if (arena->used + size > arena->committed) {
+        size_t chunk = regular_chunk_size(arena);
+        size_t committed = (arena->used + size + chunk - 1) / chunk * chunk;
+        if (committed > ARENA_RESERVE) committed = ARENA_RESERVE;
+
+        if (mprotect(arena->base + arena->committed, committed - arena->committed, PROT_READ | PROT_WRITE) != 0) return NULL;
+        arena->committed = committed;
+    }
+
+    void *ptr = arena->base + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+char *arena_strdup(Arena *arena, const char *text) {
+    size_t length = strlen(text) + 1;
+    char *copy = arena_alloc(arena, length);
+    if (copy) memcpy(copy, text, length);
+    return copy;
+}
+
+int arena_owns(const Arena *arena, const void *ptr) {
+    // Below base wraps around to a huge offset, so one comparison covers both ends
+    return arena->base && (uintptr_t)ptr - (uintptr_t)arena->base < arena->used;
+}
+
+void arena_reset(Arena *arena) {
+    // One chunk stays backed for the next request; what a large request committed past it goes back
+    size_t keep = regular_chunk_size(arena);
+    if (arena->committed > keep) {
+        void *released = mmap(arena->base + keep, arena->committed - keep, PROT_NONE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if (released != MAP_FAILED) arena->committed = keep;
+    }
+    arena->used = 0;
+}
+
+void arena_free(Arena *arena) {
+    if (arena->base) munmap(arena->base, ARENA_RESERVE);
+    arena->base = NULL;
+    arena->used = 0;
+    arena->committed = 0;
+}
+
+void arena_request_begin(Arena *arena) {
+    request_arena = arena;
+}
+
+void arena_request_end(void) {
+    request_arena = NULL;
+}
+
+void *request_alloc(size_t size) {
+    return request_arena ? arena_alloc(request_arena, size) : malloc(size);
+}
+
+char *request_strdup(const char *text) {
+    return request_arena ? arena_strdup(request_arena, text) : strdup(text);
+}
+
+void request_free(void *ptr) {
+    if (!ptr || (request_arena && arena_owns(request_arena, ptr))) return;
+    free(ptr);
+}
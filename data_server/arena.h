@@ -0,0 +1,39 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_DEFAULT_CHUNK (64 * 1024)
+#define ARENA_RESERVE ((size_t)1 << 30)  // address space per arena, and the most one request can use
+
+// Bump allocator for everything one request allocates: cJSON nodes (through cJSON_InitHooks)
+// and the strings the managers hand back. It hands out one reserved range of address space,
+// backed with memory a chunk at a time, so whether a pointer is the arena's is a single range
+// check. Nothing is freed on its own; arena_reset() gives it all back at once, keeping the
+// first chunk backed for the next request. A zeroed Arena is ready to use with
+// ARENA_DEFAULT_CHUNK chunks and reserves its range on the first allocation.
+typedef struct {
+    unsigned char *base;
+    size_t used;
+    size_t committed;   // backed with memory, in whole chunks
+    size_t chunk_size;
+} Arena;
+
+void arena_init(Arena *arena, size_t chunk_size);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strdup(Arena *arena, const char *text);
+int arena_owns(const Arena *arena, const void *ptr);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+// The calling thread's request arena. Between begin and end, request_alloc/request_strdup
+// take memory from it and request_free ignores pointers it owns; outside they are plain
+// malloc, strdup and free, so code shared with other threads works either way.
+void arena_request_begin(Arena *arena);
+void arena_request_end(void);
+
+void *request_alloc(size_t size);
+char *request_strdup(const char *text);
+void request_free(void *ptr);
+
+#endif
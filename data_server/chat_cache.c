@@ -0,0 +1,307 @@
+#include "chat_cache.h"
+#include "lru_map.h"
+#include "../lib/env/env.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    LruNode node;
+    ChatMembers members;
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    LruMap map;
+
+    // Bumped by every membership change in this shard, cached or not
+    unsigned long epoch;
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long updates;
+    unsigned long invalidations;
+    unsigned long stale_loads;
+} CacheShard;
+
+struct ChatCache {
+    CacheShard shards[CHAT_CACHE_SHARDS];
+};
+
+void chat_cache_config_from_env(ChatCacheConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->capacity = env_int("CHAT_CACHE_SIZE", CHAT_CACHE_DEFAULT_CAPACITY, true);
+}
+
+static CacheShard *shard_for(ChatCache *cache, int chat_id) {
+    return &cache->shards[(id_hash(chat_id) >> 32) % CHAT_CACHE_SHARDS];
+}
+
+static int chat_matches(const LruNode *node, const void *chat_id) {
+    return ((const CacheEntry *)node)->members.chat_id == *(const int *)chat_id;
+}
+
+static CacheEntry *shard_find(CacheShard *shard, int chat_id) {
+    return (CacheEntry *)lru_map_find(&shard->map, id_hash(chat_id), chat_matches, &chat_id);
+}
+
+static void entry_free(LruNode *node) {
+    CacheEntry *entry = (CacheEntry *)node;
+    free_chat_members(&entry->members);
+    free(entry);
+}
+
+static void shard_remove(CacheShard *shard, CacheEntry *entry) {
+    lru_map_remove(&shard->map, &entry->node);
+    entry_free(&entry->node);
+}
+
+ChatCache *chat_cache_create(const ChatCacheConfig *config) {
+    if (config->capacity <= 0) {
+        printf("Chat cache disabled\n");
+        return NULL;
+    }
+
+    ChatCache *cache = calloc(1, sizeof(ChatCache));
+    if (!cache) return NULL;
+
+    int shard_capacity = (config->capacity + CHAT_CACHE_SHARDS - 1) / CHAT_CACHE_SHARDS;
+
+    for (int i = 0; i < CHAT_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+
+        if (lru_map_init(&shard->map, shard_capacity) != 0) {
+            chat_cache_destroy(cache);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    printf("Chat cache ready: %d chats in %d shards\n", shard_capacity * CHAT_CACHE_SHARDS, CHAT_CACHE_SHARDS);
+    return cache;
+}
+
+void chat_cache_destroy(ChatCache *cache) {
+    if (!cache) return;
+
+    for (int i = 0; i < CHAT_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+        if (!shard->map.buckets) continue;
+
+        lru_map_destroy(&shard->map, entry_free);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+void chat_members_access(const ChatMembers *members, int user_id, ChatAccess *access) {
+    memset(access, 0, sizeof(*access));
+    access->is_group = members->is_group;
+    access->participant_count = members->count;
+
+    for (int i = 0; i < members->count; i++) {
+        int is_admin = members->is_admin[i] == 1;
+
+        access->admin_count += is_admin;
+        if (members->user_ids[i] == user_id) {
+            access->is_member = 1;
+            access->is_admin = is_admin;
+        }
+    }
+}
+
+int chat_cache_access(ChatCache *cache, int chat_id, int user_id, ChatAccess *access) {
+    if (!cache) return 0;
+
+    CacheShard *shard = shard_for(cache, chat_id);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = shard_find(shard, chat_id);
+    if (entry) {
+        lru_map_touch(&shard->map, &entry->node);
+        chat_members_access(&entry->members, user_id, access);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return entry != NULL;
+}
+
+int chat_cache_members(ChatCache *cache, int chat_id, ChatMembers *members) {
+    if (!cache) return 0;
+
+    CacheShard *shard = shard_for(cache, chat_id);
+    int found = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = shard_find(shard, chat_id);
+    if (entry) {
+        const ChatMembers *cached = &entry->members;
+        size_t size = (cached->count > 0 ? cached->count : 1) * sizeof(int);
+
+        *members = *cached;
+        members->user_ids = malloc(size);
+        members->is_admin = malloc(size);
+        if (members->user_ids && members->is_admin) {
+            memcpy(members->user_ids, cached->user_ids, cached->count * sizeof(int));
+            memcpy(members->is_admin, cached->is_admin, cached->count * sizeof(int));
+            lru_map_touch(&shard->map, &entry->node);
+            found = 1;
+        } else {
+            free_chat_members(members);
+        }
+    }
+    if (found) shard->hits++;
+    else shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    return found;
+}
+
+unsigned long chat_cache_epoch(ChatCache *cache, int chat_id) {
+    if (!cache) return 0;
+
+    CacheShard *shard = shard_for(cache, chat_id);
+
+    pthread_mutex_lock(&shard->lock);
+    unsigned long epoch = shard->epoch;
+    pthread_mutex_unlock(&shard->lock);
+
+    return epoch;
+}
+
+void chat_cache_put(ChatCache *cache, ChatMembers *members, unsigned long epoch) {
+    if (!cache) {
+        free_chat_members(members);
+        return;
+    }
+
+    CacheShard *shard = shard_for(cache, members->chat_id);
+
+    pthread_mutex_lock(&shard->lock);
+    // Another load got there first, or a change may have landed after this one was read
+    if (shard_find(shard, members->chat_id) || shard->epoch != epoch) {
+        if (shard->epoch != epoch) shard->stale_loads++;
+        pthread_mutex_unlock(&shard->lock);
+        free_chat_members(members);
+        return;
+    }
+
+    CacheEntry *entry = malloc(sizeof(CacheEntry));
+    if (!entry) {
+        pthread_mutex_unlock(&shard->lock);
+        free_chat_members(members);
+        return;
+    }
+
+    entry->members = *members;
+    LruNode *evicted = lru_map_insert(&shard->map, &entry->node, id_hash(members->chat_id));
+    if (evicted) {
+        entry_free(evicted);
+        shard->evictions++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    memset(members, 0, sizeof(*members));
+}
+
+void chat_cache_add_members(ChatCache *cache, int chat_id, const int user_ids[], const int is_admin[], int count) {
+    if (!cache) return;
+
+    CacheShard *shard = shard_for(cache, chat_id);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->epoch++;
+
+    CacheEntry *entry = shard_find(shard, chat_id);
+    if (entry && count > 0) {
+        ChatMembers *members = &entry->members;
+        int total = members->count + count;
+        int *grown_ids = realloc(members->user_ids, total * sizeof(int));
+        if (grown_ids) members->user_ids = grown_ids;
+        int *grown_admins = realloc(members->is_admin, total * sizeof(int));
+        if (grown_admins) members->is_admin = grown_admins;
+
+        if (grown_ids && grown_admins) {
+            // A load that raced with this change may already include some of them
+            for (int i = 0; i < count; i++) {
+                int known = 0;
+                for (int j = 0; j < members->count && !known; j++) known = members->user_ids[j] == user_ids[i];
+                if (known) continue;
+
+                members->user_ids[members->count] = user_ids[i];
+                members->is_admin[members->count] = is_admin[i];
+                members->count++;
+            }
+            shard->updates++;
+        } else {
+            shard_remove(shard, entry);
+            shard->invalidations++;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void chat_cache_remove_member(ChatCache *cache, int chat_id, int user_id) {
+    if (!cache) return;
+
+    CacheShard *shard = shard_for(cache, chat_id);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->epoch++;
+
+    CacheEntry *entry = shard_find(shard, chat_id);
+    if (entry) {
+        ChatMembers *members = &entry->members;
+        for (int i = 0; i < members->count; i++) {
+            if (members->user_ids[i] != user_id) continue;
+
+            members->count--;
+            members->user_ids[i] = members->user_ids[members->count];
+            members->is_admin[i] = members->is_admin[members->count];
+            break;
+        }
+        shard->updates++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void chat_cache_invalidate(ChatCache *cache, int chat_id) {
+    if (!cache) return;
+
+    CacheShard *shard = shard_for(cache, chat_id);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->epoch++;
+
+    CacheEntry *entry = shard_find(shard, chat_id);
+    if (entry) {
+        shard_remove(shard, entry);
+        shard->invalidations++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void chat_cache_stats(ChatCache *cache, ChatCacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!cache) return;
+
+    for (int i = 0; i < CHAT_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->updates += shard->updates;
+        stats->invalidations += shard->invalidations;
+        stats->stale_loads += shard->stale_loads;
+        stats->entries += shard->map.count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
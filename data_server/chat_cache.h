@@ -0,0 +1,67 @@
+#ifndef CHAT_CACHE_H
+#define CHAT_CACHE_H
+
+#include "chat_manager.h"
+
+#define CHAT_CACHE_DEFAULT_CAPACITY 16384
+#define CHAT_CACHE_SHARDS 16
+
+// Chat membership kept in memory so REMOVE_FROM_CHAT and EXIT_CHAT can check permissions
+// without a query per fact. Entries are loaded whole on a miss and then patched by the
+// handlers after every membership change they commit; changes the handler can't describe
+// exactly (a promotion picked by storage, a deleted chat) drop the entry instead.
+//
+// A load races with concurrent changes, so it is only kept if its shard saw no change
+// between chat_cache_epoch() and chat_cache_put().
+typedef struct {
+    int capacity;  // CHAT_CACHE_SIZE: most cached chats, 0 disables the cache
+} ChatCacheConfig;
+
+// What a permission check wants to know about one user in one chat
+typedef struct {
+    int is_group;
+    int is_member;
+    int is_admin;
+    int participant_count;
+    int admin_count;
+} ChatAccess;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long updates;        // entries patched in place
+    unsigned long invalidations;
+    unsigned long stale_loads;    // loads discarded because the chat changed meanwhile
+    unsigned long entries;
+} ChatCacheStats;
+
+typedef struct ChatCache ChatCache;
+
+void chat_cache_config_from_env(ChatCacheConfig *config);
+
+// NULL when the cache is disabled; every function below treats NULL as an always-missing cache
+ChatCache *chat_cache_create(const ChatCacheConfig *config);
+void chat_cache_destroy(ChatCache *cache);
+
+void chat_members_access(const ChatMembers *members, int user_id, ChatAccess *access);
+
+// Returns 1 and fills access on a hit, 0 on a miss
+int chat_cache_access(ChatCache *cache, int chat_id, int user_id, ChatAccess *access);
+
+// Copies the chat's members on a hit (release them with free_chat_members); 0 on a miss
+int chat_cache_members(ChatCache *cache, int chat_id, ChatMembers *members);
+
+// Read before loading members from storage and passed back to chat_cache_put
+unsigned long chat_cache_epoch(ChatCache *cache, int chat_id);
+
+// Takes ownership of the member arrays, whether or not the entry is kept
+void chat_cache_put(ChatCache *cache, ChatMembers *members, unsigned long epoch);
+
+void chat_cache_add_members(ChatCache *cache, int chat_id, const int user_ids[], const int is_admin[], int count);
+void chat_cache_remove_member(ChatCache *cache, int chat_id, int user_id);
+void chat_cache_invalidate(ChatCache *cache, int chat_id);
+
+void chat_cache_stats(ChatCache *cache, ChatCacheStats *stats);
+
+#endif
@@ -1,372 +1,467 @@
 #include "chat_manager.h"
 #include "user_manager.h"
+#include "../dbg.h"
 #include <mysql/mysql.h>
 #include <mysql/mysql_com.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define SYSTEM_USER_ID 1
 
-int create_chat(MYSQL *conn, Chat *chat){
-	char query[512];
+// Runs a statement whose only result is a single integer column.
+// Returns the value, fallback when there is no row and -1 on error.
+static int query_int(DbConn *conn, StmtId id, DbBinds *params, int fallback) {
+    MYSQL_STMT *stmt = conn->stmts[id];
+    DbBinds row = {0};
+    int value = 0;
 
-    snprintf(query, sizeof(query),
-        "INSERT INTO chats (is_group, chat_name) VALUES ('%d', '%s')", chat -> is_group, chat -> chat_name);
+    db_bind_int(&row, &value);
 
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Create chat failed: %s\n", mysql_error(conn));
-        return -1;
-    }
+    if (db_stmt_execute(stmt, params, &row)) return -1;
 
-	chat->id = (int)mysql_insert_id(conn);
+    int status = db_stmt_fetch(stmt, &row);
+    db_stmt_finish(stmt);
 
-    printf("Chat created successfully. ID = %d\n", chat->id);
-
-	return 0;
+    if (status < 0) return -1;
+    if (status == 0 || db_bind_is_null(&row, 0)) return fallback;
+    return value;
 }
 
-int add_to_chat(MYSQL *conn, int chat_id, int user_id, int is_admin){	
-	char query[512];
+int create_chat(DbConn *conn, Chat *chat){
+    MYSQL_STMT *stmt = conn->stmts[STMT_CREATE_CHAT];
+    DbBinds params = {0};
 
-    snprintf(query, sizeof(query),
-        "INSERT INTO chat_participants (chat_id, user_id, is_admin) VALUES ('%d', '%d', '%d')", 
-			 chat_id, user_id, is_admin);
+    db_bind_int(&params, &chat->is_group);
+    db_bind_string(&params, chat->chat_name);
 
-	printf("%s\n", query);
-
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Join failed: %s\n", mysql_error(conn));
+    if (db_stmt_execute(stmt, &params, NULL)) {
+        fprintf(stderr, "Create chat failed\n");
         return -1;
     }
 
-    printf("User joined succesfully successfully.\n");
+	chat->id = (int)mysql_stmt_insert_id(stmt);
+
+    debug("Chat created successfully. ID = %d", chat->id);
 
 	return 0;
 }
 
-int send_message(MYSQL *conn, Message *message) {
-    char query[2048];
+// Brings every inbox summary of the chat, new participants' included, up to its newest message
+static int sync_inbox(DbConn *conn, int chat_id) {
+    DbBinds params = {0};
 
+    db_bind_int(&params, &chat_id);
+    db_bind_int(&params, &chat_id);
 
-    snprintf(query, sizeof(query),
-        "INSERT INTO messages (chat_id, sender_id, content, message_type) VALUES (%d, %d, '%s', '%s')",
-        message->chat_id, message->sender_id, message->content, message->message_type);
+    if (db_stmt_execute(conn->stmts[STMT_SET_LATEST_MESSAGE], &params, NULL)) {
+        fprintf(stderr, "Update of chat %d inbox summaries failed\n", chat_id);
+        return -1;
+    }
+    return 0;
+}
+
+int add_to_chat(DbConn *conn, int chat_id, int user_id, int is_admin){
+    DbBinds params = {0};
+
+    db_bind_int(&params, &chat_id);
+    db_bind_int(&params, &user_id);
+    db_bind_int(&params, &is_admin);
 
-    printf("%s\n", query);
+    debug("Adding user %d to chat %d (admin: %d)", user_id, chat_id, is_admin);
 
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Send message failed: %s\n", mysql_error(conn));
+    if (db_stmt_execute(conn->stmts[STMT_ADD_TO_CHAT], &params, NULL)) {
+        fprintf(stderr, "Join failed\n");
         return -1;
     }
 
-    int message_id = (int) mysql_insert_id(conn);
+    if (sync_inbox(conn, chat_id) != 0) return -1;
 
-    snprintf(query, sizeof(query),
-        "UPDATE chats SET last_message_id = %d WHERE chat_id = %d",
-        message_id, message->chat_id);
+    debug("User joined succesfully successfully.");
 
-    printf("%s\n", query);
+	return 0;
+}
 
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Update last_message_id failed: %s\n", mysql_error(conn));
+int send_message(DbConn *conn, Message *message) {
+    return send_messages(conn, message, 1);
+}
+
+int add_participants(DbConn *conn, int chat_id, const int user_ids[], const int is_admin[], int count) {
+    MYSQL_STMT *stmt = db_batch_stmt(conn->mysql, conn->batch, BATCH_ADD_TO_CHAT, count);
+    DbBinds params = {0};
+
+    for (int i = 0; i < count; i++) {
+        db_bind_int(&params, &chat_id);
+        db_bind_int(&params, (int *)&user_ids[i]);
+        db_bind_int(&params, (int *)&is_admin[i]);
+    }
+
+    if (db_stmt_execute(stmt, &params, NULL)) {
+        fprintf(stderr, "Adding %d participants to chat %d failed\n", count, chat_id);
         return -1;
     }
 
-    printf("Message sent and last_message_id updated successfully\n");
+    if (sync_inbox(conn, chat_id) != 0) return -1;
 
+    debug("%d users joined chat %d", count, chat_id);
     return 0;
 }
 
-int get_chats(MYSQL *conn, int user_id, char *last_update_timestamp, Chat chats[MAX_CHATS]) {
-    char query[4096];  // tamaño ampliado por seguridad
-    MYSQL_RES *res;
-    MYSQL_ROW row;
-    int chat_count = 0;
-
-    if (last_update_timestamp == NULL) {
-        snprintf(query, sizeof(query),
-            "SELECT c.chat_id, c.chat_name, c.is_group, "
-            "m.content AS last_message_content, "
-            "m.message_type AS last_message_type, "
-            "m.created_at AS last_message_timestamp, "
-            "u.username AS last_message_sender_username "
-            "FROM chats c "
-            "JOIN chat_participants cp ON cp.chat_id = c.chat_id "
-            "LEFT JOIN messages m ON m.message_id = c.last_message_id "
-            "LEFT JOIN users u ON u.user_id = m.sender_id "
-            "WHERE cp.user_id = %d "
-            "ORDER BY c.chat_id", user_id);
-    } else {
-        snprintf(query, sizeof(query),
-            "SELECT c.chat_id, c.chat_name, c.is_group, "
-            "m.content AS last_message_content, "
-            "m.message_type AS last_message_type, "
-            "m.created_at AS last_message_timestamp, "
-            "u.username AS last_message_sender_username "
-            "FROM chats c "
-            "JOIN chat_participants cp ON cp.chat_id = c.chat_id "
-            "LEFT JOIN messages m ON m.message_id = c.last_message_id "
-            "LEFT JOIN users u ON u.user_id = m.sender_id "
-            "WHERE cp.user_id = %d AND (c.last_message_id IS NULL OR EXISTS ("
-            "SELECT 1 FROM messages m2 "
-            "WHERE m2.chat_id = c.chat_id AND m2.created_at > '%s' AND m2.is_deleted = 0)) "
-            "ORDER BY c.chat_id", user_id, last_update_timestamp);
-    }
-
-    printf("Query:\n%s\n", query);
-
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Query failed: %s\n", mysql_error(conn));
-        return -1;
-    }
-
-    res = mysql_store_result(conn);
-    if (!res) {
-        fprintf(stderr, "Store result failed: %s\n", mysql_error(conn));
-        return -1;
-    }
-
-    while ((row = mysql_fetch_row(res)) != NULL && chat_count < MAX_CHATS) {
-        Chat *chat = &chats[chat_count++];
-
-        chat->id = row[0] ? atoi(row[0]) : 0;
-        chat->chat_name = row[1] ? strdup(row[1]) : strdup("");
-        chat->is_group = row[2] ? atoi(row[2]) : 0;
-        chat->last_message_content = row[3] ? strdup(row[3]) : strdup("No messages yet");
-        chat->last_message_type = row[4] ? strdup(row[4]) : strdup("");
-        chat->last_message_timestamp = row[5] ? strdup(row[5]) : strdup("");
-        chat->last_message_by = row[6] ? strdup(row[6]) : strdup("");
-    }
-
-    mysql_free_result(res);
-    return chat_count;
-}
-
-int get_chat_messages(MYSQL *conn, int chat_id, char *last_update_timestamp, Message messages[MAX_MESSAGES]) {
-    char query[2048];
-    MYSQL_RES *res;
-    MYSQL_ROW row;
-    int messages_count = 0;
-
-    if (last_update_timestamp == NULL) {
-		snprintf(query, sizeof(query), "SELECT m.message_id, m.sender_id, u.username AS sender_username, m.content, m.message_type, m.created_at FROM messages m JOIN users u ON u.user_id = m.sender_id WHERE m.chat_id = %d AND m.is_deleted = 0", chat_id);
-		
-    } else {
-		snprintf(query, sizeof(query), "SELECT m.message_id, m.sender_id, u.username AS sender_username, m.content, m.message_type, m.created_at FROM messages m JOIN users u ON u.user_id = m.sender_id WHERE m.chat_id = %d AND m.is_deleted = 0 AND (m.created_at > '%s')", chat_id, last_update_timestamp);
+int send_messages(DbConn *conn, Message messages[], int count) {
+    // The inbox is synced for one chat below, so a mixed array is refused before anything is written
+    for (int i = 1; i < count; i++) {
+        if (messages[i].chat_id != messages[0].chat_id) {
+            fprintf(stderr, "Sending messages failed: chat %d and chat %d in one call\n", messages[0].chat_id, messages[i].chat_id);
+            return -1;
+        }
     }
 
-	printf("query: \n%s\n", query);
-
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Query failed: %s\n", mysql_error(conn));
-        return -1;
+    // Rows go out in chunks of the largest cached batch; last_message_id is updated once
+    for (int sent = 0; sent < count; sent += DB_BATCH_MAX_ROWS) {
+        int rows = count - sent < DB_BATCH_MAX_ROWS ? count - sent : DB_BATCH_MAX_ROWS;
+        MYSQL_STMT *stmt = db_batch_stmt(conn->mysql, conn->batch, BATCH_INSERT_MESSAGE, rows);
+        DbBinds params = {0};
+
+        for (int i = sent; i < sent + rows; i++) {
+            db_bind_int(&params, &messages[i].chat_id);
+            db_bind_int(&params, &messages[i].sender_id);
+            db_bind_string(&params, messages[i].content);
+            db_bind_string(&params, messages[i].message_type);
+            db_bind_id(&params, messages[i].log_id ? &messages[i].log_id : NULL);
+            db_bind_id(&params, messages[i].log_id ? &messages[i].log_sequence : NULL);
+        }
+
+        if (db_stmt_execute(stmt, &params, NULL)) {
+            fprintf(stderr, "Sending %d messages failed\n", rows);
+            return -1;
+        }
     }
 
-    res = mysql_store_result(conn);
-    if (!res) {
-        fprintf(stderr, "Store result failed: %s\n", mysql_error(conn));
+    // The batch may not get consecutive ids, so let the server pick the newest one
+    return sync_inbox(conn, messages[0].chat_id);
+}
+
+int get_chats(DbConn *conn, int user_id, const ChatPage *page, const RowSink *sink, int *has_more) {
+    MYSQL_STMT *stmt = conn->stmts[page->since_timestamp ? STMT_GET_INBOX_SINCE : STMT_GET_INBOX];
+    DbBinds params = {0};
+    DbBinds row = {0};
+    int chat_count = 0;
+
+    // Without a cursor the page starts above every possible key
+    int has_cursor = page->before_chat_id > 0;
+    int before_message_id = has_cursor ? page->before_message_id : INT_MAX;
+    int before_chat_id = has_cursor ? page->before_chat_id : INT_MAX;
+    int fetch_limit = page->limit + 1;  // one extra row tells whether another page exists
+
+    int chat_id, is_group, last_message_id;
+    char chat_name[MAX_STRING];
+    char content[MAX_CONTENT_LENGTH];
+    char type[MAX_TYPE_LENGTH];
+    char timestamp[MAX_TIMESTAMP_LENGTH];
+    char sender[MAX_USERNAME_LENGTH];
+
+    db_bind_int(&params, &user_id);
+    if (page->since_timestamp) db_bind_string(&params, page->since_timestamp);
+    db_bind_int(&params, &before_message_id);
+    db_bind_int(&params, &before_message_id);
+    db_bind_int(&params, &before_chat_id);
+    db_bind_int(&params, &fetch_limit);
+
+    db_bind_int(&row, &chat_id);
+    db_bind_buffer(&row, chat_name, sizeof(chat_name));
+    db_bind_int(&row, &is_group);
+    db_bind_buffer(&row, content, sizeof(content));
+    db_bind_buffer(&row, type, sizeof(type));
+    db_bind_buffer(&row, timestamp, sizeof(timestamp));
+    db_bind_buffer(&row, sender, sizeof(sender));
+    db_bind_int(&row, &last_message_id);
+
+    if (db_stmt_execute(stmt, &params, &row)) {
+        fprintf(stderr, "Query failed\n");
         return -1;
     }
 
-	while ((row = mysql_fetch_row(res)) != NULL) {
-    Message *message = &messages[messages_count++];
+    // Each row goes to the sink straight from the bind buffers
+    *has_more = db_stmt_row_count(stmt) > (unsigned long long)page->limit;
+    while (chat_count < page->limit && db_stmt_fetch(stmt, &row) == 1) {
+        Chat chat = {
+            .id = db_bind_is_null(&row, 0) ? 0 : chat_id,
+            .chat_name = chat_name,
+            .is_group = db_bind_is_null(&row, 2) ? 0 : is_group,
+            .last_message_content = db_bind_is_null(&row, 3) ? "No messages yet" : content,
+            .last_message_type = type,
+            .last_message_timestamp = timestamp,
+            .last_message_by = sender,
+            .last_message_id = db_bind_is_null(&row, 7) ? 0 : last_message_id,
+        };
+
+        sink->chat(sink->ctx, &chat);
+        chat_count++;
+    }
 
-    message->message_id = row[0] ? atoi(row[0]) : 0;
-    message->sender_id = row[1] ? atoi(row[1]) : 0;
+    db_stmt_finish(stmt);
+    return chat_count;
+}
 
-    strncpy(message->sender_username, row[2] ? row[2] : "", MAX_USERNAME_LENGTH - 1);
-    message->sender_username[MAX_USERNAME_LENGTH - 1] = '\0';
+int get_chat_count(DbConn *conn, int user_id) {
+    DbBinds params = {0};
 
-    strncpy(message->content, row[3] ? row[3] : "", MAX_CONTENT_LENGTH - 1);
-    message->content[MAX_CONTENT_LENGTH - 1] = '\0';
+    db_bind_int(&params, &user_id);
+    return query_int(conn, STMT_USER_CHAT_COUNT, &params, 0);
+}
 
-    strncpy(message->message_type, row[4] ? row[4] : "", MAX_TYPE_LENGTH - 1);
-    message->message_type[MAX_TYPE_LENGTH - 1] = '\0';
+int get_chat_messages(DbConn *conn, int chat_id, const MessagePage *page, const RowSink *sink, int *has_more) {
+    StmtId id = STMT_GET_CHAT_MESSAGES;
+    int newest_first = 1;
+    int limit = page->limit;
+    int fetch_limit = limit + 1;  // one extra row tells whether another page exists
+    DbBinds params = {0};
+    DbBinds row = {0};
+    Message current = {0};
+
+    db_bind_int(&params, &chat_id);
+    if (page->before_id > 0) {
+        id = STMT_GET_CHAT_MESSAGES_BEFORE;
+        db_bind_int(&params, (int *)&page->before_id);
+    } else if (page->after_id > 0) {
+        id = STMT_GET_CHAT_MESSAGES_AFTER;
+        newest_first = 0;
+        db_bind_int(&params, (int *)&page->after_id);
+    } else if (page->since_timestamp) {
+        id = STMT_GET_CHAT_MESSAGES_SINCE;
+        newest_first = 0;
+        db_bind_string(&params, page->since_timestamp);
+    }
+    db_bind_int(&params, &fetch_limit);
+
+    // Row columns land straight in the fixed-size Message fields
+    MYSQL_STMT *stmt = conn->stmts[id];
+    db_bind_int(&row, &current.message_id);
+    db_bind_int(&row, &current.sender_id);
+    db_bind_buffer(&row, current.sender_username, sizeof(current.sender_username));
+    db_bind_buffer(&row, current.content, sizeof(current.content));
+    db_bind_buffer(&row, current.message_type, sizeof(current.message_type));
+    db_bind_buffer(&row, current.created_at, sizeof(current.created_at));
+
+    if (db_stmt_execute(stmt, &params, &row)) {
+        fprintf(stderr, "Query failed\n");
+        return -1;
+    }
 
-    strncpy(message->created_at, row[5] ? row[5] : "", MAX_TIMESTAMP_LENGTH - 1);
-    message->created_at[MAX_TIMESTAMP_LENGTH - 1] = '\0';
-}
+    unsigned long long rows = db_stmt_row_count(stmt);
+    int messages_count = rows > (unsigned long long)limit ? limit : (int)rows;
+    *has_more = rows > (unsigned long long)limit;
+    current.chat_id = chat_id;
+
+    // Pages read newest first are walked backwards through the buffered rows, so every page
+    // reaches the sink in chronological order without being collected first
+    for (int i = 0; i < messages_count; i++) {
+        int status = newest_first ? db_stmt_fetch_at(stmt, &row, messages_count - 1 - i)
+                                  : db_stmt_fetch(stmt, &row);
+        if (status != 1) {
+            db_stmt_finish(stmt);
+            return -1;
+        }
+        sink->message(sink->ctx, &current);
+    }
 
-    mysql_free_result(res);
-	printf("Query done\n");
+    db_stmt_finish(stmt);
     return messages_count;
 }
 
-int get_chat_info(MYSQL *conn, int chat_id, Chat *chat, User participants[], int *participant_count) {
-    MYSQL_RES *res;
-    MYSQL_ROW row;
+int get_chat_info(DbConn *conn, int chat_id, const RowSink *sink) {
+    MYSQL_STMT *stmt = conn->stmts[STMT_GET_CHAT];
+    DbBinds params = {0};
+    DbBinds row = {0};
+    char chat_name[MAX_STRING];
+    int id = 0, is_group = 0;
 
     // Obtener información del chat
-    char query[512];
-    snprintf(query, sizeof(query),
-             "SELECT chat_id, chat_name, is_group FROM chats WHERE chat_id = %d", chat_id);
+    db_bind_int(&params, &chat_id);
+    db_bind_int(&row, &id);
+    db_bind_buffer(&row, chat_name, sizeof(chat_name));
+    db_bind_int(&row, &is_group);
 
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Query failed: %s\n", mysql_error(conn));
+    if (db_stmt_execute(stmt, &params, &row)) {
+        fprintf(stderr, "Query failed\n");
         return -1;
     }
 
-    res = mysql_store_result(conn);
-    if ((row = mysql_fetch_row(res)) == NULL) {
-        mysql_free_result(res);
-        return -1; // Chat no encontrado
-    }
-
-    chat->id = atoi(row[0]);
-    chat->chat_name = strdup(row[1]);
-    chat->is_group = atoi(row[2]);
+    int found = db_stmt_fetch(stmt, &row) == 1;
+    db_stmt_finish(stmt);
 
-    mysql_free_result(res);
+    if (!found) return -1; // Chat no encontrado
 
     // Obtener participantes del chat
-    snprintf(query, sizeof(query),
-             "SELECT u.user_id, u.username, u.email, u.password_hash, cp.is_admin "
-             "FROM chat_participants cp "
-             "JOIN users u ON cp.user_id = u.user_id "
-             "WHERE cp.chat_id = %d", chat_id);
-
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Query failed: %s\n", mysql_error(conn));
+    MYSQL_STMT *participants = conn->stmts[STMT_GET_CHAT_PARTICIPANTS];
+    DbBinds user_row = {0};
+    char username[MAX_STRING];
+    int user_id = 0, is_admin = 0;
+
+    db_bind_int(&user_row, &user_id);
+    db_bind_buffer(&user_row, username, sizeof(username));
+    db_bind_int(&user_row, &is_admin);
+
+    if (db_stmt_execute(participants, &params, &user_row)) {
+        fprintf(stderr, "Query failed\n");
         return -1;
     }
 
-    res = mysql_store_result(conn);
-    int count = 0;
-
-    while ((row = mysql_fetch_row(res)) != NULL && count < MAX_PARTICIPANTS) {
-        User *user = &participants[count];
-        user->id = atoi(row[0]);
-        user->username = strdup(row[1]);
-        user->email = strdup(row[2]);
-        user->hash_password = strdup(row[3]);
-        user->is_admin = atoi(row[4]);
-        count++;
-    }
+    // Both result sets are buffered by now, so nothing reaches the sink unless both queries worked
+    Chat chat = { .id = id, .chat_name = chat_name, .is_group = is_group };
+    sink->chat(sink->ctx, &chat);
 
-    *participant_count = count;
-    mysql_free_result(res);
+    User user = { .username = username };
+    for (int count = 0; count < MAX_PARTICIPANTS && db_stmt_fetch(participants, &user_row) == 1; count++) {
+        user.id = user_id;
+        user.is_admin = is_admin;
+        sink->participant(sink->ctx, &user);
+    }
 
+    db_stmt_finish(participants);
     return 0;
 }
 
-int is_user_admin(MYSQL *conn, int chat_id, int user_id) {
-    char query[256];
-    snprintf(query, sizeof(query),
-             "SELECT is_admin FROM chat_participants WHERE chat_id = %d AND user_id = %d",
-             chat_id, user_id);
+int is_user_admin(DbConn *conn, int chat_id, int user_id) {
+    DbBinds params = {0};
 
-    if (mysql_query(conn, query)) return 0;
+    db_bind_int(&params, &chat_id);
+    db_bind_int(&params, &user_id);
 
-    MYSQL_RES *res = mysql_store_result(conn);
-    MYSQL_ROW row = mysql_fetch_row(res);
-    int result = (row && atoi(row[0]) == 1) ? 1 : 0;
-
-    mysql_free_result(res);
-    return result;
+    return query_int(conn, STMT_IS_USER_ADMIN, &params, 0) == 1 ? 1 : 0;
 }
 
-int is_group_chat(MYSQL *conn, int chat_id) {
-    char query[256];
-    snprintf(query, sizeof(query), "SELECT is_group FROM chats WHERE chat_id = %d", chat_id);
+int is_group_chat(DbConn *conn, int chat_id) {
+    DbBinds params = {0};
+
+    db_bind_int(&params, &chat_id);
 
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "MySQL query failed: %s\n", mysql_error(conn));
+    int is_group = query_int(conn, STMT_IS_GROUP_CHAT, &params, 0);
+    if (is_group < 0) {
+        fprintf(stderr, "Is group chat query failed\n");
         return -1;
     }
 
-    MYSQL_RES *res = mysql_store_result(conn);
-    if (!res) {
-        fprintf(stderr, "mysql_store_result() failed\n");
-        return false;
-    }
+    return is_group == 1;
+}
+
+
+int remove_from_chat(DbConn *conn, int chat_id, int user_id) {
+    DbBinds params = {0};
+
+    db_bind_int(&params, &chat_id);
+    db_bind_int(&params, &user_id);
 
-    MYSQL_ROW row = mysql_fetch_row(res);
-    bool result = false;
-    if (row && row[0]) {
-        result = atoi(row[0]) == 1;
+    if (db_stmt_execute(conn->stmts[STMT_REMOVE_FROM_CHAT], &params, NULL)) {
+        fprintf(stderr, "Remove query failed\n");
+        return -1;
     }
 
-    mysql_free_result(res);
-    return result;
+    return 0;
 }
 
+int get_chat_members(DbConn *conn, int chat_id, ChatMembers *members) {
+    MYSQL_STMT *stmt = conn->stmts[STMT_GET_CHAT_MEMBERS];
+    DbBinds params = {0};
+    DbBinds row = {0};
+    int is_group = 0, user_id = 0, is_admin = 0;
+    int capacity = 0, status, rows = 0;
 
-int remove_from_chat(MYSQL *conn, int chat_id, int user_id) {
-    char query[256];
-    snprintf(query, sizeof(query),
-             "DELETE FROM chat_participants WHERE chat_id = %d AND user_id = %d",
-             chat_id, user_id);
+    memset(members, 0, sizeof(*members));
+    members->chat_id = chat_id;
 
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Remove query failed: %s\n", mysql_error(conn));
+    db_bind_int(&params, &chat_id);
+    db_bind_int(&row, &is_group);
+    db_bind_int(&row, &user_id);
+    db_bind_int(&row, &is_admin);
+
+    if (db_stmt_execute(stmt, &params, &row)) {
+        fprintf(stderr, "Chat members query failed\n");
         return -1;
     }
 
+    while ((status = db_stmt_fetch(stmt, &row)) == 1) {
+        rows++;
+        members->is_group = is_group;
+
+        // A chat without participants still comes back as one row with NULLs
+        if (db_bind_is_null(&row, 1)) continue;
+
+        if (members->count == capacity) {
+            capacity = capacity ? capacity * 2 : MAX_PARTICIPANTS;
+            int *user_ids = realloc(members->user_ids, capacity * sizeof(int));
+            if (user_ids) members->user_ids = user_ids;
+            int *admins = realloc(members->is_admin, capacity * sizeof(int));
+            if (admins) members->is_admin = admins;
+
+            if (!user_ids || !admins) {
+                status = -1;
+                break;
+            }
+        }
+
+        members->user_ids[members->count] = user_id;
+        members->is_admin[members->count] = is_admin;
+        members->count++;
+    }
+    db_stmt_finish(stmt);
+
+    if (status < 0 || rows == 0) {
+        free_chat_members(members);
+        return -1;
+    }
     return 0;
 }
 
-int get_participant_count(MYSQL *conn, int chat_id) {
-    char query[128];
-    snprintf(query, sizeof(query), "SELECT COUNT(*) FROM chat_participants WHERE chat_id = %d", chat_id);
-
-    if (mysql_query(conn, query)) return -1;
-    MYSQL_RES *res = mysql_store_result(conn);
-    MYSQL_ROW row = mysql_fetch_row(res);
-    int count = row ? atoi(row[0]) : -1;
-    mysql_free_result(res);
-    return count;
+void free_chat_members(ChatMembers *members) {
+    free(members->user_ids);
+    free(members->is_admin);
+    members->user_ids = NULL;
+    members->is_admin = NULL;
+    members->count = 0;
 }
 
-int get_admin_count(MYSQL *conn, int chat_id) {
-    char query[128];
-    snprintf(query, sizeof(query), "SELECT COUNT(*) FROM chat_participants WHERE chat_id = %d AND is_admin = 1", chat_id);
+int get_participant_count(DbConn *conn, int chat_id) {
+    DbBinds params = {0};
 
-    if (mysql_query(conn, query)) return -1;
-    MYSQL_RES *res = mysql_store_result(conn);
-    MYSQL_ROW row = mysql_fetch_row(res);
-    int count = row ? atoi(row[0]) : -1;
-    mysql_free_result(res);
-    return count;
+    db_bind_int(&params, &chat_id);
+    return query_int(conn, STMT_PARTICIPANT_COUNT, &params, -1);
 }
 
-int promote_random_participant_to_admin(MYSQL *conn, int chat_id) {
-    char query_select[256];
-    snprintf(query_select, sizeof(query_select),
-             "SELECT user_id FROM chat_participants WHERE chat_id = %d LIMIT 1", chat_id);
+int get_admin_count(DbConn *conn, int chat_id) {
+    DbBinds params = {0};
 
-    if (mysql_query(conn, query_select)) {
-        fprintf(stderr, "Select for promote failed: %s\n", mysql_error(conn));
-        return -1;
-    }
+    db_bind_int(&params, &chat_id);
+    return query_int(conn, STMT_ADMIN_COUNT, &params, -1);
+}
 
-    MYSQL_RES *res = mysql_store_result(conn);
-    MYSQL_ROW row = mysql_fetch_row(res);
+int promote_random_participant_to_admin(DbConn *conn, int chat_id) {
+    DbBinds params = {0};
 
-    if (!row) {
-        mysql_free_result(res);
+    db_bind_int(&params, &chat_id);
+
+    int user_id = query_int(conn, STMT_FIRST_PARTICIPANT, &params, -1);
+    if (user_id < 0) {
+        fprintf(stderr, "Select for promote failed\n");
         return -1;
     }
 
-    int user_id = atoi(row[0]);
-    mysql_free_result(res);
-
-    char query_update[256];
-    snprintf(query_update, sizeof(query_update),
-             "UPDATE chat_participants SET is_admin = 1 WHERE chat_id = %d AND user_id = %d",
-             chat_id, user_id);
+    DbBinds update = {0};
+    db_bind_int(&update, &chat_id);
+    db_bind_int(&update, &user_id);
 
-    if (mysql_query(conn, query_update)) {
-        fprintf(stderr, "Update for promote failed: %s\n", mysql_error(conn));
+    if (db_stmt_execute(conn->stmts[STMT_PROMOTE_ADMIN], &update, NULL)) {
+        fprintf(stderr, "Update for promote failed\n");
         return -1;
     }
 
     return 0;
 }
 
-int delete_chat(MYSQL *conn, int chat_id) {
-    char query[128];
-    snprintf(query, sizeof(query), "DELETE FROM chats WHERE chat_id = %d", chat_id);
+int delete_chat(DbConn *conn, int chat_id) {
+    DbBinds params = {0};
 
-    return mysql_query(conn, query) == 0 ? 0 : -1;
+    db_bind_int(&params, &chat_id);
+    return db_stmt_execute(conn->stmts[STMT_DELETE_CHAT], &params, NULL) == 0 ? 0 : -1;
 }
-
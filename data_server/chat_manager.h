@@ -1,4 +1,8 @@
+#ifndef CHAT_MANAGER_H
+#define CHAT_MANAGER_H
+
 #include<stdio.h>
+#include<stdint.h>
 #include<mysql/mysql.h>
 #include "user_manager.h"
 
@@ -6,6 +10,8 @@
 #define MAX_CHATS 100
 #define MAX_STRING 256
 #define MAX_MESSAGES 200
+#define DEFAULT_MESSAGE_PAGE 50
+#define DEFAULT_CHAT_PAGE 50
 
 #define MAX_USERNAME_LENGTH 64
 #define MAX_CONTENT_LENGTH 256
@@ -24,8 +30,19 @@ typedef struct {
 	char *last_message_type;
 	char *last_message_timestamp;
 	char *last_message_by;
+	int last_message_id;	// inbox sort key, 0 for chats without messages
 } Chat;
 
+// A page of a user's inbox, most recent activity first. The cursor is the
+// (last_message_id, chat_id) of the last chat on the previous page;
+// before_chat_id 0 starts at the top.
+typedef struct {
+    int before_message_id;
+    int before_chat_id;
+    char *since_timestamp;  // only chats with activity after this time
+    int limit;              // 1..MAX_CHATS
+} ChatPage;
+
 typedef struct {
     int message_id;
     int sender_id;
@@ -34,17 +51,62 @@ typedef struct {
     char content[MAX_CONTENT_LENGTH];
     char message_type[MAX_TYPE_LENGTH];
     char created_at[MAX_TIMESTAMP_LENGTH];
+    uint64_t log_id;        // message log the row came through, 0 when it was written directly
+    uint64_t log_sequence;  // its record in that log; the pair is unique, so a replay is skipped
 } Message;
 
-int create_chat(MYSQL *conn, Chat *chat);
-int add_to_chat(MYSQL *conn, int chat_id, int user_id, int is_admin);
-int send_message(MYSQL *conn, Message *message);
-int get_chats(MYSQL *conn, int user_id, char *last_update_timestamp, Chat chats[MAX_CHATS]);
-int get_chat_messages(MYSQL *conn, int chat_id, char *last_update_timestamp, Message messages[MAX_MESSAGES]);
-int get_chat_info(MYSQL *conn, int chat_id, Chat *chat, User participants[], int *participant_count);
+// Which page of a chat to read. With no cursor the newest messages are returned; before_id
+// scrolls back through history and after_id (or the older since_timestamp) catches up.
+typedef struct {
+    int before_id;
+    int after_id;
+    char *since_timestamp;
+    int limit;              // 1..MAX_MESSAGES
+} MessagePage;
+
+// Receives rows while they are read, so a response is written in the same pass without
+// collecting them first. Strings point into the fetch buffers (or the engine's own records)
+// and are only valid during the call. A reader only calls the callbacks for its own rows.
+typedef struct {
+    void *ctx;
+    void (*chat)(void *ctx, const Chat *chat);
+    void (*participant)(void *ctx, const User *user);
+    void (*message)(void *ctx, const Message *message);
+} RowSink;
+
+// Who belongs to a chat and who administers it; user_ids and is_admin are malloc'ed
+typedef struct {
+    int chat_id;
+    int is_group;
+    int count;
+    int *user_ids;
+    int *is_admin;
+} ChatMembers;
+
+int create_chat(DbConn *conn, Chat *chat);
+int add_to_chat(DbConn *conn, int chat_id, int user_id, int is_admin);
+int send_message(DbConn *conn, Message *message);
+// Multi-row variants. add_participants takes up to DB_BATCH_MAX_ROWS users;
+// send_messages takes any number of messages, all for the same chat
+int add_participants(DbConn *conn, int chat_id, const int user_ids[], const int is_admin[], int count);
+int send_messages(DbConn *conn, Message messages[], int count);
+// Hands up to page->limit chats to sink->chat and sets *has_more when the page was cut
+// short; returns the count or -1 on error
+int get_chats(DbConn *conn, int user_id, const ChatPage *page, const RowSink *sink, int *has_more);
+int get_chat_count(DbConn *conn, int user_id);
+// Same for messages, always in ascending message_id order
+int get_chat_messages(DbConn *conn, int chat_id, const MessagePage *page, const RowSink *sink, int *has_more);
+// sink->chat once, then sink->participant for each member (id, username and is_admin);
+// -1 if the chat doesn't exist
+int get_chat_info(DbConn *conn, int chat_id, const RowSink *sink);
+
+// One round trip for every membership fact a permission check needs; -1 if the chat doesn't exist
+int get_chat_members(DbConn *conn, int chat_id, ChatMembers *members);
+void free_chat_members(ChatMembers *members);
 
-int get_participant_count(MYSQL *conn, int chat_id);
-int get_admin_count(MYSQL *conn, int chat_id);
-int promote_random_participant_to_admin(MYSQL *conn, int chat_id);
-int delete_chat(MYSQL *conn, int chat_id);
+int get_participant_count(DbConn *conn, int chat_id);
+int get_admin_count(DbConn *conn, int chat_id);
+int promote_random_participant_to_admin(DbConn *conn, int chat_id);
+int delete_chat(DbConn *conn, int chat_id);
 
+#endif
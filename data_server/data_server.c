@@ -1,20 +1,47 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <mysql/mysql.h>
 #include <string.h>
+#include <stdarg.h>
 
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 
 #include <signal.h>
 
 #include "../lib/cjson/cJSON.h"
+#include "../lib/env/env.h"
+#include "../lib/frame/frame.h"
+#include "../lib/wire/wire.h"
+#include "../dbg.h"
 #include "user_manager.h"
 #include "chat_manager.h"
 #include "heartbeat_manager.h"
-
-#define BUFFER_SIZE 4096
+#include "storage.h"
+#include "worker_pool.h"
+#include "json_writer.h"
+#include "arena.h"
+#include "message_log.h"
+#include "user_cache.h"
+#include "chat_cache.h"
+#include "message_tail.h"
+#include "metrics.h"
+#include "subscriptions.h"
+#include "supervisor.h"
+
+#define LISTEN_BACKLOG 4096  // the kernel caps it at net.core.somaxconn
+#define MAX_EVENTS 64
+#define READS_PER_EVENT 16  // reads of one connection before the others get their turn
+#define SEND_TIMEOUT_MS 5000
+#define MAX_RESPONSE_IOV 64
+#define BATCH_MAX_REQUESTS 32
 
 
 #define UDP_HEARTBEAT_INTERVAL 1
@@ -26,32 +53,382 @@ void error(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
-enum ACTIONS{VALIDATE_USER = 0, CREATE_USER = 2, GET_USER_INFO = 3, CREATE_CHAT = 4, ADD_TO_GROUP_CHAT = 5, SEND_MESSAGE = 6, GET_CHATS = 7, GET_CHAT_MESSAGES = 8, GET_CHAT_INFO = 9, REMOVE_FROM_CHAT = 10, EXIT_CHAT = 11};
+enum ACTIONS{VALIDATE_USER = 0, CREATE_USER = 2, GET_USER_INFO = 3, CREATE_CHAT = 4, ADD_TO_GROUP_CHAT = 5, SEND_MESSAGE = 6, GET_CHATS = 7, GET_CHAT_MESSAGES = 8, GET_CHAT_INFO = 9, REMOVE_FROM_CHAT = 10, EXIT_CHAT = 11, HELLO = 12, SUBSCRIBE = 13, BATCH = 14};
+
+// Label of each action on the metrics endpoint, indexed by its id
+static const char *const action_names[] = {
+	[VALIDATE_USER] = "validate_user", [CREATE_USER] = "create_user", [GET_USER_INFO] = "get_user_info",
+	[CREATE_CHAT] = "create_chat", [ADD_TO_GROUP_CHAT] = "add_to_group_chat", [SEND_MESSAGE] = "send_message",
+	[GET_CHATS] = "get_chats", [GET_CHAT_MESSAGES] = "get_chat_messages", [GET_CHAT_INFO] = "get_chat_info",
+	[REMOVE_FROM_CHAT] = "remove_from_chat", [EXIT_CHAT] = "exit_chat", [HELLO] = "hello", [SUBSCRIBE] = "subscribe",
+	[BATCH] = "batch",
+};
+
+// A client connection stays open for many framed requests. The reactor holds one
+// reference and every request handed to a worker holds another, so the socket is
+// only closed once the last in-flight response has been written. Subscriptions hold
+// references of their own until the reactor drops the connection.
+typedef struct Connection {
+	int fd;
+	FrameBuffer input;
+	pthread_mutex_t write_lock;
+	int refcount;
+	Subscription *subscriptions;  // owned by the registry, changed under its lock
+
+	// Only touched by the reactor thread
+	char *held;                    // a request the worker queue had no room for, with its reference
+	uint32_t held_length;
+	int paused;                    // input not polled until the queue has room; on the paused list
+	int dropped;
+	struct Connection *next_paused;
+} Connection;
+
+typedef struct {
+	Storage *storage;
+	MessageLog *messages;
+	UserCache *users;
+	ChatCache *chats;
+	MessageTail *tail;
+	WorkerPool *workers;
+	Metrics *metrics;
+	Subscriptions *subscriptions;
+	MetricsWindow heartbeat_window;  // only touched by the heartbeat thread
+} ServerContext;
+
+// Resolves a username or email through the user cache, filling it from storage on a miss
+static int lookup_user(ServerContext *server, StorageSession *store, char *key, CachedUser *cached) {
+	if (user_cache_get(server->users, key, cached)) return 0;
+
+	User user = {0};
+	if (store->ops->get_user_info(store, key, &user) != 0) return -1;
+
+	cached->id = user.id;
+	snprintf(cached->username, sizeof(cached->username), "%s", user.username);
+	snprintf(cached->email, sizeof(cached->email), "%s", user.email);
+	snprintf(cached->password_hash, sizeof(cached->password_hash), "%s", user.hash_password);
+	request_free(user.username);
+	request_free(user.email);
+	request_free(user.hash_password);
+
+	// A replica may not have the latest write to this user yet, so only the primary fills the cache.
+	// Inside a transaction the user may be one that rolls back, so it isn't cached either.
+	if (!store->replica && store->depth == 0) user_cache_put(server->users, cached);
+	return 0;
+}
+
+// Permission facts for user_id in chat_id from the membership cache, loading the chat on a miss.
+// A chat that can't be loaded reads as one the user has no rights in.
+static void chat_access(ServerContext *server, StorageSession *store, int chat_id, int user_id, ChatAccess *access) {
+	if (chat_cache_access(server->chats, chat_id, user_id, access)) return;
+
+	unsigned long epoch = chat_cache_epoch(server->chats, chat_id);
+	ChatMembers members;
+	if (store->ops->get_chat_members(store, chat_id, &members) != 0) {
+		memset(access, 0, sizeof(*access));
+		return;
+	}
+
+	chat_members_access(&members, user_id, access);
+	if (!store->replica) chat_cache_put(server->chats, &members, epoch);
+}
+
+// Echoes the caller's request_id so responses to pipelined requests can be matched
+void write_request_id(cJSON *request, JsonWriter *out) {
+	cJSON *request_id = request ? cJSON_GetObjectItem(request, "request_id") : NULL;
+	if (request_id) {
+		json_write_item(out, "request_id", request_id);
+	}
+}
+
+void error_response(cJSON *request, int response_code, const char *response_text, JsonWriter *out) {
+	json_begin_object(out, NULL);
+	json_write_string(out, "response_text", response_text);
+	json_write_int(out, "response_code", response_code);
+	write_request_id(request, out);
+	json_end_object(out);
+}
+
+// Reads up to max numeric ids from a JSON array, skipping duplicates and exclude
+int collect_participants(cJSON *ids, int exclude, int participants[], int max) {
+	int count = 0;
+	cJSON *id;
+
+	cJSON_ArrayForEach(id, ids) {
+		if (!cJSON_IsNumber(id) || id->valueint == exclude || count == max) continue;
+
+		int duplicate = 0;
+		for (int i = 0; i < count && !duplicate; i++) {
+			duplicate = participants[i] == id->valueint;
+		}
+		if (!duplicate) participants[count++] = id->valueint;
+	}
+
+	return count;
+}
+
+void format_system_message(Message *message, int chat_id, const char *format, ...) {
+	va_list args;
+
+	message->chat_id = chat_id;
+	message->sender_id = 1; //FIX LATER
+	strcpy(message->message_type, "system");
+
+	va_start(args, format);
+	vsnprintf(message->content, sizeof(message->content), format, args);
+	va_end(args);
+}
+
+// Writes rows into the response as storage reads them. The array is opened by the first
+// row, so a read that fails up front leaves nothing behind.
+typedef struct {
+	JsonWriter *out;
+	const char *array;
+	int opened;
+	int count;
+	int first_id;   // first message, for cursors
+	int last_id;    // last message or chat
+	int last_key;   // last chat's last_message_id
+} RowWriter;
+
+static void row_writer_open(RowWriter *rows) {
+	if (!rows->opened) json_begin_array(rows->out, rows->array);
+	rows->opened = 1;
+}
+
+static void row_writer_close(RowWriter *rows) {
+	row_writer_open(rows);
+	json_end_array(rows->out);
+}
+
+static void write_chat_row(void *ctx, const Chat *chat) {
+	RowWriter *rows = ctx;
+
+	debug("Chat: %s | Last message from %s: %s",
+	chat->chat_name,
+	chat->last_message_by,
+	chat->last_message_content);
+
+	row_writer_open(rows);
+	json_begin_object(rows->out, NULL);
+	json_write_int(rows->out, "chat_id", chat->id);
+	json_write_string(rows->out, "chat_name", chat->chat_name);
+	json_write_string(rows->out, "last_message_content", chat->last_message_content);
+	json_write_string(rows->out, "last_message_type", chat->last_message_type);
+	json_write_string(rows->out, "last_message_timestamp", chat->last_message_timestamp);
+	json_write_string(rows->out, "last_message_sender", chat->last_message_by);
+	json_end_object(rows->out);
+
+	rows->count++;
+	rows->last_id = chat->id;
+	rows->last_key = chat->last_message_id;
+}
 
-void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
-	char response_text[1024];
-	int action, response_code;
+static void write_message_row(void *ctx, const Message *message) {
+	RowWriter *rows = ctx;
+
+	debug("Message from %s %s: %s | sent %s",
+	message->message_type,
+	message->sender_username,
+	message->content,
+	message->created_at);
+
+	row_writer_open(rows);
+	json_begin_object(rows->out, NULL);
+	json_write_int(rows->out, "message_id", message->message_id);
+	json_write_int(rows->out, "sender_id", message->sender_id);
+	json_write_string(rows->out, "sender_username", message->sender_username);
+	json_write_string(rows->out, "content", message->content);
+	json_write_string(rows->out, "message_type", message->message_type);
+	json_write_string(rows->out, "created_at", message->created_at);
+	json_end_object(rows->out);
+
+	if (rows->count++ == 0) rows->first_id = message->message_id;
+	rows->last_id = message->message_id;
+}
 
-	cJSON *response_json = cJSON_CreateObject();
+// GET_CHAT_INFO: the chat's own fields, then its participants array
+static void write_chat_info_row(void *ctx, const Chat *chat) {
+	RowWriter *rows = ctx;
+
+	json_write_int(rows->out, "chat_id", chat->id);
+	json_write_string(rows->out, "chat_name", chat->chat_name);
+	json_write_int(rows->out, "is_group", chat->is_group);
+	row_writer_open(rows);
+}
 
-	action = cJSON_GetObjectItem(json, "action") -> valueint;
+static void write_participant_row(void *ctx, const User *user) {
+	RowWriter *rows = ctx;
+
+	json_begin_object(rows->out, NULL);
+	json_write_int(rows->out, "user_id", user->id);
+	json_write_string(rows->out, "username", user->username);
+	json_write_int(rows->out, "is_admin", user->is_admin);
+	json_end_object(rows->out);
+	rows->count++;
+}
+
+// A missing action used to crash the forked child; workers are long-lived now
+static int request_action(cJSON *json) {
+	cJSON *actionItem = cJSON_GetObjectItem(json, "action");
+	return cJSON_IsNumber(actionItem) ? actionItem -> valueint : -1;
+}
+
+// What a BATCH keeps while its requests run: the ids each one created, for later requests to
+// refer to, and in a transaction the chats whose tail refresh and push wait for the commit
+typedef struct {
+	int transaction;
+	int index;                                  // request running now
+	int chat_ids[BATCH_MAX_REQUESTS];
+	int user_ids[BATCH_MAX_REQUESTS];
+	int changed[BATCH_MAX_REQUESTS];
+	int changed_messages[BATCH_MAX_REQUESTS];   // new messages in each changed chat
+	int changed_count;
+} Batch;
+
+// Set on the worker while it runs a BATCH
+static __thread Batch *current_batch;
+
+static void batch_created(int chat_id, int user_id) {
+	if (!current_batch) return;
+	if (chat_id) current_batch->chat_ids[current_batch->index] = chat_id;
+	if (user_id) current_batch->user_ids[current_batch->index] = user_id;
+}
+
+// A write to chat_id was committed: bring its tail up to date and push the new messages.
+// Inside a transactional BATCH nothing is committed yet, so the chat is only noted.
+static void chat_committed(ServerContext *server, StorageSession *store, int chat_id, int messages) {
+	Batch *batch = current_batch;
+
+	if (batch && batch->transaction) {
+		int i = 0;
+		while (i < batch->changed_count && batch->changed[i] != chat_id) i++;
+		if (i == BATCH_MAX_REQUESTS) return;
+		if (i == batch->changed_count) {
+			batch->changed[i] = chat_id;
+			batch->changed_messages[i] = 0;
+			batch->changed_count++;
+		}
+		batch->changed_messages[i] += messages;
+		return;
+	}
+
+	message_tail_refresh(server->tail, store, chat_id);
+	subscriptions_publish(server->subscriptions, store, chat_id, messages);
+}
+
+// Ends a transactional BATCH. Committed chats get the refresh and push their handlers put
+// off; rolled back ones may have been cached with rows that never committed, so they are dropped.
+static void batch_settle(ServerContext *server, StorageSession *store, Batch *batch, int committed) {
+	for (int i = 0; i < batch->changed_count; i++) {
+		int chat_id = batch->changed[i];
+
+		if (committed) {
+			message_tail_refresh(server->tail, store, chat_id);
+			subscriptions_publish(server->subscriptions, store, chat_id, batch->changed_messages[i]);
+		} else {
+			chat_cache_invalidate(server->chats, chat_id);
+			message_tail_invalidate(server->tail, chat_id);
+		}
+	}
+}
+
+// Writes answer with the primary's position, which later reads pass back so a replica catches up
+// before serving them. SEND_MESSAGE has none to give: its message reaches MySQL after the reply.
+// Inside a BATCH only the batch's own response carries one.
+static void write_position(int action, StorageSession *store, JsonWriter *out) {
+	char position[STORAGE_POSITION_MAX];
+	if (current_batch) return;
+
+	switch (action) {
+		case CREATE_USER: case CREATE_CHAT: case ADD_TO_GROUP_CHAT: case REMOVE_FROM_CHAT: case EXIT_CHAT: case BATCH:
+			if (store->ops->position(store, position, sizeof(position)) == 0) json_write_string(out, "position", position);
+			break;
+	}
+}
+
+int handle_action(ServerContext *server, Connection *conn, StorageSession *store, cJSON* json, JsonWriter *out);
+
+// The fields that hold ids, the only ones a reference can stand in for; content and names
+// are left alone whatever they look like
+static const char *const reference_fields[] = { "chat_id", "user_id", "created_by", "added_by", "removed_by", "sender_id" };
+
+// The number "$N.chat_id" or "$N.user_id" stands for: the id request N of the batch created,
+// NULL when it names nothing
+static cJSON *resolve_reference(const Batch *batch, const char *reference) {
+	int index, id = 0;
+	char name[16];
+
+	if (sscanf(reference, "$%d.%15s", &index, name) == 2 && index >= 0 && index < batch->index) {
+		if (strcmp(name, "chat_id") == 0) id = batch->chat_ids[index];
+		else if (strcmp(name, "user_id") == 0) id = batch->user_ids[index];
+	}
+	return id > 0 ? cJSON_CreateNumber(id) : NULL;
+}
+
+static int unresolved_reference(cJSON *request, const char *reference, JsonWriter *out) {
+	char text[64];
+	snprintf(text, sizeof(text), "Unresolved reference %s", reference);
+	error_response(request, 400, text, out);
+	return 400;
+}
+
+// One request of a BATCH. A string in an id field or in participant_ids becomes the id it
+// refers to, so a chat can be created and written to in one batch.
+static int run_batched(ServerContext *server, Connection *conn, StorageSession *store, Batch *batch, cJSON *request, JsonWriter *out) {
+	int action = request_action(request);
+	if (!cJSON_IsObject(request) || action == BATCH || action == SUBSCRIBE) {
+		error_response(request, 400, "Action not allowed in a batch", out);
+		return 400;
+	}
+
+	for (size_t i = 0; i < sizeof(reference_fields) / sizeof(reference_fields[0]); i++) {
+		cJSON *field = cJSON_GetObjectItemCaseSensitive(request, reference_fields[i]);
+		if (!cJSON_IsString(field)) continue;
+
+		cJSON *number = resolve_reference(batch, field->valuestring);
+		if (!number) return unresolved_reference(request, field->valuestring, out);
+		cJSON_ReplaceItemInObjectCaseSensitive(request, reference_fields[i], number);
+	}
+
+	cJSON *participants = cJSON_GetObjectItemCaseSensitive(request, "participant_ids");
+	for (int i = 0; cJSON_IsArray(participants) && i < cJSON_GetArraySize(participants); i++) {
+		cJSON *element = cJSON_GetArrayItem(participants, i);
+		if (!cJSON_IsString(element)) continue;
+
+		cJSON *number = resolve_reference(batch, element->valuestring);
+		if (!number) return unresolved_reference(request, element->valuestring, out);
+		cJSON_ReplaceItemInArray(participants, i, number);
+	}
+
+	return handle_action(server, conn, store, request, out);
+}
+
+// Writes the response for one request and returns its response_code
+int handle_action(ServerContext *server, Connection *conn, StorageSession *store, cJSON* json, JsonWriter *out){
+	char response_text[1024] = "Invalid parameters";
+	int action, response_code = 400;
+
+	json_begin_object(out, NULL);
+
+	action = request_action(json);
 
 	switch (action) {
 
 		case VALIDATE_USER:{
-			char password_hash[100];
+			CachedUser user;
 			cJSON *keyItem = cJSON_GetObjectItemCaseSensitive(json, "key");
 
 			if (keyItem && keyItem->valuestring){
 				char *key = keyItem -> valuestring;
-				if (validate_user(conn, key, password_hash) == 0){
+				// User 1 sends system messages and can't log in
+				if (lookup_user(server, store, key, &user) == 0 && user.id != 1){
 					response_code = 200;
-					sprintf(response_text, "password_hash found for user with the key: %s", key);
+					snprintf(response_text, sizeof(response_text), "password_hash found for user with the key: %s", key);
 
-					cJSON_AddStringToObject(response_json, "password_hash", password_hash);
+					json_write_string(out, "password_hash", user.password_hash);
 				} else {
 					response_code = 400;
-					sprintf(response_text, "error retrieving password_hash for key: %s", key);
+					snprintf(response_text, sizeof(response_text), "error retrieving password_hash for key: %s", key);
 				}
 			} else {
         		strcpy(response_text, "Invalid parameters");
@@ -64,54 +441,56 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 
 		case CREATE_USER:{
 
-			User newUser;
+			User newUser = {0};
 
 			cJSON *usernameItem = cJSON_GetObjectItem(json, "username");
 			cJSON *emailItem = cJSON_GetObjectItem(json, "email");
 			cJSON *passwordItem = cJSON_GetObjectItem(json, "password");
 
 			if (usernameItem && usernameItem->valuestring && emailItem && emailItem->valuestring && passwordItem && passwordItem->valuestring) {
-				newUser.username = strdup(usernameItem->valuestring);
-				newUser.email = strdup(emailItem->valuestring);
-				newUser.hash_password = strdup(passwordItem->valuestring);
+				newUser.username = request_strdup(usernameItem->valuestring);
+				newUser.email = request_strdup(emailItem->valuestring);
+				newUser.hash_password = request_strdup(passwordItem->valuestring);
 }
-			if (create_user(conn, &newUser) == 0){
+			// Nothing may keep answering for these keys with whoever held them before
+			user_cache_invalidate(server->users, newUser.username, newUser.email);
+
+			if (newUser.username && store->ops->create_user(store, &newUser) == 0){
+				json_write_int(out, "user_id", newUser.id);
+				batch_created(0, newUser.id);
 				response_code = 200;
-				sprintf(response_text,"User %s with email %s has been stored in the database",newUser.username, newUser.email);
+				snprintf(response_text, sizeof(response_text), "User %s with email %s has been stored in the database",newUser.username, newUser.email);
 			} else {
 				response_code = 400;
 				strcpy(response_text,"Unable to generate user");
 			}
 
-			free(newUser.username);
-			free(newUser.email);
-			free(newUser.hash_password);
+			request_free(newUser.username);
+			request_free(newUser.email);
+			request_free(newUser.hash_password);
 
 
 			break;
 		}
 
 		case GET_USER_INFO:{
-			User user;
+			CachedUser user;
 			cJSON *info_keyItem = cJSON_GetObjectItemCaseSensitive(json, "key");
 
 			if (info_keyItem && info_keyItem->valuestring){
 				char *key = info_keyItem -> valuestring;
-				if (get_user_info(conn, key, &user) == 0){
+				if (lookup_user(server, store, key, &user) == 0){
 					response_code = 200;
-					sprintf(response_text, "User %s was found with the ID: %d", user.username, user.id);
+					snprintf(response_text, sizeof(response_text), "User %s was found with the ID: %d", user.username, user.id);
 
-					cJSON_AddNumberToObject(response_json, "user_id", user.id);
-					cJSON_AddStringToObject(response_json, "username", user.username);
-					cJSON_AddStringToObject(response_json, "email", user.email);
+					json_write_int(out, "user_id", user.id);
+					json_write_string(out, "username", user.username);
+					json_write_string(out, "email", user.email);
 
 				} else {
 					response_code = 400;
-					sprintf(response_text, "Error retreiving user info for key: %s", key);
+					snprintf(response_text, sizeof(response_text), "Error retreiving user info for key: %s", key);
 				}
-
-				free(user.username);
-				free(user.email);
 			}
 			
 			break;
@@ -120,6 +499,7 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 		case CREATE_CHAT:{
 			Chat chat;
 			int participants[MAX_PARTICIPANTS];
+			int is_admin[MAX_PARTICIPANTS] = {0};
 			
 			cJSON *is_groupItem = cJSON_GetObjectItem(json, "is_group");
 			cJSON *chat_nameItem = cJSON_GetObjectItem(json, "chat_name");
@@ -129,47 +509,44 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 			if (is_groupItem && cJSON_IsBool(is_groupItem) && chat_nameItem && chat_nameItem -> valuestring && created_byItem && created_byItem -> valueint && participant_idsItem && cJSON_IsArray(participant_idsItem)){
 				int participant_count = cJSON_GetArraySize(participant_idsItem);
 				chat.is_group = is_groupItem -> valueint;
-				printf("participants in new gc %d\n", MAX_PARTICIPANTS - (chat.is_group ? 1 : 8));
+				debug("participants in new gc %d", MAX_PARTICIPANTS - (chat.is_group ? 1 : 8));
 				if (0 < participant_count && participant_count < MAX_PARTICIPANTS - (chat.is_group ? 1 : 8)){
 					chat.chat_name = chat_nameItem -> valuestring;
 					chat.created_by = created_byItem ->valueint;
 
-					if (create_chat(conn, &chat) == 0){
-						participants[0] = chat.created_by;
-						
-						Message system_message = {0};
-						system_message.chat_id = chat.id;
-						system_message.sender_id = 1; //FIX LATER
-						strcpy(system_message.message_type, "system");
-						sprintf(system_message.content, "User %d has created the chat %s", participants[0], chat.chat_name);
-
+					// The creator joins first and is the only admin
+					participants[0] = chat.created_by;
+					is_admin[0] = 1;
+					int member_count = 1 + collect_participants(participant_idsItem, chat.created_by, participants + 1, MAX_PARTICIPANTS - 1);
+
+					// Chat, participants and system messages are written in one transaction with
+					// multi-row inserts, so the round trips do not grow with the participant count
+					Message system_messages[MAX_PARTICIPANTS + 1] = {0};
+					int created = 0;
+
+					if (storage_begin(store) == 0) {
+						if (store->ops->create_chat(store, &chat) == 0){
+							format_system_message(&system_messages[0], chat.id, "User %d has created the chat %s", chat.created_by, chat.chat_name);
+							for (int i = 0; i < member_count; i++){
+								format_system_message(&system_messages[i + 1], chat.id, "User %d has added user %d", chat.created_by, participants[i]);
+							}
 
-						send_message(conn, &system_message);
+							created = store->ops->add_participants(store, chat.id, participants, is_admin, member_count) == 0 &&
+									  store->ops->send_messages(store, system_messages, member_count + 1) == 0;
+						}
 
-						for (int i = 0; i < participant_count+1; i++) {
-        					cJSON *id = cJSON_GetArrayItem(participant_idsItem, i);
-        					if (cJSON_IsNumber(id)) {
-            					participants[i+1] = id->valueint;
-							}
-        				}
-						
-						int success_count = 0;
-						for (int i = 0; i < participant_count + 1; i++){
-							if (add_to_chat(conn, chat.id, participants[i], participants[i] == chat.created_by) == 0){
-								printf("User %d added to chat %s\n", participants[i], chat.chat_name);
-
-								system_message.chat_id = chat.id;
-								system_message.sender_id = 1; //FIX LATER
-								strcpy(system_message.message_type, "system");
-								sprintf(system_message.content, "User %d has added user %d", participants[0], participants[i]);
-								send_message(conn, &system_message);
-								success_count++;
-							} else {
-								printf("Failed to add user %d to chat %s\n", participants[i], chat.chat_name);
-							}
+						if (created) {
+							created = storage_commit(store) == 0;
+						} else {
+							storage_rollback(store);
 						}
+					}
 
-						sprintf(response_text, "Chat %s was succesfully created with %d users", chat.chat_name, success_count);
+					if (created){
+						chat_committed(server, store, chat.id, member_count + 1);
+						json_write_int(out, "chat_id", chat.id);
+						batch_created(chat.id, 0);
+						snprintf(response_text, sizeof(response_text), "Chat %s was succesfully created with %d users", chat.chat_name, member_count);
 						response_code = 200;
 					
 					} else {
@@ -177,7 +554,7 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 						response_code = 400;
 					}
 				} else {
-						sprintf(response_text, "Number of participants invalid for a chat of type %s", chat.is_group ? "group" : "direct message");
+						snprintf(response_text, sizeof(response_text), "Number of participants invalid for a chat of type %s", chat.is_group ? "group" : "direct message");
 						response_code = 400;
 				}
 			}
@@ -191,44 +568,40 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 			cJSON *participant_idsItem_atgc = cJSON_GetObjectItemCaseSensitive(json, "participant_ids");
 			
 			int participants[MAX_PARTICIPANTS];
+			int is_admin[MAX_PARTICIPANTS] = {0};
 
 			if (chat_idItem && chat_idItem -> valueint && participant_idsItem_atgc && cJSON_IsArray(participant_idsItem_atgc)){
 				if(cJSON_GetArraySize(participant_idsItem_atgc) > 0 && added_byItem && added_byItem -> valueint){
-					int participant_count = cJSON_GetArraySize(participant_idsItem_atgc);
 					int added_by = added_byItem -> valueint;
 					int chat_id = chat_idItem -> valueint;
-						
-					for (int i = 0; i < participant_count; i++) {
-						cJSON *id = cJSON_GetArrayItem(participant_idsItem_atgc, i);
-						if (cJSON_IsNumber(id)) {
-            				participants[i] = id->valueint;
-						}
-        			}
+					int participant_count = collect_participants(participant_idsItem_atgc, 0, participants, MAX_PARTICIPANTS);
 
-					Message system_message = {0};
-					int success_count = 0;
+					Message system_messages[MAX_PARTICIPANTS] = {0};
 					for (int i = 0; i < participant_count; i++){
-						if (add_to_chat(conn, chat_id, participants[i], 0) == 0){
-							printf("User %d added to chat %d\n", participants[i], chat_id);
-
-							system_message.chat_id = chat_id;
-							system_message.sender_id = 1; //FIX LATER
-							strcpy(system_message.message_type, "system");
-							sprintf(system_message.content, "User %d has added user %d", added_by, participants[i]);
-							send_message(conn, &system_message);
+						format_system_message(&system_messages[i], chat_id, "User %d has added user %d", added_by, participants[i]);
+					}
 
-							success_count++;
-						} else {								
-							printf("Failed to add user %d to chat %d\n", participants[i], chat_id);
+					// All users are added together or not at all
+					int success_count = 0;
+					if (participant_count > 0 && storage_begin(store) == 0) {
+						if (store->ops->add_participants(store, chat_id, participants, is_admin, participant_count) == 0 &&
+							store->ops->send_messages(store, system_messages, participant_count) == 0) {
+							if (storage_commit(store) == 0) success_count = participant_count;
+							if (success_count) {
+								chat_cache_add_members(server->chats, chat_id, participants, is_admin, participant_count);
+								chat_committed(server, store, chat_id, participant_count);
+							}
+						} else {
+							storage_rollback(store);
 						}
 					}
 
 					if (success_count > 0 ){
-						sprintf(response_text, "Chat %d has succesfully added %d users", chat_id, success_count);
+						snprintf(response_text, sizeof(response_text), "Chat %d has succesfully added %d users", chat_id, success_count);
 						response_code = 200;
 
 					} else {
-						sprintf(response_text, "Unable to add users to chat %d", chat_id);
+						snprintf(response_text, sizeof(response_text), "Unable to add users to chat %d", chat_id);
 						response_code = 400;
 
 					}
@@ -240,7 +613,7 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 		}
 
 		case SEND_MESSAGE:{
-			Message message;
+			Message message = {0};
 
 			cJSON *Item_sm_chat_id = cJSON_GetObjectItem(json, "chat_id");
 			cJSON *Item_sm_sender_id = cJSON_GetObjectItem(json, "sender_id");
@@ -256,9 +629,23 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 				strncpy(message.message_type, Item_sm_message_type->valuestring, MAX_TYPE_LENGTH - 1);
 				message.message_type[MAX_TYPE_LENGTH - 1] = '\0';
 
+				// Checked before acknowledging: the flusher could only drop a message the chat refuses
+				ChatAccess access;
+				chat_access(server, store, message.chat_id, message.sender_id, &access);
+				if (!access.is_member) {
+					strcpy(response_text, "Sender is not a participant of this chat.");
+					response_code = 403;
+					break;
+				}
 
-				if(send_message(conn, &message) == 0){
-					sprintf(response_text, "Message from %d was succesfully sent to chat %d", message.sender_id, message.chat_id);
+				// Acknowledged once it is in the local log; the flusher writes it to MySQL in batches.
+				// Inside a transactional BATCH it is written with the rest of the transaction instead.
+				int in_transaction = current_batch && current_batch->transaction;
+				int sent = in_transaction ? store->ops->send_message(store, &message) : message_log_append(server->messages, &message);
+				if (sent == 0 && in_transaction) chat_committed(server, store, message.chat_id, 1);
+
+				if(sent == 0){
+					snprintf(response_text, sizeof(response_text), "Message from %d was succesfully sent to chat %d", message.sender_id, message.chat_id);
 					response_code = 200;
 				
 				} else {
@@ -275,45 +662,51 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 		case GET_CHATS:{
 			cJSON *Item_gc_user_id = cJSON_GetObjectItemCaseSensitive(json, "user_id");
 			cJSON *Item_gc_last_update_timestamp = cJSON_GetObjectItemCaseSensitive(json, "last_update_timestamp")	;
+			cJSON *Item_gc_cursor = cJSON_GetObjectItemCaseSensitive(json, "cursor");
+			cJSON *Item_gc_limit = cJSON_GetObjectItemCaseSensitive(json, "limit");
+
+			ChatPage page = {0};
+			int valid_cursor = !Item_gc_cursor || cJSON_IsNull(Item_gc_cursor) ||
+			                   (cJSON_IsString(Item_gc_cursor) &&
+			                    sscanf(Item_gc_cursor->valuestring, "%d:%d", &page.before_message_id, &page.before_chat_id) == 2);
 
-			if (Item_gc_user_id && Item_gc_last_update_timestamp && cJSON_IsNumber(Item_gc_user_id) &&
-			    (cJSON_IsString(Item_gc_last_update_timestamp) || cJSON_IsNull(Item_gc_last_update_timestamp))) {
+			if (Item_gc_user_id && cJSON_IsNumber(Item_gc_user_id) && valid_cursor &&
+			    (!Item_gc_last_update_timestamp || cJSON_IsString(Item_gc_last_update_timestamp) || cJSON_IsNull(Item_gc_last_update_timestamp)) &&
+			    (!Item_gc_limit || cJSON_IsNumber(Item_gc_limit))) {
 
-  				Chat chats[MAX_CHATS];
 				int user_id = Item_gc_user_id->valueint;
+				int has_more = 0;
+				RowWriter rows = { .out = out, .array = "chats_array" };
+				RowSink sink = { .ctx = &rows, .chat = write_chat_row };
 
-			    char *last_update_timestamp = NULL;
-    			if (!cJSON_IsNull(Item_gc_last_update_timestamp)) {
-    		    	last_update_timestamp = Item_gc_last_update_timestamp->valuestring;
+				page.limit = Item_gc_limit ? Item_gc_limit->valueint : DEFAULT_CHAT_PAGE;
+				if (page.limit < 1) page.limit = DEFAULT_CHAT_PAGE;
+				if (page.limit > MAX_CHATS) page.limit = MAX_CHATS;
+
+    			if (Item_gc_last_update_timestamp && cJSON_IsString(Item_gc_last_update_timestamp)) {
+    		    	page.since_timestamp = Item_gc_last_update_timestamp->valuestring;
     			}
 
-			    int chat_count = get_chats(conn, user_id, last_update_timestamp, chats);
-			    if (chat_count > -1){
-					sprintf(response_text, "%d chats succesfully retreived", chat_count);
+			    // Chats are written as they are read; nothing is collected in between
+			    int chat_count = store->ops->get_chats(store, user_id, &page, &sink, &has_more);
+			    int total_chats = chat_count > -1 ? store->ops->get_chat_count(store, user_id) : -1;
+			    if (chat_count > -1 && total_chats > -1){
+					snprintf(response_text, sizeof(response_text), "%d chats succesfully retreived", chat_count);
 					response_code = 200;
 
-					cJSON *chats_array = cJSON_CreateArray();
-
-					for (int i = 0; i < chat_count; i++){
-            			printf("Chat: %s | Last message from %s: %s\n",
-						chats[i].chat_name,
-						chats[i].last_message_by,
-						chats[i].last_message_content);
+					row_writer_close(&rows);
 
-						cJSON *chat_json = cJSON_CreateObject();
-						
-						cJSON_AddNumberToObject(chat_json, "chat_id", chats[i].id);
-						cJSON_AddStringToObject(chat_json, "chat_name", chats[i].chat_name);
-						cJSON_AddStringToObject(chat_json, "last_message_content", chats[i].last_message_content);
-						cJSON_AddStringToObject(chat_json, "last_message_type", chats[i].last_message_type);
-						cJSON_AddStringToObject(chat_json, "last_message_timestamp", chats[i].last_message_timestamp);
-						cJSON_AddStringToObject(chat_json, "last_message_sender", chats[i].last_message_by);
-
-						cJSON_AddItemToArray(chats_array, chat_json);
+					json_write_int(out, "total_chats", total_chats);
+					json_write_bool(out, "has_more", has_more);
+					if (has_more) {
+						char cursor[32];
+						snprintf(cursor, sizeof(cursor), "%d:%d", rows.last_key, rows.last_id);
+						json_write_string(out, "next_cursor", cursor);
+					} else {
+						json_write_null(out, "next_cursor");
 					}
-
-					cJSON_AddItemToObject(response_json, "chats_array", chats_array);
 				} else {
+					if (rows.opened) json_end_array(out);
 					strcpy(response_text, "Chats couldn't be retreived");
 					response_code = 400;
 				}
@@ -329,47 +722,55 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 		case GET_CHAT_MESSAGES:{
 			cJSON *Item_gcm_chat_id = cJSON_GetObjectItemCaseSensitive(json, "chat_id");
 			cJSON *Item_gcm_last_update_timestamp = cJSON_GetObjectItemCaseSensitive(json, "last_update_timestamp")	;
+			cJSON *Item_gcm_before = cJSON_GetObjectItemCaseSensitive(json, "before_message_id");
+			cJSON *Item_gcm_after = cJSON_GetObjectItemCaseSensitive(json, "after_message_id");
+			cJSON *Item_gcm_limit = cJSON_GetObjectItemCaseSensitive(json, "limit");
 
-			if (Item_gcm_chat_id && Item_gcm_last_update_timestamp && cJSON_IsNumber(Item_gcm_chat_id) &&
-			    (cJSON_IsString(Item_gcm_last_update_timestamp) || cJSON_IsNull(Item_gcm_last_update_timestamp))) {
+			// Everything but chat_id is optional; a cursor takes precedence over the timestamp
+			if (Item_gcm_chat_id && cJSON_IsNumber(Item_gcm_chat_id) &&
+			    (!Item_gcm_last_update_timestamp || cJSON_IsString(Item_gcm_last_update_timestamp) || cJSON_IsNull(Item_gcm_last_update_timestamp)) &&
+			    (!Item_gcm_before || cJSON_IsNumber(Item_gcm_before)) &&
+			    (!Item_gcm_after || cJSON_IsNumber(Item_gcm_after)) &&
+			    (!Item_gcm_limit || cJSON_IsNumber(Item_gcm_limit))) {
 
-  				Message messages[MAX_MESSAGES];
 				int chat_id = Item_gcm_chat_id->valueint;
-
-			    char *last_update_timestamp = NULL;
-    			if (!cJSON_IsNull(Item_gcm_last_update_timestamp)) {
-    		    	last_update_timestamp = Item_gcm_last_update_timestamp->valuestring;
+				int has_more = 0;
+				RowWriter rows = { .out = out, .array = "messages_array" };
+				RowSink sink = { .ctx = &rows, .message = write_message_row };
+
+				MessagePage page = {0};
+				page.before_id = Item_gcm_before ? Item_gcm_before->valueint : 0;
+				page.after_id = Item_gcm_after ? Item_gcm_after->valueint : 0;
+				page.limit = Item_gcm_limit ? Item_gcm_limit->valueint : DEFAULT_MESSAGE_PAGE;
+				if (page.limit < 1) page.limit = DEFAULT_MESSAGE_PAGE;
+				if (page.limit > MAX_MESSAGES) page.limit = MAX_MESSAGES;
+
+    			if (Item_gcm_last_update_timestamp && cJSON_IsString(Item_gcm_last_update_timestamp)) {
+    		    	page.since_timestamp = Item_gcm_last_update_timestamp->valuestring;
     			}
 
-			    int message_count = get_chat_messages(conn, chat_id, last_update_timestamp, messages);
+			    int message_count = message_tail_get(server->tail, store, chat_id, &page, &sink, &has_more);
 			    if (message_count > -1){
-					sprintf(response_text, "%d messages succesfully retreived", message_count);
+					snprintf(response_text, sizeof(response_text), "%d messages succesfully retreived", message_count);
 					response_code = 200;
 
-					cJSON *messages_array = cJSON_CreateArray();
-
-					for (int i = 0; i < message_count; i++){
-            			printf("Message from %s %s: %s | sent %s\n",
-						messages[i].message_type,
-						messages[i].sender_username,
-						messages[i].content,
-					  	messages[i].created_at
-					  );
-
-						cJSON *message_json = cJSON_CreateObject();	
-						cJSON_AddNumberToObject(message_json, "message_id", messages[i].message_id);
-						cJSON_AddNumberToObject(message_json, "sender_id", messages[i].sender_id);
-						cJSON_AddStringToObject(message_json, "sender_username", messages[i].sender_username);
-						cJSON_AddStringToObject(message_json, "content", messages[i].content);
-						cJSON_AddStringToObject(message_json, "message_type", messages[i].message_type);
-						cJSON_AddStringToObject(message_json, "created_at", messages[i].created_at);
-
-
-						cJSON_AddItemToArray(messages_array, message_json);
+					row_writer_close(&rows);
+
+					// Scrolling back continues before the oldest message returned, catching up
+					// continues after the newest one (or from the same cursor when nothing is new)
+					json_write_bool(out, "has_more", has_more);
+					if (page.before_id > 0 || (page.after_id <= 0 && !page.since_timestamp)) {
+						if (has_more) json_write_int(out, "next_cursor", rows.first_id);
+						else json_write_null(out, "next_cursor");
+					} else if (message_count > 0) {
+						json_write_int(out, "next_cursor", rows.last_id);
+					} else if (page.after_id > 0) {
+						json_write_int(out, "next_cursor", page.after_id);
+					} else {
+						json_write_null(out, "next_cursor");
 					}
-
-					cJSON_AddItemToObject(response_json, "messages_array", messages_array);
 				} else {
+					if (rows.opened) json_end_array(out);
 					strcpy(response_text, "Messages couldn't be retreived");
 					response_code = 400;
 				}
@@ -386,31 +787,17 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
 
 	    if (chat_id_item && cJSON_IsNumber(chat_id_item)) {
     	    int chat_id = chat_id_item->valueint;
-        	Chat chat;
-        	User participants[MAX_PARTICIPANTS];
-        	int participant_count;
+        	RowWriter rows = { .out = out, .array = "participants" };
+        	RowSink sink = { .ctx = &rows, .chat = write_chat_info_row, .participant = write_participant_row };
 
-	        if (get_chat_info(conn, chat_id, &chat, participants, &participant_count) == 0) {
+	        if (store->ops->get_chat_info(store, chat_id, &sink) == 0) {
     	        response_code = 200;
-        	    sprintf(response_text, "Chat info for ID %d retrieved successfully", chat_id);
-
-            	cJSON_AddNumberToObject(response_json, "chat_id", chat.id);
-            	cJSON_AddStringToObject(response_json, "chat_name", chat.chat_name);
-				cJSON_AddNumberToObject(response_json, "is_group", chat.is_group);
-
-            	cJSON *participants_array = cJSON_CreateArray();
-            	for (int i = 0; i < participant_count; i++) {
-                	cJSON *participant_json = cJSON_CreateObject();
-                	cJSON_AddNumberToObject(participant_json, "user_id", participants[i].id);
-                	cJSON_AddStringToObject(participant_json, "username", participants[i].username);
-                	cJSON_AddNumberToObject(participant_json, "is_admin", participants[i].is_admin);
-                	cJSON_AddItemToArray(participants_array, participant_json);
-            	}
+        	    snprintf(response_text, sizeof(response_text), "Chat info for ID %d retrieved successfully", chat_id);
 
-            	cJSON_AddItemToObject(response_json, "participants", participants_array);
+            	json_end_array(out);
         	} else {
             	response_code = 400;
-            	sprintf(response_text, "Could not retrieve info for chat ID %d", chat_id);
+            	snprintf(response_text, sizeof(response_text), "Could not retrieve info for chat ID %d", chat_id);
         	}
     	} else {
         	response_code = 400;
@@ -428,13 +815,16 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
         	int chat_id = chat_idItem->valueint;
         	int removed_by = removed_byItem->valueint;
 
-        	if (!is_user_admin(conn, chat_id, removed_by)) {
+			ChatAccess access;
+			chat_access(server, store, chat_id, removed_by, &access);
+
+        	if (!access.is_admin) {
             	strcpy(response_text, "Only admins can remove participants.");
             	response_code = 403;
             	break;
         	}
 
-			if(is_group_chat(conn, chat_id) != 1){
+			if(access.is_group != 1){
             	strcpy(response_text, "Only participants from group chats can be removed.");
             	response_code = 403;
 				break;
@@ -449,19 +839,22 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
             	if (cJSON_IsNumber(idItem)) {
                 	int user_id = idItem->valueint;
 					if (user_id != removed_by){
-                		if (remove_from_chat(conn, chat_id, user_id) == 0) {
+                		if (store->ops->remove_from_chat(store, chat_id, user_id) == 0) {
+							chat_cache_remove_member(server->chats, chat_id, user_id);
 							system_message.chat_id = chat_id;
 							system_message.sender_id = 1; //FIX LATER
 							strcpy(system_message.message_type, "system");
 							sprintf(system_message.content, "User %d has removed user %d", removed_by, user_id);
-							send_message(conn, &system_message);
+							store->ops->send_message(store, &system_message);
                     		removed_count++;
 						}
                 	}
             	}
         	}
 
-        	sprintf(response_text, "Removed %d out of %d participants from chat %d", removed_count, total_to_remove, chat_id);
+			if (removed_count > 0) chat_committed(server, store, chat_id, removed_count);
+
+        	snprintf(response_text, sizeof(response_text), "Removed %d out of %d participants from chat %d", removed_count, total_to_remove, chat_id);
         	response_code = 200;
     	} else {
         	strcpy(response_text, "Invalid parameters for REMOVE_FROM_CHAT");
@@ -478,25 +871,31 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
         	int chat_id = chat_idItem->valueint;
         	int user_id = user_idItem->valueint;
 
-        	int is_admin = is_user_admin(conn, chat_id, user_id);
-        	int participant_count = get_participant_count(conn, chat_id);
+			ChatAccess access;
+			chat_access(server, store, chat_id, user_id, &access);
 
-        	if (remove_from_chat(conn, chat_id, user_id) != 0) {
+        	if (store->ops->remove_from_chat(store, chat_id, user_id) != 0) {
             	strcpy(response_text, "Failed to exit chat.");
             	response_code = 400;
             	break;
         	}
+			chat_cache_remove_member(server->chats, chat_id, user_id);
 			Message system_message = {0};
 			system_message.chat_id = chat_id;		
 			system_message.sender_id = 1; //FIX LATER
 			strcpy(system_message.message_type, "system");			
 			sprintf(system_message.content, "User %d has exited the chat", user_id);
-			send_message(conn, &system_message);
+			store->ops->send_message(store, &system_message);
+			chat_committed(server, store, chat_id, 1);
 
 
-        	if (participant_count == 1) {
-            	if (delete_chat(conn, chat_id) == 0) {
-                	sprintf(response_text, "User %d left chat %d. Chat deleted as last participant.", user_id, chat_id);
+        	if (access.participant_count == 1) {
+				int deleted = store->ops->delete_chat(store, chat_id);
+				chat_cache_invalidate(server->chats, chat_id);
+				message_tail_invalidate(server->tail, chat_id);
+
+            	if (deleted == 0) {
+                	snprintf(response_text, sizeof(response_text), "User %d left chat %d. Chat deleted as last participant.", user_id, chat_id);
                 	response_code = 200;
             	} else {
                 	strcpy(response_text, "User left, but chat deletion failed.");
@@ -505,18 +904,19 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
             	break;
         	}
 
-        	if (is_admin) {
-            	int admin_count = get_admin_count(conn, chat_id);
-            	if (admin_count == 0) {
-                	if (promote_random_participant_to_admin(conn, chat_id) != 0) {
-                    	strcpy(response_text, "User left, but failed to promote new admin.");
-                    	response_code = 500;
-                    	break;
-                	}
+        	// The last admin leaving hands the role to someone storage picks
+        	if (access.is_admin && access.admin_count == 1) {
+				int promoted = store->ops->promote_random_participant_to_admin(store, chat_id);
+				chat_cache_invalidate(server->chats, chat_id);
+
+            	if (promoted != 0) {
+                	strcpy(response_text, "User left, but failed to promote new admin.");
+                	response_code = 500;
+                	break;
             	}
         	}
 
-        	sprintf(response_text, "User %d exited chat %d successfully", user_id, chat_id);
+        	snprintf(response_text, sizeof(response_text), "User %d exited chat %d successfully", user_id, chat_id);
         	response_code = 200;
 
     	} else {
@@ -524,47 +924,616 @@ void handle_action(MYSQL *conn, cJSON* json, char* response_buffer){
         	response_code = 400;
     	}
 
-		free(chat_idItem);
-		free(user_idItem);
     	break;
 	}
 
+		// Sent by a logic server when it connects. Every request is answered in the encoding
+		// it was sent in, so this only tells the peer which ones it may switch to.
+		case HELLO:{
+			json_begin_array(out, "encodings");
+			json_write_string(out, NULL, wire_encoding_name(WIRE_JSON));
+			json_write_string(out, NULL, wire_encoding_name(WIRE_MSGPACK));
+			json_end_array(out);
+
+			strcpy(response_text, "Encodings supported");
+			response_code = 200;
+			break;
+		}
+
+		// Registers this connection for the user's new messages until it closes; pushes carry
+		// the SUBSCRIBE's request_id. Every chat in chat_ids must be one the user is in, and
+		// without chat_ids all of the user's chats are followed, including ones joined later.
+		case SUBSCRIBE:{
+			cJSON *user_idItem = cJSON_GetObjectItemCaseSensitive(json, "user_id");
+			cJSON *chat_idsItem = cJSON_GetObjectItemCaseSensitive(json, "chat_ids");
+			cJSON *request_idItem = cJSON_GetObjectItemCaseSensitive(json, "request_id");
+
+			if (!server->subscriptions) {
+				strcpy(response_text, "Subscriptions are disabled");
+				response_code = 503;
+				break;
+			}
+
+			if (!user_idItem || !cJSON_IsNumber(user_idItem) || (chat_idsItem && !cJSON_IsNull(chat_idsItem) && !cJSON_IsArray(chat_idsItem))) {
+				strcpy(response_text, "Wrong format for the parameters");
+				response_code = 400;
+				break;
+			}
+
+			int chat_ids[SUBSCRIPTION_MAX_CHATS];
+			SubscriptionRequest request = { .user_id = user_idItem->valueint, .encoding = out->encoding };
+			if (cJSON_IsNumber(request_idItem)) {
+				request.has_request_id = 1;
+				request.request_id = (long long)request_idItem->valuedouble;
+			}
+
+			if (cJSON_IsArray(chat_idsItem)) {
+				if (cJSON_GetArraySize(chat_idsItem) > SUBSCRIPTION_MAX_CHATS) {
+					snprintf(response_text, sizeof(response_text), "At most %d chat_ids per subscription", SUBSCRIPTION_MAX_CHATS);
+					response_code = 400;
+					break;
+				}
+
+				request.chat_ids = chat_ids;
+				request.chat_count = collect_participants(chat_idsItem, 0, chat_ids, SUBSCRIPTION_MAX_CHATS);
+				if (request.chat_count == 0) {
+					strcpy(response_text, "chat_ids is empty");
+					response_code = 400;
+					break;
+				}
+
+				int denied = 0;
+				for (int i = 0; i < request.chat_count && !denied; i++) {
+					ChatAccess access;
+					chat_access(server, store, chat_ids[i], request.user_id, &access);
+					if (!access.is_member) denied = chat_ids[i];
+				}
+				if (denied) {
+					snprintf(response_text, sizeof(response_text), "User %d is not in chat %d", request.user_id, denied);
+					response_code = 403;
+					break;
+				}
+			}
+
+			int subscription_id = subscriptions_add(server->subscriptions, conn, &conn->subscriptions, &request);
+			if (subscription_id < 0) {
+				strcpy(response_text, "Subscription limit reached");
+				response_code = 503;
+				break;
+			}
+
+			json_write_int(out, "subscription_id", subscription_id);
+			if (request.chat_ids) snprintf(response_text, sizeof(response_text), "Subscribed to %d chats", request.chat_count);
+			else snprintf(response_text, sizeof(response_text), "Subscribed to every chat of user %d", request.user_id);
+			response_code = 200;
+			break;
+		}
+
+		// Runs requests in order on this session, answering each in "responses". With
+		// "transaction": true they commit together: the first one that doesn't answer 200
+		// stops the batch and rolls all of them back.
+		case BATCH:{
+			cJSON *requestsItem = cJSON_GetObjectItemCaseSensitive(json, "requests");
+			cJSON *transactionItem = cJSON_GetObjectItemCaseSensitive(json, "transaction");
+			int request_count = cJSON_GetArraySize(requestsItem);
+
+			if (!cJSON_IsArray(requestsItem) || request_count == 0 || request_count > BATCH_MAX_REQUESTS ||
+			    (transactionItem && !cJSON_IsBool(transactionItem))) {
+				snprintf(response_text, sizeof(response_text), "requests must be an array of 1 to %d requests", BATCH_MAX_REQUESTS);
+				response_code = 400;
+				break;
+			}
+
+			Batch batch = { .transaction = cJSON_IsTrue(transactionItem) };
+			if (batch.transaction && storage_begin(store) != 0) {
+				strcpy(response_text, "Batch transaction could not be started");
+				response_code = 500;
+				break;
+			}
+
+			int failed = -1;
+			current_batch = &batch;
+			json_begin_array(out, "responses");
+			for (cJSON *request = requestsItem->child; request && failed < 0; request = request->next) {
+				if (run_batched(server, conn, store, &batch, request, out) != 200 && batch.transaction) failed = batch.index;
+				batch.index++;
+			}
+			json_end_array(out);
+			current_batch = NULL;
+
+			if (!batch.transaction) {
+				snprintf(response_text, sizeof(response_text), "Ran %d requests", batch.index);
+				response_code = 200;
+			} else if (failed >= 0) {
+				storage_rollback(store);
+				batch_settle(server, store, &batch, 0);
+				snprintf(response_text, sizeof(response_text), "Request %d failed, the batch was rolled back", failed);
+				response_code = 400;
+			} else if (storage_commit(store) != 0) {
+				batch_settle(server, store, &batch, 0);
+				strcpy(response_text, "Batch could not be committed");
+				response_code = 500;
+			} else {
+				batch_settle(server, store, &batch, 1);
+				snprintf(response_text, sizeof(response_text), "Committed %d requests", batch.index);
+				response_code = 200;
+			}
+			break;
+		}
+
 		default:
 			strcpy(response_text, "UNKNOWN COMMAND\n");
 			response_code = 404;
 			break;
 	}
     
-	cJSON_AddStringToObject(response_json, "response_text", response_text);
-	cJSON_AddNumberToObject(response_json, "response_code", response_code);
+	if (response_code == 200) write_position(action, store, out);
+	json_write_string(out, "response_text", response_text);
+	json_write_int(out, "response_code", response_code);
+	write_request_id(json, out);
+	json_end_object(out);
+	return response_code;
+}
 
 
-	char *json_string = cJSON_PrintUnformatted(response_json);
 
-    if (json_string == NULL) {
-       	printf("Failed to print JSON.\n");
-       	cJSON_Delete(response_json);
-       	return;
-    }
 
-	strncpy(response_buffer, json_string, 4096 - 1);
-	response_buffer[4096 - 1] = '\0';
-	
+typedef struct {
+	Connection *conn;
+	char *payload;
+	uint32_t length;
+} RequestJob;
+
+static Connection *connection_create(int fd) {
+	Connection *conn = calloc(1, sizeof(Connection));
+	if (!conn) return NULL;
+
+	conn->fd = fd;
+	conn->refcount = 1;
+	frame_buffer_init(&conn->input);
+	pthread_mutex_init(&conn->write_lock, NULL);
+	return conn;
+}
+
+static void connection_release(Connection *conn) {
+	if (__atomic_sub_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+	close(conn->fd);
+	frame_buffer_free(&conn->input);
+	pthread_mutex_destroy(&conn->write_lock);
+	free(conn);
+	log_info("Client Disconnected");
 }
 
+// Sends a serialized response as one frame, gathering the writer's chunks with writev
+static void connection_send(Connection *conn, JsonWriter *response) {
+	struct iovec stack_iov[MAX_RESPONSE_IOV];
+	struct iovec *iov = stack_iov;
+	int chunks = json_writer_chunk_count(response);
 
+	if (chunks > MAX_RESPONSE_IOV && !(iov = malloc(chunks * sizeof(struct iovec)))) {
+		shutdown(conn->fd, SHUT_RDWR);
+		return;
+	}
+	int iovcnt = json_writer_iov(response, iov, chunks);
 
+	pthread_mutex_lock(&conn->write_lock);
+	if (frame_sendv(conn->fd, iov, iovcnt, SEND_TIMEOUT_MS) != 0) {
+		perror("send");
+		// Let the reactor notice the broken connection and drop it
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&conn->write_lock);
+
+	if (iov != stack_iov) free(iov);
+}
+
+// SubscriberOps for connections: the registry holds a reference for every subscription and
+// every queued push, so a push never writes to a closed descriptor
+static void subscriber_retain(void *conn) {
+	__atomic_add_fetch(&((Connection *)conn)->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+static void subscriber_release(void *conn) {
+	connection_release(conn);
+}
+
+// Runs on the push thread: one chat's new messages, or a resync, as a frame in the subscriber's encoding
+static void subscriber_push(void *conn, const SubscriptionPush *push) {
+	static __thread JsonWriter frame;
+	RowWriter rows = { .out = &frame, .array = "messages_array" };
+
+	json_writer_reset(&frame);
+	frame.encoding = push->encoding;
+
+	json_begin_object(&frame, NULL);
+	json_write_string(&frame, "push", push->resync ? "resync" : "messages");
+	json_write_int(&frame, "subscription_id", push->subscription_id);
+	json_write_int(&frame, "chat_id", push->chat_id);
+	if (push->resync) {
+		json_write_int(&frame, "after_message_id", push->after_id);
+	} else {
+		for (int i = 0; i < push->count; i++) {
+			write_message_row(&rows, &push->messages[i]);
+		}
+		row_writer_close(&rows);
+	}
+	json_write_int(&frame, "response_code", 200);
+	if (push->has_request_id) json_write_int(&frame, "request_id", push->request_id);
+	json_end_object(&frame);
+
+	if (!frame.failed) connection_send(conn, &frame);
+}
+
+// The four reads may go to a replica, which first waits for the request's position if it has one
+static int acquire_session(ServerContext *server, cJSON *json, int action, StorageSession *store) {
+	switch (action) {
+		case GET_CHATS: case GET_CHAT_MESSAGES: case GET_CHAT_INFO: case GET_USER_INFO: {
+			cJSON *positionItem = cJSON_GetObjectItemCaseSensitive(json, "position");
+			return storage_acquire_read(server->storage, store, cJSON_IsString(positionItem) ? positionItem->valuestring : NULL);
+		}
+		default:
+			return storage_acquire(server->storage, store);
+	}
+}
+
+// Runs on a worker thread: serves one framed request with a storage session and replies.
+void serve_request(void *job, void *arg) {
+	// Each worker keeps its own writer so response chunks are reused across requests, and its
+	// own arena for the parsed request and whatever the managers return
+	static __thread JsonWriter response;
+	static __thread Arena arena;
+
+	ServerContext *server = arg;
+	RequestJob *request = job;
+
+	// Time spent in MySQL is kept apart from the rest; waiting for a pooled connection
+	// only shows up in the total
+	uint64_t received = metrics_now(), phases[METRIC_PHASES] = {0};
+	int action = -1, response_code = 400;
+	metrics_db_take();
+
+	// Answered in the encoding it came in
+	json_writer_reset(&response);
+	response.encoding = wire_detect(request->payload, request->length);
+	arena_request_begin(&arena);
+
+	if (response.encoding == WIRE_JSON) debug("-> Received: %.*s", (int)request->length, request->payload);
+	else debug("-> Received %u bytes of msgpack", request->length);
+	cJSON *json = wire_decode(request->payload, request->length);
+	uint64_t parsed = metrics_now();
+	if (!json) {
+		fprintf(stderr, "Invalid %s received\n", wire_encoding_name(response.encoding));
+		error_response(NULL, 400, "Invalid request payload", &response);
+	} else {
+		action = request_action(json);
+
+		StorageSession store;
+		if (acquire_session(server, json, action, &store) != 0) {
+			response_code = 500;
+			error_response(json, 500, "Database unavailable", &response);
+		} else {
+			uint64_t acquired = metrics_now();
+			response_code = handle_action(server, request->conn, &store, json, &response);
+			uint64_t handled = metrics_now() - acquired;
+
+			phases[METRIC_DB] = metrics_db_take();
+			phases[METRIC_SERIALIZE] = handled > phases[METRIC_DB] ? handled - phases[METRIC_DB] : 0;
+			storage_release(&store);
+		}
+
+		if (response.failed) {
+			response_code = 500;
+			json_writer_reset(&response);
+			error_response(json, 500, "Response could not be serialized", &response);
+		}
+		cJSON_Delete(json);
+	}
+	phases[METRIC_SERIALIZE] += parsed - received;
+
+	connection_send(request->conn, &response);
+	debug("<- Sent %zu bytes", response.total);
+
+	phases[METRIC_TOTAL] = metrics_now() - received;
+	metrics_record(server->metrics, action, response_code, phases);
+
+	arena_request_end();
+	arena_reset(&arena);
+
+	free(request->payload);
+	connection_release(request->conn);
+}
+
+// Connections that stopped reading because the worker queue was full, resumed in the order they
+// were paused. The list holds a reference, so one dropped in the meantime is only unlinked.
+typedef struct {
+	int epoll_fd;
+	ServerContext *server;
+	Connection *paused_head, *paused_tail;
+} Reactor;
+
+static char queue_has_room;  // epoll tag of the worker pool's room_fd
+
+static void set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void reactor_accept(int epoll_fd, int server_fd) {
+	while (1) {
+		int client_socket = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+		if (client_socket < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+			return;
+		}
+
+		int nodelay = 1;
+		setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		Connection *conn = connection_create(client_socket);
+		struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+		if (!conn || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+			perror("epoll_ctl add");
+			if (conn) connection_release(conn);
+			else close(client_socket);
+			continue;
+		}
+
+		log_info("New Client Connection");
+	}
+}
+
+// Hands the held request and then every complete buffered frame to the worker pool without
+// blocking. Returns 0 when all of them were queued, 1 when the queue filled up (the request that
+// didn't fit is held, the rest stays buffered) and -1 when the connection has to be dropped.
+static int reactor_dispatch(Reactor *reactor, Connection *conn) {
+	WorkerPool *workers = reactor->server->workers;
+
+	if (conn->held) {
+		RequestJob job = { .conn = conn, .payload = conn->held, .length = conn->held_length };
+		int status = worker_pool_try_submit(workers, &job);
+		if (status != 0) return status;
+		conn->held = NULL;
+	}
+
+	const char *payload;
+	uint32_t length;
+	int status;
+	while ((status = frame_buffer_next(&conn->input, &payload, &length)) == 1) {
+		RequestJob job = { .conn = conn, .payload = malloc(length), .length = length };
+		if (!job.payload) return -1;
+		memcpy(job.payload, payload, length);
+
+		__atomic_add_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL);
+		int submitted = worker_pool_try_submit(workers, &job);
+		if (submitted == 1) {
+			conn->held = job.payload;
+			conn->held_length = job.length;
+			return 1;
+		}
+		if (submitted != 0) {
+			free(job.payload);
+			connection_release(conn);
+			return -1;
+		}
+	}
+
+	if (status < 0) {
+		fprintf(stderr, "Frame larger than %d bytes, dropping connection\n", FRAME_MAX_PAYLOAD);
+		return -1;
+	}
+	return 0;
+}
+
+// Stops polling the connection's input; what the peer sends meanwhile waits in the socket
+static void reactor_pause(Reactor *reactor, Connection *conn) {
+	struct epoll_event event = { .events = 0, .data.ptr = conn };
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) perror("epoll_ctl pause");
+
+	__atomic_add_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL);
+	conn->paused = 1;
+	conn->next_paused = NULL;
+	if (reactor->paused_tail) reactor->paused_tail->next_paused = conn;
+	else reactor->paused_head = conn;
+	reactor->paused_tail = conn;
+}
+
+static void reactor_drop(Reactor *reactor, Connection *conn) {
+	epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	subscriptions_drop(reactor->server->subscriptions, &conn->subscriptions);
+	if (conn->held) {
+		free(conn->held);
+		conn->held = NULL;
+		connection_release(conn);
+	}
+	conn->dropped = 1;
+	connection_release(conn);
+}
+
+// Reads a bounded number of times and queues each complete frame as soon as it is in, so a
+// connection never buffers more than the frame it is in the middle of (which frame_buffer_next
+// caps at FRAME_MAX_PAYLOAD from its header on). Returns -1 when the connection has to be dropped.
+static int reactor_read(Reactor *reactor, Connection *conn) {
+	for (int reads = 0; reads < READS_PER_EVENT; reads++) {
+		ssize_t n = frame_buffer_read(&conn->input, conn->fd);
+		if (n == 0) {
+			// Peer finished sending; the requests it sent are already queued and still answered
+			return -1;
+		}
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		int status = reactor_dispatch(reactor, conn);
+		if (status < 0) return -1;
+		if (status == 1) {
+			reactor_pause(reactor, conn);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// The worker queue has room again: paused connections get it first come, first served
+static void reactor_resume(Reactor *reactor, int room_fd) {
+	uint64_t signalled;
+	if (read(room_fd, &signalled, sizeof(signalled)) < 0 && errno != EAGAIN) perror("read room_fd");
+
+	while (reactor->paused_head) {
+		Connection *conn = reactor->paused_head;
+		if (!conn->dropped) {
+			int status = reactor_dispatch(reactor, conn);
+			if (status == 1) return;  // full again, stays first in line
+
+			struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+			if (status < 0 || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+				reactor_drop(reactor, conn);
+			}
+		}
+
+		reactor->paused_head = conn->next_paused;
+		if (!reactor->paused_head) reactor->paused_tail = NULL;
+		conn->paused = 0;
+		connection_release(conn);
+	}
+}
+
+static void reactor_run(int server_fd, ServerContext *server) {
+	Reactor reactor = { .epoll_fd = epoll_create1(0), .server = server };
+	int epoll_fd = reactor.epoll_fd;
+	if (epoll_fd < 0) error("epoll_create1");
+
+	set_nonblocking(server_fd);
+	struct epoll_event listen_event = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &listen_event) < 0) error("epoll_ctl listen");
+
+	int room_fd = worker_pool_room_fd(server->workers);
+	struct epoll_event room_event = { .events = EPOLLIN, .data.ptr = &queue_has_room };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, room_fd, &room_event) < 0) error("epoll_ctl room_fd");
+
+	struct epoll_event events[MAX_EVENTS];
+	while (1) {
+		int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (ready < 0) {
+			if (errno == EINTR) continue;
+			error("epoll_wait");
+		}
+
+		for (int i = 0; i < ready; i++) {
+			Connection *conn = events[i].data.ptr;
+			if (!conn) {
+				reactor_accept(epoll_fd, server_fd);
+				continue;
+			}
+			if (events[i].data.ptr == &queue_has_room) {
+				reactor_resume(&reactor, room_fd);
+				continue;
+			}
+
+			int drop = (events[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+			if (!drop && !conn->paused && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+				drop = reactor_read(&reactor, conn) != 0;
+			}
+
+			if (drop) reactor_drop(&reactor, conn);
+		}
+	}
+}
+
+// Load figures for the heartbeat, read on the UDP daemon's thread
+static void heartbeat_load(void *ctx, HeartbeatLoad *load) {
+	ServerContext *server = ctx;
+
+	WorkerPoolStats workers;
+	worker_pool_stats(server->workers, &workers);
+	load->in_flight = workers.busy;
+	load->utilization = workers.threads > 0 ? workers.busy * 100 / workers.threads : 0;
+	load->queue_depth = (int)workers.queued;
+	load->p99_us = metrics_window_quantile(server->metrics, &server->heartbeat_window, 0.99);
+}
+
+// Appended to every scrape after the request metrics
+static void write_gauges(void *ctx, MetricsText *text) {
+	ServerContext *server = ctx;
+
+	DbPoolStats pool;
+	server->storage->ops->pool_stats(server->storage, &pool);
+	metrics_gauge(text, "data_server_db_pool_size", "Connections in the MySQL pool", pool.size);
+	metrics_gauge(text, "data_server_db_pool_in_use", "Pooled connections checked out", pool.in_use);
+	metrics_gauge(text, "data_server_db_pool_peak_in_use", "Most pooled connections ever checked out at once", pool.peak_in_use);
+	metrics_counter(text, "data_server_db_pool_waits_total", "Acquires that found the pool empty", pool.waits);
+	metrics_counter(text, "data_server_db_pool_timeouts_total", "Acquires that gave up waiting", pool.timeouts);
+	metrics_counter(text, "data_server_db_pool_reconnects_total", "Connections reopened after a failed ping", pool.reconnects);
+
+	ReplicaStats replicas;
+	server->storage->ops->replica_stats(server->storage, &replicas);
+	metrics_gauge(text, "data_server_db_replicas", "Replicas reads are routed to", replicas.replicas);
+	metrics_counter(text, "data_server_db_replica_reads_total", "Reads served by a replica", replicas.reads);
+	metrics_counter(text, "data_server_db_replica_waits_total", "Replica reads that waited for a position", replicas.waits);
+	metrics_counter(text, "data_server_db_replica_fallbacks_total", "Reads sent to the primary because a replica was down or behind", replicas.fallbacks);
+
+	WorkerPoolStats workers;
+	worker_pool_stats(server->workers, &workers);
+	metrics_gauge(text, "data_server_worker_threads", "Worker threads", workers.threads);
+	metrics_gauge(text, "data_server_worker_busy", "Workers serving a request", workers.busy);
+	metrics_gauge(text, "data_server_worker_queue_depth", "Requests waiting for a worker", workers.queued);
+	metrics_gauge(text, "data_server_worker_queue_capacity", "Requests the queue holds", workers.capacity);
+	metrics_counter(text, "data_server_worker_queue_full_waits_total", "Submissions that found the queue full", workers.full_waits);
+
+	MessageLogStats log;
+	message_log_stats(server->messages, &log);
+	metrics_gauge(text, "data_server_message_log_pending", "Messages logged but not yet in MySQL", log.pending);
+	metrics_counter(text, "data_server_message_log_appended_total", "Messages appended to the log", log.appended);
+	metrics_counter(text, "data_server_message_log_syncs_total", "fdatasync calls on the log", log.syncs);
+	metrics_counter(text, "data_server_message_log_retries_total", "Flush batches retried", log.retries);
+
+	UserCacheStats users;
+	user_cache_stats(server->users, &users);
+	metrics_counter(text, "data_server_user_cache_hits_total", "User cache hits", users.hits);
+	metrics_counter(text, "data_server_user_cache_misses_total", "User cache misses", users.misses);
+	metrics_gauge(text, "data_server_user_cache_entries", "Users cached", users.entries);
+
+	ChatCacheStats chats;
+	chat_cache_stats(server->chats, &chats);
+	metrics_counter(text, "data_server_chat_cache_hits_total", "Chat cache hits", chats.hits);
+	metrics_counter(text, "data_server_chat_cache_misses_total", "Chat cache misses", chats.misses);
+	metrics_gauge(text, "data_server_chat_cache_entries", "Chats cached", chats.entries);
+
+	MessageTailStats tail;
+	message_tail_stats(server->tail, &tail);
+	metrics_counter(text, "data_server_message_tail_hits_total", "Message pages served from the tail", tail.hits);
+	metrics_counter(text, "data_server_message_tail_misses_total", "Message pages read from storage", tail.misses);
+	metrics_gauge(text, "data_server_message_tail_bytes", "Bytes held by the message tail", tail.bytes);
+
+	SubscriptionsStats subs;
+	subscriptions_stats(server->subscriptions, &subs);
+	metrics_gauge(text, "data_server_subscriptions_active", "Live SUBSCRIBE registrations", subs.active);
+	metrics_gauge(text, "data_server_subscriptions_queued", "Pushes waiting for the push thread", subs.queued);
+	metrics_counter(text, "data_server_subscriptions_pushes_total", "Push frames written", subs.pushes);
+	metrics_counter(text, "data_server_subscriptions_pushed_messages_total", "Messages carried by push frames", subs.messages);
+	metrics_counter(text, "data_server_subscriptions_dropped_total", "Pushes dropped on a full queue", subs.dropped);
+	metrics_counter(text, "data_server_subscriptions_resyncs_total", "Resync frames queued for subscriptions that lost pushes", subs.resyncs);
+}
 
 int main() {
 	int opt = 1;
 
-	int server_fd, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+	// With several processes this returns in each worker, which then sets up as a server of its own
+	SupervisorConfig supervisor_config;
+	supervisor_config_from_env(&supervisor_config);
+	int worker = -1;
+	if (supervisor_config.processes > 1 && (worker = supervisor_run(&supervisor_config)) < 0) exit(1);
+
+	int server_fd;
+    struct sockaddr_in server_addr;
 
 	if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) error("socket failed");
 
-	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+	// Every worker binds its own listener on the port and the kernel balances connections between them
+	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+	    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
         perror("setsockopt");
         exit(EXIT_FAILURE);
     }
@@ -575,92 +1544,92 @@ int main() {
 
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) error("bind failed");
 
-    if (listen(server_fd, 3) < 0) error("listen failed");
-
-	signal(SIGCHLD, SIG_IGN);
-
+    if (listen(server_fd, LISTEN_BACKLOG) < 0) error("listen failed");
 
+	signal(SIGPIPE, SIG_IGN);
 
-    MYSQL *conn;
+	// cJSON allocates from the worker's request arena while it serves a request
+	cJSON_Hooks json_hooks = { request_alloc, request_free };
+	cJSON_InitHooks(&json_hooks);
 
-    const char *server = getenv("DB_HOST");
-    const char *user = getenv("DB_USER");
-    const char *password = getenv("DB_PASS");
-    const char *database = getenv("DB_NAME");
-
-    conn = mysql_init(NULL);
+	if (mysql_library_init(0, NULL, NULL)) {
+		fprintf(stderr, "Could not initialize MySQL client library\n");
+		exit(1);
+	}
 
-    if (!mysql_real_connect(conn, server, user, password, database, 0, NULL, 0)) {
-        fprintf(stderr, "Connection failed: %s\n", mysql_error(conn));
-        exit(1);
-    }
+	ServerContext server = {0};
+	server.metrics = metrics_create(action_names, sizeof(action_names) / sizeof(action_names[0]));
+	if (!server.metrics) {
+		fprintf(stderr, "Metrics could not be created\n");
+		exit(1);
+	}
 
-	pthread_t udp_thread;
-	if (pthread_create(&udp_thread, NULL, udp_daemon, NULL) != 0) {
-		perror("No se pudo crear el hilo del daemon UDP");
+	server.storage = storage_open_from_env();
+	if (!server.storage) {
+		fprintf(stderr, "Storage could not be opened\n");
+		exit(1);
 	}
 
+	MessageLogConfig log_config;
+	message_log_config_from_env(&log_config);
 
-	while (1){
-		if ((client_socket = accept(server_fd, (struct sockaddr *)&client_addr, &addr_len)) < 0) {
-			perror("accept");
-			continue;
-		}
+	MessageTailConfig tail_config;
+	message_tail_config_from_env(&tail_config);
+	server.tail = message_tail_create(&tail_config);
 
-		pid_t pid = fork();
+	UserCacheConfig cache_config;
+	user_cache_config_from_env(&cache_config);
+	server.users = user_cache_create(&cache_config);
 
-		if (pid == 0) {
-			close(server_fd);
+	ChatCacheConfig chat_cache_config;
+	chat_cache_config_from_env(&chat_cache_config);
+	server.chats = chat_cache_create(&chat_cache_config);
 
-			MYSQL *child_conn = mysql_init(NULL);
-			if (!mysql_real_connect(child_conn, server, user, password, database, 0, NULL, 0)) {
-				fprintf(stderr, "Child DB connection failed: %s\n", mysql_error(child_conn));
-				exit(1);
-			}
+	// Fed by the message log's flusher and by handlers that write system messages
+	SubscriptionsConfig subscriptions_config;
+	subscriptions_config_from_env(&subscriptions_config);
+	SubscriberOps subscriber_ops = { subscriber_retain, subscriber_release, subscriber_push };
+	server.subscriptions = subscriptions_create(&subscriptions_config, &subscriber_ops, server.chats, server.tail);
 
-			printf("New Client Connection\n");
+	server.messages = message_log_open(&log_config, server.storage, server.tail, server.subscriptions);
+	if (!server.messages) {
+		fprintf(stderr, "Message log could not be opened\n");
+		exit(1);
+	}
 
-			char receive_buffer[BUFFER_SIZE];
-			char response_buffer[BUFFER_SIZE];
-			memset(receive_buffer, 0, BUFFER_SIZE);
+	WorkerPool *workers = worker_pool_create(env_int("WORKER_THREADS", WORKER_POOL_DEFAULT_THREADS, false),
+	                                         env_int("WORKER_QUEUE_CAPACITY", WORKER_POOL_DEFAULT_CAPACITY, false),
+	                                         sizeof(RequestJob), serve_request, &server);
+	if (!workers) {
+		fprintf(stderr, "Worker pool could not be created\n");
+		exit(1);
+	}
+	server.workers = workers;
 
-			int valread = read(client_socket, receive_buffer, BUFFER_SIZE - 1);
-			if (valread < 1){
-				perror("read");
-				printf("wtf\n");
-				close(client_socket);
-				mysql_close(child_conn);
-				exit(1);
-			}
+	MetricsConfig metrics_config;
+	metrics_config_from_env(&metrics_config);
+	if (metrics_serve(server.metrics, &metrics_config, write_gauges, &server) != 0) {
+		fprintf(stderr, "Metrics endpoint could not be started\n");
+	}
 
-			receive_buffer[valread] = '\0';
+	// A worker's load goes into the supervisor's heartbeats
+	HeartbeatSource heartbeat = { heartbeat_load, &server };
+	pthread_t udp_thread;
+	if (worker >= 0) {
+		if (supervisor_report(worker, &heartbeat) != 0) fprintf(stderr, "Load reports to the supervisor could not be started\n");
+	} else if (pthread_create(&udp_thread, NULL, udp_daemon, &heartbeat) != 0) {
+		perror("No se pudo crear el hilo del daemon UDP");
+	}
 
-			printf("-> Received: %s\n\n", receive_buffer);
-			cJSON *json = cJSON_Parse(receive_buffer);
-			if (!json) {
-				fprintf(stderr, "Invalid JSON received\n");
-				close(client_socket);
-				mysql_close(child_conn);
-				exit(1);
-			}
+	reactor_run(server_fd, &server);
 
-			handle_action(child_conn, json, response_buffer);
-			cJSON_Delete(json);
-
-			send(client_socket, response_buffer, strlen(response_buffer), 0);
-			printf("<- Sent: %s\n\n", response_buffer);
-			close(client_socket);
-			mysql_close(child_conn);
-			printf("Client Disconnected\n");
-			exit(0);
-		} else if (pid > 0) {
-			close(client_socket);
-		} else {
-			perror("fork");
-			close(client_socket);
-		}
-	}
-    mysql_close(conn);
+	subscriptions_destroy(server.subscriptions);
+	message_tail_destroy(server.tail);
+	chat_cache_destroy(server.chats);
+	user_cache_destroy(server.users);
+	storage_close(server.storage);
+	metrics_destroy(server.metrics);
+	mysql_library_end();
 
     return 0;
 }
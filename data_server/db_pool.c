@@ -0,0 +1,314 @@
+#include "db_pool.h"
+#include "metrics.h"
+#include "../lib/env/env.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+struct DbPool {
+    DbPoolConfig config;
+    DbConn *conns;
+    DbConn **free_list;
+    int free_count;
+    DbPoolStats stats;
+
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+};
+
+void db_pool_config_from_env(DbPoolConfig *config) {
+    memset(config, 0, sizeof(*config));
+
+    config->host = getenv("DB_HOST");
+    config->user = getenv("DB_USER");
+    config->password = getenv("DB_PASS");
+    config->database = getenv("DB_NAME");
+    config->port = env_int("DB_PORT", 0, false);
+
+    config->size = env_int("DB_POOL_SIZE", DB_POOL_DEFAULT_SIZE, false);
+    config->idle_reconnect = env_int("DB_POOL_IDLE_RECONNECT", DB_POOL_DEFAULT_IDLE_RECONNECT, false);
+    config->acquire_timeout_ms = env_int("DB_POOL_ACQUIRE_TIMEOUT_MS", DB_POOL_DEFAULT_ACQUIRE_TIMEOUT_MS, false);
+
+    config->replicas = getenv("DB_REPLICAS");
+    config->replica_wait_ms = env_int("DB_REPLICA_WAIT_MS", DB_REPLICA_DEFAULT_WAIT_MS, false);
+
+    config->shards = getenv("DB_SHARDS");
+}
+
+static int db_conn_open(DbPool *pool, DbConn *conn) {
+    unsigned int connect_timeout = 5;
+
+    conn->mysql = mysql_init(NULL);
+    if (!conn->mysql) {
+        fprintf(stderr, "mysql_init failed for pool slot %d\n", conn->index);
+        return -1;
+    }
+
+    mysql_options(conn->mysql, MYSQL_OPT_CONNECT_TIMEOUT, &connect_timeout);
+
+    if (!mysql_real_connect(conn->mysql, pool->config.host, pool->config.user, pool->config.password,
+                            pool->config.database, pool->config.port, NULL, 0)) {
+        fprintf(stderr, "Pool connection %d failed: %s\n", conn->index, mysql_error(conn->mysql));
+        mysql_close(conn->mysql);
+        conn->mysql = NULL;
+        return -1;
+    }
+
+    if (pool->config.auto_increment_increment > 1) {
+        char sql[128];
+        snprintf(sql, sizeof(sql), "SET SESSION auto_increment_increment = %d, auto_increment_offset = %d",
+                 pool->config.auto_increment_increment, pool->config.auto_increment_offset);
+
+        if (mysql_query(conn->mysql, sql)) {
+            fprintf(stderr, "Pool connection %d could not set its id offset: %s\n", conn->index, mysql_error(conn->mysql));
+            mysql_close(conn->mysql);
+            conn->mysql = NULL;
+            return -1;
+        }
+    }
+
+    if (db_stmts_prepare(conn->mysql, conn->stmts) != 0) {
+        fprintf(stderr, "Pool connection %d could not prepare its statements\n", conn->index);
+        mysql_close(conn->mysql);
+        conn->mysql = NULL;
+        return -1;
+    }
+
+    conn->last_used = time(NULL);
+    return 0;
+}
+
+static void db_conn_close(DbConn *conn) {
+    if (conn->mysql) {
+        db_stmts_close(conn->stmts);
+        db_batch_close(conn->batch);
+        if (conn->gtid_executed) mysql_stmt_close(conn->gtid_executed);
+        if (conn->gtid_wait) mysql_stmt_close(conn->gtid_wait);
+        conn->gtid_executed = NULL;
+        conn->gtid_wait = NULL;
+        mysql_close(conn->mysql);
+        conn->mysql = NULL;
+    }
+}
+
+DbPool *db_pool_create(const DbPoolConfig *config) {
+    DbPool *pool = calloc(1, sizeof(DbPool));
+    if (!pool) return NULL;
+
+    pool->config = *config;
+    pool->conns = calloc(config->size, sizeof(DbConn));
+    pool->free_list = calloc(config->size, sizeof(DbConn *));
+    if (!pool->conns || !pool->free_list) {
+        free(pool->conns);
+        free(pool->free_list);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pool->stats.size = config->size;
+
+    int opened = 0;
+    for (int i = 0; i < config->size; i++) {
+        DbConn *conn = &pool->conns[i];
+        conn->index = i;
+        conn->pool = pool;
+        if (db_conn_open(pool, conn) == 0) opened++;
+        pool->free_list[pool->free_count++] = conn;
+    }
+
+    if (opened == 0) {
+        fprintf(stderr, "No database connection could be opened\n");
+        db_pool_destroy(pool);
+        return NULL;
+    }
+
+    printf("DB pool ready: %d/%d connections to %s\n", opened, config->size,
+           config->host ? config->host : "localhost");
+    return pool;
+}
+
+// Makes sure a checked out connection is usable: slots that failed to open are retried,
+// and connections idle longer than idle_reconnect or marked stale are pinged and reopened
+// if the ping fails.
+static int db_conn_prepare(DbPool *pool, DbConn *conn) {
+    time_t now = time(NULL);
+
+    if (conn->mysql && !conn->stale && now - conn->last_used < pool->config.idle_reconnect) return 0;
+    conn->stale = 0;
+    if (conn->mysql && mysql_ping(conn->mysql) == 0) return 0;
+
+    db_conn_close(conn);
+    if (db_conn_open(pool, conn) != 0) return -1;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.reconnects++;
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+DbConn *db_pool_acquire(DbPool *pool) {
+    struct timeval now;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.acquires++;
+
+    if (pool->free_count == 0) {
+        pool->stats.waits++;
+
+        gettimeofday(&now, NULL);
+        long nsec = now.tv_usec * 1000L + (pool->config.acquire_timeout_ms % 1000) * 1000000L;
+        deadline.tv_sec = now.tv_sec + pool->config.acquire_timeout_ms / 1000 + nsec / 1000000000L;
+        deadline.tv_nsec = nsec % 1000000000L;
+
+        while (pool->free_count == 0) {
+            if (pthread_cond_timedwait(&pool->available, &pool->lock, &deadline) == ETIMEDOUT && pool->free_count == 0) {
+                pool->stats.timeouts++;
+                pthread_mutex_unlock(&pool->lock);
+                fprintf(stderr, "DB pool saturated: no connection after %d ms (%lu timeouts)\n",
+                        pool->config.acquire_timeout_ms, pool->stats.timeouts);
+                return NULL;
+            }
+        }
+    }
+
+    DbConn *conn = pool->free_list[--pool->free_count];
+    pool->stats.in_use++;
+    if (pool->stats.in_use > pool->stats.peak_in_use) pool->stats.peak_in_use = pool->stats.in_use;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (db_conn_prepare(pool, conn) != 0) {
+        db_pool_release(pool, conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+void db_pool_release(DbPool *pool, DbConn *conn) {
+    if (!conn) return;
+
+    conn->last_used = time(NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->free_list[pool->free_count++] = conn;
+    pool->stats.in_use--;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void db_pool_stats(DbPool *pool, DbPoolStats *stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void db_pool_destroy(DbPool *pool) {
+    if (!pool) return;
+
+    for (int i = 0; i < pool->config.size; i++) {
+        db_conn_close(&pool->conns[i]);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->available);
+    free(pool->conns);
+    free(pool->free_list);
+    free(pool);
+}
+
+int db_begin(DbConn *conn) {
+    uint64_t started = metrics_now();
+    int failed = mysql_query(conn->mysql, "START TRANSACTION");
+    metrics_db_add(metrics_now() - started);
+
+    if (failed) {
+        fprintf(stderr, "Begin transaction failed: %s\n", mysql_error(conn->mysql));
+        return -1;
+    }
+    return 0;
+}
+
+int db_commit(DbConn *conn) {
+    uint64_t started = metrics_now();
+    int failed = mysql_commit(conn->mysql);
+    metrics_db_add(metrics_now() - started);
+
+    if (failed) {
+        fprintf(stderr, "Commit failed: %s\n", mysql_error(conn->mysql));
+        db_rollback(conn);
+        return -1;
+    }
+    return 0;
+}
+
+void db_rollback(DbConn *conn) {
+    uint64_t started = metrics_now();
+    int failed = mysql_rollback(conn->mysql);
+    metrics_db_add(metrics_now() - started);
+
+    if (failed) {
+        fprintf(stderr, "Rollback failed: %s\n", mysql_error(conn->mysql));
+    }
+}
+
+// Only deployments with replicas run these, and servers without GTIDs can't even prepare
+// them, so they are prepared on first use rather than with the rest
+static MYSQL_STMT *position_stmt(DbConn *conn, MYSQL_STMT **slot, const char *sql) {
+    if (*slot) return *slot;
+
+    MYSQL_STMT *stmt = mysql_stmt_init(conn->mysql);
+    if (!stmt) {
+        fprintf(stderr, "mysql_stmt_init failed: %s\n", mysql_error(conn->mysql));
+        return NULL;
+    }
+
+    if (mysql_stmt_prepare(stmt, sql, strlen(sql))) {
+        fprintf(stderr, "Prepare failed: %s\nStatement: %s\n", mysql_stmt_error(stmt), sql);
+        mysql_stmt_close(stmt);
+        return NULL;
+    }
+
+    *slot = stmt;
+    return stmt;
+}
+
+int db_position(DbConn *conn, char *position, size_t size) {
+    MYSQL_STMT *stmt = position_stmt(conn, &conn->gtid_executed, "SELECT @@GLOBAL.gtid_executed");
+    DbBinds row = {0};
+
+    db_bind_buffer(&row, position, size);
+    if (!stmt || db_stmt_execute(stmt, NULL, &row)) return -1;
+
+    int status = db_stmt_fetch(stmt, &row);
+    db_stmt_finish(stmt);
+
+    // A truncated set would be waited on as if it were complete
+    if (status != 1 || db_bind_is_null(&row, 0) || row.length[0] > size - 1) return -1;
+    return 0;
+}
+
+int db_wait_position(DbConn *conn, const char *position, int timeout_ms) {
+    MYSQL_STMT *stmt = position_stmt(conn, &conn->gtid_wait, "SELECT WAIT_FOR_EXECUTED_GTID_SET(?, ?)");
+    DbBinds params = {0};
+    DbBinds row = {0};
+    char timeout[32];
+    int timed_out = 0;
+
+    // Fractional seconds are accepted, so the wait can stay well under a second
+    snprintf(timeout, sizeof(timeout), "%.3f", timeout_ms / 1000.0);
+    db_bind_string(&params, position);
+    db_bind_string(&params, timeout);
+    db_bind_int(&row, &timed_out);
+    if (!stmt || db_stmt_execute(stmt, &params, &row)) return -1;
+
+    int status = db_stmt_fetch(stmt, &row);
+    db_stmt_finish(stmt);
+
+    if (status != 1 || db_bind_is_null(&row, 0)) return -1;
+    return timed_out ? 1 : 0;
+}
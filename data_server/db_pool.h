@@ -0,0 +1,82 @@
+#ifndef DB_POOL_H
+#define DB_POOL_H
+
+#include <mysql/mysql.h>
+#include <pthread.h>
+#include <time.h>
+#include "db_stmt.h"
+
+#define DB_POOL_DEFAULT_SIZE 8
+#define DB_POOL_DEFAULT_IDLE_RECONNECT 30
+#define DB_POOL_DEFAULT_ACQUIRE_TIMEOUT_MS 2000
+#define DB_REPLICA_DEFAULT_WAIT_MS 200
+#define DB_MAX_REPLICAS 8
+#define DB_MAX_SHARDS 16
+
+typedef struct DbPool DbPool;
+
+typedef struct {
+    const char *host;
+    const char *user;
+    const char *password;
+    const char *database;
+    unsigned int port;
+
+    int size;                // DB_POOL_SIZE: connections opened at startup
+    int idle_reconnect;      // DB_POOL_IDLE_RECONNECT: seconds idle before a ping is required
+    int acquire_timeout_ms;  // DB_POOL_ACQUIRE_TIMEOUT_MS: max wait for a free connection
+
+    // Read replicas, each with a pool of size connections and the same credentials
+    const char *replicas;    // DB_REPLICAS: comma-separated host[:port] list, unset for none
+    int replica_wait_ms;     // DB_REPLICA_WAIT_MS: how long a read waits for a replica to catch up
+
+    // Chat shards, same credentials; DB_HOST/DB_NAME then only holds users
+    const char *shards;      // DB_SHARDS: comma-separated host[:port]/database list, unset for none
+
+    // Set on every connection of a shard's pool so its ids are offset modulo increment;
+    // 0 leaves the server's settings alone
+    int auto_increment_increment;
+    int auto_increment_offset;
+} DbPoolConfig;
+
+typedef struct {
+    MYSQL *mysql;
+    MYSQL_STMT *stmts[STMT_COUNT];  // prepared on open, re-prepared whenever the connection is reopened
+    MYSQL_STMT *batch[BATCH_COUNT][DB_BATCH_MAX_ROWS];  // multi-row inserts, prepared on first use
+    MYSQL_STMT *gtid_executed;  // replication positions, prepared on first use
+    MYSQL_STMT *gtid_wait;
+    time_t last_used;
+    int stale;  // set by a user that saw a query fail; the next acquire pings it first
+    int index;
+    DbPool *pool;  // the pool it belongs to
+} DbConn;
+
+typedef struct {
+    int size;
+    int in_use;
+    int peak_in_use;
+    unsigned long acquires;
+    unsigned long waits;      // acquires that found the pool empty
+    unsigned long timeouts;   // acquires that gave up after acquire_timeout_ms
+    unsigned long reconnects; // connections reopened after a failed ping
+} DbPoolStats;
+
+void db_pool_config_from_env(DbPoolConfig *config);
+DbPool *db_pool_create(const DbPoolConfig *config);
+DbConn *db_pool_acquire(DbPool *pool);
+void db_pool_release(DbPool *pool, DbConn *conn);
+void db_pool_stats(DbPool *pool, DbPoolStats *stats);
+void db_pool_destroy(DbPool *pool);
+
+// Explicit transactions on a checked out connection; a failed commit is rolled back
+int db_begin(DbConn *conn);
+int db_commit(DbConn *conn);
+void db_rollback(DbConn *conn);
+
+// Replication positions (GTID sets) for reading your own writes on a replica. db_position
+// copies what the server has executed; db_wait_position returns 0 once conn's server has
+// applied position, 1 if it hasn't within timeout_ms, -1 on error (e.g. GTIDs are off).
+int db_position(DbConn *conn, char *position, size_t size);
+int db_wait_position(DbConn *conn, const char *position, int timeout_ms);
+
+#endif
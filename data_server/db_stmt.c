@@ -0,0 +1,362 @@
+#include "db_stmt.h"
+#include "metrics.h"
+#include <mysql/mysqld_error.h>
+#include <stdio.h>
+#include <string.h>
+
+// The inbox is read through chat_participants (user_id, last_message_id, chat_id), newest
+// activity first, resuming strictly after the (last_message_id, chat_id) cursor. Each row
+// carries a summary of its chat's last message, so only the chat name is joined in.
+#define INBOX_COLUMNS \
+    "SELECT c.chat_id, c.chat_name, c.is_group, " \
+    "cp.last_message_content, cp.last_message_type, cp.last_message_at, cp.last_message_sender, " \
+    "cp.last_message_id " \
+    "FROM chat_participants cp " \
+    "JOIN chats c ON c.chat_id = cp.chat_id "
+
+#define INBOX_PAGE \
+    "AND (cp.last_message_id < ? OR (cp.last_message_id = ? AND cp.chat_id < ?)) " \
+    "ORDER BY cp.last_message_id DESC, cp.chat_id DESC LIMIT ?"
+
+#define MESSAGE_COLUMNS \
+    "SELECT m.message_id, m.sender_id, u.username AS sender_username, m.content, m.message_type, m.created_at " \
+    "FROM messages m JOIN users u ON u.user_id = m.sender_id "
+
+static const char *stmt_sql[STMT_COUNT] = {
+    [STMT_CREATE_USER] =
+        "INSERT INTO users (username, email, password_hash) VALUES (?, ?, ?)",
+    // Chat shards keep the users their joins need, without the password
+    [STMT_COPY_USER] =
+        "INSERT INTO users (user_id, username, email, password_hash) VALUES (?, ?, ?, '') "
+        "ON DUPLICATE KEY UPDATE username = VALUES(username), email = VALUES(email)",
+    [STMT_VALIDATE_USER] =
+        "SELECT password_hash, user_id FROM users WHERE username = ? OR email = ?",
+    [STMT_GET_USER_INFO] =
+        "SELECT username, email, user_id, password_hash FROM users WHERE username = ? OR email = ?",
+    [STMT_CREATE_CHAT] =
+        "INSERT INTO chats (is_group, chat_name) VALUES (?, ?)",
+    [STMT_ADD_TO_CHAT] =
+        "INSERT INTO chat_participants (chat_id, user_id, is_admin) VALUES (?, ?, ?)",
+    // Copies the newest message into the chat and every participant's inbox summary;
+    // a chat without messages is left as it is
+    [STMT_SET_LATEST_MESSAGE] =
+        "UPDATE chats c "
+        "JOIN (SELECT m.message_id, m.content, m.message_type, m.created_at, u.username "
+        "      FROM messages m JOIN users u ON u.user_id = m.sender_id "
+        "      WHERE m.chat_id = ? ORDER BY m.message_id DESC LIMIT 1) latest "
+        "LEFT JOIN chat_participants cp ON cp.chat_id = c.chat_id "
+        "SET c.last_message_id = latest.message_id, "
+        "    cp.last_message_id = latest.message_id, "
+        "    cp.last_message_content = latest.content, "
+        "    cp.last_message_type = latest.message_type, "
+        "    cp.last_message_at = latest.created_at, "
+        "    cp.last_message_sender = latest.username "
+        "WHERE c.chat_id = ?",
+    [STMT_GET_INBOX] =
+        INBOX_COLUMNS
+        "WHERE cp.user_id = ? "
+        INBOX_PAGE,
+    [STMT_GET_INBOX_SINCE] =
+        INBOX_COLUMNS
+        "WHERE cp.user_id = ? AND (cp.last_message_id = 0 OR cp.last_message_at > ?) "
+        INBOX_PAGE,
+    [STMT_USER_CHAT_COUNT] =
+        "SELECT COUNT(*) FROM chat_participants WHERE user_id = ?",
+    // Message pages walk the (chat_id, message_id) index: newest first when scrolling back,
+    // oldest first when catching up. Every variant takes the page size last.
+    [STMT_GET_CHAT_MESSAGES] =
+        MESSAGE_COLUMNS
+        "WHERE m.chat_id = ? AND m.is_deleted = 0 "
+        "ORDER BY m.message_id DESC LIMIT ?",
+    [STMT_GET_CHAT_MESSAGES_BEFORE] =
+        MESSAGE_COLUMNS
+        "WHERE m.chat_id = ? AND m.is_deleted = 0 AND m.message_id < ? "
+        "ORDER BY m.message_id DESC LIMIT ?",
+    [STMT_GET_CHAT_MESSAGES_AFTER] =
+        MESSAGE_COLUMNS
+        "WHERE m.chat_id = ? AND m.is_deleted = 0 AND m.message_id > ? "
+        "ORDER BY m.message_id ASC LIMIT ?",
+    [STMT_GET_CHAT_MESSAGES_SINCE] =
+        MESSAGE_COLUMNS
+        "WHERE m.chat_id = ? AND m.is_deleted = 0 AND m.created_at > ? "
+        "ORDER BY m.message_id ASC LIMIT ?",
+    [STMT_GET_CHAT] =
+        "SELECT chat_id, chat_name, is_group FROM chats WHERE chat_id = ?",
+    [STMT_GET_CHAT_PARTICIPANTS] =
+        "SELECT u.user_id, u.username, cp.is_admin "
+        "FROM chat_participants cp "
+        "JOIN users u ON cp.user_id = u.user_id "
+        "WHERE cp.chat_id = ?",
+    [STMT_IS_USER_ADMIN] =
+        "SELECT is_admin FROM chat_participants WHERE chat_id = ? AND user_id = ?",
+    [STMT_IS_GROUP_CHAT] =
+        "SELECT is_group FROM chats WHERE chat_id = ?",
+    [STMT_REMOVE_FROM_CHAT] =
+        "DELETE FROM chat_participants WHERE chat_id = ? AND user_id = ?",
+    [STMT_PARTICIPANT_COUNT] =
+        "SELECT COUNT(*) FROM chat_participants WHERE chat_id = ?",
+    [STMT_ADMIN_COUNT] =
+        "SELECT COUNT(*) FROM chat_participants WHERE chat_id = ? AND is_admin = 1",
+    [STMT_FIRST_PARTICIPANT] =
+        "SELECT user_id FROM chat_participants WHERE chat_id = ? LIMIT 1",
+    [STMT_PROMOTE_ADMIN] =
+        "UPDATE chat_participants SET is_admin = 1 WHERE chat_id = ? AND user_id = ?",
+    [STMT_DELETE_CHAT] =
+        "DELETE FROM chats WHERE chat_id = ?",
+    [STMT_GET_CHAT_MEMBERS] =
+        "SELECT c.is_group, cp.user_id, cp.is_admin FROM chats c "
+        "LEFT JOIN chat_participants cp ON cp.chat_id = c.chat_id "
+        "WHERE c.chat_id = ?",
+};
+
+int db_stmts_prepare(MYSQL *mysql, MYSQL_STMT *stmts[STMT_COUNT]) {
+    memset(stmts, 0, STMT_COUNT * sizeof(MYSQL_STMT *));
+
+    for (int i = 0; i < STMT_COUNT; i++) {
+        stmts[i] = mysql_stmt_init(mysql);
+        if (!stmts[i]) {
+            fprintf(stderr, "mysql_stmt_init failed: %s\n", mysql_error(mysql));
+            db_stmts_close(stmts);
+            return -1;
+        }
+
+        if (mysql_stmt_prepare(stmts[i], stmt_sql[i], strlen(stmt_sql[i]))) {
+            fprintf(stderr, "Prepare failed: %s\nStatement: %s\n", mysql_stmt_error(stmts[i]), stmt_sql[i]);
+            db_stmts_close(stmts);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void db_stmts_close_range(MYSQL_STMT **stmts, int count) {
+    for (int i = 0; i < count; i++) {
+        if (stmts[i]) {
+            mysql_stmt_close(stmts[i]);
+            stmts[i] = NULL;
+        }
+    }
+}
+
+void db_stmts_close(MYSQL_STMT *stmts[STMT_COUNT]) {
+    db_stmts_close_range(stmts, STMT_COUNT);
+}
+
+static const struct {
+    const char *insert;
+    const char *row;
+    const char *suffix;
+} batch_sql[BATCH_COUNT] = {
+    [BATCH_ADD_TO_CHAT] = {
+        "INSERT INTO chat_participants (chat_id, user_id, is_admin) VALUES ", "(?, ?, ?)", "" },
+    // A row already stored under the same log record is left alone, so replaying a batch is a no-op.
+    // Unlike INSERT IGNORE this still fails on a deleted chat or an unknown sender.
+    [BATCH_INSERT_MESSAGE] = {
+        "INSERT INTO messages (chat_id, sender_id, content, message_type, log_id, log_sequence) VALUES ",
+        "(?, ?, ?, ?, ?, ?)",
+        " ON DUPLICATE KEY UPDATE message_id = message_id" },
+};
+
+MYSQL_STMT *db_batch_stmt(MYSQL *mysql, MYSQL_STMT *batch[BATCH_COUNT][DB_BATCH_MAX_ROWS], BatchStmtId id, int rows) {
+    if (rows < 1 || rows > DB_BATCH_MAX_ROWS) {
+        fprintf(stderr, "Batch of %d rows is out of range\n", rows);
+        return NULL;
+    }
+
+    MYSQL_STMT **slot = &batch[id][rows - 1];
+    if (*slot) return *slot;
+
+    char sql[1024];
+    size_t length = snprintf(sql, sizeof(sql), "%s", batch_sql[id].insert);
+    for (int i = 0; i < rows; i++) {
+        length += snprintf(sql + length, sizeof(sql) - length, "%s%s", i ? ", " : "", batch_sql[id].row);
+    }
+    length += snprintf(sql + length, sizeof(sql) - length, "%s", batch_sql[id].suffix);
+
+    MYSQL_STMT *stmt = mysql_stmt_init(mysql);
+    if (!stmt) {
+        fprintf(stderr, "mysql_stmt_init failed: %s\n", mysql_error(mysql));
+        return NULL;
+    }
+
+    if (mysql_stmt_prepare(stmt, sql, length)) {
+        fprintf(stderr, "Prepare failed: %s\nStatement: %s\n", mysql_stmt_error(stmt), sql);
+        mysql_stmt_close(stmt);
+        return NULL;
+    }
+
+    *slot = stmt;
+    return stmt;
+}
+
+void db_batch_close(MYSQL_STMT *batch[BATCH_COUNT][DB_BATCH_MAX_ROWS]) {
+    for (int id = 0; id < BATCH_COUNT; id++) {
+        db_stmts_close_range(batch[id], DB_BATCH_MAX_ROWS);
+    }
+}
+
+static MYSQL_BIND *db_bind_next(DbBinds *binds) {
+    if (binds->count >= DB_STMT_MAX_BINDS) {
+        fprintf(stderr, "Too many bindings for one statement\n");
+        return NULL;
+    }
+
+    int i = binds->count++;
+    MYSQL_BIND *bind = &binds->bind[i];
+    memset(bind, 0, sizeof(*bind));
+    bind->length = &binds->length[i];
+    bind->is_null = &binds->is_null[i];
+    bind->error = &binds->error[i];
+    return bind;
+}
+
+void db_bind_int(DbBinds *binds, int *value) {
+    MYSQL_BIND *bind = db_bind_next(binds);
+    if (!bind) return;
+
+    bind->buffer_type = MYSQL_TYPE_LONG;
+    bind->buffer = value;
+}
+
+void db_bind_string(DbBinds *binds, const char *value) {
+    MYSQL_BIND *bind = db_bind_next(binds);
+    if (!bind) return;
+
+    bind->buffer_type = MYSQL_TYPE_STRING;
+    bind->buffer = (void *)value;
+    if (value) {
+        *bind->length = strlen(value);
+        bind->buffer_length = *bind->length;
+    } else {
+        *bind->is_null = true;
+    }
+}
+
+void db_bind_id(DbBinds *binds, const uint64_t *value) {
+    MYSQL_BIND *bind = db_bind_next(binds);
+    if (!bind) return;
+
+    bind->buffer_type = MYSQL_TYPE_LONGLONG;
+    bind->buffer = (void *)value;
+    bind->is_unsigned = true;
+    if (!value) *bind->is_null = true;
+}
+
+void db_bind_buffer(DbBinds *binds, char *buffer, size_t size) {
+    MYSQL_BIND *bind = db_bind_next(binds);
+    if (!bind) return;
+
+    // Keep one byte back so db_stmt_fetch can always terminate the value
+    bind->buffer_type = MYSQL_TYPE_STRING;
+    bind->buffer = buffer;
+    bind->buffer_length = size - 1;
+    buffer[0] = '\0';
+}
+
+bool db_bind_is_null(const DbBinds *binds, int column) {
+    return column < binds->count && binds->is_null[column];
+}
+
+static __thread unsigned int last_error;
+
+static int stmt_execute(MYSQL_STMT *stmt, DbBinds *params, DbBinds *results) {
+    last_error = 0;
+    if (!stmt) {
+        fprintf(stderr, "Statement is not prepared\n");
+        return -1;
+    }
+
+    if (params && params->count > 0 && mysql_stmt_bind_param(stmt, params->bind)) {
+        fprintf(stderr, "Bind params failed: %s\n", mysql_stmt_error(stmt));
+        return -1;
+    }
+
+    if (mysql_stmt_execute(stmt)) {
+        fprintf(stderr, "Execute failed: %s\n", mysql_stmt_error(stmt));
+        last_error = mysql_stmt_errno(stmt);
+        return -1;
+    }
+
+    if (!results) return 0;
+
+    if (mysql_stmt_bind_result(stmt, results->bind)) {
+        fprintf(stderr, "Bind result failed: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -1;
+    }
+
+    if (mysql_stmt_store_result(stmt)) {
+        fprintf(stderr, "Store result failed: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Results are buffered here, so this is where a request waits on MySQL; fetches are local
+int db_stmt_execute(MYSQL_STMT *stmt, DbBinds *params, DbBinds *results) {
+    uint64_t started = metrics_now();
+    int status = stmt_execute(stmt, params, results);
+
+    metrics_db_add(metrics_now() - started);
+    return status;
+}
+
+unsigned int db_last_error(void) {
+    return last_error;
+}
+
+void db_clear_error(void) {
+    last_error = 0;
+}
+
+bool db_error_permanent(unsigned int error) {
+    switch (error) {
+        case ER_NO_REFERENCED_ROW: case ER_NO_REFERENCED_ROW_2:
+        case ER_BAD_NULL_ERROR: case ER_DATA_TOO_LONG: case ER_TRUNCATED_WRONG_VALUE_FOR_FIELD:
+            return true;
+        default:
+            return false;
+    }
+}
+
+int db_stmt_fetch(MYSQL_STMT *stmt, DbBinds *results) {
+    int status = mysql_stmt_fetch(stmt);
+
+    if (status == MYSQL_NO_DATA) return 0;
+    if (status != 0 && status != MYSQL_DATA_TRUNCATED) {
+        fprintf(stderr, "Fetch failed: %s\n", mysql_stmt_error(stmt));
+        return -1;
+    }
+
+    // Truncated strings keep their full length in length[], so clamp before terminating
+    for (int i = 0; i < results->count; i++) {
+        MYSQL_BIND *bind = &results->bind[i];
+        if (bind->buffer_type != MYSQL_TYPE_STRING) continue;
+
+        char *buffer = bind->buffer;
+        if (results->is_null[i]) {
+            buffer[0] = '\0';
+        } else {
+            unsigned long length = results->length[i];
+            buffer[length < bind->buffer_length ? length : bind->buffer_length] = '\0';
+        }
+    }
+
+    return 1;
+}
+
+unsigned long long db_stmt_row_count(MYSQL_STMT *stmt) {
+    return mysql_stmt_num_rows(stmt);
+}
+
+int db_stmt_fetch_at(MYSQL_STMT *stmt, DbBinds *results, unsigned long long row) {
+    mysql_stmt_data_seek(stmt, row);
+    return db_stmt_fetch(stmt, results);
+}
+
+void db_stmt_finish(MYSQL_STMT *stmt) {
+    if (stmt) mysql_stmt_free_result(stmt);
+}
@@ -0,0 +1,100 @@
+#ifndef DB_STMT_H
+#define DB_STMT_H
+
+#include <mysql/mysql.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DB_BATCH_MAX_ROWS 16
+#define DB_STMT_MAX_BINDS (DB_BATCH_MAX_ROWS * 6)
+
+// Every statement the managers run. Each pooled connection prepares the whole
+// set once when it is opened and keeps the handles until it is closed.
+typedef enum {
+    STMT_CREATE_USER,
+    STMT_COPY_USER,
+    STMT_VALIDATE_USER,
+    STMT_GET_USER_INFO,
+    STMT_CREATE_CHAT,
+    STMT_ADD_TO_CHAT,
+    STMT_SET_LATEST_MESSAGE,
+    STMT_GET_INBOX,
+    STMT_GET_INBOX_SINCE,
+    STMT_USER_CHAT_COUNT,
+    STMT_GET_CHAT_MESSAGES,
+    STMT_GET_CHAT_MESSAGES_BEFORE,
+    STMT_GET_CHAT_MESSAGES_AFTER,
+    STMT_GET_CHAT_MESSAGES_SINCE,
+    STMT_GET_CHAT,
+    STMT_GET_CHAT_PARTICIPANTS,
+    STMT_IS_USER_ADMIN,
+    STMT_IS_GROUP_CHAT,
+    STMT_REMOVE_FROM_CHAT,
+    STMT_PARTICIPANT_COUNT,
+    STMT_ADMIN_COUNT,
+    STMT_FIRST_PARTICIPANT,
+    STMT_PROMOTE_ADMIN,
+    STMT_DELETE_CHAT,
+    STMT_GET_CHAT_MEMBERS,
+    STMT_COUNT
+} StmtId;
+
+// Multi-row INSERTs. The VALUES list depends on the row count, so each variant is
+// prepared the first time a connection needs it and cached next to the fixed set.
+typedef enum {
+    BATCH_ADD_TO_CHAT,
+    BATCH_INSERT_MESSAGE,
+    BATCH_COUNT
+} BatchStmtId;
+
+// Parameter or result bindings for one execution, filled in column order.
+// Declare with = {0}; the arrays back the pointers stored in bind[].
+typedef struct {
+    MYSQL_BIND bind[DB_STMT_MAX_BINDS];
+    unsigned long length[DB_STMT_MAX_BINDS];
+    bool is_null[DB_STMT_MAX_BINDS];
+    bool error[DB_STMT_MAX_BINDS];
+    int count;
+} DbBinds;
+
+int db_stmts_prepare(MYSQL *mysql, MYSQL_STMT *stmts[STMT_COUNT]);
+void db_stmts_close(MYSQL_STMT *stmts[STMT_COUNT]);
+
+// Returns the statement inserting rows rows at once (1..DB_BATCH_MAX_ROWS), preparing it on first use
+MYSQL_STMT *db_batch_stmt(MYSQL *mysql, MYSQL_STMT *batch[BATCH_COUNT][DB_BATCH_MAX_ROWS], BatchStmtId id, int rows);
+void db_batch_close(MYSQL_STMT *batch[BATCH_COUNT][DB_BATCH_MAX_ROWS]);
+
+// A NULL string or id is sent as SQL NULL
+void db_bind_int(DbBinds *binds, int *value);
+void db_bind_string(DbBinds *binds, const char *value);
+void db_bind_id(DbBinds *binds, const uint64_t *value);
+// Result column copied into buffer; long values are truncated and always NUL terminated
+void db_bind_buffer(DbBinds *binds, char *buffer, size_t size);
+bool db_bind_is_null(const DbBinds *binds, int column);
+
+// Executes with the given parameters. When results is not NULL the result set is
+// bound to it and buffered for db_stmt_fetch. Returns 0 on success, -1 on error.
+int db_stmt_execute(MYSQL_STMT *stmt, DbBinds *params, DbBinds *results);
+
+// Returns 1 when a row was fetched into results, 0 when there are no more rows, -1 on error
+int db_stmt_fetch(MYSQL_STMT *stmt, DbBinds *results);
+
+// The result set is buffered, so its size is known before the first fetch and rows
+// can be read in any order
+unsigned long long db_stmt_row_count(MYSQL_STMT *stmt);
+int db_stmt_fetch_at(MYSQL_STMT *stmt, DbBinds *results, unsigned long long row);
+
+// Releases the buffered result set so the statement can be executed again
+void db_stmt_finish(MYSQL_STMT *stmt);
+
+// The MySQL error number of the calling thread's last statement, 0 when it succeeded.
+// db_clear_error resets it before a unit of work that may fail without running one.
+unsigned int db_last_error(void);
+void db_clear_error(void);
+
+// Errors that come back the same however often the statement is retried: rows that refer
+// to a missing chat or user, or values the schema can't hold
+bool db_error_permanent(unsigned int error);
+
+#endif
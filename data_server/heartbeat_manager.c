@@ -1,6 +1,7 @@
 #include "heartbeat_manager.h"
 
 void* udp_daemon(void* arg) {
+    HeartbeatSource *source = arg;
     LoadBalancerInfo load_balancers[MAX_LOAD_BALANCERS];
     int lb_count = 0;
 
@@ -15,6 +16,7 @@ void* udp_daemon(void* arg) {
     char tcp_addr[32];
     char udp_addr[32];
     char recv_buffer[128];
+    char ok_message[128];
 
     if ((udp_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("UDP socket");
@@ -52,9 +54,18 @@ char update = 0;
 while (1) {
     heartbeat_counter++;
 
+    // Sampled once per interval: every load balancer gets the same figures
+    strcpy(ok_message, "OK");
+    if (source && source->load) {
+        HeartbeatLoad load = {0};
+        source->load(source->ctx, &load);
+        snprintf(ok_message, sizeof(ok_message), "OK inflight=%d util=%d queue=%d p99_us=%lu",
+                 load.in_flight, load.utilization, load.queue_depth, load.p99_us);
+    }
+
     for (int i = 0; i < lb_count; i++) {
         if (load_balancers[i].auth_done)
-            strcpy(load_balancers[i].send_buffer, "OK");
+            strcpy(load_balancers[i].send_buffer, ok_message);
         else
             snprintf(load_balancers[i].send_buffer, sizeof(load_balancers[i].send_buffer), "%s %s", tcp_addr, udp_addr);
 
@@ -1,3 +1,6 @@
+#ifndef HEARTBEAT_MANAGER_H
+#define HEARTBEAT_MANAGER_H
+
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -23,5 +26,22 @@ typedef struct {
     char send_buffer[128];
 } LoadBalancerInfo;
 
+// Live load sent with every heartbeat ("OK inflight=.. util=.. queue=.. p99_us=..") so the
+// load balancer can weight its picks; a bare "OK" is sent when there is no source
+typedef struct {
+    int in_flight;         // requests received and not answered yet
+    int utilization;       // percent of the workers serving a request
+    int queue_depth;       // requests waiting for a worker
+    unsigned long p99_us;  // 99th percentile latency since the previous heartbeat
+} HeartbeatLoad;
+
+typedef struct {
+    void (*load)(void *ctx, HeartbeatLoad *load);  // called once per interval on the daemon thread
+    void *ctx;
+} HeartbeatSource;
+
+// arg is a HeartbeatSource, or NULL
 void* udp_daemon(void* arg);
 int load_lb_config(const char *filename, LoadBalancerInfo *lbs, int *lb_count);
+
+#endif
@@ -0,0 +1,276 @@
+#include "json_writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static JsonChunk *json_chunk_take(JsonWriter *w) {
+    JsonChunk *chunk = w->spare;
+    if (chunk) {
+        w->spare = chunk->next;
+        w->spare_count--;
+    } else {
+        chunk = malloc(sizeof(JsonChunk));
+        if (!chunk) return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->len = 0;
+    return chunk;
+}
+
+void json_writer_reset(JsonWriter *w) {
+    JsonChunk *chunk = w->head;
+    while (chunk) {
+        JsonChunk *next = chunk->next;
+        if (w->spare_count < JSON_MAX_SPARE_CHUNKS) {
+            chunk->next = w->spare;
+            w->spare = chunk;
+            w->spare_count++;
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+
+    w->head = w->tail = NULL;
+    w->total = 0;
+    w->failed = 0;
+    w->depth = 0;
+    w->count[0] = 0;
+}
+
+void json_writer_free(JsonWriter *w) {
+    json_writer_reset(w);
+    while (w->spare) {
+        JsonChunk *next = w->spare->next;
+        free(w->spare);
+        w->spare = next;
+    }
+    w->spare_count = 0;
+}
+
+static void json_append(JsonWriter *w, const char *data, size_t len) {
+    while (len > 0 && !w->failed) {
+        if (!w->tail || w->tail->len == JSON_CHUNK_SIZE) {
+            JsonChunk *chunk = json_chunk_take(w);
+            if (!chunk) {
+                w->failed = 1;
+                return;
+            }
+            if (w->tail) w->tail->next = chunk;
+            else w->head = chunk;
+            w->tail = chunk;
+        }
+
+        size_t room = JSON_CHUNK_SIZE - w->tail->len;
+        size_t n = len < room ? len : room;
+        memcpy(w->tail->data + w->tail->len, data, n);
+        w->tail->len += n;
+        w->total += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void json_append_str(JsonWriter *w, const char *s) {
+    json_append(w, s, strlen(s));
+}
+
+static void json_append_escaped(JsonWriter *w, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t run = 0;
+
+    json_append(w, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            run++;
+            continue;
+        }
+
+        // Copy the run of plain characters in one go, then the escape
+        json_append(w, s + i - run, run);
+        run = 0;
+
+        char escape[6] = { '\\', 0 };
+        size_t escape_len = 2;
+        switch (c) {
+            case '"': escape[1] = '"'; break;
+            case '\\': escape[1] = '\\'; break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            default:
+                escape[1] = 'u'; escape[2] = '0'; escape[3] = '0';
+                escape[4] = hex[c >> 4]; escape[5] = hex[c & 0xF];
+                escape_len = 6;
+                break;
+        }
+        json_append(w, escape, escape_len);
+    }
+    json_append(w, s + len - run, run);
+    json_append(w, "\"", 1);
+}
+
+static void pack_string(JsonWriter *w, const char *s, size_t len) {
+    unsigned char header[WIRE_PACK_MAX];
+    json_append(w, (const char *)header, wire_pack_str_header(header, len));
+    json_append(w, s, len);
+}
+
+// Writes the separator and key that precede every value
+static void json_prefix(JsonWriter *w, const char *key) {
+    int first = w->count[w->depth]++ == 0;
+
+    if (w->encoding == WIRE_MSGPACK) {
+        if (key) pack_string(w, key, strlen(key));
+        return;
+    }
+
+    if (!first) json_append(w, ",", 1);
+    if (key) {
+        json_append_escaped(w, key, strlen(key));
+        json_append(w, ":", 1);
+    }
+}
+
+// The count header has to be patched later, so it must not straddle two chunks
+static unsigned char *pack_count_header(JsonWriter *w, int is_map) {
+    if (!w->tail || JSON_CHUNK_SIZE - w->tail->len < WIRE_PACK_COUNT32) {
+        JsonChunk *chunk = json_chunk_take(w);
+        if (!chunk) {
+            w->failed = 1;
+            return NULL;
+        }
+        if (w->tail) w->tail->next = chunk;
+        else w->head = chunk;
+        w->tail = chunk;
+    }
+
+    unsigned char *header = (unsigned char *)w->tail->data + w->tail->len;
+    size_t n = is_map ? wire_pack_map32(header, 0) : wire_pack_array32(header, 0);
+    w->tail->len += n;
+    w->total += n;
+    return header;
+}
+
+static void json_open(JsonWriter *w, const char *key, const char *token) {
+    unsigned char *header = NULL;
+
+    json_prefix(w, key);
+    if (w->encoding == WIRE_MSGPACK) header = pack_count_header(w, *token == '{');
+    else json_append(w, token, 1);
+
+    if (w->depth + 1 < JSON_MAX_DEPTH) w->depth++;
+    else w->failed = 1;
+    w->count[w->depth] = 0;
+    w->header[w->depth] = header;
+}
+
+static void json_close(JsonWriter *w, const char *token) {
+    if (w->encoding == WIRE_MSGPACK) {
+        // Every map entry is counted once, with its key
+        if (w->header[w->depth]) wire_patch_count(w->header[w->depth], w->count[w->depth]);
+    } else {
+        json_append(w, token, 1);
+    }
+    if (w->depth > 0) w->depth--;
+}
+
+void json_begin_object(JsonWriter *w, const char *key) { json_open(w, key, "{"); }
+void json_end_object(JsonWriter *w) { json_close(w, "}"); }
+void json_begin_array(JsonWriter *w, const char *key) { json_open(w, key, "["); }
+void json_end_array(JsonWriter *w) { json_close(w, "]"); }
+
+void json_write_string_len(JsonWriter *w, const char *key, const char *value, size_t len) {
+    json_prefix(w, key);
+    if (w->encoding == WIRE_MSGPACK) pack_string(w, value ? value : "", value ? len : 0);
+    else json_append_escaped(w, value ? value : "", value ? len : 0);
+}
+
+void json_write_string(JsonWriter *w, const char *key, const char *value) {
+    json_write_string_len(w, key, value, value ? strlen(value) : 0);
+}
+
+void json_write_int(JsonWriter *w, const char *key, long long value) {
+    json_prefix(w, key);
+    if (w->encoding == WIRE_MSGPACK) {
+        unsigned char packed[WIRE_PACK_MAX];
+        json_append(w, (const char *)packed, wire_pack_int(packed, value));
+        return;
+    }
+
+    char number[24];
+    int len = snprintf(number, sizeof(number), "%lld", value);
+    json_append(w, number, len);
+}
+
+void json_write_bool(JsonWriter *w, const char *key, int value) {
+    json_prefix(w, key);
+    if (w->encoding == WIRE_MSGPACK) {
+        unsigned char packed[1];
+        json_append(w, (const char *)packed, wire_pack_bool(packed, value));
+    } else {
+        json_append_str(w, value ? "true" : "false");
+    }
+}
+
+void json_write_null(JsonWriter *w, const char *key) {
+    json_prefix(w, key);
+    if (w->encoding == WIRE_MSGPACK) {
+        unsigned char packed[1];
+        json_append(w, (const char *)packed, wire_pack_nil(packed));
+    } else {
+        json_append_str(w, "null");
+    }
+}
+
+// Copies an arbitrary cJSON value, used to echo fields from the request
+void json_write_item(JsonWriter *w, const char *key, const cJSON *item) {
+    if (cJSON_IsString(item)) {
+        json_write_string(w, key, item->valuestring);
+    } else if (cJSON_IsNumber(item) && item->valuedouble > -9e15 && item->valuedouble < 9e15 &&
+               item->valuedouble == (double)(long long)item->valuedouble) {
+        json_write_int(w, key, (long long)item->valuedouble);
+    } else if (w->encoding == WIRE_MSGPACK) {
+        if (cJSON_IsObject(item) || cJSON_IsArray(item)) {
+            int is_object = cJSON_IsObject(item);
+            json_open(w, key, is_object ? "{" : "[");
+            for (const cJSON *child = item->child; child; child = child->next) {
+                json_write_item(w, is_object ? child->string : NULL, child);
+            }
+            json_close(w, is_object ? "}" : "]");
+        } else if (cJSON_IsNumber(item)) {
+            unsigned char packed[WIRE_PACK_MAX];
+            json_prefix(w, key);
+            json_append(w, (const char *)packed, wire_pack_double(packed, item->valuedouble));
+        } else if (cJSON_IsBool(item)) {
+            json_write_bool(w, key, cJSON_IsTrue(item));
+        } else {
+            json_write_null(w, key);
+        }
+    } else {
+        char *printed = cJSON_PrintUnformatted(item);
+        json_prefix(w, key);
+        json_append_str(w, printed ? printed : "null");
+        cJSON_free(printed);
+    }
+}
+
+int json_writer_chunk_count(JsonWriter *w) {
+    int count = 0;
+    for (JsonChunk *chunk = w->head; chunk; chunk = chunk->next) count++;
+    return count;
+}
+
+int json_writer_iov(JsonWriter *w, struct iovec *iov, int max_iov) {
+    int count = 0;
+    for (JsonChunk *chunk = w->head; chunk && count < max_iov; chunk = chunk->next) {
+        iov[count].iov_base = chunk->data;
+        iov[count].iov_len = chunk->len;
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,59 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "../lib/cjson/cJSON.h"
+#include "../lib/wire/wire.h"
+
+#define JSON_CHUNK_SIZE 16384
+#define JSON_MAX_DEPTH 16
+#define JSON_MAX_SPARE_CHUNKS 16
+
+// Responses are serialized straight into a list of fixed-size chunks, so a large
+// history never needs a single contiguous buffer or a final copy. Chunks are kept
+// on a spare list between responses and reused by the next one.
+//
+// The same calls produce MessagePack when encoding is WIRE_MSGPACK: objects and arrays
+// get a 32-bit count header that is filled in when they are closed.
+typedef struct JsonChunk {
+    struct JsonChunk *next;
+    size_t len;
+    char data[JSON_CHUNK_SIZE];
+} JsonChunk;
+
+typedef struct {
+    JsonChunk *head;
+    JsonChunk *tail;
+    JsonChunk *spare;
+    int spare_count;
+    size_t total;
+    int failed;                          // set when a chunk could not be allocated
+    WireEncoding encoding;               // kept across resets
+
+    int depth;
+    unsigned int count[JSON_MAX_DEPTH];  // values written so far at each depth
+    unsigned char *header[JSON_MAX_DEPTH]; // MessagePack count of each open container
+} JsonWriter;
+
+void json_writer_reset(JsonWriter *w);
+void json_writer_free(JsonWriter *w);
+
+// A NULL key writes a bare value (array element or top-level document)
+void json_begin_object(JsonWriter *w, const char *key);
+void json_end_object(JsonWriter *w);
+void json_begin_array(JsonWriter *w, const char *key);
+void json_end_array(JsonWriter *w);
+
+void json_write_string(JsonWriter *w, const char *key, const char *value);
+void json_write_string_len(JsonWriter *w, const char *key, const char *value, size_t len);
+void json_write_int(JsonWriter *w, const char *key, long long value);
+void json_write_bool(JsonWriter *w, const char *key, int value);
+void json_write_null(JsonWriter *w, const char *key);
+void json_write_item(JsonWriter *w, const char *key, const cJSON *item);
+
+// Fills iov with one entry per chunk, returns the number of entries used
+int json_writer_iov(JsonWriter *w, struct iovec *iov, int max_iov);
+int json_writer_chunk_count(JsonWriter *w);
+
+#endif
@@ -0,0 +1,82 @@
+#include "lru_map.h"
+#include <stdlib.h>
+
+int lru_map_init(LruMap *map, int capacity) {
+    size_t bucket_count = 1;
+    while (bucket_count < (size_t)capacity) bucket_count <<= 1;
+
+    map->buckets = calloc(bucket_count, sizeof(LruNode *));
+    if (!map->buckets) return -1;
+
+    map->bucket_mask = bucket_count - 1;
+    map->newest = map->oldest = NULL;
+    map->count = 0;
+    map->capacity = capacity;
+    return 0;
+}
+
+void lru_map_destroy(LruMap *map, void (*free_entry)(LruNode *node)) {
+    LruNode *node = map->newest;
+    while (node) {
+        LruNode *older = node->older;
+        free_entry(node);
+        node = older;
+    }
+
+    free(map->buckets);
+    map->buckets = NULL;
+}
+
+LruNode *lru_map_find(LruMap *map, uint64_t hash, LruMatch match, const void *key) {
+    LruNode *node = map->buckets[hash & map->bucket_mask];
+    while (node && (node->hash != hash || !match(node, key))) {
+        node = node->next;
+    }
+    return node;
+}
+
+static void lru_unlink(LruMap *map, LruNode *node) {
+    if (node->newer) node->newer->older = node->older;
+    else map->newest = node->older;
+
+    if (node->older) node->older->newer = node->newer;
+    else map->oldest = node->newer;
+}
+
+static void lru_push(LruMap *map, LruNode *node) {
+    node->newer = NULL;
+    node->older = map->newest;
+    if (map->newest) map->newest->newer = node;
+    map->newest = node;
+    if (!map->oldest) map->oldest = node;
+}
+
+void lru_map_touch(LruMap *map, LruNode *node) {
+    lru_unlink(map, node);
+    lru_push(map, node);
+}
+
+void lru_map_remove(LruMap *map, LruNode *node) {
+    LruNode **link = &map->buckets[node->hash & map->bucket_mask];
+    while (*link != node) link = &(*link)->next;
+
+    *link = node->next;
+    lru_unlink(map, node);
+    map->count--;
+}
+
+LruNode *lru_map_insert(LruMap *map, LruNode *node, uint64_t hash) {
+    LruNode *evicted = NULL;
+    if (map->count >= map->capacity && map->oldest) {
+        evicted = map->oldest;
+        lru_map_remove(map, evicted);
+    }
+
+    LruNode **bucket = &map->buckets[hash & map->bucket_mask];
+    node->hash = hash;
+    node->next = *bucket;
+    *bucket = node;
+    lru_push(map, node);
+    map->count++;
+    return evicted;
+}
@@ -0,0 +1,50 @@
+#ifndef LRU_MAP_H
+#define LRU_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The hash table with least-recently-used order behind the user cache, the chat cache and
+// the message tail. It is intrusive: an entry starts with an LruNode and belongs to its
+// cache, which allocates it, frees what the map hands back and holds the lock around
+// every call (one map per shard).
+typedef struct LruNode {
+    uint64_t hash;
+    struct LruNode *next;   // bucket chain
+    struct LruNode *newer;  // LRU order
+    struct LruNode *older;
+} LruNode;
+
+typedef struct {
+    LruNode **buckets;
+    size_t bucket_mask;
+
+    LruNode *newest;
+    LruNode *oldest;
+    int count;
+    int capacity;
+} LruMap;
+
+// For integer keys. Ids are sequential; multiplying by 2^64 / phi spreads neighbours over
+// shards and buckets, best read from the high bits.
+static inline uint64_t id_hash(int id) {
+    return (uint64_t)(uint32_t)id * 11400714819323198485ull;
+}
+
+// Whether the entry starting with node is the one key names; only called for equal hashes
+typedef int (*LruMatch)(const LruNode *node, const void *key);
+
+int lru_map_init(LruMap *map, int capacity);
+// Frees the buckets and hands every entry, newest first, to free_entry
+void lru_map_destroy(LruMap *map, void (*free_entry)(LruNode *node));
+
+// NULL when absent. Doesn't change the LRU order; lru_map_touch does.
+LruNode *lru_map_find(LruMap *map, uint64_t hash, LruMatch match, const void *key);
+void lru_map_touch(LruMap *map, LruNode *node);
+
+// Links in an entry whose key is not in the map yet, as the most recently used one. A full
+// map first unlinks its least recently used entry and returns it for the caller to free.
+LruNode *lru_map_insert(LruMap *map, LruNode *node, uint64_t hash);
+void lru_map_remove(LruMap *map, LruNode *node);
+
+#endif
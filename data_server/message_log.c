@@ -0,0 +1,474 @@
+#include "message_log.h"
+#include "../lib/env/env.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define RETRY_MAX_DELAY_MS 1000
+
+// The file starts with a header, followed by fixed-size records in arrival order
+typedef struct {
+    uint64_t checkpoint;     // leading records already committed to MySQL
+    uint64_t log_id;         // random, picked when the file is created
+    uint64_t next_sequence;  // kept across truncations so no sequence is handed out twice
+} LogHeader;
+
+#define LOG_HEADER_SIZE ((off_t)sizeof(LogHeader))
+
+typedef struct {
+    uint32_t checksum;
+    int32_t chat_id;
+    int32_t sender_id;
+    uint64_t sequence;
+    char content[MAX_CONTENT_LENGTH];
+    char message_type[MAX_TYPE_LENGTH];
+} LogRecord;
+
+struct MessageLog {
+    MessageLogConfig config;
+    Storage *storage;
+    MessageTail *tail;
+    Subscriptions *subs;
+    int fd;
+    uint64_t log_id;
+    uint64_t next_sequence;
+
+    uint64_t records;       // records in the file
+    unsigned long written;  // append sequence, compared against synced for group commit
+    unsigned long synced;
+    int syncing;
+
+    // Logged but not yet taken by the flusher, in log order: the last one is record records - 1
+    Message *pending;
+    int pending_count;
+    int pending_capacity;
+
+    MessageLogStats stats;
+    pthread_mutex_t lock;
+    pthread_cond_t synced_changed;
+    pthread_cond_t has_pending;
+    pthread_t flusher;
+};
+
+void message_log_config_from_env(MessageLogConfig *config) {
+    memset(config, 0, sizeof(*config));
+
+    config->path = getenv("MESSAGE_LOG_PATH");
+    if (!config->path || !*config->path) config->path = MESSAGE_LOG_DEFAULT_PATH;
+
+    config->batch = env_int("MESSAGE_LOG_BATCH", MESSAGE_LOG_DEFAULT_BATCH, false);
+    config->interval_ms = env_int("MESSAGE_LOG_INTERVAL_MS", MESSAGE_LOG_DEFAULT_INTERVAL_MS, false);
+}
+
+// FNV-1a over everything after the checksum field
+static uint32_t record_checksum(const LogRecord *record) {
+    const unsigned char *bytes = (const unsigned char *)record + sizeof(record->checksum);
+    size_t length = sizeof(*record) - sizeof(record->checksum);
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void record_from_message(LogRecord *record, const Message *message) {
+    memset(record, 0, sizeof(*record));
+    record->chat_id = message->chat_id;
+    record->sender_id = message->sender_id;
+    record->sequence = message->log_sequence;
+    strncpy(record->content, message->content, sizeof(record->content) - 1);
+    strncpy(record->message_type, message->message_type, sizeof(record->message_type) - 1);
+    record->checksum = record_checksum(record);
+}
+
+static void message_from_record(Message *message, const LogRecord *record, uint64_t log_id) {
+    memset(message, 0, sizeof(*message));
+    message->chat_id = record->chat_id;
+    message->sender_id = record->sender_id;
+    message->log_id = log_id;
+    message->log_sequence = record->sequence;
+    memcpy(message->content, record->content, sizeof(message->content));
+    memcpy(message->message_type, record->message_type, sizeof(message->message_type));
+}
+
+static off_t record_offset(uint64_t index) {
+    return LOG_HEADER_SIZE + (off_t)(index * sizeof(LogRecord));
+}
+
+static int write_header(MessageLog *log, uint64_t checkpoint) {
+    LogHeader header = { checkpoint, log->log_id, log->next_sequence };
+    if (pwrite(log->fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("message log header");
+        return -1;
+    }
+    return 0;
+}
+
+// Called with the lock held
+static int pending_push(MessageLog *log, const Message *message) {
+    if (log->pending_count == log->pending_capacity) {
+        int capacity = log->pending_capacity ? log->pending_capacity * 2 : log->config.batch;
+        Message *grown = realloc(log->pending, capacity * sizeof(Message));
+        if (!grown) return -1;
+
+        log->pending = grown;
+        log->pending_capacity = capacity;
+    }
+
+    log->pending[log->pending_count++] = *message;
+
+    // The flusher only needs waking to start a batch or because one is full
+    if (log->pending_count == 1 || log->pending_count >= log->config.batch) {
+        pthread_cond_signal(&log->has_pending);
+    }
+    return 0;
+}
+
+// A new log gets an id of its own, so its sequences can't collide with rows another log
+// (another worker, or a log file that was deleted) already stored
+static int log_create(MessageLog *log) {
+    do {
+        if (getrandom(&log->log_id, sizeof(log->log_id), 0) != sizeof(log->log_id)) {
+            perror("message log id");
+            return -1;
+        }
+    } while (log->log_id == 0);
+
+    log->next_sequence = 1;
+    log->records = 0;
+    return ftruncate(log->fd, 0) == 0 ? write_header(log, 0) : -1;
+}
+
+// Queues the records a previous run logged after its last checkpoint and drops a torn tail
+static int log_recover(MessageLog *log) {
+    struct stat st;
+    LogHeader header;
+
+    if (fstat(log->fd, &st) != 0) return -1;
+
+    if (st.st_size < LOG_HEADER_SIZE) return log_create(log);
+
+    if (pread(log->fd, &header, sizeof(header), 0) != sizeof(header)) return -1;
+    if (header.log_id == 0) return log_create(log);
+
+    log->log_id = header.log_id;
+    log->next_sequence = header.next_sequence;
+
+    uint64_t records = (st.st_size - LOG_HEADER_SIZE) / sizeof(LogRecord);
+    uint64_t checkpoint = header.checkpoint < records ? header.checkpoint : records;
+
+    LogRecord record;
+    uint64_t index;
+    for (index = checkpoint; index < records; index++) {
+        if (pread(log->fd, &record, sizeof(record), record_offset(index)) != sizeof(record) ||
+            record.checksum != record_checksum(&record)) {
+            break;
+        }
+
+        Message message;
+        message_from_record(&message, &record, log->log_id);
+        if (pending_push(log, &message) != 0) return -1;
+        if (record.sequence >= log->next_sequence) log->next_sequence = record.sequence + 1;
+    }
+
+    log->records = index;
+    if (ftruncate(log->fd, record_offset(index)) != 0) return -1;
+
+    if (log->pending_count > 0) {
+        printf("Message log: replaying %d messages not yet in the database\n", log->pending_count);
+    }
+    return 0;
+}
+
+// Waits until the record with the given sequence is on disk. Called with the lock held; the
+// first waiter syncs on behalf of everyone who appended before it started.
+static int log_sync(MessageLog *log, unsigned long sequence) {
+    while (log->synced < sequence) {
+        if (log->syncing) {
+            pthread_cond_wait(&log->synced_changed, &log->lock);
+            continue;
+        }
+
+        unsigned long target = log->written;
+        log->syncing = 1;
+        pthread_mutex_unlock(&log->lock);
+
+        int failed = fdatasync(log->fd) != 0;
+        if (failed) perror("message log fdatasync");
+
+        pthread_mutex_lock(&log->lock);
+        log->syncing = 0;
+        log->stats.syncs++;
+        if (!failed) log->synced = target;
+        pthread_cond_broadcast(&log->synced_changed);
+
+        if (failed) return -1;
+    }
+    return 0;
+}
+
+int message_log_append(MessageLog *log, const Message *message) {
+    LogRecord record;
+    Message logged = *message;
+
+    pthread_mutex_lock(&log->lock);
+
+    logged.log_id = log->log_id;
+    logged.log_sequence = log->next_sequence;
+    record_from_message(&record, &logged);
+
+    if (pwrite(log->fd, &record, sizeof(record), record_offset(log->records)) != sizeof(record)) {
+        perror("message log append");
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    if (pending_push(log, &logged) != 0) {
+        fprintf(stderr, "Message log: out of memory for pending messages\n");
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    log->records++;
+    log->next_sequence++;
+    log->stats.appended++;
+    int status = log_sync(log, ++log->written);
+
+    pthread_mutex_unlock(&log->lock);
+    return status;
+}
+
+static int write_chats(StorageSession *store, Message *messages, int count) {
+    for (int start = 0, end; start < count; start = end) {
+        for (end = start + 1; end < count && messages[end].chat_id == messages[start].chat_id; end++);
+
+        if (store->ops->send_messages(store, messages + start, end - start) != 0) return -1;
+    }
+    return 0;
+}
+
+static int commit_chats(StorageSession *store, Message *messages, int count) {
+    if (store->ops->begin(store) != 0) return -1;
+
+    if (write_chats(store, messages, count) != 0) {
+        store->ops->rollback(store);
+        return -1;
+    }
+    return store->ops->commit(store);
+}
+
+// Writes one shard's messages, grouped by chat. Returns how many leading messages are settled,
+// either committed or rejected by storage; the rest have to be retried.
+static int write_shard(MessageLog *log, StorageSession *store, Message *messages, int count) {
+    int settled = count;
+    if (commit_chats(store, messages, count) == 0) {
+        for (int start = 0, end; start < count; start = end) {
+            for (end = start + 1; end < count && messages[end].chat_id == messages[start].chat_id; end++);
+            message_tail_refresh(log->tail, store, messages[start].chat_id);
+            subscriptions_publish(log->subs, store, messages[start].chat_id, end - start);
+        }
+    } else {
+        settled = 0;
+
+        // Commit chat by chat: a chat storage refuses for good (deleted, or an unknown sender)
+        // is dropped, and any other failure (a deadlock, a lock wait timeout, a lost
+        // connection) leaves that chat and the ones after it to be retried
+        for (int start = 0, end; start < count; start = end) {
+            for (end = start + 1; end < count && messages[end].chat_id == messages[start].chat_id; end++);
+
+            if (commit_chats(store, messages + start, end - start) == 0) {
+                message_tail_refresh(log->tail, store, messages[start].chat_id);
+                subscriptions_publish(log->subs, store, messages[start].chat_id, end - start);
+            } else if (!store->ops->refused(store)) {
+                break;
+            } else {
+                fprintf(stderr, "Message log: dropping %d messages for chat %d\n", end - start, messages[start].chat_id);
+                pthread_mutex_lock(&log->lock);
+                log->stats.dropped += end - start;
+                pthread_mutex_unlock(&log->lock);
+            }
+            settled = end;
+        }
+    }
+    return settled;
+}
+
+// Writes messages grouped by shard, one transaction per shard: shards commit on their own, so
+// a batch spanning them could be left half committed. Returns how many leading messages are
+// settled; a shard that fails leaves its messages and the shards after it to be retried.
+static int write_batch(MessageLog *log, Message *messages, int count) {
+    StorageSession store;
+    if (storage_acquire(log->storage, &store) != 0) return 0;
+
+    int settled = 0;
+    for (int end; settled < count; settled = end) {
+        int shard = log->storage->ops->shard(log->storage, messages[settled].chat_id);
+        for (end = settled + 1; end < count && log->storage->ops->shard(log->storage, messages[end].chat_id) == shard; end++);
+
+        int written = write_shard(log, &store, messages + settled, end - settled);
+        if (written < end - settled) {
+            settled += written;
+            break;
+        }
+    }
+
+    storage_release(&store);
+    return settled;
+}
+
+// Orders the batch by shard and then by chat, keeping arrival order within each chat
+static void group_by_shard(Storage *storage, Message *batch, Message *grouped, char *taken, int count) {
+    int next = 0;
+
+    memset(taken, 0, count);
+    for (int i = 0; i < count; i++) {
+        if (taken[i]) continue;
+        int shard = storage->ops->shard(storage, batch[i].chat_id);
+
+        for (int k = i; k < count; k++) {
+            if (taken[k] || storage->ops->shard(storage, batch[k].chat_id) != shard) continue;
+
+            for (int j = k; j < count; j++) {
+                if (!taken[j] && batch[j].chat_id == batch[k].chat_id) {
+                    grouped[next++] = batch[j];
+                    taken[j] = 1;
+                }
+            }
+        }
+    }
+}
+
+static void log_checkpoint(MessageLog *log, uint64_t end, int count) {
+    pthread_mutex_lock(&log->lock);
+    log->stats.flushed += count;
+    log->stats.batches++;
+
+    if (log->pending_count == 0) {
+        if (ftruncate(log->fd, LOG_HEADER_SIZE) == 0) {
+            log->records = 0;
+            write_header(log, 0);
+        } else {
+            perror("message log truncate");
+            write_header(log, end);
+        }
+    } else {
+        write_header(log, end);
+    }
+
+    pthread_mutex_unlock(&log->lock);
+
+    // Synced right away: until the header is on disk a crash replays the batch
+    if (fdatasync(log->fd) != 0) perror("message log checkpoint fdatasync");
+}
+
+static void *flusher_main(void *data) {
+    MessageLog *log = data;
+    Message *batch = malloc(log->config.batch * sizeof(Message));
+    Message *grouped = malloc(log->config.batch * sizeof(Message));
+    char *taken = malloc(log->config.batch);
+
+    mysql_thread_init();
+
+    while (batch && grouped && taken) {
+        struct timeval now;
+        struct timespec deadline;
+
+        pthread_mutex_lock(&log->lock);
+        while (log->pending_count == 0) {
+            pthread_cond_wait(&log->has_pending, &log->lock);
+        }
+
+        // Give concurrent senders a moment to join this batch
+        gettimeofday(&now, NULL);
+        long nsec = now.tv_usec * 1000L + log->config.interval_ms * 1000000L;
+        deadline.tv_sec = now.tv_sec + nsec / 1000000000L;
+        deadline.tv_nsec = nsec % 1000000000L;
+
+        while (log->pending_count < log->config.batch &&
+               pthread_cond_timedwait(&log->has_pending, &log->lock, &deadline) != ETIMEDOUT);
+
+        int count = log->pending_count < log->config.batch ? log->pending_count : log->config.batch;
+        memcpy(batch, log->pending, count * sizeof(Message));
+        log->pending_count -= count;
+        memmove(log->pending, log->pending + count, log->pending_count * sizeof(Message));
+
+        uint64_t end = log->records - log->pending_count;
+        pthread_mutex_unlock(&log->lock);
+
+        group_by_shard(log->storage, batch, grouped, taken, count);
+
+        int settled = 0, delay_ms = log->config.interval_ms;
+        while ((settled += write_batch(log, grouped + settled, count - settled)) < count) {
+            pthread_mutex_lock(&log->lock);
+            log->stats.retries++;
+            pthread_mutex_unlock(&log->lock);
+
+            usleep(delay_ms * 1000);
+            delay_ms = delay_ms * 2 < RETRY_MAX_DELAY_MS ? delay_ms * 2 : RETRY_MAX_DELAY_MS;
+        }
+
+        log_checkpoint(log, end, count);
+    }
+
+    fprintf(stderr, "Message log: flusher could not allocate its batch\n");
+    mysql_thread_end();
+    free(batch);
+    free(grouped);
+    free(taken);
+    return NULL;
+}
+
+MessageLog *message_log_open(const MessageLogConfig *config, Storage *storage, MessageTail *tail, Subscriptions *subs) {
+    MessageLog *log = calloc(1, sizeof(MessageLog));
+    if (!log) return NULL;
+
+    log->config = *config;
+    log->storage = storage;
+    log->tail = tail;
+    log->subs = subs;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->synced_changed, NULL);
+    pthread_cond_init(&log->has_pending, NULL);
+
+    log->fd = open(config->path, O_RDWR | O_CREAT, 0644);
+    if (log->fd < 0) {
+        perror(config->path);
+        free(log);
+        return NULL;
+    }
+
+    if (log_recover(log) != 0) {
+        fprintf(stderr, "Message log %s could not be recovered\n", config->path);
+        close(log->fd);
+        free(log->pending);
+        free(log);
+        return NULL;
+    }
+
+    if (pthread_create(&log->flusher, NULL, flusher_main, log) != 0) {
+        perror("pthread_create message log flusher");
+        close(log->fd);
+        free(log->pending);
+        free(log);
+        return NULL;
+    }
+    pthread_detach(log->flusher);
+
+    printf("Message log ready: %s (batch %d, %d ms)\n", config->path, config->batch, config->interval_ms);
+    return log;
+}
+
+void message_log_stats(MessageLog *log, MessageLogStats *stats) {
+    pthread_mutex_lock(&log->lock);
+    *stats = log->stats;
+    stats->pending = log->pending_count;
+    pthread_mutex_unlock(&log->lock);
+}
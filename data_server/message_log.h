@@ -0,0 +1,54 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include "chat_manager.h"
+#include "message_tail.h"
+#include "storage.h"
+#include "subscriptions.h"
+
+#define MESSAGE_LOG_DEFAULT_PATH "data_server_messages.log"
+#define MESSAGE_LOG_DEFAULT_BATCH 256
+#define MESSAGE_LOG_DEFAULT_INTERVAL_MS 5
+
+// Write-behind pipeline for SEND_MESSAGE. Accepted messages are appended to a local
+// log and acknowledged once it is synced to disk (appends that arrive together share
+// one fdatasync). A flusher thread drains the log into storage in batched transactions:
+// one multi-row insert and one last_message_id update per chat per batch.
+//
+// Each record carries the log's random id and its own sequence number, and MySQL keeps the
+// pair under a unique key. The flusher syncs its checkpoint after every batch, so a crash
+// between a commit and that sync replays the batch on the next start; the replayed rows
+// match ones already stored and are skipped, so each message is stored once.
+//
+// Only chats storage refuses for good (deleted, or an unknown sender) are dropped; batches
+// that fail for any other reason are retried until they commit.
+typedef struct {
+    const char *path;   // MESSAGE_LOG_PATH
+    int batch;          // MESSAGE_LOG_BATCH: most messages written per transaction
+    int interval_ms;    // MESSAGE_LOG_INTERVAL_MS: how long the flusher lets a batch fill up
+} MessageLogConfig;
+
+typedef struct {
+    unsigned long appended;
+    unsigned long syncs;      // fdatasync calls; appended / syncs is the group commit factor
+    unsigned long flushed;    // messages committed to MySQL
+    unsigned long batches;
+    unsigned long retries;    // batches that failed and were retried
+    unsigned long dropped;    // messages MySQL rejected on their own (e.g. unknown chat)
+    unsigned long pending;    // logged but not yet in MySQL
+} MessageLogStats;
+
+typedef struct MessageLog MessageLog;
+
+void message_log_config_from_env(MessageLogConfig *config);
+
+// Opens (or creates) the log, queues whatever a previous run left unflushed and starts the flusher.
+// Chats the flusher commits to are refreshed in tail and then published to subs (either may be NULL).
+MessageLog *message_log_open(const MessageLogConfig *config, Storage *storage, MessageTail *tail, Subscriptions *subs);
+
+// Returns 0 once the message is durable in the log, -1 if it could not be written
+int message_log_append(MessageLog *log, const Message *message);
+
+void message_log_stats(MessageLog *log, MessageLogStats *stats);
+
+#endif
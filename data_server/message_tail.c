@@ -0,0 +1,381 @@
+#include "message_tail.h"
+#include "lru_map.h"
+#include "../lib/env/env.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    LruNode node;
+    int chat_id;
+    int start;  // ring slot of the oldest message
+    int count;
+
+    // Every message of the chat newer than floor_id is in the ring, and none of the missing
+    // ones is newer than floor_created_at. 0 means the ring holds the whole chat.
+    int floor_id;
+    char floor_created_at[MAX_TIMESTAMP_LENGTH];
+
+    Message ring[];
+} TailEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    LruMap map;
+
+    // Bumped whenever one of the shard's chats gets new messages, cached or not
+    unsigned long epoch;
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long loads;
+    unsigned long refreshes;
+    unsigned long evictions;
+    unsigned long stale_loads;
+} TailShard;
+
+struct MessageTail {
+    int size;
+    size_t entry_bytes;
+    TailShard shards[MESSAGE_TAIL_SHARDS];
+};
+
+void message_tail_config_from_env(MessageTailConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->size = env_int("MESSAGE_TAIL_SIZE", MESSAGE_TAIL_DEFAULT_SIZE, true);
+    config->memory_mb = env_int("MESSAGE_TAIL_MEMORY_MB", MESSAGE_TAIL_DEFAULT_MEMORY_MB, true);
+}
+
+static TailShard *shard_for(MessageTail *tail, int chat_id) {
+    return &tail->shards[(id_hash(chat_id) >> 32) % MESSAGE_TAIL_SHARDS];
+}
+
+static int chat_matches(const LruNode *node, const void *chat_id) {
+    return ((const TailEntry *)node)->chat_id == *(const int *)chat_id;
+}
+
+static TailEntry *shard_find(TailShard *shard, int chat_id) {
+    return (TailEntry *)lru_map_find(&shard->map, id_hash(chat_id), chat_matches, &chat_id);
+}
+
+static void entry_free(LruNode *node) {
+    free(node);
+}
+
+static void shard_remove(TailShard *shard, TailEntry *entry) {
+    lru_map_remove(&shard->map, &entry->node);
+    free(entry);
+}
+
+// --- rings -------------------------------------------------------------------------------
+
+static Message *ring_at(const MessageTail *tail, TailEntry *entry, int i) {
+    return &entry->ring[(entry->start + i) % tail->size];
+}
+
+// First position whose message_id is at least message_id
+static int ring_search(const MessageTail *tail, TailEntry *entry, int message_id) {
+    int low = 0, high = entry->count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (ring_at(tail, entry, mid)->message_id < message_id) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// First position created after timestamp
+static int ring_search_time(const MessageTail *tail, TailEntry *entry, const char *timestamp) {
+    int low = 0, high = entry->count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (strcmp(ring_at(tail, entry, mid)->created_at, timestamp) <= 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Merges messages (ascending ids, as read from storage) into the ring by id, keeping the newest
+// tail->size of both. kept needs room for tail->size messages.
+static void ring_merge(const MessageTail *tail, TailEntry *entry, const Message *messages, int count, Message *kept) {
+    int i = entry->count - 1, j = count - 1, k = tail->size;
+
+    // From the newest down, so what doesn't fit is simply what is left over
+    while (k > 0 && (i >= 0 || j >= 0)) {
+        int ring_id = i >= 0 ? ring_at(tail, entry, i)->message_id : -1;
+        int fresh_id = j >= 0 ? messages[j].message_id : -1;
+
+        if (ring_id >= fresh_id) {
+            kept[--k] = *ring_at(tail, entry, i--);
+            if (ring_id == fresh_id) j--;
+        } else {
+            kept[--k] = messages[j--];
+        }
+    }
+
+    if (i >= 0 || j >= 0) {
+        const Message *dropped = j < 0 || (i >= 0 && ring_at(tail, entry, i)->message_id > messages[j].message_id)
+                                     ? ring_at(tail, entry, i) : &messages[j];
+        if (dropped->message_id > entry->floor_id) {
+            entry->floor_id = dropped->message_id;
+            memcpy(entry->floor_created_at, dropped->created_at, sizeof(entry->floor_created_at));
+        }
+    }
+
+    entry->start = 0;
+    entry->count = tail->size - k;
+    memcpy(entry->ring, kept + k, entry->count * sizeof(Message));
+}
+
+// Serves the page if the ring covers it, with the same results storage would give; -1 if not.
+// The messages go to the sink straight from the ring, under the shard lock.
+static int ring_read(const MessageTail *tail, TailEntry *entry, const MessagePage *page, const RowSink *sink, int *has_more) {
+    int start, end;
+
+    if (page->before_id > 0) {
+        return -1;
+    } else if (page->after_id > 0) {
+        if (page->after_id < entry->floor_id) return -1;
+        start = ring_search(tail, entry, page->after_id + 1);
+    } else if (page->since_timestamp) {
+        if (entry->floor_id && strcmp(page->since_timestamp, entry->floor_created_at) < 0) return -1;
+        start = ring_search_time(tail, entry, page->since_timestamp);
+    } else {
+        // Newest page
+        if (entry->count < page->limit && entry->floor_id) return -1;
+        start = entry->count > page->limit ? entry->count - page->limit : 0;
+    }
+
+    end = entry->count - start > page->limit ? start + page->limit : entry->count;
+    if (page->after_id > 0 || page->since_timestamp) *has_more = end < entry->count;
+    else *has_more = start > 0 || entry->floor_id != 0;
+
+    for (int i = start; i < end; i++) sink->message(sink->ctx, ring_at(tail, entry, i));
+    return end - start;
+}
+
+// Loads and refreshes keep what they read, so they collect it into an array first
+typedef struct {
+    Message *messages;
+    int count;
+} MessageCollector;
+
+static void collect_message(void *ctx, const Message *message) {
+    MessageCollector *collector = ctx;
+    collector->messages[collector->count++] = *message;
+}
+
+static int read_messages(StorageSession *store, int chat_id, const MessagePage *page, Message messages[], int *has_more) {
+    MessageCollector collector = { messages, 0 };
+    RowSink sink = { .ctx = &collector, .message = collect_message };
+
+    return store->ops->get_chat_messages(store, chat_id, page, &sink, has_more);
+}
+
+// --- cache -------------------------------------------------------------------------------
+
+MessageTail *message_tail_create(const MessageTailConfig *config) {
+    if (config->size <= 0 || config->memory_mb <= 0) {
+        printf("Message tail cache disabled\n");
+        return NULL;
+    }
+
+    MessageTail *tail = calloc(1, sizeof(MessageTail));
+    if (!tail) return NULL;
+
+    tail->size = config->size < MAX_MESSAGES ? config->size : MAX_MESSAGES;
+    tail->entry_bytes = sizeof(TailEntry) + tail->size * sizeof(Message);
+
+    size_t shard_budget = (size_t)config->memory_mb * 1024 * 1024 / MESSAGE_TAIL_SHARDS;
+    int shard_capacity = shard_budget / tail->entry_bytes > 0 ? (int)(shard_budget / tail->entry_bytes) : 1;
+
+    for (int i = 0; i < MESSAGE_TAIL_SHARDS; i++) {
+        TailShard *shard = &tail->shards[i];
+
+        if (lru_map_init(&shard->map, shard_capacity) != 0) {
+            message_tail_destroy(tail);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    printf("Message tail cache ready: last %d messages of up to %d chats\n", tail->size, shard_capacity * MESSAGE_TAIL_SHARDS);
+    return tail;
+}
+
+void message_tail_destroy(MessageTail *tail) {
+    if (!tail) return;
+
+    for (int i = 0; i < MESSAGE_TAIL_SHARDS; i++) {
+        TailShard *shard = &tail->shards[i];
+        if (!shard->map.buckets) continue;
+
+        lru_map_destroy(&shard->map, entry_free);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(tail);
+}
+
+// Reads the chat's newest messages into a new ring, unless the chat changed since epoch
+static int tail_load(MessageTail *tail, StorageSession *store, int chat_id, unsigned long epoch) {
+    TailEntry *loaded = malloc(tail->entry_bytes);
+    if (!loaded) return -1;
+
+    MessagePage page = { .limit = tail->size };
+    int has_more = 0;
+    int count = read_messages(store, chat_id, &page, loaded->ring, &has_more);
+    if (count < 0) {
+        free(loaded);
+        return -1;
+    }
+
+    loaded->chat_id = chat_id;
+    loaded->start = 0;
+    loaded->count = count;
+    loaded->floor_id = 0;
+    loaded->floor_created_at[0] = '\0';
+    if (has_more) {
+        // Older messages have smaller ids and are no newer than the oldest one read
+        loaded->floor_id = loaded->ring[0].message_id - 1;
+        memcpy(loaded->floor_created_at, loaded->ring[0].created_at, sizeof(loaded->floor_created_at));
+    }
+
+    TailShard *shard = shard_for(tail, chat_id);
+    pthread_mutex_lock(&shard->lock);
+
+    if (shard->epoch != epoch || shard_find(shard, chat_id)) {
+        if (shard->epoch != epoch) shard->stale_loads++;
+        pthread_mutex_unlock(&shard->lock);
+        free(loaded);
+        return shard->epoch != epoch ? -1 : 0;
+    }
+
+    LruNode *evicted = lru_map_insert(&shard->map, &loaded->node, id_hash(chat_id));
+    if (evicted) {
+        free(evicted);
+        shard->evictions++;
+    }
+    shard->loads++;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+// Serves from the cached ring; 1 on a hit, 0 when the chat is cached but the page isn't covered,
+// -1 when the chat isn't cached (with *epoch set for a load)
+static int tail_lookup(MessageTail *tail, int chat_id, const MessagePage *page, const RowSink *sink, int *has_more,
+                       int *count, unsigned long *epoch) {
+    TailShard *shard = shard_for(tail, chat_id);
+    int status = -1;
+
+    pthread_mutex_lock(&shard->lock);
+    TailEntry *entry = shard_find(shard, chat_id);
+    if (entry) {
+        lru_map_touch(&shard->map, &entry->node);
+
+        *count = ring_read(tail, entry, page, sink, has_more);
+        status = *count >= 0;
+    }
+
+    if (status == 1) shard->hits++;
+    else shard->misses++;
+    *epoch = shard->epoch;
+    pthread_mutex_unlock(&shard->lock);
+
+    return status;
+}
+
+int message_tail_get(MessageTail *tail, StorageSession *store, int chat_id, const MessagePage *page,
+                     const RowSink *sink, int *has_more) {
+    int count;
+    unsigned long epoch;
+
+    if (!tail || page->before_id > 0) {
+        return store->ops->get_chat_messages(store, chat_id, page, sink, has_more);
+    }
+
+    int status = tail_lookup(tail, chat_id, page, sink, has_more, &count, &epoch);
+    if (status == 1) return count;
+
+    // Only a chat that isn't cached yet is worth a load; a cached one just doesn't reach back far enough.
+    // A replica may lag the commits the ring is kept current with, so it never fills one.
+    if (status < 0 && !store->replica && tail_load(tail, store, chat_id, epoch) == 0 &&
+        tail_lookup(tail, chat_id, page, sink, has_more, &count, &epoch) == 1) {
+        return count;
+    }
+
+    return store->ops->get_chat_messages(store, chat_id, page, sink, has_more);
+}
+
+void message_tail_refresh(MessageTail *tail, StorageSession *store, int chat_id) {
+    if (!tail) return;
+
+    TailShard *shard = shard_for(tail, chat_id);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->epoch++;
+    int cached = shard_find(shard, chat_id) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!cached) return;
+
+    // Ids are handed out at insert but become visible at commit, so a message can show up after
+    // one with a higher id was already read. Asking only for what is newer than the ring's newest
+    // would skip it for good; the whole newest page is read again and merged by id instead.
+    Message *fresh = malloc(2 * tail->size * sizeof(Message));
+    MessagePage page = { .limit = tail->size };
+    int has_more = 0;
+    int count = fresh ? read_messages(store, chat_id, &page, fresh, &has_more) : -1;
+
+    pthread_mutex_lock(&shard->lock);
+    TailEntry *entry = shard_find(shard, chat_id);
+    if (entry) {
+        if (count < 0) {
+            // Start over on the next read
+            shard_remove(shard, entry);
+        } else {
+            // A concurrent refresh may already have merged some of them
+            ring_merge(tail, entry, fresh, count, fresh + tail->size);
+            shard->refreshes++;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    free(fresh);
+}
+
+void message_tail_invalidate(MessageTail *tail, int chat_id) {
+    if (!tail) return;
+
+    TailShard *shard = shard_for(tail, chat_id);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->epoch++;
+
+    TailEntry *entry = shard_find(shard, chat_id);
+    if (entry) shard_remove(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void message_tail_stats(MessageTail *tail, MessageTailStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!tail) return;
+
+    for (int i = 0; i < MESSAGE_TAIL_SHARDS; i++) {
+        TailShard *shard = &tail->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->loads += shard->loads;
+        stats->refreshes += shard->refreshes;
+        stats->evictions += shard->evictions;
+        stats->stale_loads += shard->stale_loads;
+        stats->entries += shard->map.count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    stats->bytes = stats->entries * tail->entry_bytes;
+}
@@ -0,0 +1,57 @@
+#ifndef MESSAGE_TAIL_H
+#define MESSAGE_TAIL_H
+
+#include "chat_manager.h"
+#include "storage.h"
+
+#define MESSAGE_TAIL_DEFAULT_SIZE 64
+#define MESSAGE_TAIL_DEFAULT_MEMORY_MB 64
+#define MESSAGE_TAIL_SHARDS 16
+
+// The newest messages of recently read chats, kept in a fixed-size ring per chat so
+// polling GET_CHAT_MESSAGES calls (newest page, after_message_id, last_update_timestamp)
+// are answered without a query while they fall inside the ring.
+//
+// Message ids and timestamps are assigned by storage, so rings are not filled at send
+// time: whoever commits messages calls message_tail_refresh(), which reads the newest page
+// again and merges it into the ring by id, only for chats that are cached. Each ring
+// knows the id below which it is incomplete, so older ranges fall through to storage.
+typedef struct {
+    int size;       // MESSAGE_TAIL_SIZE: messages kept per chat (at most MAX_MESSAGES), 0 disables
+    int memory_mb;  // MESSAGE_TAIL_MEMORY_MB: budget for all rings; the least recently read chats go first
+} MessageTailConfig;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long loads;        // chats read into the cache
+    unsigned long refreshes;    // cached chats topped up after a commit
+    unsigned long evictions;
+    unsigned long stale_loads;  // loads discarded because the chat changed meanwhile
+    unsigned long entries;
+    unsigned long bytes;
+} MessageTailStats;
+
+typedef struct MessageTail MessageTail;
+
+void message_tail_config_from_env(MessageTailConfig *config);
+
+// NULL when disabled; every function below treats NULL as an always-missing cache
+MessageTail *message_tail_create(const MessageTailConfig *config);
+void message_tail_destroy(MessageTail *tail);
+
+// Same contract as get_chat_messages, served from the chat's ring (loading it on first use)
+// when the ring covers the page, from storage otherwise. Ring hits reach the sink under a
+// shard lock, so it should only serialize what it is given.
+int message_tail_get(MessageTail *tail, StorageSession *store, int chat_id, const MessagePage *page,
+                     const RowSink *sink, int *has_more);
+
+// Called after new messages for chat_id were committed
+void message_tail_refresh(MessageTail *tail, StorageSession *store, int chat_id);
+
+// For changes a refresh can't follow, like a deleted chat
+void message_tail_invalidate(MessageTail *tail, int chat_id);
+
+void message_tail_stats(MessageTail *tail, MessageTailStats *stats);
+
+#endif
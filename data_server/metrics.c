@@ -0,0 +1,469 @@
+#include "metrics.h"
+#include "../lib/env/env.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// Response codes the handlers use; anything else is counted as "other"
+static const int tracked_codes[] = { 200, 400, 403, 404, 500 };
+#define METRICS_CODES (sizeof(tracked_codes) / sizeof(tracked_codes[0]) + 1)
+
+static const char *const phase_names[METRIC_PHASES] = { "total", "db", "serialize" };
+
+// Exported bucket bounds are the powers of two from 16 us to 16.8 s, which fall exactly
+// on bucket edges
+#define METRICS_LE_FIRST 4
+#define METRICS_LE_LAST 24
+
+typedef struct {
+    _Atomic uint64_t codes[METRICS_CODES];
+    _Atomic uint64_t sum_ns[METRIC_PHASES];
+    _Atomic uint64_t buckets[METRIC_PHASES][METRICS_HIST_BUCKETS];
+} ActionMetrics;
+
+// Written by one thread only, read by scrapes
+typedef struct MetricsShard {
+    struct MetricsShard *next;
+    ActionMetrics actions[];
+} MetricsShard;
+
+struct Metrics {
+    const char *const *names;
+    int action_count;  // the slot after the last action collects unknown ones
+
+    pthread_mutex_t lock;  // guards the shard list
+    MetricsShard *shards;
+
+    int listen_fd;
+    pthread_t server;
+    int serving;
+    MetricsGauges gauges;
+    void *gauges_ctx;
+};
+
+static __thread MetricsShard *local_shard;
+static __thread uint64_t local_db_ns;
+
+void metrics_config_from_env(MetricsConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->port = env_int("METRICS_PORT", METRICS_DEFAULT_PORT, true);
+    config->address = getenv("METRICS_ADDRESS") ? getenv("METRICS_ADDRESS") : METRICS_DEFAULT_ADDRESS;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void metrics_db_add(uint64_t ns) {
+    local_db_ns += ns;
+}
+
+uint64_t metrics_db_take(void) {
+    uint64_t ns = local_db_ns;
+    local_db_ns = 0;
+    return ns;
+}
+
+// --- histograms ------------------------------------------------------------------------
+
+static int bucket_index(uint64_t us) {
+    if (us < METRICS_HIST_SUB) return (int)us;
+
+    int exponent = 63 - __builtin_clzll(us);
+    if (exponent >= METRICS_HIST_MAX_EXP) return METRICS_HIST_BUCKETS - 1;
+
+    int step = exponent - 4;
+    return (exponent - 3) * METRICS_HIST_SUB + (int)((us >> step) & (METRICS_HIST_SUB - 1));
+}
+
+// Exclusive upper edge of a bucket, in microseconds
+static uint64_t bucket_limit(int index) {
+    if (index < METRICS_HIST_SUB) return index + 1;
+
+    int exponent = index / METRICS_HIST_SUB + 3;
+    uint64_t step = 1ull << (exponent - 4);
+    return (METRICS_HIST_SUB + index % METRICS_HIST_SUB + 1) * step;
+}
+
+// Only the owning thread writes, so a relaxed load and store is enough and needs no lock prefix
+static inline void shard_add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+static int code_slot(int response_code) {
+    for (size_t i = 0; i < METRICS_CODES - 1; i++) {
+        if (tracked_codes[i] == response_code) return (int)i;
+    }
+    return METRICS_CODES - 1;
+}
+
+static int action_slot(Metrics *metrics, int action) {
+    if (action < 0 || action >= metrics->action_count || !metrics->names[action]) return metrics->action_count;
+    return action;
+}
+
+static size_t shard_bytes(Metrics *metrics) {
+    return sizeof(MetricsShard) + (metrics->action_count + 1) * sizeof(ActionMetrics);
+}
+
+static MetricsShard *shard_for_thread(Metrics *metrics) {
+    if (local_shard) return local_shard;
+
+    MetricsShard *shard = calloc(1, shard_bytes(metrics));
+    if (!shard) return NULL;
+
+    pthread_mutex_lock(&metrics->lock);
+    shard->next = metrics->shards;
+    metrics->shards = shard;
+    pthread_mutex_unlock(&metrics->lock);
+
+    local_shard = shard;
+    return shard;
+}
+
+void metrics_record(Metrics *metrics, int action, int response_code, const uint64_t phase_ns[METRIC_PHASES]) {
+    if (!metrics) return;
+
+    MetricsShard *shard = shard_for_thread(metrics);
+    if (!shard) return;
+
+    ActionMetrics *entry = &shard->actions[action_slot(metrics, action)];
+    shard_add(&entry->codes[code_slot(response_code)], 1);
+
+    for (int phase = 0; phase < METRIC_PHASES; phase++) {
+        shard_add(&entry->sum_ns[phase], phase_ns[phase]);
+        shard_add(&entry->buckets[phase][bucket_index(phase_ns[phase] / 1000)], 1);
+    }
+}
+
+// --- exposition ------------------------------------------------------------------------
+
+void metrics_printf(MetricsText *text, const char *format, ...) {
+    va_list args;
+
+    for (;;) {
+        size_t room = text->cap - text->len;
+
+        va_start(args, format);
+        int n = vsnprintf(text->data ? text->data + text->len : NULL, room, format, args);
+        va_end(args);
+
+        if (n < 0) return;
+        if ((size_t)n < room) {
+            text->len += n;
+            return;
+        }
+
+        size_t cap = text->cap ? text->cap * 2 : 16384;
+        while (cap < text->len + n + 1) cap *= 2;
+
+        char *grown = realloc(text->data, cap);
+        if (!grown) return;
+        text->data = grown;
+        text->cap = cap;
+    }
+}
+
+void metrics_gauge(MetricsText *text, const char *name, const char *help, double value) {
+    metrics_printf(text, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n", name, help, name, name, value);
+}
+
+void metrics_counter(MetricsText *text, const char *name, const char *help, double value) {
+    metrics_printf(text, "# HELP %s %s\n# TYPE %s counter\n%s %.17g\n", name, help, name, name, value);
+}
+
+static void code_label(char *label, size_t size, int slot) {
+    if (slot < (int)METRICS_CODES - 1) snprintf(label, size, "%d", tracked_codes[slot]);
+    else snprintf(label, size, "other");
+}
+
+static uint64_t action_requests(const ActionMetrics *entry) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < METRICS_CODES; i++) count += entry->codes[i];
+    return count;
+}
+
+// Smallest bucket edge at or above the given fraction of the recorded values
+static double quantile_seconds(const _Atomic uint64_t *buckets, uint64_t count, double quantile) {
+    uint64_t rank = (uint64_t)(quantile * count + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) return bucket_limit(i) / 1e6;
+    }
+    return bucket_limit(METRICS_HIST_BUCKETS - 1) / 1e6;
+}
+
+uint64_t metrics_window_quantile(Metrics *metrics, MetricsWindow *window, double quantile) {
+    if (!metrics) return 0;
+
+    uint64_t now[METRICS_HIST_BUCKETS] = {0};
+    pthread_mutex_lock(&metrics->lock);
+    for (MetricsShard *shard = metrics->shards; shard; shard = shard->next) {
+        for (int a = 0; a <= metrics->action_count; a++) {
+            const _Atomic uint64_t *buckets = shard->actions[a].buckets[METRIC_TOTAL];
+            for (int b = 0; b < METRICS_HIST_BUCKETS; b++) now[b] += atomic_load_explicit(&buckets[b], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&metrics->lock);
+
+    // Counters only grow, so what each bucket gained is what landed in it since the last call
+    uint64_t count = 0;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+        uint64_t seen = now[b];
+        now[b] -= window->seen[b];
+        window->seen[b] = seen;
+        count += now[b];
+    }
+    if (!count) return 0;
+
+    uint64_t rank = (uint64_t)(quantile * count + 0.5), passed = 0;
+    if (rank == 0) rank = 1;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+        passed += now[b];
+        if (passed >= rank) return bucket_limit(b);
+    }
+    return bucket_limit(METRICS_HIST_BUCKETS - 1);
+}
+
+void metrics_render(Metrics *metrics, MetricsText *text) {
+    int slots = metrics->action_count + 1;
+    ActionMetrics *totals = calloc(slots, sizeof(ActionMetrics));
+    if (!totals) return;
+
+    pthread_mutex_lock(&metrics->lock);
+    for (MetricsShard *shard = metrics->shards; shard; shard = shard->next) {
+        for (int a = 0; a < slots; a++) {
+            ActionMetrics *from = &shard->actions[a], *to = &totals[a];
+
+            for (size_t i = 0; i < METRICS_CODES; i++) {
+                to->codes[i] += atomic_load_explicit(&from->codes[i], memory_order_relaxed);
+            }
+            for (int p = 0; p < METRIC_PHASES; p++) {
+                to->sum_ns[p] += atomic_load_explicit(&from->sum_ns[p], memory_order_relaxed);
+                for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+                    to->buckets[p][b] += atomic_load_explicit(&from->buckets[p][b], memory_order_relaxed);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&metrics->lock);
+
+    metrics_printf(text, "# HELP data_server_requests_total Requests answered, by action and response code\n"
+                         "# TYPE data_server_requests_total counter\n");
+    for (int a = 0; a < slots; a++) {
+        const char *name = a < metrics->action_count ? metrics->names[a] : "unknown";
+        for (size_t i = 0; i < METRICS_CODES; i++) {
+            if (!totals[a].codes[i]) continue;
+
+            char code[16];
+            code_label(code, sizeof(code), (int)i);
+            metrics_printf(text, "data_server_requests_total{action=\"%s\",code=\"%s\"} %llu\n",
+                           name, code, (unsigned long long)totals[a].codes[i]);
+        }
+    }
+
+    metrics_printf(text, "# HELP data_server_request_seconds Request latency by phase: total, db (inside MySQL), "
+                         "serialize (parsing and handler work outside MySQL)\n"
+                         "# TYPE data_server_request_seconds histogram\n");
+    for (int a = 0; a < slots; a++) {
+        uint64_t count = action_requests(&totals[a]);
+        if (!count) continue;
+
+        const char *name = a < metrics->action_count ? metrics->names[a] : "unknown";
+        for (int p = 0; p < METRIC_PHASES; p++) {
+            uint64_t cumulative = 0;
+            int b = 0;
+
+            for (int exponent = METRICS_LE_FIRST; exponent <= METRICS_LE_LAST; exponent++) {
+                uint64_t edge = 1ull << exponent;
+                for (; b < METRICS_HIST_BUCKETS && bucket_limit(b) <= edge; b++) cumulative += totals[a].buckets[p][b];
+
+                metrics_printf(text, "data_server_request_seconds_bucket{action=\"%s\",phase=\"%s\",le=\"%.9g\"} %llu\n",
+                               name, phase_names[p], edge / 1e6, (unsigned long long)cumulative);
+            }
+            metrics_printf(text, "data_server_request_seconds_bucket{action=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n"
+                                 "data_server_request_seconds_sum{action=\"%s\",phase=\"%s\"} %.9f\n"
+                                 "data_server_request_seconds_count{action=\"%s\",phase=\"%s\"} %llu\n",
+                           name, phase_names[p], (unsigned long long)count,
+                           name, phase_names[p], totals[a].sum_ns[p] / 1e9,
+                           name, phase_names[p], (unsigned long long)count);
+        }
+    }
+
+    // The fine buckets give tail latencies the exported bounds are too coarse for
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    metrics_printf(text, "# HELP data_server_request_quantile_seconds Total request latency quantiles since start, within 6%%\n"
+                         "# TYPE data_server_request_quantile_seconds gauge\n");
+    for (int a = 0; a < slots; a++) {
+        uint64_t count = action_requests(&totals[a]);
+        if (!count) continue;
+
+        const char *name = a < metrics->action_count ? metrics->names[a] : "unknown";
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            metrics_printf(text, "data_server_request_quantile_seconds{action=\"%s\",quantile=\"%g\"} %g\n",
+                           name, quantiles[q], quantile_seconds(totals[a].buckets[METRIC_TOTAL], count, quantiles[q]));
+        }
+    }
+
+    free(totals);
+
+    if (metrics->gauges) metrics->gauges(metrics->gauges_ctx, text);
+}
+
+// --- endpoint --------------------------------------------------------------------------
+
+static void send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += sent;
+        len -= sent;
+    }
+}
+
+// One short-lived HTTP/1.0 exchange per scrape; anything but GET /metrics gets a 404
+static void serve_scrape(Metrics *metrics, int fd) {
+    char request[2048];
+    size_t len = 0;
+
+    request[0] = '\0';
+    while (len < sizeof(request) - 1 && !strstr(request, "\r\n\r\n")) {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+        request[len] = '\0';
+    }
+
+    if (strncmp(request, "GET /metrics", 12) != 0 || (request[12] != ' ' && request[12] != '?')) {
+        const char *missing = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, missing, strlen(missing));
+        return;
+    }
+
+    MetricsText body = {0};
+    metrics_render(metrics, &body);
+
+    char header[160];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.len);
+    send_all(fd, header, header_len);
+    send_all(fd, body.data, body.len);
+    free(body.data);
+}
+
+static void *server_main(void *arg) {
+    Metrics *metrics = arg;
+
+    for (;;) {
+        int fd = accept(metrics->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;  // the listening socket was shut down
+        }
+
+        // A scraper that stalls mid-request can't hold the endpoint for long
+        struct timeval timeout = { .tv_sec = 2 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        serve_scrape(metrics, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+Metrics *metrics_create(const char *const action_names[], int action_count) {
+    Metrics *metrics = calloc(1, sizeof(Metrics));
+    if (!metrics) return NULL;
+
+    metrics->names = action_names;
+    metrics->action_count = action_count;
+    metrics->listen_fd = -1;
+    pthread_mutex_init(&metrics->lock, NULL);
+    return metrics;
+}
+
+int metrics_serve(Metrics *metrics, const MetricsConfig *config, MetricsGauges gauges, void *ctx) {
+    metrics->gauges = gauges;
+    metrics->gauges_ctx = ctx;
+
+    if (config->port <= 0) {
+        printf("Metrics endpoint disabled\n");
+        return 0;
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config->port);
+    if (inet_pton(AF_INET, config->address, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid METRICS_ADDRESS %s\n", config->address);
+        return -1;
+    }
+
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("metrics socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("metrics bind");
+        close(fd);
+        return -1;
+    }
+
+    metrics->listen_fd = fd;
+    if (pthread_create(&metrics->server, NULL, server_main, metrics) != 0) {
+        perror("pthread_create metrics endpoint");
+        close(fd);
+        metrics->listen_fd = -1;
+        return -1;
+    }
+    metrics->serving = 1;
+
+    printf("Metrics endpoint ready: http://%s:%d/metrics\n", config->address, config->port);
+    return 0;
+}
+
+void metrics_destroy(Metrics *metrics) {
+    if (!metrics) return;
+
+    if (metrics->serving) {
+        shutdown(metrics->listen_fd, SHUT_RDWR);
+        pthread_join(metrics->server, NULL);
+    }
+    if (metrics->listen_fd >= 0) close(metrics->listen_fd);
+
+    MetricsShard *shard = metrics->shards;
+    while (shard) {
+        MetricsShard *next = shard->next;
+        free(shard);
+        shard = next;
+    }
+
+    pthread_mutex_destroy(&metrics->lock);
+    free(metrics);
+}
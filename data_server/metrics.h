@@ -0,0 +1,81 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_DEFAULT_PORT 9400
+#define METRICS_DEFAULT_ADDRESS "127.0.0.1"
+
+// Latencies are kept in microseconds in log-linear buckets: every power of two is split
+// into METRICS_HIST_SUB equal steps, so any recorded value is known to within about 6%
+#define METRICS_HIST_SUB 16
+#define METRICS_HIST_MAX_EXP 32  // up to 2^32 us (~71 min); anything slower lands in the last bucket
+#define METRICS_HIST_BUCKETS ((METRICS_HIST_MAX_EXP - 3) * METRICS_HIST_SUB)
+
+// Per-action request counts, response codes and latency histograms, scraped in Prometheus
+// text format over HTTP. Each worker thread records into its own shard with plain stores,
+// so a request pays a few clock reads and touches no shared cache line; a scrape adds the
+// shards up. Only one Metrics is expected per process.
+typedef struct {
+    int port;             // METRICS_PORT: 0 turns the endpoint off (recording stays on)
+    const char *address;  // METRICS_ADDRESS: interface it listens on, loopback by default
+} MetricsConfig;
+
+// Where a request's time went: all of it (received to sent), inside MySQL, and parsing
+// the request plus the handler's own work outside MySQL, which is mostly building the response
+typedef enum {
+    METRIC_TOTAL,
+    METRIC_DB,
+    METRIC_SERIALIZE,
+    METRIC_PHASES
+} MetricPhase;
+
+// A growing text buffer for the exposition
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} MetricsText;
+
+// Called on every scrape to append gauges (pools, queues, caches) after the request metrics
+typedef void (*MetricsGauges)(void *ctx, MetricsText *text);
+
+// What a window has already counted: total latencies of every action, by bucket
+typedef struct {
+    uint64_t seen[METRICS_HIST_BUCKETS];
+} MetricsWindow;
+
+typedef struct Metrics Metrics;
+
+void metrics_config_from_env(MetricsConfig *config);
+
+// action_names is indexed by action id; ids without a name are counted as "unknown"
+Metrics *metrics_create(const char *const action_names[], int action_count);
+// Starts the scrape endpoint on its own thread; 0 on success or when it is turned off
+int metrics_serve(Metrics *metrics, const MetricsConfig *config, MetricsGauges gauges, void *ctx);
+void metrics_destroy(Metrics *metrics);
+
+// Monotonic clock in nanoseconds
+uint64_t metrics_now(void);
+
+// Time the calling thread spent waiting on MySQL, added around each statement and taken
+// (and reset) once per request
+void metrics_db_add(uint64_t ns);
+uint64_t metrics_db_take(void);
+
+void metrics_record(Metrics *metrics, int action, int response_code, const uint64_t phase_ns[METRIC_PHASES]);
+
+// Total-latency quantile in microseconds over the requests recorded since the previous call
+// with the same window (zeroed at first), for figures that follow the load as it changes
+// instead of adding up since start. 0 when nothing was recorded in between.
+uint64_t metrics_window_quantile(Metrics *metrics, MetricsWindow *window, double quantile);
+
+// Full exposition: request metrics followed by the gauges
+void metrics_render(Metrics *metrics, MetricsText *text);
+
+void metrics_printf(MetricsText *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void metrics_gauge(MetricsText *text, const char *name, const char *help, double value);
+void metrics_counter(MetricsText *text, const char *name, const char *help, double value);
+
+#endif
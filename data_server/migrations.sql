@@ -0,0 +1,34 @@
+-- Schema changes the data server relies on, on top of schema.sql. Run once, in order.
+
+-- GET_CHAT_MESSAGES pages: seek to (chat_id, message_id) and read one page in either direction
+CREATE INDEX idx_messages_chat_message ON messages (chat_id, message_id);
+
+-- GET_CHATS inbox: every participant row carries its chat's newest message id, kept current on
+-- each send, so a user's chats come straight off the index in activity order
+ALTER TABLE chat_participants ADD COLUMN last_message_id INT NOT NULL DEFAULT 0;
+UPDATE chat_participants cp JOIN chats c ON c.chat_id = cp.chat_id
+    SET cp.last_message_id = COALESCE(c.last_message_id, 0);
+CREATE INDEX idx_participants_inbox ON chat_participants (user_id, last_message_id, chat_id);
+
+-- GET_CHATS without joins on messages/users: each inbox row also keeps a copy of its chat's
+-- last message, rewritten together with last_message_id (which doubles as its version)
+ALTER TABLE chat_participants
+    ADD COLUMN last_message_content TEXT NULL,
+    ADD COLUMN last_message_type VARCHAR(32) NULL,
+    ADD COLUMN last_message_at TIMESTAMP NULL,
+    ADD COLUMN last_message_sender VARCHAR(64) NULL;
+UPDATE chat_participants cp
+    JOIN messages m ON m.message_id = cp.last_message_id
+    JOIN users u ON u.user_id = m.sender_id
+    SET cp.last_message_content = m.content,
+        cp.last_message_type = m.message_type,
+        cp.last_message_at = m.created_at,
+        cp.last_message_sender = u.username;
+
+-- Messages flushed from a data server's message log carry the log and record they came from.
+-- The flusher inserts with ON DUPLICATE KEY, so a batch replayed after a crash is not stored twice;
+-- messages written directly leave both NULL, which the unique key doesn't compare
+ALTER TABLE messages
+    ADD COLUMN log_id BIGINT UNSIGNED NULL,
+    ADD COLUMN log_sequence BIGINT UNSIGNED NULL,
+    ADD UNIQUE KEY uq_messages_log_record (log_id, log_sequence);
@@ -0,0 +1,21 @@
+#include "storage.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Storage *storage_open_from_env(void) {
+    const char *engine = getenv("STORAGE_ENGINE");
+
+    if (!engine || !*engine || strcmp(engine, "mysql") == 0) {
+        DbPoolConfig pool_config;
+        db_pool_config_from_env(&pool_config);
+        return storage_mysql_open(&pool_config);
+    }
+
+    if (strcmp(engine, "memory") == 0) {
+        return storage_memory_open();
+    }
+
+    fprintf(stderr, "Unknown STORAGE_ENGINE \"%s\" (expected mysql or memory)\n", engine);
+    return NULL;
+}
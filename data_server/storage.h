@@ -0,0 +1,150 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "chat_manager.h"
+#include "user_manager.h"
+
+// Pluggable storage behind handle_action. STORAGE_ENGINE picks the backend:
+//   mysql  (default) chat_manager/user_manager over the pooled MySQL connections, with reads
+//                    optionally served by DB_REPLICAS
+//   memory           everything in process, for benchmarks and load tests without a database
+//
+// Every operation keeps the contract of the chat_manager/user_manager function it is named
+// after, including which strings the caller gets back from request_strdup and how long the
+// rows handed to a RowSink stay valid (the memory engine calls it under its read lock).
+
+// Longest replication position handed to clients
+#define STORAGE_POSITION_MAX 256
+
+typedef struct StorageOps StorageOps;
+
+typedef struct {
+    const StorageOps *ops;
+    void *engine;
+} Storage;
+
+// Checked out for one request or flush: a pooled MySQL connection, or the calling thread's
+// in-memory transaction. All calls between acquire and release go through the same session.
+typedef struct {
+    const StorageOps *ops;
+    Storage *storage;
+    void *handle;
+    int replica;  // reads may trail the primary, so nothing read here should be cached
+    int depth;    // storage_begin calls not yet matched by a commit or rollback
+    int failed;   // an inner transaction rolled back, so the outer one can only roll back
+} StorageSession;
+
+typedef struct {
+    int replicas;
+    unsigned long reads;      // read sessions served by a replica
+    unsigned long waits;      // of those, ones that first waited for a position
+    unsigned long fallbacks;  // read sessions sent to the primary: replica behind, busy or down
+} ReplicaStats;
+
+struct StorageOps {
+    const char *name;
+
+    int (*acquire)(Storage *storage, StorageSession *session);
+    // For requests that only read: the session may be on a replica that has applied position
+    // (from position(), NULL for none). Engines without replicas hand out a normal session.
+    int (*acquire_read)(Storage *storage, StorageSession *session, const char *position);
+    void (*release)(StorageSession *session);
+    // After a failed write: 1 when storage rejected it for good (an unknown chat or sender),
+    // 0 when trying again may succeed (a lost connection, a deadlock, a lock wait timeout)
+    int (*refused)(StorageSession *session);
+    // Chats on the same shard can commit in one transaction; engines without shards have only shard 0
+    int (*shard)(Storage *storage, int chat_id);
+    void (*close)(Storage *storage);
+    // Connection pool counters for the metrics endpoint; engines without a pool report zeros
+    void (*pool_stats)(Storage *storage, DbPoolStats *stats);
+    void (*replica_stats)(Storage *storage, ReplicaStats *stats);
+
+    int (*begin)(StorageSession *session);
+    int (*commit)(StorageSession *session);
+    void (*rollback)(StorageSession *session);
+    // Replication position covering what this session has committed, for a later read session
+    // to wait on; -1 when there are no replicas to wait for
+    int (*position)(StorageSession *session, char *position, size_t size);
+
+    int (*create_user)(StorageSession *session, User *user);
+    int (*validate_user)(StorageSession *session, char *key, char *password_hash);
+    // Fills id, username, email and hash_password, so one call can populate the user cache
+    int (*get_user_info)(StorageSession *session, char *key, User *user);
+
+    int (*create_chat)(StorageSession *session, Chat *chat);
+    int (*add_to_chat)(StorageSession *session, int chat_id, int user_id, int is_admin);
+    int (*add_participants)(StorageSession *session, int chat_id, const int user_ids[], const int is_admin[], int count);
+    int (*send_message)(StorageSession *session, Message *message);
+    int (*send_messages)(StorageSession *session, Message messages[], int count);
+    int (*get_chats)(StorageSession *session, int user_id, const ChatPage *page, const RowSink *sink, int *has_more);
+    int (*get_chat_count)(StorageSession *session, int user_id);
+    int (*get_chat_messages)(StorageSession *session, int chat_id, const MessagePage *page, const RowSink *sink, int *has_more);
+    int (*get_chat_info)(StorageSession *session, int chat_id, const RowSink *sink);
+    int (*get_chat_members)(StorageSession *session, int chat_id, ChatMembers *members);
+
+    int (*is_user_admin)(StorageSession *session, int chat_id, int user_id);
+    int (*is_group_chat)(StorageSession *session, int chat_id);
+    int (*remove_from_chat)(StorageSession *session, int chat_id, int user_id);
+    int (*get_participant_count)(StorageSession *session, int chat_id);
+    int (*get_admin_count)(StorageSession *session, int chat_id);
+    int (*promote_random_participant_to_admin)(StorageSession *session, int chat_id);
+    int (*delete_chat)(StorageSession *session, int chat_id);
+};
+
+Storage *storage_open_from_env(void);
+Storage *storage_mysql_open(const DbPoolConfig *config);
+Storage *storage_memory_open(void);
+
+static inline int storage_acquire(Storage *storage, StorageSession *session) {
+    session->depth = 0;
+    session->failed = 0;
+    return storage->ops->acquire(storage, session);
+}
+
+static inline int storage_acquire_read(Storage *storage, StorageSession *session, const char *position) {
+    session->depth = 0;
+    session->failed = 0;
+    return storage->ops->acquire_read(storage, session, position);
+}
+
+// Transactions that nest: only the outermost begin and commit reach the engine, so code
+// that runs its own transaction can also run inside a caller's (a BATCH)
+static inline int storage_begin(StorageSession *session) {
+    if (session->depth > 0) {
+        session->depth++;
+        return 0;
+    }
+
+    if (session->ops->begin(session) != 0) return -1;
+    session->depth = 1;
+    session->failed = 0;
+    return 0;
+}
+
+static inline void storage_rollback(StorageSession *session) {
+    if (--session->depth > 0) {
+        session->failed = 1;
+        return;
+    }
+    session->ops->rollback(session);
+}
+
+static inline int storage_commit(StorageSession *session) {
+    if (--session->depth > 0) return session->failed ? -1 : 0;
+
+    if (session->failed) {
+        session->ops->rollback(session);
+        return -1;
+    }
+    return session->ops->commit(session);
+}
+
+static inline void storage_release(StorageSession *session) {
+    session->ops->release(session);
+}
+
+static inline void storage_close(Storage *storage) {
+    storage->ops->close(storage);
+}
+
+#endif
@@ -0,0 +1,1070 @@
+#include "storage.h"
+#include "../dbg.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// In-process engine for benchmarks and load tests. One rwlock guards everything: reads run
+// concurrently, writes and whole transactions are exclusive. Users are found through hash
+// indexes on username and email; each chat keeps its messages in message_id order and each
+// user's inbox is kept sorted by (last_message_id, chat_id), so pages are binary searches.
+
+#define MEMORY_INITIAL_CAPACITY 64
+#define SYSTEM_USER_ID 1
+
+typedef struct {
+    char *username;
+    char *email;
+    char *password_hash;
+
+    // Chat ids sorted by (last_message_id, chat_id), oldest activity first
+    int *inbox;
+    int inbox_count;
+    int inbox_capacity;
+} MemUser;
+
+typedef struct {
+    int user_id;
+    int is_admin;
+} MemParticipant;
+
+typedef struct {
+    int exists;
+    char *name;
+    int is_group;
+    int last_message_id;
+
+    MemParticipant *participants;
+    int participant_count;
+    int participant_capacity;
+
+    Message *messages;  // ascending message_id
+    int message_count;
+    int message_capacity;
+} MemChat;
+
+typedef struct HashEntry {
+    char *key;
+    int id;
+    struct HashEntry *next;
+} HashEntry;
+
+typedef struct {
+    HashEntry **buckets;
+    size_t bucket_count;
+    size_t size;
+} HashIndex;
+
+typedef struct {
+    pthread_rwlock_t lock;
+
+    MemUser *users;  // indexed by user_id, slot 0 unused
+    int user_count;
+    int user_capacity;
+    HashIndex by_username;
+    HashIndex by_email;
+
+    MemChat *chats;  // indexed by chat_id, slot 0 unused
+    int chat_count;
+    int chat_capacity;
+
+    int next_message_id;
+} MemoryEngine;
+
+// Transactions hold the write lock from begin to commit and log how to undo each write.
+// Rollback replays the log backwards, so every entry finds the chat as its write left it.
+typedef enum {
+    UNDO_CREATE_USER,
+    UNDO_CREATE_CHAT,
+    UNDO_ADD_PARTICIPANT,
+    UNDO_REMOVE_PARTICIPANT,
+    UNDO_PROMOTE_ADMIN,
+    UNDO_SEND_MESSAGES,
+    UNDO_DELETE_CHAT
+} UndoType;
+
+typedef struct {
+    UndoType type;
+    int chat_id;
+    int user_id;                   // UNDO_CREATE_USER and participant entries
+    int is_admin;                  // UNDO_REMOVE_PARTICIPANT: where and how to put it back
+    int slot;
+    int count;                     // UNDO_SEND_MESSAGES
+    int previous_last_message_id;
+    MemChat deleted;               // UNDO_DELETE_CHAT: the chat itself, freed on commit
+} UndoEntry;
+
+typedef struct {
+    MemoryEngine *engine;
+    int in_transaction;
+    int refused;  // the last send_messages named a missing chat or sender
+
+    UndoEntry *undo;
+    int undo_count;
+    int undo_capacity;
+} MemorySession;
+
+static __thread MemorySession thread_session;
+
+// --- helpers -----------------------------------------------------------------------------
+
+static int grow(void **items, int *capacity, int needed, size_t item_size) {
+    if (needed <= *capacity) return 0;
+
+    int next = *capacity ? *capacity : MEMORY_INITIAL_CAPACITY;
+    while (next < needed) next *= 2;
+
+    void *grown = realloc(*items, next * item_size);
+    if (!grown) return -1;
+
+    memset((char *)grown + *capacity * item_size, 0, (next - *capacity) * item_size);
+    *items = grown;
+    *capacity = next;
+    return 0;
+}
+
+static uint64_t hash_key(const char *key) {
+    uint64_t hash = 14695981039346656037ull;
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static int hash_lookup(const HashIndex *index, const char *key) {
+    if (!key || index->bucket_count == 0) return 0;
+
+    for (HashEntry *entry = index->buckets[hash_key(key) % index->bucket_count]; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) return entry->id;
+    }
+    return 0;
+}
+
+static int hash_insert(HashIndex *index, const char *key, int id) {
+    if (index->size + 1 > index->bucket_count) {
+        size_t bucket_count = index->bucket_count ? index->bucket_count * 2 : MEMORY_INITIAL_CAPACITY;
+        HashEntry **buckets = calloc(bucket_count, sizeof(HashEntry *));
+        if (!buckets) return -1;
+
+        for (size_t i = 0; i < index->bucket_count; i++) {
+            HashEntry *entry = index->buckets[i];
+            while (entry) {
+                HashEntry *next = entry->next;
+                size_t slot = hash_key(entry->key) % bucket_count;
+                entry->next = buckets[slot];
+                buckets[slot] = entry;
+                entry = next;
+            }
+        }
+
+        free(index->buckets);
+        index->buckets = buckets;
+        index->bucket_count = bucket_count;
+    }
+
+    HashEntry *entry = malloc(sizeof(HashEntry));
+    if (!entry || !(entry->key = strdup(key))) {
+        free(entry);
+        return -1;
+    }
+
+    size_t slot = hash_key(key) % index->bucket_count;
+    entry->id = id;
+    entry->next = index->buckets[slot];
+    index->buckets[slot] = entry;
+    index->size++;
+    return 0;
+}
+
+static void hash_remove(HashIndex *index, const char *key) {
+    if (!key || index->bucket_count == 0) return;
+
+    HashEntry **link = &index->buckets[hash_key(key) % index->bucket_count];
+    while (*link && strcmp((*link)->key, key) != 0) link = &(*link)->next;
+    if (!*link) return;
+
+    HashEntry *entry = *link;
+    *link = entry->next;
+    free(entry->key);
+    free(entry);
+    index->size--;
+}
+
+static void hash_free(HashIndex *index) {
+    for (size_t i = 0; i < index->bucket_count; i++) {
+        HashEntry *entry = index->buckets[i];
+        while (entry) {
+            HashEntry *next = entry->next;
+            free(entry->key);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(index->buckets);
+}
+
+static MemUser *find_user(MemoryEngine *engine, int user_id) {
+    if (user_id <= 0 || user_id >= engine->user_count) return NULL;
+    return &engine->users[user_id];
+}
+
+static MemUser *find_user_by_key(MemoryEngine *engine, const char *key) {
+    int id = hash_lookup(&engine->by_username, key);
+    if (!id) id = hash_lookup(&engine->by_email, key);
+    return find_user(engine, id);
+}
+
+static MemChat *find_chat(MemoryEngine *engine, int chat_id) {
+    if (chat_id <= 0 || chat_id >= engine->chat_count || !engine->chats[chat_id].exists) return NULL;
+    return &engine->chats[chat_id];
+}
+
+static MemParticipant *find_participant(MemChat *chat, int user_id) {
+    for (int i = 0; i < chat->participant_count; i++) {
+        if (chat->participants[i].user_id == user_id) return &chat->participants[i];
+    }
+    return NULL;
+}
+
+static void format_now(char *out, size_t size) {
+    time_t now = time(NULL);
+    struct tm local;
+
+    localtime_r(&now, &local);
+    strftime(out, size, "%Y-%m-%d %H:%M:%S", &local);
+}
+
+// First inbox slot whose key is not below (last_message_id, chat_id)
+static int inbox_search(MemoryEngine *engine, MemUser *user, int last_message_id, int chat_id) {
+    int low = 0, high = user->inbox_count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        int entry = user->inbox[mid];
+        int entry_last = engine->chats[entry].last_message_id;
+
+        if (entry_last < last_message_id || (entry_last == last_message_id && entry < chat_id)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int inbox_insert(MemoryEngine *engine, MemUser *user, int chat_id) {
+    if (grow((void **)&user->inbox, &user->inbox_capacity, user->inbox_count + 1, sizeof(int)) != 0) return -1;
+
+    int slot = inbox_search(engine, user, engine->chats[chat_id].last_message_id, chat_id);
+    memmove(user->inbox + slot + 1, user->inbox + slot, (user->inbox_count - slot) * sizeof(int));
+    user->inbox[slot] = chat_id;
+    user->inbox_count++;
+    return 0;
+}
+
+// Must run before the chat's key changes, while the inbox is still sorted by the old one
+static void inbox_remove(MemoryEngine *engine, MemUser *user, int chat_id) {
+    int slot = inbox_search(engine, user, engine->chats[chat_id].last_message_id, chat_id);
+    if (slot == user->inbox_count || user->inbox[slot] != chat_id) return;
+
+    memmove(user->inbox + slot, user->inbox + slot + 1, (user->inbox_count - slot - 1) * sizeof(int));
+    user->inbox_count--;
+}
+
+// Moves the chat to its new place in every participant's inbox after last_message_id changed
+static void chat_set_last_message(MemoryEngine *engine, MemChat *chat, int chat_id, int last_message_id) {
+    for (int i = 0; i < chat->participant_count; i++) {
+        inbox_remove(engine, find_user(engine, chat->participants[i].user_id), chat_id);
+    }
+
+    chat->last_message_id = last_message_id;
+
+    for (int i = 0; i < chat->participant_count; i++) {
+        // Capacity is already there: the entry was just removed
+        inbox_insert(engine, find_user(engine, chat->participants[i].user_id), chat_id);
+    }
+}
+
+static void chat_free(MemChat *chat) {
+    free(chat->name);
+    free(chat->participants);
+    free(chat->messages);
+    memset(chat, 0, sizeof(*chat));
+}
+
+static void participant_remove(MemoryEngine *engine, MemChat *chat, int chat_id, MemParticipant *participant) {
+    inbox_remove(engine, find_user(engine, participant->user_id), chat_id);
+
+    int slot = (int)(participant - chat->participants);
+    memmove(participant, participant + 1, (chat->participant_count - slot - 1) * sizeof(MemParticipant));
+    chat->participant_count--;
+}
+
+// First message whose id is at least message_id
+static int message_search(const MemChat *chat, int message_id) {
+    int low = 0, high = chat->message_count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (chat->messages[mid].message_id < message_id) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// First message created after timestamp; creation times grow with message_id
+static int message_search_time(const MemChat *chat, const char *timestamp) {
+    int low = 0, high = chat->message_count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (strcmp(chat->messages[mid].created_at, timestamp) <= 0) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static int engine_add_user(MemoryEngine *engine, const char *username, const char *email, const char *password_hash) {
+    if (grow((void **)&engine->users, &engine->user_capacity, engine->user_count + 1, sizeof(MemUser)) != 0) return -1;
+
+    int user_id = engine->user_count;
+    MemUser *user = &engine->users[user_id];
+    user->username = strdup(username);
+    user->email = strdup(email ? email : "");
+    user->password_hash = strdup(password_hash ? password_hash : "");
+
+    if (!user->username || !user->email || !user->password_hash ||
+        hash_insert(&engine->by_username, username, user_id) != 0 ||
+        (email && hash_insert(&engine->by_email, email, user_id) != 0)) {
+        if (hash_lookup(&engine->by_username, username) == user_id) hash_remove(&engine->by_username, username);
+        free(user->username);
+        free(user->email);
+        free(user->password_hash);
+        memset(user, 0, sizeof(*user));
+        return -1;
+    }
+
+    engine->user_count++;
+    return user_id;
+}
+
+// Takes back the newest user, the only one whose id can be handed out again
+static void engine_drop_user(MemoryEngine *engine, int user_id) {
+    if (user_id != engine->user_count - 1) return;
+
+    MemUser *user = &engine->users[user_id];
+    hash_remove(&engine->by_username, user->username);
+    if (hash_lookup(&engine->by_email, user->email) == user_id) hash_remove(&engine->by_email, user->email);
+    free(user->username);
+    free(user->email);
+    free(user->password_hash);
+    free(user->inbox);
+    memset(user, 0, sizeof(*user));
+    engine->user_count--;
+}
+
+// --- sessions and transactions -----------------------------------------------------------
+
+static void mem_read_lock(MemorySession *session) {
+    if (!session->in_transaction) pthread_rwlock_rdlock(&session->engine->lock);
+}
+
+static void mem_write_lock(MemorySession *session) {
+    if (!session->in_transaction) pthread_rwlock_wrlock(&session->engine->lock);
+}
+
+static void mem_unlock(MemorySession *session) {
+    if (!session->in_transaction) pthread_rwlock_unlock(&session->engine->lock);
+}
+
+// NULL outside a transaction, or when the log can't grow; the caller fills in the details
+static UndoEntry *mem_undo_push(MemorySession *session, UndoType type, int chat_id) {
+    if (!session->in_transaction) return NULL;
+
+    if (grow((void **)&session->undo, &session->undo_capacity, session->undo_count + 1, sizeof(UndoEntry)) != 0) {
+        fprintf(stderr, "Memory storage: undo log full, rollback will be partial\n");
+        return NULL;
+    }
+
+    UndoEntry *entry = &session->undo[session->undo_count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->type = type;
+    entry->chat_id = chat_id;
+    return entry;
+}
+
+static int mem_acquire(Storage *storage, StorageSession *session) {
+    thread_session.engine = storage->engine;
+    thread_session.in_transaction = 0;
+    thread_session.undo_count = 0;
+
+    session->ops = storage->ops;
+    session->storage = storage;
+    session->handle = &thread_session;
+    session->replica = 0;
+    return 0;
+}
+
+// There is only the one copy, so reads need no routing
+static int mem_acquire_read(Storage *storage, StorageSession *session, const char *position) {
+    (void)position;
+    return mem_acquire(storage, session);
+}
+
+static void mem_release(StorageSession *session) {
+    if (((MemorySession *)session->handle)->in_transaction) {
+        session->ops->rollback(session);
+    }
+    session->handle = NULL;
+}
+
+static int mem_refused(StorageSession *session) {
+    return ((MemorySession *)session->handle)->refused;
+}
+
+static int mem_shard(Storage *storage, int chat_id) {
+    (void)storage;
+    (void)chat_id;
+    return 0;
+}
+
+static void mem_pool_stats(Storage *storage, DbPoolStats *stats) {
+    (void)storage;
+    memset(stats, 0, sizeof(*stats));
+}
+
+static void mem_replica_stats(Storage *storage, ReplicaStats *stats) {
+    (void)storage;
+    memset(stats, 0, sizeof(*stats));
+}
+
+static int mem_position(StorageSession *session, char *position, size_t size) {
+    (void)session;
+    (void)position;
+    (void)size;
+    return -1;
+}
+
+static int mem_begin(StorageSession *session) {
+    MemorySession *s = session->handle;
+    if (s->in_transaction) return -1;
+
+    pthread_rwlock_wrlock(&s->engine->lock);
+    s->in_transaction = 1;
+    s->undo_count = 0;
+    return 0;
+}
+
+static int mem_commit(StorageSession *session) {
+    MemorySession *s = session->handle;
+    if (!s->in_transaction) return -1;
+
+    for (int i = 0; i < s->undo_count; i++) {
+        if (s->undo[i].type == UNDO_DELETE_CHAT) chat_free(&s->undo[i].deleted);
+    }
+
+    s->in_transaction = 0;
+    s->undo_count = 0;
+    pthread_rwlock_unlock(&s->engine->lock);
+    return 0;
+}
+
+static void mem_rollback(StorageSession *session) {
+    MemorySession *s = session->handle;
+    MemoryEngine *engine = s->engine;
+    if (!s->in_transaction) return;
+
+    for (int i = s->undo_count - 1; i >= 0; i--) {
+        UndoEntry *entry = &s->undo[i];
+        MemChat *chat = &engine->chats[entry->chat_id];
+        MemParticipant *participant;
+
+        switch (entry->type) {
+            case UNDO_SEND_MESSAGES:
+                chat->message_count -= entry->count;
+                chat_set_last_message(engine, chat, entry->chat_id, entry->previous_last_message_id);
+                break;
+
+            case UNDO_ADD_PARTICIPANT:
+                participant = find_participant(chat, entry->user_id);
+                if (participant) participant_remove(engine, chat, entry->chat_id, participant);
+                break;
+
+            case UNDO_REMOVE_PARTICIPANT:
+                // The array never shrinks, so the removed slot's capacity is still there
+                memmove(chat->participants + entry->slot + 1, chat->participants + entry->slot,
+                        (chat->participant_count - entry->slot) * sizeof(MemParticipant));
+                chat->participants[entry->slot].user_id = entry->user_id;
+                chat->participants[entry->slot].is_admin = entry->is_admin;
+                chat->participant_count++;
+                inbox_insert(engine, find_user(engine, entry->user_id), entry->chat_id);
+                break;
+
+            case UNDO_PROMOTE_ADMIN:
+                participant = find_participant(chat, entry->user_id);
+                if (participant) participant->is_admin = 0;
+                break;
+
+            case UNDO_DELETE_CHAT:
+                *chat = entry->deleted;
+                for (int j = 0; j < chat->participant_count; j++) {
+                    inbox_insert(engine, find_user(engine, chat->participants[j].user_id), entry->chat_id);
+                }
+                break;
+
+            case UNDO_CREATE_CHAT:
+                chat_free(chat);
+                break;
+
+            case UNDO_CREATE_USER:
+                // Undone newest first, so the user is still the last one
+                engine_drop_user(engine, entry->user_id);
+                break;
+        }
+    }
+
+    s->in_transaction = 0;
+    s->undo_count = 0;
+    pthread_rwlock_unlock(&engine->lock);
+}
+
+// --- users -------------------------------------------------------------------------------
+
+static int mem_create_user(StorageSession *session, User *new_user) {
+    MemorySession *s = session->handle;
+    MemoryEngine *engine = s->engine;
+    int user_id = -1;
+
+    mem_write_lock(s);
+    if (new_user->username && !find_user_by_key(engine, new_user->username) &&
+        !(new_user->email && find_user_by_key(engine, new_user->email))) {
+        user_id = engine_add_user(engine, new_user->username, new_user->email, new_user->hash_password);
+    }
+    if (user_id > 0) {
+        UndoEntry *undo = mem_undo_push(s, UNDO_CREATE_USER, 0);
+        if (undo) undo->user_id = user_id;
+    }
+    mem_unlock(s);
+
+    if (user_id < 0) {
+        fprintf(stderr, "Create user failed\n");
+        return -1;
+    }
+
+    new_user->id = user_id;
+    debug("User created successfully");
+    return 0;
+}
+
+static int mem_validate_user(StorageSession *session, char *key, char *password_hash) {
+    MemorySession *s = session->handle;
+
+    mem_read_lock(s);
+    MemUser *user = find_user_by_key(s->engine, key);
+    int found = user && user != &s->engine->users[SYSTEM_USER_ID];
+    if (found) snprintf(password_hash, 65, "%s", user->password_hash);
+    mem_unlock(s);
+
+    if (!found) {
+        debug("User not found");
+        return -1;
+    }
+    return 0;
+}
+
+static int mem_get_user_info(StorageSession *session, char *key, User *user) {
+    MemorySession *s = session->handle;
+
+    mem_read_lock(s);
+    MemUser *found = find_user_by_key(s->engine, key);
+    if (found) {
+        user->username = request_strdup(found->username);
+        user->email = request_strdup(found->email);
+        user->hash_password = request_strdup(found->password_hash);
+        user->id = (int)(found - s->engine->users);
+    }
+    mem_unlock(s);
+
+    if (!found) {
+        debug("User not found");
+        return -1;
+    }
+    return 0;
+}
+
+// --- chats -------------------------------------------------------------------------------
+
+static int mem_create_chat(StorageSession *session, Chat *chat) {
+    MemorySession *s = session->handle;
+    MemoryEngine *engine = s->engine;
+    int chat_id = -1;
+
+    mem_write_lock(s);
+    if (grow((void **)&engine->chats, &engine->chat_capacity, engine->chat_count + 1, sizeof(MemChat)) == 0) {
+        MemChat *created = &engine->chats[engine->chat_count];
+        created->name = strdup(chat->chat_name ? chat->chat_name : "");
+        created->is_group = chat->is_group;
+
+        if (created->name) {
+            created->exists = 1;
+            chat_id = engine->chat_count++;
+            mem_undo_push(s, UNDO_CREATE_CHAT, chat_id);
+        }
+    }
+    mem_unlock(s);
+
+    if (chat_id < 0) {
+        fprintf(stderr, "Create chat failed\n");
+        return -1;
+    }
+
+    chat->id = chat_id;
+    debug("Chat created successfully. ID = %d", chat->id);
+    return 0;
+}
+
+static int mem_add_participants(StorageSession *session, int chat_id, const int user_ids[], const int is_admin[], int count) {
+    MemorySession *s = session->handle;
+    MemoryEngine *engine = s->engine;
+    int status = -1;
+
+    mem_write_lock(s);
+    MemChat *chat = find_chat(engine, chat_id);
+
+    // Like the multi-row INSERT, the whole batch is refused if any row is
+    int valid = chat != NULL;
+    for (int i = 0; valid && i < count; i++) {
+        valid = find_user(engine, user_ids[i]) && !find_participant(chat, user_ids[i]);
+        for (int j = 0; valid && j < i; j++) valid = user_ids[j] != user_ids[i];
+    }
+
+    if (valid && grow((void **)&chat->participants, &chat->participant_capacity,
+                      chat->participant_count + count, sizeof(MemParticipant)) == 0) {
+        int added = 0;
+        while (added < count && inbox_insert(engine, find_user(engine, user_ids[added]), chat_id) == 0) {
+            chat->participants[chat->participant_count].user_id = user_ids[added];
+            chat->participants[chat->participant_count].is_admin = is_admin[added];
+            chat->participant_count++;
+            added++;
+        }
+
+        if (added == count) {
+            for (int i = 0; i < count; i++) {
+                UndoEntry *undo = mem_undo_push(s, UNDO_ADD_PARTICIPANT, chat_id);
+                if (undo) undo->user_id = user_ids[i];
+            }
+            status = 0;
+        } else {
+            for (int i = 0; i < added; i++) {
+                inbox_remove(engine, find_user(engine, user_ids[i]), chat_id);
+            }
+            chat->participant_count -= added;
+        }
+    }
+    mem_unlock(s);
+
+    if (status != 0) {
+        fprintf(stderr, "Adding %d participants to chat %d failed\n", count, chat_id);
+    }
+    return status;
+}
+
+static int mem_add_to_chat(StorageSession *session, int chat_id, int user_id, int is_admin) {
+    return mem_add_participants(session, chat_id, &user_id, &is_admin, 1);
+}
+
+static int mem_send_messages(StorageSession *session, Message messages[], int count) {
+    MemorySession *s = session->handle;
+    MemoryEngine *engine = s->engine;
+    int chat_id = count > 0 ? messages[0].chat_id : 0;
+    int status = -1;
+
+    mem_write_lock(s);
+    MemChat *chat = find_chat(engine, chat_id);
+
+    int valid = chat != NULL && count > 0;
+    for (int i = 0; valid && i < count; i++) {
+        valid = messages[i].chat_id == chat_id && find_user(engine, messages[i].sender_id);
+    }
+    s->refused = !valid;
+
+    if (valid && grow((void **)&chat->messages, &chat->message_capacity,
+                      chat->message_count + count, sizeof(Message)) == 0) {
+        char now[MAX_TIMESTAMP_LENGTH];
+        format_now(now, sizeof(now));
+
+        int previous_last_message_id = chat->last_message_id;
+        for (int i = 0; i < count; i++) {
+            Message *stored = &chat->messages[chat->message_count++];
+            *stored = messages[i];
+            stored->message_id = ++engine->next_message_id;
+            snprintf(stored->sender_username, sizeof(stored->sender_username), "%s",
+                     find_user(engine, stored->sender_id)->username);
+            snprintf(stored->created_at, sizeof(stored->created_at), "%s", now);
+        }
+
+        chat_set_last_message(engine, chat, chat_id, engine->next_message_id);
+        UndoEntry *undo = mem_undo_push(s, UNDO_SEND_MESSAGES, chat_id);
+        if (undo) {
+            undo->count = count;
+            undo->previous_last_message_id = previous_last_message_id;
+        }
+        status = 0;
+    }
+    mem_unlock(s);
+
+    if (status != 0) {
+        fprintf(stderr, "Sending %d messages failed\n", count);
+    }
+    return status;
+}
+
+static int mem_send_message(StorageSession *session, Message *message) {
+    return mem_send_messages(session, message, 1);
+}
+
+// Rows point straight into the engine's records; the read lock keeps them in place while the sink runs
+static void emit_chat(const RowSink *sink, MemChat *chat, int chat_id) {
+    Message *last = chat->message_count > 0 ? &chat->messages[chat->message_count - 1] : NULL;
+    Chat row = {
+        .id = chat_id,
+        .chat_name = chat->name,
+        .is_group = chat->is_group,
+        .last_message_content = last ? last->content : "No messages yet",
+        .last_message_type = last ? last->message_type : "",
+        .last_message_timestamp = last ? last->created_at : "",
+        .last_message_by = last ? last->sender_username : "",
+        .last_message_id = chat->last_message_id,
+    };
+
+    sink->chat(sink->ctx, &row);
+}
+
+static int mem_get_chats(StorageSession *session, int user_id, const ChatPage *page, const RowSink *sink, int *has_more) {
+    MemorySession *s = session->handle;
+    MemoryEngine *engine = s->engine;
+    int chat_count = 0;
+
+    *has_more = 0;
+    mem_read_lock(s);
+    MemUser *user = find_user(engine, user_id);
+    if (user) {
+        // Walk the inbox downwards from just below the cursor
+        int slot = page->before_chat_id > 0
+            ? inbox_search(engine, user, page->before_message_id, page->before_chat_id)
+            : user->inbox_count;
+
+        while (--slot >= 0) {
+            int chat_id = user->inbox[slot];
+            MemChat *chat = &engine->chats[chat_id];
+
+            if (page->since_timestamp && chat->message_count > 0 &&
+                strcmp(chat->messages[chat->message_count - 1].created_at, page->since_timestamp) <= 0) {
+                continue;
+            }
+
+            if (chat_count == page->limit) {
+                *has_more = 1;
+                break;
+            }
+            emit_chat(sink, chat, chat_id);
+            chat_count++;
+        }
+    }
+    mem_unlock(s);
+
+    return chat_count;
+}
+
+static int mem_get_chat_count(StorageSession *session, int user_id) {
+    MemorySession *s = session->handle;
+
+    mem_read_lock(s);
+    MemUser *user = find_user(s->engine, user_id);
+    int count = user ? user->inbox_count : 0;
+    mem_unlock(s);
+
+    return count;
+}
+
+static int mem_get_chat_messages(StorageSession *session, int chat_id, const MessagePage *page, const RowSink *sink, int *has_more) {
+    MemorySession *s = session->handle;
+    int messages_count = 0;
+
+    *has_more = 0;
+    mem_read_lock(s);
+    MemChat *chat = find_chat(s->engine, chat_id);
+    if (chat) {
+        int start, end;
+
+        if (page->before_id > 0 || (page->after_id <= 0 && !page->since_timestamp)) {
+            // Newest page below the cursor
+            end = page->before_id > 0 ? message_search(chat, page->before_id) : chat->message_count;
+            start = end > page->limit ? end - page->limit : 0;
+            *has_more = start > 0;
+        } else {
+            start = page->after_id > 0 ? message_search(chat, page->after_id + 1)
+                                       : message_search_time(chat, page->since_timestamp);
+            end = chat->message_count - start > page->limit ? start + page->limit : chat->message_count;
+            *has_more = end < chat->message_count;
+        }
+
+        messages_count = end - start;
+        for (int i = start; i < end; i++) sink->message(sink->ctx, &chat->messages[i]);
+    }
+    mem_unlock(s);
+
+    return chat ? messages_count : 0;
+}
+
+static int mem_get_chat_info(StorageSession *session, int chat_id, const RowSink *sink) {
+    MemorySession *s = session->handle;
+    MemoryEngine *engine = s->engine;
+
+    mem_read_lock(s);
+    MemChat *found = find_chat(engine, chat_id);
+    if (found) {
+        Chat chat = { .id = chat_id, .chat_name = found->name, .is_group = found->is_group };
+        sink->chat(sink->ctx, &chat);
+
+        for (int i = 0; i < found->participant_count && i < MAX_PARTICIPANTS; i++) {
+            User user = {
+                .id = found->participants[i].user_id,
+                .username = find_user(engine, found->participants[i].user_id)->username,
+                .is_admin = found->participants[i].is_admin,
+            };
+            sink->participant(sink->ctx, &user);
+        }
+    }
+    mem_unlock(s);
+
+    return found ? 0 : -1;
+}
+
+static int mem_get_chat_members(StorageSession *session, int chat_id, ChatMembers *members) {
+    MemorySession *s = session->handle;
+    int status = -1;
+
+    memset(members, 0, sizeof(*members));
+    members->chat_id = chat_id;
+
+    mem_read_lock(s);
+    MemChat *chat = find_chat(s->engine, chat_id);
+    if (chat) {
+        int count = chat->participant_count;
+        members->is_group = chat->is_group;
+        members->user_ids = malloc((count ? count : 1) * sizeof(int));
+        members->is_admin = malloc((count ? count : 1) * sizeof(int));
+
+        if (members->user_ids && members->is_admin) {
+            for (int i = 0; i < count; i++) {
+                members->user_ids[i] = chat->participants[i].user_id;
+                members->is_admin[i] = chat->participants[i].is_admin;
+            }
+            members->count = count;
+            status = 0;
+        }
+    }
+    mem_unlock(s);
+
+    if (status != 0) free_chat_members(members);
+    return status;
+}
+
+static int mem_is_user_admin(StorageSession *session, int chat_id, int user_id) {
+    MemorySession *s = session->handle;
+
+    mem_read_lock(s);
+    MemChat *chat = find_chat(s->engine, chat_id);
+    MemParticipant *participant = chat ? find_participant(chat, user_id) : NULL;
+    int is_admin = participant && participant->is_admin == 1;
+    mem_unlock(s);
+
+    return is_admin;
+}
+
+static int mem_is_group_chat(StorageSession *session, int chat_id) {
+    MemorySession *s = session->handle;
+
+    mem_read_lock(s);
+    MemChat *chat = find_chat(s->engine, chat_id);
+    int is_group = chat && chat->is_group == 1;
+    mem_unlock(s);
+
+    return is_group;
+}
+
+static int mem_remove_from_chat(StorageSession *session, int chat_id, int user_id) {
+    MemorySession *s = session->handle;
+    MemoryEngine *engine = s->engine;
+
+    mem_write_lock(s);
+    MemChat *chat = find_chat(engine, chat_id);
+    MemParticipant *participant = chat ? find_participant(chat, user_id) : NULL;
+    if (participant) {
+        UndoEntry *undo = mem_undo_push(s, UNDO_REMOVE_PARTICIPANT, chat_id);
+        if (undo) {
+            undo->user_id = user_id;
+            undo->is_admin = participant->is_admin;
+            undo->slot = (int)(participant - chat->participants);
+        }
+        participant_remove(engine, chat, chat_id, participant);
+    }
+    mem_unlock(s);
+
+    return 0;
+}
+
+static int mem_get_participant_count(StorageSession *session, int chat_id) {
+    MemorySession *s = session->handle;
+
+    mem_read_lock(s);
+    MemChat *chat = find_chat(s->engine, chat_id);
+    int count = chat ? chat->participant_count : 0;
+    mem_unlock(s);
+
+    return count;
+}
+
+static int mem_get_admin_count(StorageSession *session, int chat_id) {
+    MemorySession *s = session->handle;
+    int count = 0;
+
+    mem_read_lock(s);
+    MemChat *chat = find_chat(s->engine, chat_id);
+    for (int i = 0; chat && i < chat->participant_count; i++) {
+        count += chat->participants[i].is_admin == 1;
+    }
+    mem_unlock(s);
+
+    return count;
+}
+
+static int mem_promote_random_participant_to_admin(StorageSession *session, int chat_id) {
+    MemorySession *s = session->handle;
+
+    mem_write_lock(s);
+    MemChat *chat = find_chat(s->engine, chat_id);
+    int promoted = chat && chat->participant_count > 0;
+    if (promoted && chat->participants[0].is_admin != 1) {
+        UndoEntry *undo = mem_undo_push(s, UNDO_PROMOTE_ADMIN, chat_id);
+        if (undo) undo->user_id = chat->participants[0].user_id;
+        chat->participants[0].is_admin = 1;
+    }
+    mem_unlock(s);
+
+    return promoted ? 0 : -1;
+}
+
+static int mem_delete_chat(StorageSession *session, int chat_id) {
+    MemorySession *s = session->handle;
+    MemoryEngine *engine = s->engine;
+
+    mem_write_lock(s);
+    MemChat *chat = find_chat(engine, chat_id);
+    if (chat) {
+        for (int i = 0; i < chat->participant_count; i++) {
+            inbox_remove(engine, find_user(engine, chat->participants[i].user_id), chat_id);
+        }
+
+        // In a transaction the chat moves into the undo log whole, for a rollback to put back
+        UndoEntry *undo = mem_undo_push(s, UNDO_DELETE_CHAT, chat_id);
+        if (undo) {
+            undo->deleted = *chat;
+            memset(chat, 0, sizeof(*chat));
+        } else {
+            chat_free(chat);
+        }
+    }
+    mem_unlock(s);
+
+    return 0;
+}
+
+static void mem_close(Storage *storage) {
+    MemoryEngine *engine = storage->engine;
+
+    for (int i = 0; i < engine->chat_count; i++) {
+        chat_free(&engine->chats[i]);
+    }
+    for (int i = 0; i < engine->user_count; i++) {
+        free(engine->users[i].username);
+        free(engine->users[i].email);
+        free(engine->users[i].password_hash);
+        free(engine->users[i].inbox);
+    }
+
+    hash_free(&engine->by_username);
+    hash_free(&engine->by_email);
+    free(engine->users);
+    free(engine->chats);
+    pthread_rwlock_destroy(&engine->lock);
+    free(engine);
+    free(storage);
+}
+
+static const StorageOps memory_ops = {
+    .name = "memory",
+    .acquire = mem_acquire,
+    .acquire_read = mem_acquire_read,
+    .release = mem_release,
+    .refused = mem_refused,
+    .shard = mem_shard,
+    .close = mem_close,
+    .pool_stats = mem_pool_stats,
+    .replica_stats = mem_replica_stats,
+    .begin = mem_begin,
+    .commit = mem_commit,
+    .rollback = mem_rollback,
+    .position = mem_position,
+    .create_user = mem_create_user,
+    .validate_user = mem_validate_user,
+    .get_user_info = mem_get_user_info,
+    .create_chat = mem_create_chat,
+    .add_to_chat = mem_add_to_chat,
+    .add_participants = mem_add_participants,
+    .send_message = mem_send_message,
+    .send_messages = mem_send_messages,
+    .get_chats = mem_get_chats,
+    .get_chat_count = mem_get_chat_count,
+    .get_chat_messages = mem_get_chat_messages,
+    .get_chat_info = mem_get_chat_info,
+    .get_chat_members = mem_get_chat_members,
+    .is_user_admin = mem_is_user_admin,
+    .is_group_chat = mem_is_group_chat,
+    .remove_from_chat = mem_remove_from_chat,
+    .get_participant_count = mem_get_participant_count,
+    .get_admin_count = mem_get_admin_count,
+    .promote_random_participant_to_admin = mem_promote_random_participant_to_admin,
+    .delete_chat = mem_delete_chat,
+};
+
+Storage *storage_memory_open(void) {
+    Storage *storage = calloc(1, sizeof(Storage));
+    MemoryEngine *engine = calloc(1, sizeof(MemoryEngine));
+    if (!storage || !engine) {
+        free(storage);
+        free(engine);
+        return NULL;
+    }
+
+    pthread_rwlock_init(&engine->lock, NULL);
+    engine->user_count = 1;  // ids start at 1 like AUTO_INCREMENT
+    engine->chat_count = 1;
+
+    storage->ops = &memory_ops;
+    storage->engine = engine;
+
+    // System messages are sent as user 1, which the MySQL schema seeds
+    if (engine_add_user(engine, "system", "system@localhost", "") != SYSTEM_USER_ID) {
+        fprintf(stderr, "Memory storage could not be initialized\n");
+        mem_close(storage);
+        return NULL;
+    }
+
+    printf("Storage: in-memory engine (data is lost on exit)\n");
+    return storage;
+}
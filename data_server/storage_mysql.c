@@ -0,0 +1,643 @@
+#include "storage.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// A replica that could not hand out a connection is skipped for this long
+#define REPLICA_RETRY_SECONDS 5
+
+// The MySQL engine is chat_manager/user_manager as they are; each session is a pooled connection,
+// to the primary or, for read sessions, to one of the replicas.
+//
+// With DB_SHARDS the primary (DB_HOST/DB_NAME) becomes the user directory, and chats, their
+// participants and messages are spread over the shards by chat_id. Shard k hands out ids
+// k+1, k+1+N, k+1+2N... (N shards), so (chat_id - 1) % N finds a chat's shard without a lookup.
+// New chats go to the shards in turn. Every shard keeps a copy of the users table, because its
+// message and participant queries join on it.
+typedef struct {
+    DbPool *primary;
+    DbPool *replicas[DB_MAX_REPLICAS];
+    time_t replica_down_until[DB_MAX_REPLICAS];
+    int replica_count;
+    int wait_ms;
+    char *replica_hosts;  // DB_REPLICAS split in place; the replica pools' hosts point into it
+
+    DbPool *shards[DB_MAX_SHARDS];
+    int shard_count;
+    char *shard_specs;    // DB_SHARDS split in place, like replica_hosts
+
+    unsigned int next_replica;
+    unsigned int next_shard;
+    ReplicaStats stats;
+} SqlEngine;
+
+// What a session holds. Shard connections are taken the first time a call needs one,
+// and join the session's transaction if one was begun.
+typedef struct {
+    DbConn *conn;                   // the primary or a replica
+    DbConn *shards[DB_MAX_SHARDS];
+    int transaction;
+    int directory;                  // a user created in the transaction holds one open on the primary
+} SqlSession;
+
+static int sql_session(Storage *storage, StorageSession *session, DbConn *conn, int replica) {
+    SqlSession *handle = calloc(1, sizeof(SqlSession));
+    if (!handle) {
+        db_pool_release(conn->pool, conn);
+        return -1;
+    }
+
+    handle->conn = conn;
+    session->ops = storage->ops;
+    session->storage = storage;
+    session->handle = handle;
+    session->replica = replica;
+    return 0;
+}
+
+static DbConn *session_conn(StorageSession *session) {
+    SqlSession *handle = session->handle;
+    return handle->conn;
+}
+
+static void shards_release(SqlSession *handle) {
+    for (int i = 0; i < DB_MAX_SHARDS; i++) {
+        if (!handle->shards[i]) continue;
+
+        db_pool_release(handle->shards[i]->pool, handle->shards[i]);
+        handle->shards[i] = NULL;
+    }
+}
+
+static DbConn *shard_conn(StorageSession *session, int shard) {
+    SqlEngine *engine = session->storage->engine;
+    SqlSession *handle = session->handle;
+    if (handle->shards[shard]) return handle->shards[shard];
+
+    // Outside a transaction a call is done with a shard once it has read its rows, so the
+    // session gives back what it holds before waiting for another: a scatter-gather read taking
+    // the shards in index order and a BATCH taking them in request order can't wait on each other.
+    // A transaction keeps its connections; a pool that stays empty times out.
+    if (!handle->transaction) shards_release(handle);
+
+    DbConn *conn = db_pool_acquire(engine->shards[shard]);
+    if (!conn) return NULL;
+
+    if (handle->transaction && db_begin(conn) != 0) {
+        db_pool_release(conn->pool, conn);
+        return NULL;
+    }
+
+    handle->shards[shard] = conn;
+    return conn;
+}
+
+static int shard_of(SqlEngine *engine, int chat_id) {
+    return chat_id > 0 ? (chat_id - 1) % engine->shard_count : 0;
+}
+
+// Where chat_id's rows live; NULL when its shard has no connection to spare
+static DbConn *chat_conn(StorageSession *session, int chat_id) {
+    SqlEngine *engine = session->storage->engine;
+    if (engine->shard_count == 0) return session_conn(session);
+
+    return shard_conn(session, shard_of(engine, chat_id));
+}
+
+static int sql_acquire(Storage *storage, StorageSession *session) {
+    SqlEngine *engine = storage->engine;
+    DbConn *conn = db_pool_acquire(engine->primary);
+    if (!conn) return -1;
+
+    return sql_session(storage, session, conn, 0);
+}
+
+// One replica is tried, round robin. If it is down or still hasn't applied position after
+// wait_ms the read goes to the primary, which always has.
+static int sql_acquire_read(Storage *storage, StorageSession *session, const char *position) {
+    SqlEngine *engine = storage->engine;
+    if (engine->replica_count == 0) return sql_acquire(storage, session);
+
+    int pick = __atomic_fetch_add(&engine->next_replica, 1, __ATOMIC_RELAXED) % engine->replica_count;
+    int wait = position && *position;
+    DbConn *conn = NULL;
+
+    if (__atomic_load_n(&engine->replica_down_until[pick], __ATOMIC_RELAXED) <= time(NULL)) {
+        conn = db_pool_acquire(engine->replicas[pick]);
+        if (!conn) {
+            __atomic_store_n(&engine->replica_down_until[pick], time(NULL) + REPLICA_RETRY_SECONDS, __ATOMIC_RELAXED);
+        } else if (wait && db_wait_position(conn, position, engine->wait_ms) != 0) {
+            db_pool_release(conn->pool, conn);
+            conn = NULL;
+        }
+    }
+
+    if (!conn) {
+        __atomic_add_fetch(&engine->stats.fallbacks, 1, __ATOMIC_RELAXED);
+        return sql_acquire(storage, session);
+    }
+
+    __atomic_add_fetch(&engine->stats.reads, 1, __ATOMIC_RELAXED);
+    if (wait) __atomic_add_fetch(&engine->stats.waits, 1, __ATOMIC_RELAXED);
+    return sql_session(storage, session, conn, 1);
+}
+
+static void sql_release(StorageSession *session) {
+    SqlSession *handle = session->handle;
+
+    if (handle->directory) db_rollback(handle->conn);
+    db_pool_release(handle->conn->pool, handle->conn);
+    shards_release(handle);
+    free(handle);
+    session->handle = NULL;
+}
+
+// Decided by the statement that failed. A call that failed before running one (no connection
+// to spare, a failed BEGIN) leaves no error behind, since begin clears it, and is retried.
+static int sql_refused(StorageSession *session) {
+    (void)session;
+    return db_error_permanent(db_last_error());
+}
+
+static int sql_shard(Storage *storage, int chat_id) {
+    SqlEngine *engine = storage->engine;
+    return engine->shard_count > 0 ? shard_of(engine, chat_id) : 0;
+}
+
+static void sql_close(Storage *storage) {
+    SqlEngine *engine = storage->engine;
+
+    db_pool_destroy(engine->primary);
+    for (int i = 0; i < engine->replica_count; i++) {
+        db_pool_destroy(engine->replicas[i]);
+    }
+    for (int i = 0; i < engine->shard_count; i++) {
+        db_pool_destroy(engine->shards[i]);
+    }
+    free(engine->replica_hosts);
+    free(engine->shard_specs);
+    free(engine);
+    free(storage);
+}
+
+// The primary's pool and the shards' added up; replicas show up in replica_stats
+static void sql_pool_stats(Storage *storage, DbPoolStats *stats) {
+    SqlEngine *engine = storage->engine;
+    db_pool_stats(engine->primary, stats);
+
+    for (int i = 0; i < engine->shard_count; i++) {
+        DbPoolStats shard;
+        db_pool_stats(engine->shards[i], &shard);
+        stats->size += shard.size;
+        stats->in_use += shard.in_use;
+        stats->peak_in_use += shard.peak_in_use;
+        stats->waits += shard.waits;
+        stats->timeouts += shard.timeouts;
+        stats->reconnects += shard.reconnects;
+    }
+}
+
+static void sql_replica_stats(Storage *storage, ReplicaStats *stats) {
+    SqlEngine *engine = storage->engine;
+
+    stats->replicas = engine->replica_count;
+    stats->reads = __atomic_load_n(&engine->stats.reads, __ATOMIC_RELAXED);
+    stats->waits = __atomic_load_n(&engine->stats.waits, __ATOMIC_RELAXED);
+    stats->fallbacks = __atomic_load_n(&engine->stats.fallbacks, __ATOMIC_RELAXED);
+}
+
+// Without shards the primary's transaction is the session's. With them, only chat data is
+// written in transactions, so each shard begins its own when the session first uses it.
+static int sql_begin(StorageSession *session) {
+    SqlEngine *engine = session->storage->engine;
+    SqlSession *handle = session->handle;
+    db_clear_error();
+    if (engine->shard_count == 0) return db_begin(handle->conn);
+
+    for (int i = 0; i < engine->shard_count; i++) {
+        if (handle->shards[i] && db_begin(handle->shards[i]) != 0) return -1;
+    }
+    handle->transaction = 1;
+    return 0;
+}
+
+static void sql_rollback(StorageSession *session) {
+    SqlEngine *engine = session->storage->engine;
+    SqlSession *handle = session->handle;
+    if (engine->shard_count == 0) {
+        db_rollback(handle->conn);
+        return;
+    }
+
+    for (int i = 0; i < engine->shard_count; i++) {
+        if (handle->shards[i]) db_rollback(handle->shards[i]);
+    }
+    if (handle->directory) db_rollback(handle->conn);
+    handle->transaction = 0;
+    handle->directory = 0;
+}
+
+// Shards commit one after another, then the directory if a user was created. A request only
+// writes to one chat and the message log commits shard by shard, so only new users span
+// shards; if a later shard fails the earlier ones stay committed and the rest is rolled back.
+static int sql_commit(StorageSession *session) {
+    SqlEngine *engine = session->storage->engine;
+    SqlSession *handle = session->handle;
+    if (engine->shard_count == 0) return db_commit(handle->conn);
+
+    int status = 0;
+    for (int i = 0; i < engine->shard_count; i++) {
+        if (!handle->shards[i]) continue;
+
+        if (status == 0) status = db_commit(handle->shards[i]);
+        else db_rollback(handle->shards[i]);
+    }
+    if (handle->directory) {
+        if (status == 0) status = db_commit(handle->conn);
+        else db_rollback(handle->conn);
+    }
+    handle->transaction = 0;
+    handle->directory = 0;
+    return status;
+}
+
+// Everything the primary has executed, which includes this session's commits. Without
+// replicas nobody needs it, and the query is skipped.
+static int sql_position(StorageSession *session, char *position, size_t size) {
+    SqlEngine *engine = session->storage->engine;
+    if (engine->replica_count == 0 || session->replica) return -1;
+
+    return db_position(session_conn(session), position, size);
+}
+
+// A shard that misses the copy can't show the user's messages or membership there, so the
+// user goes to the directory and every shard or nowhere. The directory's insert stays open
+// on the primary until the session's transaction ends; outside one the create is its own.
+static int sql_create_user(StorageSession *session, User *user) {
+    SqlEngine *engine = session->storage->engine;
+    SqlSession *handle = session->handle;
+    if (engine->shard_count == 0) return create_user(session_conn(session), user);
+
+    int own = !handle->transaction;
+    if (own && sql_begin(session) != 0) return -1;
+
+    int status = 0;
+    if (!handle->directory) {
+        status = db_begin(handle->conn);
+        if (status == 0) handle->directory = 1;
+    }
+    if (status == 0) status = create_user(handle->conn, user);
+
+    for (int shard = 0; shard < engine->shard_count && status == 0; shard++) {
+        DbConn *conn = shard_conn(session, shard);
+        if (!conn || copy_user(conn, user) != 0) {
+            fprintf(stderr, "User %d was not copied to shard %d\n", user->id, shard);
+            status = -1;
+        }
+    }
+
+    if (!own) return status;
+    if (status != 0) {
+        sql_rollback(session);
+        return -1;
+    }
+    return sql_commit(session);
+}
+
+static int sql_validate_user(StorageSession *session, char *key, char *password_hash) {
+    return validate_user(session_conn(session), key, password_hash);
+}
+
+static int sql_get_user_info(StorageSession *session, char *key, User *user) {
+    return get_user_info(session_conn(session), key, user);
+}
+
+static int sql_create_chat(StorageSession *session, Chat *chat) {
+    SqlEngine *engine = session->storage->engine;
+    if (engine->shard_count == 0) return create_chat(session_conn(session), chat);
+
+    int shard = __atomic_fetch_add(&engine->next_shard, 1, __ATOMIC_RELAXED) % engine->shard_count;
+    DbConn *conn = shard_conn(session, shard);
+    if (!conn || create_chat(conn, chat) != 0) return -1;
+
+    // An id off the shard's sequence would send every later call for the chat elsewhere
+    if (shard_of(engine, chat->id) != shard) {
+        fprintf(stderr, "Chat %d was created on shard %d but maps to shard %d\n", chat->id, shard, shard_of(engine, chat->id));
+        return -1;
+    }
+    return 0;
+}
+
+static int sql_add_to_chat(StorageSession *session, int chat_id, int user_id, int is_admin) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? add_to_chat(conn, chat_id, user_id, is_admin) : -1;
+}
+
+static int sql_add_participants(StorageSession *session, int chat_id, const int user_ids[], const int is_admin[], int count) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? add_participants(conn, chat_id, user_ids, is_admin, count) : -1;
+}
+
+static int sql_send_message(StorageSession *session, Message *message) {
+    DbConn *conn = chat_conn(session, message->chat_id);
+    return conn ? send_message(conn, message) : -1;
+}
+
+static int sql_send_messages(StorageSession *session, Message messages[], int count) {
+    DbConn *conn = chat_conn(session, messages[0].chat_id);
+    return conn ? send_messages(conn, messages, count) : -1;
+}
+
+// A shard's inbox row, copied out of its fetch buffers until every shard has answered
+typedef struct {
+    Chat chat;
+    char chat_name[MAX_STRING];
+    char content[MAX_CONTENT_LENGTH];
+    char type[MAX_TYPE_LENGTH];
+    char timestamp[MAX_TIMESTAMP_LENGTH];
+    char sender[MAX_USERNAME_LENGTH];
+} InboxRow;
+
+typedef struct {
+    InboxRow *rows;
+    int count;
+} InboxRows;
+
+static void copy_text(char *buffer, size_t size, const char *text) {
+    snprintf(buffer, size, "%s", text ? text : "");
+}
+
+static void collect_chat(void *ctx, const Chat *chat) {
+    InboxRows *inbox = ctx;
+    InboxRow *row = &inbox->rows[inbox->count++];
+
+    row->chat = *chat;
+    copy_text(row->chat_name, sizeof(row->chat_name), chat->chat_name);
+    copy_text(row->content, sizeof(row->content), chat->last_message_content);
+    copy_text(row->type, sizeof(row->type), chat->last_message_type);
+    copy_text(row->timestamp, sizeof(row->timestamp), chat->last_message_timestamp);
+    copy_text(row->sender, sizeof(row->sender), chat->last_message_by);
+}
+
+// The inbox order: newest last message first, ties by chat_id
+static int inbox_order(const void *a, const void *b) {
+    const Chat *x = &((const InboxRow *)a)->chat;
+    const Chat *y = &((const InboxRow *)b)->chat;
+
+    if (x->last_message_id != y->last_message_id) return x->last_message_id < y->last_message_id ? 1 : -1;
+    return x->id < y->id ? 1 : (x->id > y->id ? -1 : 0);
+}
+
+// Each shard returns its own page after the cursor and the newest rows of all of them make
+// the merged page. Shards number their messages on their own, so between chats on different
+// shards the order follows each shard's id sequence rather than exact send time.
+static int sql_get_chats(StorageSession *session, int user_id, const ChatPage *page, const RowSink *sink, int *has_more) {
+    SqlEngine *engine = session->storage->engine;
+    if (engine->shard_count == 0) return get_chats(session_conn(session), user_id, page, sink, has_more);
+
+    InboxRows inbox = { .rows = malloc(engine->shard_count * page->limit * sizeof(InboxRow)) };
+    RowSink collect = { .ctx = &inbox, .chat = collect_chat };
+    int more = 0, status = 0;
+    if (!inbox.rows) return -1;
+
+    for (int shard = 0; shard < engine->shard_count && status == 0; shard++) {
+        DbConn *conn = shard_conn(session, shard);
+        int shard_more = 0;
+
+        if (!conn || get_chats(conn, user_id, page, &collect, &shard_more) < 0) status = -1;
+        more |= shard_more;
+    }
+
+    if (status == 0) {
+        qsort(inbox.rows, inbox.count, sizeof(InboxRow), inbox_order);
+        status = inbox.count < page->limit ? inbox.count : page->limit;
+        *has_more = more || inbox.count > page->limit;
+
+        for (int i = 0; i < status; i++) {
+            InboxRow *row = &inbox.rows[i];
+            row->chat.chat_name = row->chat_name;
+            row->chat.last_message_content = row->content;
+            row->chat.last_message_type = row->type;
+            row->chat.last_message_timestamp = row->timestamp;
+            row->chat.last_message_by = row->sender;
+            sink->chat(sink->ctx, &row->chat);
+        }
+    }
+
+    free(inbox.rows);
+    return status;
+}
+
+static int sql_get_chat_count(StorageSession *session, int user_id) {
+    SqlEngine *engine = session->storage->engine;
+    if (engine->shard_count == 0) return get_chat_count(session_conn(session), user_id);
+
+    int total = 0;
+    for (int shard = 0; shard < engine->shard_count; shard++) {
+        DbConn *conn = shard_conn(session, shard);
+        int count = conn ? get_chat_count(conn, user_id) : -1;
+        if (count < 0) return -1;
+        total += count;
+    }
+    return total;
+}
+
+static int sql_get_chat_messages(StorageSession *session, int chat_id, const MessagePage *page, const RowSink *sink, int *has_more) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? get_chat_messages(conn, chat_id, page, sink, has_more) : -1;
+}
+
+static int sql_get_chat_info(StorageSession *session, int chat_id, const RowSink *sink) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? get_chat_info(conn, chat_id, sink) : -1;
+}
+
+static int sql_get_chat_members(StorageSession *session, int chat_id, ChatMembers *members) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? get_chat_members(conn, chat_id, members) : -1;
+}
+
+static int sql_is_user_admin(StorageSession *session, int chat_id, int user_id) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? is_user_admin(conn, chat_id, user_id) : 0;
+}
+
+static int sql_is_group_chat(StorageSession *session, int chat_id) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? is_group_chat(conn, chat_id) : -1;
+}
+
+static int sql_remove_from_chat(StorageSession *session, int chat_id, int user_id) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? remove_from_chat(conn, chat_id, user_id) : -1;
+}
+
+static int sql_get_participant_count(StorageSession *session, int chat_id) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? get_participant_count(conn, chat_id) : -1;
+}
+
+static int sql_get_admin_count(StorageSession *session, int chat_id) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? get_admin_count(conn, chat_id) : -1;
+}
+
+static int sql_promote_random_participant_to_admin(StorageSession *session, int chat_id) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? promote_random_participant_to_admin(conn, chat_id) : -1;
+}
+
+static int sql_delete_chat(StorageSession *session, int chat_id) {
+    DbConn *conn = chat_conn(session, chat_id);
+    return conn ? delete_chat(conn, chat_id) : -1;
+}
+
+static const StorageOps mysql_ops = {
+    .name = "mysql",
+    .acquire = sql_acquire,
+    .acquire_read = sql_acquire_read,
+    .release = sql_release,
+    .refused = sql_refused,
+    .shard = sql_shard,
+    .close = sql_close,
+    .pool_stats = sql_pool_stats,
+    .replica_stats = sql_replica_stats,
+    .begin = sql_begin,
+    .commit = sql_commit,
+    .rollback = sql_rollback,
+    .position = sql_position,
+    .create_user = sql_create_user,
+    .validate_user = sql_validate_user,
+    .get_user_info = sql_get_user_info,
+    .create_chat = sql_create_chat,
+    .add_to_chat = sql_add_to_chat,
+    .add_participants = sql_add_participants,
+    .send_message = sql_send_message,
+    .send_messages = sql_send_messages,
+    .get_chats = sql_get_chats,
+    .get_chat_count = sql_get_chat_count,
+    .get_chat_messages = sql_get_chat_messages,
+    .get_chat_info = sql_get_chat_info,
+    .get_chat_members = sql_get_chat_members,
+    .is_user_admin = sql_is_user_admin,
+    .is_group_chat = sql_is_group_chat,
+    .remove_from_chat = sql_remove_from_chat,
+    .get_participant_count = sql_get_participant_count,
+    .get_admin_count = sql_get_admin_count,
+    .promote_random_participant_to_admin = sql_promote_random_participant_to_admin,
+    .delete_chat = sql_delete_chat,
+};
+
+// Opens a pool per host[:port] in DB_REPLICAS. A replica that can't be reached at startup
+// is left out; reads then spread over the others, or all go to the primary.
+static void open_replicas(SqlEngine *engine, const DbPoolConfig *config) {
+    engine->replica_hosts = strdup(config->replicas);
+    if (!engine->replica_hosts) return;
+
+    char *next = NULL;
+    for (char *host = strtok_r(engine->replica_hosts, ", ", &next); host; host = strtok_r(NULL, ", ", &next)) {
+        if (engine->replica_count == DB_MAX_REPLICAS) {
+            fprintf(stderr, "Only the first %d replicas are used\n", DB_MAX_REPLICAS);
+            break;
+        }
+
+        DbPoolConfig replica = *config;
+        char *port = strchr(host, ':');
+        if (port) {
+            *port = '\0';
+            replica.port = atoi(port + 1);
+        }
+        replica.host = host;
+
+        DbPool *pool = db_pool_create(&replica);
+        if (!pool) {
+            fprintf(stderr, "Replica %s could not be opened, leaving it out\n", host);
+            continue;
+        }
+        engine->replicas[engine->replica_count++] = pool;
+    }
+
+    printf("Reads routed to %d replicas, waiting up to %d ms for a position\n", engine->replica_count, engine->wait_ms);
+}
+
+// Opens a pool per host[:port][/database] in DB_SHARDS. Which chat lives where depends on the
+// shard count and order, so every shard has to open, and the list can't change once chats exist.
+static int open_shards(SqlEngine *engine, const DbPoolConfig *config) {
+    char *specs[DB_MAX_SHARDS];
+    int count = 0;
+
+    engine->shard_specs = strdup(config->shards);
+    if (!engine->shard_specs) return -1;
+
+    char *next = NULL;
+    for (char *spec = strtok_r(engine->shard_specs, ", ", &next); spec; spec = strtok_r(NULL, ", ", &next)) {
+        if (count == DB_MAX_SHARDS) {
+            fprintf(stderr, "DB_SHARDS lists more than %d shards\n", DB_MAX_SHARDS);
+            return -1;
+        }
+        specs[count++] = spec;
+    }
+
+    for (int i = 0; i < count; i++) {
+        DbPoolConfig shard = *config;
+        char *database = strchr(specs[i], '/');
+        if (database) {
+            *database = '\0';
+            shard.database = database + 1;
+        }
+        char *port = strchr(specs[i], ':');
+        if (port) {
+            *port = '\0';
+            shard.port = atoi(port + 1);
+        }
+        shard.host = specs[i];
+        shard.auto_increment_increment = count;
+        shard.auto_increment_offset = i + 1;
+
+        engine->shards[i] = db_pool_create(&shard);
+        if (!engine->shards[i]) {
+            fprintf(stderr, "Shard %d (%s/%s) could not be opened\n", i, shard.host, shard.database ? shard.database : "");
+            return -1;
+        }
+        engine->shard_count++;
+    }
+
+    printf("Chats sharded over %d databases\n", engine->shard_count);
+    return 0;
+}
+
+Storage *storage_mysql_open(const DbPoolConfig *config) {
+    Storage *storage = calloc(1, sizeof(Storage));
+    SqlEngine *engine = calloc(1, sizeof(SqlEngine));
+    if (!storage || !engine) {
+        free(storage);
+        free(engine);
+        return NULL;
+    }
+
+    engine->primary = db_pool_create(config);
+    if (!engine->primary) {
+        fprintf(stderr, "Connection failed: database pool could not be created\n");
+        free(engine);
+        free(storage);
+        return NULL;
+    }
+
+    storage->ops = &mysql_ops;
+    storage->engine = engine;
+
+    if (config->shards && *config->shards && open_shards(engine, config) != 0) {
+        sql_close(storage);
+        return NULL;
+    }
+
+    // Replicas copy the primary, which holds no chats once they are sharded
+    engine->wait_ms = config->replica_wait_ms;
+    if (config->replicas && *config->replicas) {
+        if (engine->shard_count > 0) fprintf(stderr, "DB_REPLICAS is ignored when DB_SHARDS is set\n");
+        else open_replicas(engine, config);
+    }
+
+    return storage;
+}
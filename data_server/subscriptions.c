@@ -0,0 +1,632 @@
+#include "subscriptions.h"
+#include "lru_map.h"
+#include "../lib/env/env.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CURSOR_BUCKETS 4096
+#define CURSOR_RECENT 32
+
+struct Subscription {
+    int id;
+    int user_id;
+    int chat_count;                         // 0 for every chat the user is in
+    int chat_ids[SUBSCRIPTION_MAX_CHATS];
+    WireEncoding encoding;
+    int has_request_id;
+    long long request_id;
+    void *conn;
+
+    // Set when one of its pushes found the queue full: it then gets a resync frame, telling the
+    // peer to read again after resync_after_id in resync_chat_id (0 for several chats), instead
+    // of its next push that fits. Changed under the registry's write lock.
+    int lagging;
+    int resync_chat_id;
+    int resync_after_id;
+    unsigned long losses;  // so a resync only clears the losses it covered
+
+    struct Subscription *user_next;  // same user bucket
+    struct Subscription *conn_next;  // same connection
+};
+
+// What was already pushed for a chat with subscribers. Ids are handed out at insert but become
+// visible at commit, so a message can show up below one already pushed: instead of only the
+// newest id, a cursor keeps the ids it pushed above floor_id and every publish reads what is
+// after floor_id again, skipping those.
+typedef struct Cursor {
+    int chat_id;
+    int refs;              // publishes using it, under cursor_lock
+    pthread_mutex_t lock;  // held by a publish from its read to its enqueue
+    int started;           // 0 until a first read placed floor_id
+    int floor_id;
+    int recent[CURSOR_RECENT];  // ascending
+    int recent_count;
+    struct Cursor *next;
+} Cursor;
+
+// Messages of one publish, shared by every push made from it
+typedef struct {
+    int refs;
+    int count;
+    int capacity;
+    int failed;
+    Message *messages;
+} PushBatch;
+
+typedef struct {
+    PushBatch *batch;
+    const Cursor *cursor;  // ids it already pushed are left out
+    int last_id;           // of the last message read, left out or not
+} Collector;
+
+enum { TARGET_QUEUED, TARGET_LOST, TARGET_RESYNCED };
+
+// A subscription as it was when a publish picked it, holding a reference to its connection
+typedef struct {
+    void *conn;
+    int user_id;
+    int lagging;
+    int resync_chat_id;
+    int resync_after_id;
+    unsigned long losses;
+    int outcome;
+    SubscriptionPush push;
+} Target;
+
+typedef struct PushJob {
+    Target target;
+    PushBatch *batch;  // NULL for a resync
+    struct PushJob *next;
+} PushJob;
+
+struct Subscriptions {
+    SubscriptionsConfig config;
+    SubscriberOps ops;
+    ChatCache *chats;
+    MessageTail *tail;
+
+    // Registry: add and drop write, publish reads
+    pthread_rwlock_t lock;
+    Subscription **users;
+    size_t user_mask;
+    int active;
+    int next_id;
+
+    // Guards the table only; each cursor has a lock of its own for the read
+    pthread_mutex_t cursor_lock;
+    Cursor *cursors[CURSOR_BUCKETS];
+    unsigned long publishes;
+
+    pthread_mutex_t queue_lock;
+    pthread_cond_t has_jobs;
+    PushJob *head;
+    PushJob *last;
+    int queued;
+    int stopping;
+    unsigned long pushes;
+    unsigned long messages;
+    unsigned long dropped;
+    unsigned long resyncs;
+    pthread_t pusher;
+};
+
+// A dropped connection's list is left pointing here, so a SUBSCRIBE still in flight on it fails
+static Subscription dropped_list;
+
+void subscriptions_config_from_env(SubscriptionsConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->max = env_int("SUBSCRIPTIONS_MAX", SUBSCRIPTIONS_DEFAULT_MAX, true);
+    config->queue = env_int("SUBSCRIPTIONS_QUEUE", SUBSCRIPTIONS_DEFAULT_QUEUE, false);
+    if (config->queue < 1) config->queue = SUBSCRIPTIONS_DEFAULT_QUEUE;
+}
+
+static Subscription **user_bucket(Subscriptions *subs, int user_id) {
+    return &subs->users[(id_hash(user_id) >> 32) & subs->user_mask];
+}
+
+static Cursor **cursor_find(Subscriptions *subs, int chat_id) {
+    Cursor **link = &subs->cursors[(id_hash(chat_id) >> 32) % CURSOR_BUCKETS];
+    while (*link && (*link)->chat_id != chat_id) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static Cursor *cursor_new(int chat_id) {
+    Cursor *cursor = calloc(1, sizeof(Cursor));
+    if (!cursor) return NULL;
+
+    cursor->chat_id = chat_id;
+    pthread_mutex_init(&cursor->lock, NULL);
+    return cursor;
+}
+
+static void cursor_free(Cursor *cursor) {
+    pthread_mutex_destroy(&cursor->lock);
+    free(cursor);
+}
+
+static int cursor_pushed(const Cursor *cursor, int message_id) {
+    for (int i = 0; i < cursor->recent_count; i++) {
+        if (cursor->recent[i] == message_id) return 1;
+    }
+    return 0;
+}
+
+// Adds a pushed id; with the window full the lowest one goes below the floor
+static void cursor_remember(Cursor *cursor, int message_id) {
+    int at = cursor->recent_count;
+    while (at > 0 && cursor->recent[at - 1] > message_id) at--;
+
+    if (cursor->recent_count == CURSOR_RECENT) {
+        if (at == 0) {
+            cursor->floor_id = message_id;
+            return;
+        }
+        cursor->floor_id = cursor->recent[0];
+        memmove(cursor->recent, cursor->recent + 1, (CURSOR_RECENT - 1) * sizeof(int));
+        cursor->recent_count--;
+        at--;
+    }
+
+    memmove(cursor->recent + at + 1, cursor->recent + at, (cursor->recent_count - at) * sizeof(int));
+    cursor->recent[at] = message_id;
+    cursor->recent_count++;
+}
+
+static void batch_release(PushBatch *batch) {
+    if (!batch) return;
+    if (__atomic_sub_fetch(&batch->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+    free(batch->messages);
+    free(batch);
+}
+
+static void *pusher_main(void *data) {
+    Subscriptions *subs = data;
+
+    while (1) {
+        pthread_mutex_lock(&subs->queue_lock);
+        while (!subs->head && !subs->stopping) {
+            pthread_cond_wait(&subs->has_jobs, &subs->queue_lock);
+        }
+        if (!subs->head) {
+            pthread_mutex_unlock(&subs->queue_lock);
+            return NULL;
+        }
+
+        PushJob *job = subs->head;
+        subs->head = job->next;
+        if (!subs->head) subs->last = NULL;
+        subs->queued--;
+        pthread_mutex_unlock(&subs->queue_lock);
+
+        if (job->batch) {
+            job->target.push.messages = job->batch->messages;
+            job->target.push.count = job->batch->count;
+        }
+        subs->ops.push(job->target.conn, &job->target.push);
+
+        pthread_mutex_lock(&subs->queue_lock);
+        subs->pushes++;
+        subs->messages += job->target.push.count;
+        pthread_mutex_unlock(&subs->queue_lock);
+
+        subs->ops.release(job->target.conn);
+        batch_release(job->batch);
+        free(job);
+    }
+}
+
+Subscriptions *subscriptions_create(const SubscriptionsConfig *config, const SubscriberOps *ops,
+                                    ChatCache *chats, MessageTail *tail) {
+    if (config->max <= 0) {
+        printf("Subscriptions disabled\n");
+        return NULL;
+    }
+
+    Subscriptions *subs = calloc(1, sizeof(Subscriptions));
+    if (!subs) return NULL;
+
+    size_t bucket_count = 1;
+    while (bucket_count < (size_t)config->max) bucket_count <<= 1;
+
+    subs->users = calloc(bucket_count, sizeof(Subscription *));
+    if (!subs->users) {
+        free(subs);
+        return NULL;
+    }
+
+    subs->config = *config;
+    subs->ops = *ops;
+    subs->chats = chats;
+    subs->tail = tail;
+    subs->user_mask = bucket_count - 1;
+    pthread_rwlock_init(&subs->lock, NULL);
+    pthread_mutex_init(&subs->cursor_lock, NULL);
+    pthread_mutex_init(&subs->queue_lock, NULL);
+    pthread_cond_init(&subs->has_jobs, NULL);
+
+    if (pthread_create(&subs->pusher, NULL, pusher_main, subs) != 0) {
+        perror("pthread_create subscription pusher");
+        free(subs->users);
+        free(subs);
+        return NULL;
+    }
+
+    printf("Subscriptions ready: up to %d, %d queued pushes\n", config->max, config->queue);
+    return subs;
+}
+
+void subscriptions_destroy(Subscriptions *subs) {
+    if (!subs) return;
+
+    // Pushes already queued are written out before the thread exits
+    pthread_mutex_lock(&subs->queue_lock);
+    subs->stopping = 1;
+    pthread_cond_signal(&subs->has_jobs);
+    pthread_mutex_unlock(&subs->queue_lock);
+    pthread_join(subs->pusher, NULL);
+
+    for (size_t i = 0; i <= subs->user_mask; i++) {
+        Subscription *sub = subs->users[i];
+        while (sub) {
+            Subscription *next = sub->user_next;
+            subs->ops.release(sub->conn);
+            free(sub);
+            sub = next;
+        }
+    }
+    for (int i = 0; i < CURSOR_BUCKETS; i++) {
+        Cursor *cursor = subs->cursors[i];
+        while (cursor) {
+            Cursor *next = cursor->next;
+            cursor_free(cursor);
+            cursor = next;
+        }
+    }
+
+    free(subs->users);
+    pthread_rwlock_destroy(&subs->lock);
+    pthread_mutex_destroy(&subs->cursor_lock);
+    pthread_mutex_destroy(&subs->queue_lock);
+    pthread_cond_destroy(&subs->has_jobs);
+    free(subs);
+}
+
+int subscriptions_add(Subscriptions *subs, void *conn, Subscription **owned, const SubscriptionRequest *request) {
+    if (!subs || request->chat_count > SUBSCRIPTION_MAX_CHATS) return -1;
+
+    Subscription *sub = calloc(1, sizeof(Subscription));
+    if (!sub) return -1;
+
+    sub->user_id = request->user_id;
+    sub->chat_count = request->chat_ids ? request->chat_count : 0;
+    if (sub->chat_count > 0) memcpy(sub->chat_ids, request->chat_ids, sub->chat_count * sizeof(int));
+    sub->encoding = request->encoding;
+    sub->has_request_id = request->has_request_id;
+    sub->request_id = request->request_id;
+    sub->conn = conn;
+
+    pthread_rwlock_wrlock(&subs->lock);
+    if (*owned == &dropped_list || subs->active >= subs->config.max) {
+        pthread_rwlock_unlock(&subs->lock);
+        free(sub);
+        return -1;
+    }
+
+    sub->id = ++subs->next_id;
+    Subscription **bucket = user_bucket(subs, sub->user_id);
+    sub->user_next = *bucket;
+    *bucket = sub;
+    sub->conn_next = *owned;
+    *owned = sub;
+    subs->ops.retain(conn);
+    __atomic_add_fetch(&subs->active, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&subs->lock);
+
+    return sub->id;
+}
+
+void subscriptions_drop(Subscriptions *subs, Subscription **owned) {
+    if (!subs) return;
+
+    pthread_rwlock_wrlock(&subs->lock);
+    Subscription *sub = *owned != &dropped_list ? *owned : NULL;
+    *owned = &dropped_list;
+
+    while (sub) {
+        Subscription *next = sub->conn_next;
+
+        Subscription **link = user_bucket(subs, sub->user_id);
+        while (*link != sub) link = &(*link)->user_next;
+        *link = sub->user_next;
+
+        subs->ops.release(sub->conn);
+        free(sub);
+        __atomic_sub_fetch(&subs->active, 1, __ATOMIC_RELEASE);
+        sub = next;
+    }
+    pthread_rwlock_unlock(&subs->lock);
+}
+
+static int subscription_wants(const Subscription *sub, int chat_id) {
+    if (sub->chat_count == 0) return 1;
+
+    for (int i = 0; i < sub->chat_count; i++) {
+        if (sub->chat_ids[i] == chat_id) return 1;
+    }
+    return 0;
+}
+
+// Snapshots every subscription of a member that covers chat_id; returns how many
+static int collect_targets(Subscriptions *subs, int chat_id, const ChatMembers *members, Target **targets) {
+    int count = 0, capacity = 0;
+
+    pthread_rwlock_rdlock(&subs->lock);
+    for (int i = 0; i < members->count; i++) {
+        int user_id = members->user_ids[i];
+
+        for (Subscription *sub = *user_bucket(subs, user_id); sub; sub = sub->user_next) {
+            if (sub->user_id != user_id || !subscription_wants(sub, chat_id)) continue;
+
+            if (count == capacity) {
+                int grown = capacity ? capacity * 2 : 8;
+                Target *bigger = realloc(*targets, grown * sizeof(Target));
+                if (!bigger) goto done;
+                *targets = bigger;
+                capacity = grown;
+            }
+
+            Target *target = &(*targets)[count++];
+            memset(target, 0, sizeof(*target));
+            target->conn = sub->conn;
+            target->user_id = user_id;
+            target->lagging = sub->lagging;
+            target->resync_chat_id = sub->resync_chat_id;
+            target->resync_after_id = sub->resync_after_id;
+            target->losses = sub->losses;
+            target->push.subscription_id = sub->id;
+            target->push.has_request_id = sub->has_request_id;
+            target->push.request_id = sub->request_id;
+            target->push.encoding = sub->encoding;
+            target->push.chat_id = chat_id;
+            subs->ops.retain(sub->conn);
+        }
+    }
+done:
+    pthread_rwlock_unlock(&subs->lock);
+    return count;
+}
+
+static void collect_message(void *ctx, const Message *message) {
+    Collector *collector = ctx;
+    PushBatch *batch = collector->batch;
+
+    collector->last_id = message->message_id;
+    if (batch->failed || cursor_pushed(collector->cursor, message->message_id)) return;
+
+    if (batch->count == batch->capacity) {
+        int grown = batch->capacity ? batch->capacity * 2 : 16;
+        Message *bigger = realloc(batch->messages, grown * sizeof(Message));
+        if (!bigger) {
+            batch->failed = 1;
+            return;
+        }
+        batch->messages = bigger;
+        batch->capacity = grown;
+    }
+    batch->messages[batch->count++] = *message;
+}
+
+// Reads what the chat got after the cursor's floor and wasn't pushed yet, or its newest count
+// messages the first time, and remembers them as pushed. NULL when storage could not be read.
+static PushBatch *read_new_messages(Subscriptions *subs, StorageSession *store, Cursor *cursor, int count) {
+    PushBatch *batch = calloc(1, sizeof(PushBatch));
+    if (!batch) return NULL;
+
+    Collector collector = { .batch = batch, .cursor = cursor };
+    RowSink sink = { .ctx = &collector, .message = collect_message };
+    MessagePage page = {0};
+    int has_more = 0;
+
+    if (cursor->started) {
+        page.after_id = cursor->floor_id;
+        page.limit = MAX_MESSAGES;
+        do {
+            int read = message_tail_get(subs->tail, store, cursor->chat_id, &page, &sink, &has_more);
+            if (read < 0 || batch->failed) goto fail;
+            if (read == 0) break;
+            page.after_id = collector.last_id;
+        } while (has_more);
+    } else {
+        page.limit = count < MAX_MESSAGES ? count : MAX_MESSAGES;
+        if (message_tail_get(subs->tail, store, cursor->chat_id, &page, &sink, &has_more) < 0 || batch->failed) goto fail;
+
+        // Until something was read the chat is simply read again from the newest page
+        if (batch->count > 0) {
+            cursor->started = 1;
+            cursor->floor_id = batch->messages[0].message_id - 1;
+        }
+    }
+
+    for (int i = 0; i < batch->count; i++) cursor_remember(cursor, batch->messages[i].message_id);
+    return batch;
+
+fail:
+    free(batch->messages);
+    free(batch);
+    return NULL;
+}
+
+static void release_targets(Subscriptions *subs, Target *targets, int count) {
+    for (int i = 0; i < count; i++) subs->ops.release(targets[i].conn);
+}
+
+static Subscription *subscription_find(Subscriptions *subs, int user_id, int id) {
+    for (Subscription *sub = *user_bucket(subs, user_id); sub; sub = sub->user_next) {
+        if (sub->id == id) return sub;
+    }
+    return NULL;
+}
+
+// Records the outcome of each target that lost a push or was sent a resync on its subscription,
+// unless that was dropped in the meantime
+static void settle_targets(Subscriptions *subs, const Target *targets, int count, int after_id) {
+    pthread_rwlock_wrlock(&subs->lock);
+    for (int i = 0; i < count; i++) {
+        const Target *target = &targets[i];
+        if (target->outcome == TARGET_QUEUED) continue;
+
+        Subscription *sub = subscription_find(subs, target->user_id, target->push.subscription_id);
+        if (!sub) continue;
+
+        if (target->outcome == TARGET_RESYNCED) {
+            // A push lost since the target was taken isn't covered by the resync just queued
+            if (sub->losses == target->losses) sub->lagging = 0;
+        } else if (!sub->lagging) {
+            sub->lagging = 1;
+            sub->resync_chat_id = target->push.chat_id;
+            sub->resync_after_id = after_id;
+            sub->losses++;
+        } else {
+            if (sub->resync_chat_id != target->push.chat_id) sub->resync_chat_id = 0;
+            if (after_id < sub->resync_after_id) sub->resync_after_id = after_id;
+            sub->losses++;
+        }
+    }
+    pthread_rwlock_unlock(&subs->lock);
+}
+
+// Hands each target its push; the queue takes over their connection references. A lagging
+// target gets a resync frame in place of the push, covering it too. Nothing is dropped
+// silently: a target whose frame doesn't fit is marked lagging.
+static void enqueue_pushes(Subscriptions *subs, Target *targets, int count, PushBatch *batch) {
+    int after_id = batch->messages[0].message_id - 1;
+    int settle = 0;
+    batch->refs = count;
+
+    pthread_mutex_lock(&subs->queue_lock);
+    for (int i = 0; i < count; i++) {
+        Target *target = &targets[i];
+        PushJob *job = subs->queued < subs->config.queue ? malloc(sizeof(PushJob)) : NULL;
+
+        if (!job) {
+            subs->dropped++;
+            subs->ops.release(target->conn);
+            batch_release(batch);
+            target->outcome = TARGET_LOST;
+            settle = 1;
+            continue;
+        }
+
+        job->batch = batch;
+        if (target->lagging) {
+            batch_release(batch);
+            job->batch = NULL;
+            target->push.resync = 1;
+            target->push.after_id = target->resync_after_id < after_id ? target->resync_after_id : after_id;
+            if (target->resync_chat_id != target->push.chat_id) target->push.chat_id = 0;
+            target->outcome = TARGET_RESYNCED;
+            subs->resyncs++;
+            settle = 1;
+        }
+
+        job->target = *target;
+        job->next = NULL;
+        if (subs->last) subs->last->next = job;
+        else subs->head = job;
+        subs->last = job;
+        subs->queued++;
+    }
+    pthread_cond_signal(&subs->has_jobs);
+    pthread_mutex_unlock(&subs->queue_lock);
+
+    if (settle) settle_targets(subs, targets, count, after_id);
+}
+
+void subscriptions_publish(Subscriptions *subs, StorageSession *store, int chat_id, int count) {
+    if (!subs || count <= 0 || __atomic_load_n(&subs->active, __ATOMIC_ACQUIRE) == 0) return;
+
+    // Membership comes from the chat cache, which a miss here fills like any permission check
+    ChatMembers members;
+    int cached = chat_cache_members(subs->chats, chat_id, &members);
+    unsigned long epoch = 0;
+    if (!cached) {
+        epoch = chat_cache_epoch(subs->chats, chat_id);
+        if (store->ops->get_chat_members(store, chat_id, &members) != 0) return;
+    }
+
+    Target *targets = NULL;
+    int target_count = collect_targets(subs, chat_id, &members, &targets);
+
+    if (cached) free_chat_members(&members);
+    else chat_cache_put(subs->chats, &members, epoch);
+
+    Cursor *cursor = NULL;
+    pthread_mutex_lock(&subs->cursor_lock);
+    Cursor **link = cursor_find(subs, chat_id);
+    if (target_count == 0) {
+        // Nobody is listening; whoever subscribes next starts from the newest messages
+        if (*link && (*link)->refs == 0) {
+            Cursor *unused = *link;
+            *link = unused->next;
+            cursor_free(unused);
+        }
+    } else {
+        if (!*link) *link = cursor_new(chat_id);
+        cursor = *link;
+        if (cursor) cursor->refs++;
+        subs->publishes++;
+    }
+    pthread_mutex_unlock(&subs->cursor_lock);
+
+    if (!cursor) {
+        if (target_count > 0) fprintf(stderr, "Subscriptions: no cursor for chat %d\n", chat_id);
+        release_targets(subs, targets, target_count);
+        free(targets);
+        return;
+    }
+
+    // Publishes of other chats read in parallel; one chat's take turns, and queue in the order they read
+    pthread_mutex_lock(&cursor->lock);
+    PushBatch *batch = read_new_messages(subs, store, cursor, count);
+    if (!batch || batch->count == 0) {
+        if (!batch) fprintf(stderr, "Subscriptions: could not read new messages for chat %d\n", chat_id);
+        release_targets(subs, targets, target_count);
+        if (batch) {
+            free(batch->messages);
+            free(batch);
+        }
+    } else {
+        enqueue_pushes(subs, targets, target_count, batch);
+    }
+    pthread_mutex_unlock(&cursor->lock);
+
+    pthread_mutex_lock(&subs->cursor_lock);
+    cursor->refs--;
+    pthread_mutex_unlock(&subs->cursor_lock);
+    free(targets);
+}
+
+void subscriptions_stats(Subscriptions *subs, SubscriptionsStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!subs) return;
+
+    stats->active = __atomic_load_n(&subs->active, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&subs->cursor_lock);
+    stats->publishes = subs->publishes;
+    pthread_mutex_unlock(&subs->cursor_lock);
+
+    pthread_mutex_lock(&subs->queue_lock);
+    stats->pushes = subs->pushes;
+    stats->messages = subs->messages;
+    stats->dropped = subs->dropped;
+    stats->resyncs = subs->resyncs;
+    stats->queued = subs->queued;
+    pthread_mutex_unlock(&subs->queue_lock);
+}
@@ -0,0 +1,95 @@
+#ifndef SUBSCRIPTIONS_H
+#define SUBSCRIPTIONS_H
+
+#include "../lib/wire/wire.h"
+#include "chat_cache.h"
+#include "chat_manager.h"
+#include "message_tail.h"
+#include "storage.h"
+
+#define SUBSCRIPTIONS_DEFAULT_MAX 65536
+#define SUBSCRIPTIONS_DEFAULT_QUEUE 4096
+#define SUBSCRIPTION_MAX_CHATS 64
+
+// Server push for new messages. A SUBSCRIBE request registers its connection for a user's
+// chats (all of them, or a list) and stays registered until the connection closes. Whoever
+// commits messages calls subscriptions_publish(), which reads back what is new in the chat,
+// picks the subscriptions of its members and queues one push per subscription; a push
+// thread writes them out, so a slow peer never holds up the commit path.
+//
+// Message ids are assigned by storage, so each chat with subscribers has a cursor: a floor
+// and the ids pushed above it. A publish reads everything after the floor that wasn't pushed
+// yet, which also catches a message that committed after one with a higher id. A chat without
+// a cursor (its first publish since anyone was listening) gets the newest count messages.
+// Publishes of different chats read storage in parallel.
+//
+// A push that doesn't fit the queue marks its subscription lagging. The next one that fits is
+// a resync instead: no messages, only the id after which the peer should read again.
+typedef struct {
+    int max;    // SUBSCRIPTIONS_MAX: most live subscriptions, 0 turns SUBSCRIBE off
+    int queue;  // SUBSCRIPTIONS_QUEUE: pushes waiting for the push thread before subscriptions start lagging
+} SubscriptionsConfig;
+
+typedef struct {
+    unsigned long active;
+    unsigned long publishes;   // publishes that found a subscriber
+    unsigned long pushes;      // frames written
+    unsigned long messages;    // messages carried by them
+    unsigned long dropped;     // pushes lost to a full queue
+    unsigned long resyncs;     // resync frames queued for lagging subscriptions
+    unsigned long queued;
+} SubscriptionsStats;
+
+// What the push thread hands back to the server for one subscription
+typedef struct {
+    int subscription_id;
+    int has_request_id;
+    long long request_id;   // of the SUBSCRIBE, so the peer can route the push
+    WireEncoding encoding;  // of the SUBSCRIBE
+    int chat_id;            // 0 for a resync covering several chats
+    int resync;             // pushes were lost: no messages, read again after after_id
+    int after_id;
+    const Message *messages;
+    int count;
+} SubscriptionPush;
+
+// How the registry holds on to and writes to the connections it is given
+typedef struct {
+    void (*retain)(void *conn);
+    void (*release)(void *conn);
+    void (*push)(void *conn, const SubscriptionPush *push);  // called on the push thread
+} SubscriberOps;
+
+typedef struct {
+    int user_id;
+    const int *chat_ids;  // NULL for every chat the user is a member of
+    int chat_count;
+    WireEncoding encoding;
+    int has_request_id;
+    long long request_id;
+} SubscriptionRequest;
+
+typedef struct Subscription Subscription;
+typedef struct Subscriptions Subscriptions;
+
+void subscriptions_config_from_env(SubscriptionsConfig *config);
+
+// NULL when disabled; every function below treats NULL as a registry nobody is subscribed to.
+// Members are looked up in chats (which may be NULL) and messages read through tail.
+Subscriptions *subscriptions_create(const SubscriptionsConfig *config, const SubscriberOps *ops,
+                                    ChatCache *chats, MessageTail *tail);
+void subscriptions_destroy(Subscriptions *subs);
+
+// Registers conn and links the subscription into *owned, the connection's own list (NULL at
+// first). Returns its id, or -1 when the registry is full or *owned was already dropped.
+int subscriptions_add(Subscriptions *subs, void *conn, Subscription **owned, const SubscriptionRequest *request);
+
+// Ends every subscription in *owned; later adds to the same list fail
+void subscriptions_drop(Subscriptions *subs, Subscription **owned);
+
+// Called after count new messages for chat_id were committed (and the tail refreshed)
+void subscriptions_publish(Subscriptions *subs, StorageSession *store, int chat_id, int count);
+
+void subscriptions_stats(Subscriptions *subs, SubscriptionsStats *stats);
+
+#endif
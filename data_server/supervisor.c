@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include "supervisor.h"
+#include "message_log.h"
+#include "metrics.h"
+#include "../lib/env/env.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// What a worker last reported, in memory shared with the supervisor
+typedef struct {
+    int alive;  // set by the worker's reports, cleared when the supervisor reaps it
+    HeartbeatLoad load;
+} WorkerSlot;
+
+typedef struct {
+    pid_t pid;
+    time_t started;
+} Worker;
+
+typedef struct {
+    int index;
+    HeartbeatSource source;
+} Reporter;
+
+static WorkerSlot *slots;
+static int slot_count;
+static volatile sig_atomic_t stopping;
+
+void supervisor_config_from_env(SupervisorConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->processes = 1;
+
+    const char *value = getenv("SERVER_PROCESSES");
+    if (!value || !*value) return;
+
+    if (strcmp(value, "auto") == 0) {
+        cpu_set_t cpus;
+        config->processes = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus)
+                                                                            : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    } else if (atoi(value) > 0) {
+        config->processes = atoi(value);
+    } else {
+        fprintf(stderr, "Invalid SERVER_PROCESSES \"%s\", running a single process\n", value);
+    }
+
+    if (config->processes < 1) config->processes = 1;
+    if (config->processes > SUPERVISOR_MAX_PROCESSES) config->processes = SUPERVISOR_MAX_PROCESSES;
+}
+
+// Settings every worker needs before it opens anything
+static int prepare_env(void) {
+    const char *engine = getenv("STORAGE_ENGINE");
+    if (engine && strcmp(engine, "memory") == 0) {
+        fprintf(stderr, "STORAGE_ENGINE=memory keeps its data inside one process and can't be shared by several\n");
+        return -1;
+    }
+
+    // These are kept current by the writes of their own process only: another worker would go
+    // on serving memberships and message pages that changed, and a push only reaches
+    // subscribers connected to the worker that committed
+    static const char *const process_local[] = { "CHAT_CACHE_SIZE", "MESSAGE_TAIL_SIZE", "SUBSCRIPTIONS_MAX" };
+    for (size_t i = 0; i < sizeof(process_local) / sizeof(process_local[0]); i++) {
+        setenv(process_local[i], "0", 1);
+    }
+    printf("Chat cache, message tail and SUBSCRIBE are off with several processes\n");
+    return 0;
+}
+
+// A log and a metrics port of its own, the same ones again when the worker is restarted
+static void worker_env(int index) {
+    char value[PATH_MAX];
+
+    const char *path = getenv("MESSAGE_LOG_PATH");
+    snprintf(value, sizeof(value), "%s.%d", path && *path ? path : MESSAGE_LOG_DEFAULT_PATH, index);
+    setenv("MESSAGE_LOG_PATH", value, 1);
+
+    int metrics_port = env_int("METRICS_PORT", METRICS_DEFAULT_PORT, true);
+    if (metrics_port > 0) {
+        snprintf(value, sizeof(value), "%d", metrics_port + index);
+        setenv("METRICS_PORT", value, 1);
+    }
+}
+
+// The index-th CPU the supervisor may run on, wrapping around when there are more workers than CPUs.
+// Threads started later inherit it, so the worker's whole pool stays on that core.
+static void pin_to_cpu(int index, const cpu_set_t *allowed) {
+    int count = CPU_COUNT(allowed), seen = 0;
+    if (count == 0) return;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, allowed) || seen++ != index % count) continue;
+
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) != 0) perror("sched_setaffinity");
+        else printf("Worker %d (pid %d) pinned to CPU %d\n", index, (int)getpid(), cpu);
+        return;
+    }
+}
+
+// 0 in the new worker, its pid in the supervisor
+static pid_t start_worker(int index, Worker *worker, const cpu_set_t *allowed) {
+    // Or whatever is still buffered would be written again by the worker
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        worker->pid = pid;
+        worker->started = time(NULL);
+        return pid;
+    }
+
+    // Workers don't outlive a supervisor that was killed outright
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    pin_to_cpu(index, allowed);
+    worker_env(index);
+    return 0;
+}
+
+// The workers' reports added up: requests in flight and queued add, the p99 is the worst one
+// and utilization the average, with a worker that is being restarted counted as fully busy
+static void supervisor_load(void *ctx, HeartbeatLoad *load) {
+    int utilization = 0;
+    (void)ctx;
+
+    for (int i = 0; i < slot_count; i++) {
+        WorkerSlot *slot = &slots[i];
+        if (!__atomic_load_n(&slot->alive, __ATOMIC_ACQUIRE)) {
+            utilization += 100;
+            continue;
+        }
+
+        load->in_flight += __atomic_load_n(&slot->load.in_flight, __ATOMIC_RELAXED);
+        load->queue_depth += __atomic_load_n(&slot->load.queue_depth, __ATOMIC_RELAXED);
+        utilization += __atomic_load_n(&slot->load.utilization, __ATOMIC_RELAXED);
+
+        unsigned long p99 = __atomic_load_n(&slot->load.p99_us, __ATOMIC_RELAXED);
+        if (p99 > load->p99_us) load->p99_us = p99;
+    }
+    load->utilization = slot_count > 0 ? utilization / slot_count : 0;
+}
+
+static void on_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+int supervisor_run(const SupervisorConfig *config) {
+    static Worker workers[SUPERVISOR_MAX_PROCESSES];
+    static HeartbeatSource heartbeat = { supervisor_load, NULL };
+
+    if (prepare_env() != 0) return -1;
+
+    slot_count = config->processes;
+    slots = mmap(NULL, slot_count * sizeof(WorkerSlot), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) CPU_ZERO(&allowed);
+
+    // No SA_RESTART, so a stop interrupts waitpid
+    struct sigaction stop = { .sa_handler = on_stop };
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+    for (int i = 0; i < slot_count; i++) {
+        pid_t pid = start_worker(i, &workers[i], &allowed);
+        if (pid == 0) return i;
+        if (pid < 0) {
+            perror("fork");
+            for (int j = 0; j < i; j++) kill(workers[j].pid, SIGTERM);
+            return -1;
+        }
+    }
+    printf("Supervisor %d started %d workers\n", (int)getpid(), slot_count);
+
+    pthread_t udp_thread;
+    if (pthread_create(&udp_thread, NULL, udp_daemon, &heartbeat) != 0) {
+        perror("No se pudo crear el hilo del daemon UDP");
+    }
+
+    while (!stopping) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("waitpid");
+            break;
+        }
+
+        int index = -1;
+        for (int i = 0; i < slot_count; i++) {
+            if (workers[i].pid == pid) index = i;
+        }
+        if (index < 0) continue;
+
+        __atomic_store_n(&slots[index].alive, 0, __ATOMIC_RELEASE);
+        if (WIFSIGNALED(status)) fprintf(stderr, "Worker %d (pid %d) killed by signal %d\n", index, (int)pid, WTERMSIG(status));
+        else fprintf(stderr, "Worker %d (pid %d) exited with status %d\n", index, (int)pid, WEXITSTATUS(status));
+
+        // One that can't get through its startup would otherwise be restarted in a tight loop
+        if (time(NULL) - workers[index].started < SUPERVISOR_RESTART_DELAY) sleep(SUPERVISOR_RESTART_DELAY);
+
+        while (!stopping) {
+            pid = start_worker(index, &workers[index], &allowed);
+            if (pid == 0) return index;
+            if (pid > 0) break;
+
+            perror("fork");
+            sleep(SUPERVISOR_RESTART_DELAY);
+        }
+    }
+
+    printf("Supervisor stopping %d workers\n", slot_count);
+    for (int i = 0; i < slot_count; i++) {
+        if (workers[i].pid > 0) kill(workers[i].pid, SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+    exit(0);
+}
+
+static void *report_loop(void *arg) {
+    Reporter *reporter = arg;
+    WorkerSlot *slot = &slots[reporter->index];
+
+    while (1) {
+        HeartbeatLoad load = {0};
+        reporter->source.load(reporter->source.ctx, &load);
+
+        __atomic_store_n(&slot->load.in_flight, load.in_flight, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->load.utilization, load.utilization, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->load.queue_depth, load.queue_depth, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->load.p99_us, load.p99_us, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->alive, 1, __ATOMIC_RELEASE);
+
+        sleep(UDP_HEARTBEAT_INTERVAL);
+    }
+    return NULL;
+}
+
+int supervisor_report(int index, const HeartbeatSource *source) {
+    static Reporter reporter;
+    pthread_t thread;
+
+    if (!slots || index < 0 || index >= slot_count) return -1;
+
+    reporter.index = index;
+    reporter.source = *source;
+    if (pthread_create(&thread, NULL, report_loop, &reporter) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include "heartbeat_manager.h"
+
+#define SUPERVISOR_MAX_PROCESSES 256
+#define SUPERVISOR_RESTART_DELAY 1  // seconds before restarting a worker that died right after starting
+
+// Multi-process mode. The supervisor forks SERVER_PROCESSES workers; each one binds its own
+// SO_REUSEPORT listener, pins itself to a CPU and opens its own storage (and so its own MySQL
+// pool), and the kernel spreads new connections across their listeners. Nothing is shared
+// between workers but the database: caches that only see their own process's writes are
+// turned off, each worker keeps its own message log and metrics port, and a worker that dies
+// is started again under the same index, so it replays the log it left behind. The supervisor
+// sends the heartbeats, carrying the workers' load added up.
+typedef struct {
+    int processes;  // SERVER_PROCESSES: a count or "auto" for one per CPU; 1 runs without a supervisor
+} SupervisorConfig;
+
+void supervisor_config_from_env(SupervisorConfig *config);
+
+// Forks the workers and supervises them from then on. Returns only in a worker, with its
+// index, or -1 when the workers could not be started.
+int supervisor_run(const SupervisorConfig *config);
+
+// Called in a worker: samples source once per heartbeat interval on a thread of its own and
+// hands the figures to the supervisor
+int supervisor_report(int index, const HeartbeatSource *source);
+
+#endif
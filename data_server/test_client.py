@@ -1,19 +1,29 @@
 import socket
+import struct
 import json
 import time
 
 SERVER_IP = '127.0.0.1'
 SERVER_PORT = 5001
-BUFFER_SIZE = 4096
 
-def send_request(request_data):
+def recv_exact(s, size):
+    data = b''
+    while len(data) < size:
+        chunk = s.recv(size - len(data))
+        if not chunk:
+            raise ConnectionError("server closed the connection")
+        data += chunk
+    return data
+
+def send_request(s, request_data):
+    # Every message is a 4-byte big-endian length followed by the JSON payload
     try:
-        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
-            s.connect((SERVER_IP, SERVER_PORT))
-            s.sendall(json.dumps(request_data).encode())
-            response = s.recv(BUFFER_SIZE)
-            print(f"→ Request: {request_data}")
-            print(f"← Response: {json.loads(response.decode())}\n")
+        payload = json.dumps(request_data).encode()
+        s.sendall(struct.pack('>I', len(payload)) + payload)
+        length, = struct.unpack('>I', recv_exact(s, 4))
+        response = recv_exact(s, length)
+        print(f"→ Request: {request_data}")
+        print(f"← Response: {json.loads(response.decode())}\n")
     except Exception as e:
         print(f"Error: {e}\n")
 
@@ -66,11 +76,22 @@ if __name__ == "__main__":
             "content": "Hello again",
             "message_type": "text"
         },
+        {
+            "action": 7,
+            "user_id": 1,
+            "limit": 1
+        },
         {
             "action": 8,
             "chat_id": 2,
             "last_update_timestamp": None
         },
+        {
+            "action": 8,
+            "chat_id": 2,
+            "before_message_id": 3,
+            "limit": 2
+        },
         {
             "action": 9,
             "chat_id": 2,
@@ -90,8 +111,26 @@ if __name__ == "__main__":
             "action": 9,
             "chat_id": 2,
         },
+        # A transactional batch that fails takes back the user it created, even one it looked up:
+        # expect 400 for the batch and 400 for the lookup after it
+        {
+            "action": 14,
+            "transaction": True,
+            "requests": [
+                {"action": 2, "username": "user4", "email": "user4@example.com", "password": "pass4"},
+                {"action": 3, "key": "user4"},
+                {"action": 9, "chat_id": "$6.chat_id"}
+            ]
+        },
+        {
+            "action": 3,
+            "key": "user4"
+        },
     ]
 
-    for request in test_cases:
-        send_request(request)
-        time.sleep(0.5)  # Optional: avoid overloading server
+    # One persistent connection carries every request
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.connect((SERVER_IP, SERVER_PORT))
+        for request in test_cases:
+            send_request(s, request)
+            time.sleep(0.5)  # Optional: avoid overloading server
@@ -0,0 +1,190 @@
+#include "user_cache.h"
+#include "lru_map.h"
+#include "../lib/env/env.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    LruNode node;
+    char key[USER_CACHE_FIELD];
+    CachedUser user;
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    LruMap map;
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+} CacheShard;
+
+struct UserCache {
+    CacheShard shards[USER_CACHE_SHARDS];
+};
+
+void user_cache_config_from_env(UserCacheConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->capacity = env_int("USER_CACHE_SIZE", USER_CACHE_DEFAULT_CAPACITY, true);
+}
+
+static uint64_t hash_key(const char *key) {
+    uint64_t hash = 14695981039346656037ull;
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// The high half of the hash picks the shard, the low bits the bucket inside it
+static CacheShard *shard_for(UserCache *cache, uint64_t hash) {
+    return &cache->shards[(hash >> 32) % USER_CACHE_SHARDS];
+}
+
+static int key_matches(const LruNode *node, const void *key) {
+    return strcmp(((const CacheEntry *)node)->key, key) == 0;
+}
+
+static CacheEntry *shard_find(CacheShard *shard, uint64_t hash, const char *key) {
+    return (CacheEntry *)lru_map_find(&shard->map, hash, key_matches, key);
+}
+
+static void entry_free(LruNode *node) {
+    free(node);
+}
+
+UserCache *user_cache_create(const UserCacheConfig *config) {
+    if (config->capacity <= 0) {
+        printf("User cache disabled\n");
+        return NULL;
+    }
+
+    UserCache *cache = calloc(1, sizeof(UserCache));
+    if (!cache) return NULL;
+
+    int shard_capacity = (config->capacity + USER_CACHE_SHARDS - 1) / USER_CACHE_SHARDS;
+
+    for (int i = 0; i < USER_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+
+        if (lru_map_init(&shard->map, shard_capacity) != 0) {
+            user_cache_destroy(cache);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    printf("User cache ready: %d keys in %d shards\n", shard_capacity * USER_CACHE_SHARDS, USER_CACHE_SHARDS);
+    return cache;
+}
+
+void user_cache_destroy(UserCache *cache) {
+    if (!cache) return;
+
+    for (int i = 0; i < USER_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+        if (!shard->map.buckets) continue;
+
+        lru_map_destroy(&shard->map, entry_free);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+int user_cache_get(UserCache *cache, const char *key, CachedUser *user) {
+    if (!cache || !key) return 0;
+
+    uint64_t hash = hash_key(key);
+    CacheShard *shard = shard_for(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = shard_find(shard, hash, key);
+    if (entry) {
+        lru_map_touch(&shard->map, &entry->node);
+        *user = entry->user;
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return entry != NULL;
+}
+
+static void cache_put_key(UserCache *cache, const char *key, const CachedUser *user) {
+    // Longer keys could only be stored truncated and would then match the wrong lookups
+    if (!*key || strlen(key) >= USER_CACHE_FIELD) return;
+
+    uint64_t hash = hash_key(key);
+    CacheShard *shard = shard_for(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = shard_find(shard, hash, key);
+
+    if (entry) {
+        lru_map_touch(&shard->map, &entry->node);
+    } else if ((entry = malloc(sizeof(CacheEntry)))) {
+        strcpy(entry->key, key);
+        LruNode *evicted = lru_map_insert(&shard->map, &entry->node, hash);
+        if (evicted) {
+            free(evicted);
+            shard->evictions++;
+        }
+    }
+
+    if (entry) entry->user = *user;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void user_cache_put(UserCache *cache, const CachedUser *user) {
+    if (!cache) return;
+
+    cache_put_key(cache, user->username, user);
+    if (strcmp(user->email, user->username) != 0) {
+        cache_put_key(cache, user->email, user);
+    }
+}
+
+static void cache_invalidate_key(UserCache *cache, const char *key) {
+    if (!key) return;
+
+    uint64_t hash = hash_key(key);
+    CacheShard *shard = shard_for(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = shard_find(shard, hash, key);
+    if (entry) {
+        lru_map_remove(&shard->map, &entry->node);
+        free(entry);
+        shard->invalidations++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void user_cache_invalidate(UserCache *cache, const char *username, const char *email) {
+    if (!cache) return;
+
+    cache_invalidate_key(cache, username);
+    cache_invalidate_key(cache, email);
+}
+
+void user_cache_stats(UserCache *cache, UserCacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!cache) return;
+
+    for (int i = 0; i < USER_CACHE_SHARDS; i++) {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        stats->entries += shard->map.count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+
+#define USER_CACHE_DEFAULT_CAPACITY 65536
+#define USER_CACHE_SHARDS 16
+#define USER_CACHE_FIELD 256
+#define USER_CACHE_HASH 65
+
+// Login lookups (VALIDATE_USER then GET_USER_INFO) served from memory. Every user is
+// cached under both its username and its email, so either key hits. Entries are spread
+// over USER_CACHE_SHARDS shards by key, each with its own lock and LRU order.
+typedef struct {
+    int capacity;  // USER_CACHE_SIZE: most cached keys, 0 disables the cache
+} UserCacheConfig;
+
+typedef struct {
+    int id;
+    char username[USER_CACHE_FIELD];
+    char email[USER_CACHE_FIELD];
+    char password_hash[USER_CACHE_HASH];
+} CachedUser;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+    unsigned long entries;
+} UserCacheStats;
+
+typedef struct UserCache UserCache;
+
+void user_cache_config_from_env(UserCacheConfig *config);
+
+// NULL when the cache is disabled; every function below treats NULL as an always-missing cache
+UserCache *user_cache_create(const UserCacheConfig *config);
+void user_cache_destroy(UserCache *cache);
+
+// Returns 1 and fills user on a hit, 0 on a miss
+int user_cache_get(UserCache *cache, const char *key, CachedUser *user);
+
+// Caches user under its username and its email
+void user_cache_put(UserCache *cache, const CachedUser *user);
+
+// Drops whatever is cached under these keys, e.g. before a new user claims them
+void user_cache_invalidate(UserCache *cache, const char *username, const char *email);
+
+void user_cache_stats(UserCache *cache, UserCacheStats *stats);
+
+#endif
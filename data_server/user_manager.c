@@ -1,85 +1,105 @@
 #include "user_manager.h"
+#include "../dbg.h"
 
-int create_user(MYSQL *conn, User *newUser) {
-    char query[512];
+#define MAX_KEY_FIELD 256
 
-    snprintf(query, sizeof(query),
-        "INSERT INTO users (username, email, password_hash) VALUES ('%s', '%s', '%s')",
-        newUser->username, newUser->email, newUser->hash_password);
+int create_user(DbConn *conn, User *newUser) {
+    DbBinds params = {0};
 
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Create user failed: %s\n", mysql_error(conn));
+    db_bind_string(&params, newUser->username);
+    db_bind_string(&params, newUser->email);
+    db_bind_string(&params, newUser->hash_password);
+
+    if (db_stmt_execute(conn->stmts[STMT_CREATE_USER], &params, NULL)) {
+        fprintf(stderr, "Create user failed\n");
         return -1;
     }
 
-    printf("User created successfully.\n");
+    newUser->id = (int)mysql_stmt_insert_id(conn->stmts[STMT_CREATE_USER]);
+    debug("User created successfully.");
     return 0;
 }
 
-int validate_user(MYSQL *conn, char *key, char *password_hash) {
-    char query[512];
-    MYSQL_RES *res;
-    MYSQL_ROW row;
+int copy_user(DbConn *conn, const User *user) {
+    DbBinds params = {0};
+    int user_id = user->id;
 
-    snprintf(query, sizeof(query),
-        "SELECT password_hash, user_id FROM users WHERE username = '%s' OR email = '%s'", key, key);
+    db_bind_int(&params, &user_id);
+    db_bind_string(&params, user->username);
+    db_bind_string(&params, user->email);
 
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Validate user query failed: %s\n", mysql_error(conn));
+    if (db_stmt_execute(conn->stmts[STMT_COPY_USER], &params, NULL)) {
+        fprintf(stderr, "Copy of user %d failed\n", user->id);
         return -1;
     }
+    return 0;
+}
+
+int validate_user(DbConn *conn, char *key, char *password_hash) {
+    MYSQL_STMT *stmt = conn->stmts[STMT_VALIDATE_USER];
+    DbBinds params = {0};
+    DbBinds row = {0};
+    char hash[65];
+    int user_id = 0;
+
+    db_bind_string(&params, key);
+    db_bind_string(&params, key);
+    db_bind_buffer(&row, hash, sizeof(hash));
+    db_bind_int(&row, &user_id);
 
-    res = mysql_store_result(conn);
-    if (!res) {
-        fprintf(stderr, "mysql_store_result() failed: %s\n", mysql_error(conn));
+    if (db_stmt_execute(stmt, &params, &row)) {
+        fprintf(stderr, "Validate user query failed\n");
         return -1;
     }
 
-    row = mysql_fetch_row(res);
-    if (row && row[0] && atoi(row[1]) != 1) {
-        strncpy(password_hash, row[0], 64);
-        password_hash[64] = '\0'; // Ensure null termination
-        printf("User found\npss: {%s}\n", password_hash);
-        mysql_free_result(res);
+    int found = db_stmt_fetch(stmt, &row) == 1 && !db_bind_is_null(&row, 0) && user_id != 1;
+    db_stmt_finish(stmt);
+
+    if (found) {
+        strcpy(password_hash, hash);
+        debug("User found");
         return 0;
-    } else {
-        printf("User not found\n");
     }
 
-    mysql_free_result(res);
+    debug("User not found");
     return -1;
 }
 
-int get_user_info(MYSQL *conn, char *key, User *user) {
-    char query[512];
-    MYSQL_RES *res;
-    MYSQL_ROW row;
+int get_user_info(DbConn *conn, char *key, User *user) {
+    MYSQL_STMT *stmt = conn->stmts[STMT_GET_USER_INFO];
+    DbBinds params = {0};
+    DbBinds row = {0};
+    char username[MAX_KEY_FIELD];
+    char email[MAX_KEY_FIELD];
+    char hash[65];
+    int user_id = 0;
 
-    snprintf(query, sizeof(query),
-        "SELECT username, email, user_id FROM users WHERE username = '%s' OR email = '%s'", key, key);
+    db_bind_string(&params, key);
+    db_bind_string(&params, key);
+    db_bind_buffer(&row, username, sizeof(username));
+    db_bind_buffer(&row, email, sizeof(email));
+    db_bind_int(&row, &user_id);
+    db_bind_buffer(&row, hash, sizeof(hash));
 
-    if (mysql_query(conn, query)) {
-        fprintf(stderr, "Validate user query failed: %s\n", mysql_error(conn));
+    if (db_stmt_execute(stmt, &params, &row)) {
+        fprintf(stderr, "Validate user query failed\n");
         return -1;
     }
 
-    res = mysql_store_result(conn);
-    if (!res) {
-        fprintf(stderr, "mysql_store_result() failed: %s\n", mysql_error(conn));
-        return -1;
-    }
+    int found = db_stmt_fetch(stmt, &row) == 1 &&
+                !db_bind_is_null(&row, 0) && !db_bind_is_null(&row, 1) && !db_bind_is_null(&row, 2) &&
+                !db_bind_is_null(&row, 3);
+    db_stmt_finish(stmt);
+
+    if (found) {
+		user->username = request_strdup(username);
+		user->email = request_strdup(email);
+		user->hash_password = request_strdup(hash);
+		user->id = user_id;
 
-    row = mysql_fetch_row(res);
-    if (row && row[0] && row[1] && row[2]) {
-		user->username = strdup(row[0]);
-		user->email = strdup(row[1]);
-		user->id = atoi(row[2]);
-		
-        mysql_free_result(res);
         return 0;
     } else {
-        printf("User not found\n");
-        mysql_free_result(res);
+        debug("User not found");
         return -1;
     }
 }
@@ -1,12 +1,16 @@
 #ifndef USER_MANAGER_H
 #define USER_MANAGER_H
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <mysql/mysql.h>
 #include <stdbool.h>
+#include "db_pool.h"
+#include "arena.h"
 
+// Strings filled in by the managers come from request_strdup: freed with the request arena
+// when called from a request, by request_free otherwise
 typedef struct {
 	char* username;
 	char* email;
@@ -15,13 +19,16 @@ typedef struct {
 	int is_admin;
 } User;
 
-int create_user(MYSQL *db_connection, User *newUser);
-int validate_user(MYSQL *db_connection, char *key, char *password_hash);
-int get_user_info(MYSQL *db_connection, char *key, User *user);
-int is_user_admin(MYSQL *conn, int chat_id, int user_id);
-int remove_from_chat(MYSQL *conn, int chat_id, int user_id);
-int is_group_chat(MYSQL *conn, int chat_id);
-int remove_from_chat(MYSQL *conn, int chat_id, int user_id);
+// Sets newUser->id
+int create_user(DbConn *conn, User *newUser);
+// Writes the user's id, username and email into another database's users table
+int copy_user(DbConn *conn, const User *user);
+int validate_user(DbConn *conn, char *key, char *password_hash);
+int get_user_info(DbConn *conn, char *key, User *user);
+int is_user_admin(DbConn *conn, int chat_id, int user_id);
+int remove_from_chat(DbConn *conn, int chat_id, int user_id);
+int is_group_chat(DbConn *conn, int chat_id);
+int remove_from_chat(DbConn *conn, int chat_id, int user_id);
 
 #endif
 
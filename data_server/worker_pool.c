@@ -0,0 +1,138 @@
+#include "worker_pool.h"
+#include <mysql/mysql.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+struct WorkerPool {
+    queue *jobs;
+    size_t job_size;
+    size_t capacity;
+    WorkerHandler handler;
+    void *arg;
+
+    int thread_count;
+    pthread_t *threads;
+    WorkerPoolStats stats;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+
+    int room_fd;
+    int refused;  // a try_submit found the queue full and room_fd hasn't been signalled since
+};
+
+static void *worker_main(void *data) {
+    WorkerPool *pool = data;
+    void *job = malloc(pool->job_size);
+
+    // Every thread that talks to MySQL has to register with the client library
+    mysql_thread_init();
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (isEmpty(pool->jobs)) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        dequeue(pool->jobs, job);
+        pool->stats.busy++;
+        if (pool->refused) {
+            uint64_t one = 1;
+            pool->refused = 0;
+            if (write(pool->room_fd, &one, sizeof(one)) < 0) perror("write room_fd");
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->handler(job, pool->arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.busy--;
+        pool->stats.completed++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    mysql_thread_end();
+    free(job);
+    return NULL;
+}
+
+WorkerPool *worker_pool_create(int threads, size_t capacity, size_t job_size, WorkerHandler handler, void *arg) {
+    WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+    if (!pool) return NULL;
+
+    pool->jobs = createQueue(job_size);
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    pool->room_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!pool->jobs || !pool->threads || pool->room_fd < 0) {
+        if (pool->room_fd >= 0) close(pool->room_fd);
+        destroyQueue(&pool->jobs);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    pool->job_size = job_size;
+    pool->capacity = capacity;
+    pool->handler = handler;
+    pool->arg = arg;
+    pool->stats.capacity = capacity;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            perror("pthread_create worker");
+            break;
+        }
+        pthread_detach(pool->threads[i]);
+        pool->thread_count++;
+    }
+
+    if (pool->thread_count == 0) {
+        fprintf(stderr, "No worker threads could be started\n");
+        pthread_cond_destroy(&pool->not_empty);
+        pthread_mutex_destroy(&pool->lock);
+        close(pool->room_fd);
+        destroyQueue(&pool->jobs);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    pool->stats.threads = pool->thread_count;
+    printf("Worker pool ready: %d threads, queue capacity %zu\n", pool->thread_count, capacity);
+    return pool;
+}
+
+int worker_pool_try_submit(WorkerPool *pool, void *job) {
+    pthread_mutex_lock(&pool->lock);
+    if (getSize(pool->jobs) >= pool->capacity) {
+        pool->stats.full_waits++;
+        pool->refused = 1;
+        pthread_mutex_unlock(&pool->lock);
+        return 1;
+    }
+
+    if (!enqueue(pool->jobs, job)) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int worker_pool_room_fd(WorkerPool *pool) {
+    return pool->room_fd;
+}
+
+void worker_pool_stats(WorkerPool *pool, WorkerPoolStats *stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->queued = getSize(pool->jobs);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,31 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "../lib/queue/queue.h"
+
+#define WORKER_POOL_DEFAULT_THREADS 16
+#define WORKER_POOL_DEFAULT_CAPACITY 1024
+
+typedef void (*WorkerHandler)(void *job, void *arg);
+
+typedef struct {
+    int threads;
+    int busy;
+    size_t queued;
+    size_t capacity;
+    unsigned long completed;
+    unsigned long full_waits;   // submissions that found the queue full
+} WorkerPoolStats;
+
+typedef struct WorkerPool WorkerPool;
+
+WorkerPool *worker_pool_create(int threads, size_t capacity, size_t job_size, WorkerHandler handler, void *arg);
+// Never blocks: 0 when queued, 1 when the queue is full, -1 on error
+int worker_pool_try_submit(WorkerPool *pool, void *job);
+// An eventfd that becomes readable once a worker has taken a job after a try_submit was refused
+int worker_pool_room_fd(WorkerPool *pool);
+void worker_pool_stats(WorkerPool *pool, WorkerPoolStats *stats);
+
+#endif
@@ -4,31 +4,36 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include "lib/log/log.h"
+
+// Every macro below queues its line for the asynchronous writer in lib/log;
+// LOG_LEVEL, LOG_RATE and LOG_SYNC control what reaches stderr and when.
 
 #ifdef NDEBUG
 #define debug(M, ...)
 #else
 #define debug(M, ...)                                                          \
-  fprintf(stderr, "🪲 [DEBUG] (%s:%d): " M "\n", __FILE__, __LINE__,             \
-          ##__VA_ARGS__)
+  LOG_AT(LOG_DEBUG, "🪲 [DEBUG] (%s:%d): " M "\n", __FILE__, __LINE__,          \
+         ##__VA_ARGS__)
 #endif
 
 #define clean_errno() (errno == 0 ? "None" : strerror(errno))
 
 #define log_err(M, ...)                                                        \
-  fprintf(stderr, "❌ [ERROR] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, \
-          clean_errno(), ##__VA_ARGS__)
+  LOG_AT(LOG_ERROR, "❌ [ERROR] (%s:%d: errno: %s) " M "\n", __FILE__,        \
+         __LINE__, clean_errno(), ##__VA_ARGS__)
 
 #define log_warn(M, ...)                                                       \
-  fprintf(stderr, "⚠️ [WARN] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__,   \
-          clean_errno(), ##__VA_ARGS__)
+  LOG_AT(LOG_WARN, "⚠️ [WARN] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, \
+         clean_errno(), ##__VA_ARGS__)
 
 #define log_info(M, ...)                                                       \
-  fprintf(stderr, "ℹ️ [INFO] (%s:%d) " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+  LOG_AT(LOG_INFO, "ℹ️ [INFO] (%s:%d) " M "\n", __FILE__, __LINE__,            \
+         ##__VA_ARGS__)
 
 #define log_success(M, ...)                                                    \
-  fprintf(stderr, "✅ [SUCCESS] (%s:%d) " M "\n", __FILE__, __LINE__,          \
-          ##__VA_ARGS__)
+  LOG_AT(LOG_INFO, "✅ [SUCCESS] (%s:%d) " M "\n", __FILE__, __LINE__,        \
+         ##__VA_ARGS__)
 
 #define check(A, M, ...)                                                       \
   if (!(A)) {                                                                  \
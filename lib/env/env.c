@@ -0,0 +1,20 @@
+#include "env.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int env_int(const char *name, int fallback, bool allow_zero) {
+  const char *value = getenv(name);
+  if (!value || !*value) return fallback;
+
+  char *end;
+  errno = 0;
+  long parsed = strtol(value, &end, 10);
+
+  if (errno != 0 || *end != '\0' || parsed < 0 || parsed > INT_MAX || (parsed == 0 && !allow_zero)) {
+    fprintf(stderr, "Ignoring %s=\"%s\", using %d\n", name, value, fallback);
+    return fallback;
+  }
+  return (int)parsed;
+}
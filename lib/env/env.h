@@ -0,0 +1,31 @@
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Integer settings read from the environment. Every module reads its knobs
+ * through here, so they all treat unset, malformed and out of range values
+ * the same way: the default is used, with a warning for a value that was set.
+ */
+
+/**
+ * @brief Read a non-negative integer setting
+ * @param name Environment variable
+ * @param fallback Returned when the variable is unset, empty, not a number,
+ * negative, or 0 without allow_zero
+ * @param allow_zero Whether 0 is a value of its own (usually "off") rather
+ * than a request for the default
+ * @return The setting
+ */
+int env_int(const char *name, int fallback, bool allow_zero);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ENV_H
@@ -0,0 +1,173 @@
+#include "frame.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define FRAME_READ_CHUNK 16384
+
+void frame_buffer_init(FrameBuffer *fb) {
+  fb->data = NULL;
+  fb->start = fb->len = fb->cap = 0;
+}
+
+void frame_buffer_free(FrameBuffer *fb) {
+  free(fb->data);
+  frame_buffer_init(fb);
+}
+
+// Makes room for `extra` more bytes, first by sliding consumed bytes out of the way
+static int frame_buffer_reserve(FrameBuffer *fb, size_t extra) {
+  if (fb->start > 0 && fb->start + fb->len + extra > fb->cap) {
+    memmove(fb->data, fb->data + fb->start, fb->len);
+    fb->start = 0;
+  }
+
+  if (fb->len + extra <= fb->cap) {
+    return 0;
+  }
+
+  size_t cap = fb->cap ? fb->cap : FRAME_READ_CHUNK;
+  while (cap < fb->len + extra) {
+    cap *= 2;
+  }
+
+  char *data = realloc(fb->data, cap);
+  if (data == NULL) {
+    return -1;
+  }
+
+  fb->data = data;
+  fb->cap = cap;
+  return 0;
+}
+
+int frame_buffer_append(FrameBuffer *fb, const char *data, size_t len) {
+  if (frame_buffer_reserve(fb, len) != 0) {
+    return -1;
+  }
+
+  memcpy(fb->data + fb->start + fb->len, data, len);
+  fb->len += len;
+  return 0;
+}
+
+ssize_t frame_buffer_read(FrameBuffer *fb, int fd) {
+  if (frame_buffer_reserve(fb, FRAME_READ_CHUNK) != 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  ssize_t n = recv(fd, fb->data + fb->start + fb->len,
+                   fb->cap - fb->start - fb->len, 0);
+  if (n > 0) {
+    fb->len += n;
+  }
+  return n;
+}
+
+int frame_buffer_next(FrameBuffer *fb, const char **payload, uint32_t *len) {
+  if (fb->len < FRAME_HEADER_SIZE) {
+    return 0;
+  }
+
+  const unsigned char *header = (const unsigned char *)fb->data + fb->start;
+  uint32_t frame_len = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                       ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+
+  if (frame_len > FRAME_MAX_PAYLOAD) {
+    return -1;
+  }
+
+  if (fb->len < FRAME_HEADER_SIZE + (size_t)frame_len) {
+    return 0;
+  }
+
+  *payload = fb->data + fb->start + FRAME_HEADER_SIZE;
+  *len = frame_len;
+
+  fb->start += FRAME_HEADER_SIZE + frame_len;
+  fb->len -= FRAME_HEADER_SIZE + frame_len;
+  if (fb->len == 0) {
+    fb->start = 0;
+  }
+  return 1;
+}
+
+static int frame_wait_writable(int fd, int timeout_ms) {
+  struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+  int ret;
+  do {
+    ret = poll(&pfd, 1, timeout_ms);
+  } while (ret < 0 && errno == EINTR);
+  return ret > 0 ? 0 : -1;
+}
+
+#define FRAME_MAX_IOV 64
+
+// Sends every byte described by iov, polling for writability when the socket is full
+static int frame_writev_all(int fd, struct iovec *iov, int iovcnt, int timeout_ms) {
+  while (iovcnt > 0) {
+    struct msghdr msg = {.msg_iov = iov,
+                         .msg_iovlen = iovcnt < FRAME_MAX_IOV ? iovcnt : FRAME_MAX_IOV};
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+          frame_wait_writable(fd, timeout_ms) == 0) {
+        continue;
+      }
+      return -1;
+    }
+
+    while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+
+  return 0;
+}
+
+int frame_sendv(int fd, const struct iovec *iov, int iovcnt, int timeout_ms) {
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+
+  unsigned char header[FRAME_HEADER_SIZE] = {
+      (len >> 24) & 0xFF, (len >> 16) & 0xFF, (len >> 8) & 0xFF, len & 0xFF};
+
+  struct iovec stack_iov[FRAME_MAX_IOV];
+  struct iovec *all = stack_iov;
+  if (iovcnt + 1 > FRAME_MAX_IOV) {
+    all = malloc((iovcnt + 1) * sizeof(struct iovec));
+    if (all == NULL) {
+      return -1;
+    }
+  }
+
+  all[0].iov_base = header;
+  all[0].iov_len = FRAME_HEADER_SIZE;
+  memcpy(all + 1, iov, iovcnt * sizeof(struct iovec));
+
+  int status = frame_writev_all(fd, all, iovcnt + 1, timeout_ms);
+  if (all != stack_iov) {
+    free(all);
+  }
+  return status;
+}
+
+int frame_send(int fd, const char *payload, size_t len, int timeout_ms) {
+  struct iovec iov = {.iov_base = (void *)payload, .iov_len = len};
+  return frame_sendv(fd, &iov, 1, timeout_ms);
+}
@@ -0,0 +1,85 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Wire framing used between the logic and data servers: every message is a
+ * 4-byte big-endian payload length followed by the payload itself.
+ */
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+
+typedef struct {
+  char *data;
+  size_t start; // offset of the first unconsumed byte
+  size_t len;   // bytes buffered after start
+  size_t cap;
+} FrameBuffer;
+
+/**
+ * @brief Reset a reassembly buffer to the empty state
+ * @param fb The buffer
+ */
+void frame_buffer_init(FrameBuffer *fb);
+
+/**
+ * @brief Release the memory held by a reassembly buffer
+ * @param fb The buffer
+ */
+void frame_buffer_free(FrameBuffer *fb);
+
+/**
+ * @brief Append raw bytes received from the socket
+ * @return 0 on success, -1 when out of memory
+ */
+int frame_buffer_append(FrameBuffer *fb, const char *data, size_t len);
+
+/**
+ * @brief Read whatever is available on fd into the buffer
+ * @return bytes read, 0 on orderly shutdown, -1 on error (errno is kept,
+ * EAGAIN means nothing was available on a non-blocking socket)
+ */
+ssize_t frame_buffer_read(FrameBuffer *fb, int fd);
+
+/**
+ * @brief Pop the next complete frame
+ * The payload points inside the buffer and stays valid until the next call
+ * that modifies it.
+ * @param payload Set to the first payload byte
+ * @param len Set to the payload length
+ * @return 1 when a frame was popped, 0 if more bytes are needed, -1 when the
+ * announced length exceeds FRAME_MAX_PAYLOAD
+ */
+int frame_buffer_next(FrameBuffer *fb, const char **payload, uint32_t *len);
+
+/**
+ * @brief Send one frame whose payload is scattered over several buffers
+ * The header and every buffer go out with writev-style gathering, so the
+ * payload never has to be copied into one contiguous block.
+ * @param iov Payload pieces, in order
+ * @param iovcnt Number of pieces
+ * @return 0 on success, -1 on error
+ */
+int frame_sendv(int fd, const struct iovec *iov, int iovcnt, int timeout_ms);
+
+/**
+ * @brief Send one frame, retrying on partial writes
+ * Non-blocking sockets are polled for writability for up to timeout_ms.
+ * @return 0 on success, -1 on error
+ */
+int frame_send(int fd, const char *payload, size_t len, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAME_H
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include "log.h"
+#include "../env/env.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_OUT_SIZE 65536
+#define LOG_LINE_FULL (LOG_LINE_MAX + 64) // with timestamp and skipped count
+
+typedef struct {
+  struct timespec time;
+  uint32_t suppressed;
+  uint32_t len;
+  char text[LOG_LINE_MAX];
+} LogRecord;
+
+// Single producer (the owning thread), single consumer (whoever holds log_lock)
+typedef struct LogRing {
+  _Atomic uint32_t head; // next slot the owner fills
+  _Atomic uint32_t tail; // next slot to write out
+  _Atomic uint32_t dropped;
+  _Atomic int closed; // the owner exited; freed once drained
+  struct LogRing *next;
+  LogRecord slots[LOG_RING_SLOTS];
+} LogRing;
+
+int log_level = LOG_DEBUG;
+
+static int log_rate = 100;
+static int log_sample = 100;
+static int log_flush_ms = 20;
+static _Atomic int log_sync;
+
+// Guards the ring list and the writer's lifecycle; held while draining
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static LogRing *log_rings;
+static pthread_key_t log_key;
+static pthread_t log_writer;
+static _Atomic int log_writer_running;
+static int log_stopping;
+
+static __thread LogRing *log_ring;
+
+// Only touched with log_lock held
+static char log_out[LOG_OUT_SIZE];
+static size_t log_out_len;
+
+static void write_all(const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDERR_FILENO, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+static void out_flush(void) {
+  write_all(log_out, log_out_len);
+  log_out_len = 0;
+}
+
+static void out_append(const char *data, size_t len) {
+  if (log_out_len + len > LOG_OUT_SIZE) out_flush();
+  memcpy(log_out + log_out_len, data, len);
+  log_out_len += len;
+}
+
+// "HH:MM:SS.mmm text", with the skipped count ahead of the newline. dest holds LOG_LINE_FULL.
+static size_t format_line(char *dest, const struct timespec *time, uint32_t suppressed,
+                          const char *text, size_t len) {
+  struct tm tm;
+  localtime_r(&time->tv_sec, &tm);
+
+  size_t n = strftime(dest, LOG_LINE_FULL, "%H:%M:%S", &tm);
+  n += snprintf(dest + n, LOG_LINE_FULL - n, ".%03ld ", time->tv_nsec / 1000000);
+
+  if (len > 0 && text[len - 1] == '\n') len--;
+  memcpy(dest + n, text, len);
+  n += len;
+
+  if (suppressed > 0) {
+    n += snprintf(dest + n, LOG_LINE_FULL - n, " (+%u similar skipped)", suppressed);
+  }
+  dest[n++] = '\n';
+  return n;
+}
+
+// Writes out every ring and frees those whose thread is gone. Caller holds log_lock.
+static void drain_all(void) {
+  LogRing **link = &log_rings;
+
+  while (*link) {
+    LogRing *ring = *link;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+      LogRecord *record = &ring->slots[tail % LOG_RING_SLOTS];
+      char line[LOG_LINE_FULL];
+      out_append(line, format_line(line, &record->time, record->suppressed, record->text, record->len));
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    uint32_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+      char line[96];
+      int n = snprintf(line, sizeof(line), "[LOG] %u lines dropped, a thread outran the writer\n", dropped);
+      out_append(line, n);
+    }
+
+    if (atomic_load_explicit(&ring->closed, memory_order_acquire) &&
+        atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+      *link = ring->next;
+      free(ring);
+    } else {
+      link = &ring->next;
+    }
+  }
+
+  out_flush();
+}
+
+static void *writer_main(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&log_lock);
+  while (!log_stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)log_flush_ms * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    pthread_cond_timedwait(&log_wake, &log_lock, &deadline);
+    drain_all();
+  }
+  pthread_mutex_unlock(&log_lock);
+  return NULL;
+}
+
+// Started by the first line a process logs, and again in a forked child
+static void writer_start(void) {
+  pthread_mutex_lock(&log_lock);
+  if (!atomic_load(&log_writer_running) && !log_stopping) {
+    if (pthread_create(&log_writer, NULL, writer_main, NULL) == 0) {
+      atomic_store(&log_writer_running, 1);
+    } else {
+      atomic_store(&log_sync, 1);
+    }
+  }
+  pthread_mutex_unlock(&log_lock);
+}
+
+static void ring_release(void *ring) {
+  atomic_store_explicit(&((LogRing *)ring)->closed, 1, memory_order_release);
+}
+
+static LogRing *ring_for_thread(void) {
+  if (log_ring) return log_ring;
+
+  LogRing *ring = calloc(1, sizeof(LogRing));
+  if (!ring) return NULL;
+
+  pthread_mutex_lock(&log_lock);
+  ring->next = log_rings;
+  log_rings = ring;
+  pthread_mutex_unlock(&log_lock);
+
+  pthread_setspecific(log_key, ring);
+  log_ring = ring;
+  return ring;
+}
+
+// Over the call site's rate only every log_sample-th line gets through
+static int site_admit(LogSite *site, const struct timespec *now) {
+  if (log_rate <= 0) return 1;
+
+  uint64_t now_ms = (uint64_t)now->tv_sec * 1000 + now->tv_nsec / 1000000;
+  if (now_ms - site->window_start >= 1000) {
+    site->window_start = now_ms;
+    site->count = 0;
+  }
+
+  site->count++;
+  if (site->count <= (uint32_t)log_rate) return 1;
+  if (log_sample > 0 && (site->count - log_rate) % log_sample == 0) return 1;
+
+  site->suppressed++;
+  return 0;
+}
+
+void log_write(LogSite *site, const char *format, ...) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (!site_admit(site, &now)) return;
+
+  LogRing *ring = atomic_load_explicit(&log_sync, memory_order_relaxed) ? NULL : ring_for_thread();
+  va_list args;
+
+  if (!ring) {
+    char text[LOG_LINE_MAX], line[LOG_LINE_FULL];
+
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    size_t len = n < 0 ? 0 : (size_t)n < sizeof(text) ? (size_t)n : sizeof(text) - 1;
+    write_all(line, format_line(line, &now, site->suppressed, text, len));
+    site->suppressed = 0;
+    return;
+  }
+
+  if (!atomic_load_explicit(&log_writer_running, memory_order_relaxed)) writer_start();
+
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SLOTS) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  LogRecord *record = &ring->slots[head % LOG_RING_SLOTS];
+  va_start(args, format);
+  int n = vsnprintf(record->text, sizeof(record->text), format, args);
+  va_end(args);
+
+  record->len = n < 0 ? 0 : (size_t)n < sizeof(record->text) ? (uint32_t)n : sizeof(record->text) - 1;
+  record->time = now;
+  record->suppressed = site->suppressed;
+  site->suppressed = 0;
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void log_flush(void) {
+  pthread_mutex_lock(&log_lock);
+  drain_all();
+  pthread_mutex_unlock(&log_lock);
+}
+
+static void log_shutdown(void) {
+  pthread_mutex_lock(&log_lock);
+  log_stopping = 1;
+  pthread_cond_signal(&log_wake);
+  pthread_mutex_unlock(&log_lock);
+
+  if (atomic_exchange(&log_writer_running, 0)) pthread_join(log_writer, NULL);
+
+  // Whatever other threads log from here on goes straight out
+  atomic_store(&log_sync, 1);
+  log_flush();
+}
+
+static void fork_prepare(void) {
+  pthread_mutex_lock(&log_lock);
+}
+
+static void fork_parent(void) {
+  pthread_mutex_unlock(&log_lock);
+}
+
+// The parent still owns everything queued so far, and the writer didn't come along
+static void fork_child(void) {
+  for (LogRing *ring = log_rings; ring; ring = ring->next) {
+    atomic_store(&ring->tail, atomic_load(&ring->head));
+    atomic_store(&ring->dropped, 0);
+    if (ring != log_ring) atomic_store(&ring->closed, 1);
+  }
+
+  atomic_store(&log_writer_running, 0);
+  pthread_mutex_unlock(&log_lock);
+}
+
+__attribute__((constructor)) static void log_setup(void) {
+  static const char *names[] = {"debug", "info", "warn", "error", "off"};
+  const char *level = getenv("LOG_LEVEL");
+
+  for (int i = 0; level && i <= LOG_OFF; i++) {
+    if (strcasecmp(level, names[i]) == 0) log_level = i;
+  }
+
+  log_rate = env_int("LOG_RATE", log_rate, true);
+  log_sample = env_int("LOG_SAMPLE", log_sample, true);
+  log_flush_ms = env_int("LOG_FLUSH_MS", log_flush_ms, false);
+  if (log_flush_ms < 1) log_flush_ms = 1;
+  atomic_store(&log_sync, env_int("LOG_SYNC", 0, true) == 1);
+
+  if (pthread_key_create(&log_key, ring_release) != 0) atomic_store(&log_sync, 1);
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+  atexit(log_shutdown);
+}
@@ -0,0 +1,74 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Asynchronous logging behind the dbg.h macros. A call formats its line into
+ * the calling thread's ring buffer and returns; a background writer drains
+ * every ring and writes to stderr in batches, so logging costs no syscall on
+ * the request path. A full ring drops the line and the writer reports how
+ * many were lost. Lines keep their order within a thread and carry a
+ * timestamp, since threads are written out one ring at a time.
+ *
+ * Filtering happens twice: LOG_COMPILE_LEVEL removes calls below it at build
+ * time, LOG_LEVEL skips them at runtime. Each call site may then log LOG_RATE
+ * lines per second per thread; beyond that one line in LOG_SAMPLE gets through
+ * and carries the count of the ones skipped.
+ *
+ * Read once at startup:
+ *   LOG_LEVEL     debug, info, warn or error (default debug)
+ *   LOG_RATE      lines per second per call site and thread, 0 for no limit (default 100)
+ *   LOG_SAMPLE    one line kept out of this many over the rate, 0 keeps none (default 100)
+ *   LOG_FLUSH_MS  how often the writer drains the rings (default 20)
+ *   LOG_SYNC      1 writes every line straight to stderr from the caller
+ */
+
+enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF };
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_LINE_MAX 256
+#define LOG_RING_SLOTS 256
+
+// Rate limiting state of one call site in one thread
+typedef struct {
+  uint64_t window_start; // ms
+  uint32_t count;        // lines seen in the current window
+  uint32_t suppressed;   // skipped since the last line that got through
+} LogSite;
+
+extern int log_level;
+
+/**
+ * @brief Queue one formatted line for the writer
+ * @param site The call site's rate limiting state
+ * @param format printf format, normally ending in a newline
+ */
+void log_write(LogSite *site, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Write out everything queued so far, from the calling thread
+ */
+void log_flush(void);
+
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) >= LOG_COMPILE_LEVEL && (level) >= log_level) {                \
+      static __thread LogSite log_site_;                                       \
+      log_write(&log_site_, __VA_ARGS__);                                      \
+    }                                                                          \
+  } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,331 @@
+#include "wire.h"
+#include <string.h>
+#include <strings.h>
+
+#define WIRE_MAX_DEPTH 64
+
+WireEncoding wire_detect(const char *payload, size_t len) {
+  if (len == 0) return WIRE_JSON;
+
+  unsigned char first = (unsigned char)payload[0];
+  if ((first & 0xf0) == 0x80 || first == 0xde || first == 0xdf) return WIRE_MSGPACK;
+  return WIRE_JSON;
+}
+
+const char *wire_encoding_name(WireEncoding encoding) {
+  return encoding == WIRE_MSGPACK ? "msgpack" : "json";
+}
+
+int wire_encoding_parse(const char *name, WireEncoding *encoding) {
+  if (strcasecmp(name, "json") == 0) *encoding = WIRE_JSON;
+  else if (strcasecmp(name, "msgpack") == 0) *encoding = WIRE_MSGPACK;
+  else return -1;
+  return 0;
+}
+
+// --- packing ---------------------------------------------------------------
+
+static void put_be(unsigned char *out, uint64_t value, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    out[i] = (unsigned char)value;
+    value >>= 8;
+  }
+}
+
+static size_t pack_typed(unsigned char *out, unsigned char type, uint64_t value, int bytes) {
+  out[0] = type;
+  put_be(out + 1, value, bytes);
+  return 1 + bytes;
+}
+
+size_t wire_pack_int(unsigned char *out, long long value) {
+  if (value >= 0) {
+    if (value < 0x80) {
+      out[0] = (unsigned char)value;
+      return 1;
+    }
+    if (value <= 0xff) return pack_typed(out, 0xcc, value, 1);
+    if (value <= 0xffff) return pack_typed(out, 0xcd, value, 2);
+    if (value <= 0xffffffffLL) return pack_typed(out, 0xce, value, 4);
+    return pack_typed(out, 0xcf, value, 8);
+  }
+
+  if (value >= -32) {
+    out[0] = (unsigned char)(value & 0xff);
+    return 1;
+  }
+  if (value >= INT8_MIN) return pack_typed(out, 0xd0, (uint64_t)value, 1);
+  if (value >= INT16_MIN) return pack_typed(out, 0xd1, (uint64_t)value, 2);
+  if (value >= INT32_MIN) return pack_typed(out, 0xd2, (uint64_t)value, 4);
+  return pack_typed(out, 0xd3, (uint64_t)value, 8);
+}
+
+size_t wire_pack_double(unsigned char *out, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return pack_typed(out, 0xcb, bits, 8);
+}
+
+size_t wire_pack_bool(unsigned char *out, int value) {
+  out[0] = value ? 0xc3 : 0xc2;
+  return 1;
+}
+
+size_t wire_pack_nil(unsigned char *out) {
+  out[0] = 0xc0;
+  return 1;
+}
+
+size_t wire_pack_str_header(unsigned char *out, size_t len) {
+  if (len < 32) {
+    out[0] = (unsigned char)(0xa0 | len);
+    return 1;
+  }
+  if (len <= 0xff) return pack_typed(out, 0xd9, len, 1);
+  if (len <= 0xffff) return pack_typed(out, 0xda, len, 2);
+  return pack_typed(out, 0xdb, len, 4);
+}
+
+size_t wire_pack_map32(unsigned char *out, uint32_t count) {
+  return pack_typed(out, 0xdf, count, 4);
+}
+
+size_t wire_pack_array32(unsigned char *out, uint32_t count) {
+  return pack_typed(out, 0xdd, count, 4);
+}
+
+void wire_patch_count(unsigned char *header, uint32_t count) {
+  put_be(header + 1, count, 4);
+}
+
+// Smallest map or array header for a known count
+static size_t pack_count(unsigned char *out, uint32_t count, int is_map) {
+  if (count < 16) {
+    out[0] = (unsigned char)((is_map ? 0x80 : 0x90) | count);
+    return 1;
+  }
+  if (count <= 0xffff) return pack_typed(out, is_map ? 0xde : 0xdc, count, 2);
+  return pack_typed(out, is_map ? 0xdf : 0xdd, count, 4);
+}
+
+static int is_integral(double value) {
+  return value > -9e15 && value < 9e15 && value == (double)(long long)value;
+}
+
+// With out NULL nothing is written and only the size is worked out
+static size_t pack_string(const char *text, unsigned char *out) {
+  unsigned char scratch[WIRE_PACK_MAX];
+  size_t len = text ? strlen(text) : 0;
+  size_t n = wire_pack_str_header(out ? out : scratch, len);
+
+  if (out && len > 0) memcpy(out + n, text, len);
+  return n + len;
+}
+
+static size_t pack_item(const cJSON *item, unsigned char *out) {
+  unsigned char scratch[WIRE_PACK_MAX];
+  unsigned char *head = out ? out : scratch;
+
+  if (cJSON_IsObject(item) || cJSON_IsArray(item)) {
+    int is_map = cJSON_IsObject(item);
+    uint32_t count = 0;
+    for (const cJSON *child = item->child; child; child = child->next) count++;
+
+    size_t n = pack_count(head, count, is_map);
+    for (const cJSON *child = item->child; child; child = child->next) {
+      if (is_map) n += pack_string(child->string, out ? out + n : NULL);
+      n += pack_item(child, out ? out + n : NULL);
+    }
+    return n;
+  }
+
+  if (cJSON_IsString(item) || cJSON_IsRaw(item)) return pack_string(item->valuestring, out);
+  if (cJSON_IsNumber(item)) {
+    if (is_integral(item->valuedouble)) return wire_pack_int(head, (long long)item->valuedouble);
+    return wire_pack_double(head, item->valuedouble);
+  }
+  if (cJSON_IsBool(item)) return wire_pack_bool(head, cJSON_IsTrue(item));
+  return wire_pack_nil(head);
+}
+
+char *wire_encode(const cJSON *item, WireEncoding encoding, size_t *len) {
+  if (encoding == WIRE_JSON) {
+    char *text = cJSON_PrintUnformatted(item);
+    *len = text ? strlen(text) : 0;
+    return text;
+  }
+
+  size_t size = pack_item(item, NULL);
+  unsigned char *out = cJSON_malloc(size);
+  if (!out) return NULL;
+
+  pack_item(item, out);
+  *len = size;
+  return (char *)out;
+}
+
+// --- unpacking -------------------------------------------------------------
+
+typedef struct {
+  const unsigned char *pos;
+  const unsigned char *end;
+} Reader;
+
+static const unsigned char *take(Reader *r, size_t n) {
+  if ((size_t)(r->end - r->pos) < n) return NULL;
+  const unsigned char *at = r->pos;
+  r->pos += n;
+  return at;
+}
+
+static int take_be(Reader *r, int bytes, uint64_t *value) {
+  const unsigned char *at = take(r, bytes);
+  if (!at) return -1;
+
+  *value = 0;
+  for (int i = 0; i < bytes; i++) *value = (*value << 8) | at[i];
+  return 0;
+}
+
+// A NUL-terminated copy owned by the caller, allocated like any cJSON string
+static char *take_string(Reader *r, size_t len) {
+  const unsigned char *at = take(r, len);
+  if (!at) return NULL;
+
+  char *text = cJSON_malloc(len + 1);
+  if (!text) return NULL;
+  memcpy(text, at, len);
+  text[len] = '\0';
+  return text;
+}
+
+// Length of a str or bin value, from its type byte
+static int string_length(Reader *r, unsigned char type, size_t *len) {
+  uint64_t value;
+
+  if ((type & 0xe0) == 0xa0) {
+    *len = type & 0x1f;
+    return 0;
+  }
+  switch (type) {
+    case 0xc4: case 0xd9: if (take_be(r, 1, &value)) return -1; break;
+    case 0xc5: case 0xda: if (take_be(r, 2, &value)) return -1; break;
+    case 0xc6: case 0xdb: if (take_be(r, 4, &value)) return -1; break;
+    default: return -1;
+  }
+  *len = value;
+  return 0;
+}
+
+static cJSON *string_item(char *text) {
+  cJSON *item = text ? cJSON_CreateNull() : NULL;
+  if (!item) {
+    cJSON_free(text);
+    return NULL;
+  }
+
+  item->type = cJSON_String;
+  item->valuestring = text;
+  return item;
+}
+
+static cJSON *read_item(Reader *r, int depth);
+
+static cJSON *read_container(Reader *r, uint64_t count, int is_map, int depth) {
+  // Every element takes at least a byte, which bounds the count a payload can claim
+  if (depth >= WIRE_MAX_DEPTH || count > (uint64_t)(r->end - r->pos)) return NULL;
+
+  cJSON *container = is_map ? cJSON_CreateObject() : cJSON_CreateArray();
+  if (!container) return NULL;
+
+  for (uint64_t i = 0; i < count; i++) {
+    char *key = NULL;
+    if (is_map) {
+      const unsigned char *type = take(r, 1);
+      size_t len;
+      if (!type || string_length(r, *type, &len) || !(key = take_string(r, len))) goto fail;
+    }
+
+    cJSON *value = read_item(r, depth + 1);
+    if (!value) {
+      cJSON_free(key);
+      goto fail;
+    }
+    value->string = key;
+    cJSON_AddItemToArray(container, value);
+  }
+  return container;
+
+fail:
+  cJSON_Delete(container);
+  return NULL;
+}
+
+static cJSON *read_item(Reader *r, int depth) {
+  const unsigned char *at = take(r, 1);
+  if (!at) return NULL;
+
+  unsigned char type = *at;
+  uint64_t value;
+  size_t len;
+
+  if (type <= 0x7f) return cJSON_CreateNumber(type);
+  if (type >= 0xe0) return cJSON_CreateNumber((int8_t)type);
+  if ((type & 0xf0) == 0x80) return read_container(r, type & 0x0f, 1, depth);
+  if ((type & 0xf0) == 0x90) return read_container(r, type & 0x0f, 0, depth);
+  if (string_length(r, type, &len) == 0) return string_item(take_string(r, len));
+
+  switch (type) {
+    case 0xc0: return cJSON_CreateNull();
+    case 0xc2: return cJSON_CreateFalse();
+    case 0xc3: return cJSON_CreateTrue();
+
+    case 0xcc: case 0xcd: case 0xce: case 0xcf: {
+      int bytes = 1 << (type - 0xcc);
+      if (take_be(r, bytes, &value)) return NULL;
+      return cJSON_CreateNumber((double)value);
+    }
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+      int bytes = 1 << (type - 0xd0);
+      if (take_be(r, bytes, &value)) return NULL;
+      // Sign-extend from the encoded width
+      int shift = 64 - bytes * 8;
+      return cJSON_CreateNumber((double)((int64_t)(value << shift) >> shift));
+    }
+    case 0xca: {
+      float single;
+      uint32_t bits;
+      if (take_be(r, 4, &value)) return NULL;
+      bits = (uint32_t)value;
+      memcpy(&single, &bits, sizeof(single));
+      return cJSON_CreateNumber(single);
+    }
+    case 0xcb: {
+      double number;
+      if (take_be(r, 8, &value)) return NULL;
+      memcpy(&number, &value, sizeof(number));
+      return cJSON_CreateNumber(number);
+    }
+
+    case 0xdc: if (take_be(r, 2, &value)) return NULL; return read_container(r, value, 0, depth);
+    case 0xdd: if (take_be(r, 4, &value)) return NULL; return read_container(r, value, 0, depth);
+    case 0xde: if (take_be(r, 2, &value)) return NULL; return read_container(r, value, 1, depth);
+    case 0xdf: if (take_be(r, 4, &value)) return NULL; return read_container(r, value, 1, depth);
+
+    default:
+      // Extension types have no JSON counterpart
+      return NULL;
+  }
+}
+
+cJSON *wire_decode(const char *payload, size_t len) {
+  if (wire_detect(payload, len) == WIRE_JSON) return cJSON_ParseWithLength(payload, len);
+
+  Reader r = { (const unsigned char *)payload, (const unsigned char *)payload + len };
+  cJSON *item = read_item(&r, 0);
+  if (item && r.pos != r.end) {
+    cJSON_Delete(item);
+    return NULL;
+  }
+  return item;
+}
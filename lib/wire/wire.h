@@ -0,0 +1,83 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../cjson/cJSON.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Payload encodings carried inside frames between the logic and data servers.
+ * JSON is what every tool can read; MessagePack carries the same documents
+ * without number formatting, string escaping or text parsing. A logic server
+ * asks for MessagePack with a HELLO request once it is connected, and the data
+ * server answers each request in the encoding it arrived in. Both tell the two
+ * apart by the first byte: a MessagePack document is always a map, and no
+ * JSON text starts with a map marker.
+ */
+
+typedef enum { WIRE_JSON, WIRE_MSGPACK } WireEncoding;
+
+// Longest header wire_pack_* writes: a type byte and an 8-byte value
+#define WIRE_PACK_MAX 9
+// Map and array headers left to be patched once the count is known
+#define WIRE_PACK_COUNT32 5
+
+/**
+ * @brief Tell which encoding a payload uses
+ */
+WireEncoding wire_detect(const char *payload, size_t len);
+
+/**
+ * @brief "json" or "msgpack"
+ */
+const char *wire_encoding_name(WireEncoding encoding);
+
+/**
+ * @brief Look up an encoding by name
+ * @return 0 on success, -1 for an unknown name
+ */
+int wire_encoding_parse(const char *name, WireEncoding *encoding);
+
+/**
+ * @brief Parse a payload in either encoding into a cJSON tree
+ * Nodes come from the cJSON allocation hooks, like cJSON_Parse.
+ * @return The tree, or NULL when the payload is malformed
+ */
+cJSON *wire_decode(const char *payload, size_t len);
+
+/**
+ * @brief Serialize a cJSON tree
+ * @param len Set to the number of bytes returned
+ * @return A buffer to release with cJSON_free, NULL when out of memory
+ */
+char *wire_encode(const cJSON *item, WireEncoding encoding, size_t *len);
+
+/*
+ * MessagePack building blocks for writers that stream a document themselves.
+ * Each writes at most WIRE_PACK_MAX bytes to out and returns how many.
+ */
+size_t wire_pack_int(unsigned char *out, long long value);
+size_t wire_pack_double(unsigned char *out, double value);
+size_t wire_pack_bool(unsigned char *out, int value);
+size_t wire_pack_nil(unsigned char *out);
+size_t wire_pack_str_header(unsigned char *out, size_t len);
+
+/**
+ * @brief Write a map or array header with a 32-bit count
+ * The count can be rewritten in place with wire_patch_count once the
+ * elements have been written.
+ * @return WIRE_PACK_COUNT32
+ */
+size_t wire_pack_map32(unsigned char *out, uint32_t count);
+size_t wire_pack_array32(unsigned char *out, uint32_t count);
+void wire_patch_count(unsigned char *header, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WIRE_H
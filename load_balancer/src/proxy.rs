@@ -3,7 +3,6 @@ use std::fs;
 use std::net::SocketAddr;
 use std::path::Path;
 use std::str;
-use std::sync::atomic::{AtomicUsize, Ordering};
 use std::sync::Arc;
 use std::time::{Duration, Instant};
 use tokio::io::AsyncWriteExt;
@@ -13,6 +12,10 @@ use tokio::sync::Mutex;
 use crate::config::Config;
 
 const TIMEOUT: u64 = 2;
+// Weight of a backend with nothing in flight
+const IDLE_WEIGHT: u64 = 10_000;
+// Tail latency above which a backend's weight starts shrinking
+const P99_TARGET_US: u64 = 5_000;
 
 #[derive(Debug, Clone)]
 pub struct Server {
@@ -21,6 +24,77 @@ pub struct Server {
     pub tcp_addr: SocketAddr,
     pub last_heartbeat: Option<Instant>,
     pub is_up: bool,
+    pub load: Load,
+    pub credit: i64,
+}
+
+/// Load a backend reports with each heartbeat: "OK inflight=3 util=40 queue=0 p99_us=850".
+/// A bare "OK" reads as an idle backend.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Load {
+    pub in_flight: u64,
+    pub utilization: u64,
+    pub queue_depth: u64,
+    pub p99_us: u64,
+}
+
+impl Load {
+    /// Unknown keys are skipped, so backends can report more than this understands
+    fn parse(fields: &str) -> Self {
+        let mut load = Load::default();
+        for field in fields.split_whitespace() {
+            let Some((key, value)) = field.split_once('=') else {
+                continue;
+            };
+            let Ok(value) = value.parse::<u64>() else {
+                continue;
+            };
+            match key {
+                "inflight" => load.in_flight = value,
+                "util" => load.utilization = value.min(100),
+                "queue" => load.queue_depth = value,
+                "p99_us" => load.p99_us = value,
+                _ => {}
+            }
+        }
+        return load;
+    }
+
+    /// Every request in flight or queued divides the idle weight, a busy worker pool and a
+    /// p99 over the target scale it down further. Never 0, so an overloaded backend still
+    /// gets the odd connection instead of being written off until the next heartbeat.
+    fn weight(&self) -> i64 {
+        let mut weight = IDLE_WEIGHT / (1 + self.in_flight + self.queue_depth);
+        weight = weight * (100 - self.utilization.min(90)) / 100;
+        if self.p99_us > P99_TARGET_US {
+            weight = weight * P99_TARGET_US / self.p99_us;
+        }
+        return weight.max(1) as i64;
+    }
+}
+
+/// Smooth weighted round robin over the servers that are up: every pick credits each one its
+/// weight and takes the one with the most credit, which then pays the total back. Picks follow
+/// the weights without bursts, and new weights apply from the next pick on. A pick places a
+/// whole connection, which stays on its server until it closes.
+fn pick_weighted(servers: &mut [Server]) -> Option<SocketAddr> {
+    let mut total = 0;
+    let mut best: Option<usize> = None;
+    for i in 0..servers.len() {
+        if !servers[i].is_up {
+            continue;
+        }
+        let weight = servers[i].load.weight();
+        servers[i].credit += weight;
+        total += weight;
+        if best.map_or(true, |b| servers[i].credit > servers[b].credit) {
+            best = Some(i);
+        }
+    }
+
+    let best = &mut servers[best?];
+    best.credit -= total;
+    return Some(best.tcp_addr);
 }
 
 pub enum ReverseProxy {
@@ -32,7 +106,6 @@ pub struct ReverseProxyFl {
     client_tcp_listening_addr: SocketAddr,
     logic_heartbeat_udp_addr: SocketAddr,
     logic_servers: Mutex<Vec<Server>>,
-    next_index: AtomicUsize,
 }
 
 pub struct ReverseProxyLd {
@@ -42,7 +115,6 @@ pub struct ReverseProxyLd {
     data_servers_tcp_listening_addr: SocketAddr,
     data_servers_hearbeat_udp_addr: SocketAddr,
     data_servers: Arc<Mutex<Vec<Server>>>,
-    next_index: AtomicUsize,
 }
 
 #[derive(Serialize, Deserialize)]
@@ -67,7 +139,6 @@ impl ReverseProxy {
                     client_tcp_listening_addr,
                     logic_heartbeat_udp_addr,
                     logic_servers: Mutex::new(backend_servers),
-                    next_index: AtomicUsize::new(0),
                 });
             }
 
@@ -88,7 +159,6 @@ impl ReverseProxy {
                     logic_servers_heartbeat_udp_addr,
                     data_servers: Arc::new(Mutex::new(backend_servers)),
                     logic_servers: Arc::new(Mutex::new(frontend_servers)),
-                    next_index: AtomicUsize::new(0),
                 });
             }
         }
@@ -114,6 +184,8 @@ impl ReverseProxy {
                     udp_addr: udp,
                     last_heartbeat: None,
                     is_up: false,
+                    load: Load::default(),
+                    credit: 0,
                 });
             })
             .collect();
@@ -210,13 +282,14 @@ impl ReverseProxyFl {
                 let mut backends = self_.logic_servers.lock().await;
 
                 match message.as_str() {
-                    "OK" => {
+                    _ if message == "OK" || message.starts_with("OK ") => {
                         if let Some(server) = backends
                             .iter_mut()
                             .filter(|s| s.addr_identifier.is_some())
                             .find(|s| s.addr_identifier.unwrap() == from)
                         {
                             server.last_heartbeat = Some(Instant::now());
+                            server.load = Load::parse(&message[2..]);
                             if !server.is_up {
                                 println!("✅ Server {} is back online!", from);
                             }
@@ -280,6 +353,7 @@ impl ReverseProxyFl {
                             println!("⚠️ Backend {} timed out", backend.udp_addr);
                         }
                         backend.is_up = false;
+                        backend.credit = 0;
                     }
                 }
             }
@@ -289,13 +363,8 @@ impl ReverseProxyFl {
     }
 
     async fn get_available_backend(&self) -> Option<SocketAddr> {
-        let backends = self.logic_servers.lock().await;
-        let available: Vec<_> = backends.iter().filter(|s| s.is_up).collect();
-        if available.is_empty() {
-            return None;
-        }
-        let index = self.next_index.fetch_add(1, Ordering::Relaxed) % available.len();
-        Some(available[index].tcp_addr)
+        let mut backends = self.logic_servers.lock().await;
+        pick_weighted(&mut backends)
     }
 }
 
@@ -470,13 +539,14 @@ impl ReverseProxyLd {
                 let mut servers = servers.lock().await;
 
                 match message.as_str() {
-                    "OK" => {
+                    _ if message == "OK" || message.starts_with("OK ") => {
                         if let Some(server) = servers
                             .iter_mut()
                             .filter(|s| s.addr_identifier.is_some())
                             .find(|s| s.addr_identifier.unwrap() == from)
                         {
                             server.last_heartbeat = Some(Instant::now());
+                            server.load = Load::parse(&message[2..]);
                             if !server.is_up {
                                 println!("✅ {} {} is back online!", role, from);
                             }
@@ -542,6 +612,7 @@ impl ReverseProxyLd {
                             println!("⚠️ Data server {} timed out", server.udp_addr);
                         }
                         server.is_up = false;
+                        server.credit = 0;
                     }
                 }
             }
@@ -554,6 +625,7 @@ impl ReverseProxyLd {
                             println!("⚠️ Logic server {} timed out", server.udp_addr);
                         }
                         server.is_up = false;
+                        server.credit = 0;
                     }
                 }
             }
@@ -562,22 +634,12 @@ impl ReverseProxyLd {
     }
 
     async fn get_available_backend(&self) -> Option<SocketAddr> {
-        let backends = self.data_servers.lock().await;
-        let available: Vec<_> = backends.iter().filter(|s| s.is_up).collect();
-        if available.is_empty() {
-            return None;
-        }
-        let index = self.next_index.fetch_add(1, Ordering::Relaxed) % available.len();
-        Some(available[index].tcp_addr)
+        let mut backends = self.data_servers.lock().await;
+        pick_weighted(&mut backends)
     }
 
     async fn get_available_frontend(&self) -> Option<SocketAddr> {
-        let frontends = self.logic_servers.lock().await;
-        let available: Vec<_> = frontends.iter().filter(|s| s.is_up).collect();
-        if available.is_empty() {
-            return None;
-        }
-        let index = self.next_index.fetch_add(1, Ordering::Relaxed) % available.len();
-        Some(available[index].tcp_addr)
+        let mut frontends = self.logic_servers.lock().await;
+        pick_weighted(&mut frontends)
     }
 }
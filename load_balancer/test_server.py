@@ -14,6 +14,7 @@ parser.add_argument('--backend-tcp-port', type=int, required=True)
 parser.add_argument('--backend-udp-ip', default='0.0.0.0')
 parser.add_argument('--backend-udp-port', type=int, required=True)
 parser.add_argument('--heartbeat-interval', type=float, default=1.0)
+parser.add_argument('--load', default='', help='load reported with each OK, e.g. "inflight=3 util=40 queue=0 p99_us=850"')
 
 args = parser.parse_args()
 
@@ -37,7 +38,7 @@ def send_heartbeat(udp_sock):
             if send_mode == "ADDR":
                 msg = f"{args.backend_tcp_ip}:{args.backend_tcp_port} {args.backend_udp_ip}:{args.backend_udp_port}".encode()
             elif send_mode == "OK":
-                msg = b"OK"
+                msg = f"OK {args.load}".strip().encode()
             else:
                 msg = b"UNKNOWN"
         udp_sock.sendto(msg, PROXY_UDP_ADDR)
@@ -1,6 +1,7 @@
 #include "logic_server.h"
 int sd;
 int udp_sd;
+static pid_t udp_daemon_pid;
 
 const char *db_ips[LB_COUNT] = { "10.7.11.159", "10.7.11.159"};
 const char *client_ips[LB_COUNT] = { "10.7.11.159", "10.7.11.159"};
@@ -11,7 +12,8 @@ int client_ports_tcp[LB_COUNT]= {3000, 3100};
 const char *string_tcp_addr = MAKE_ADDR(IP, TCP_PORT);
 const char *string_udp_addr = MAKE_ADDR(IP, UDP_PORT);
 static const char *HMAC_SECRET = "mi_secreto_super_fuerte";
-static CurrentRequest current_request = {0};
+static DbLink db_link = {0};
+static WireEncoding db_encoding = WIRE_MSGPACK; // DB_ENCODING, asked for on every DB link
 
 #define CESAR_SHIFT 1  // Desplazamiento fijo para el cifrado
 #define CESAR_MAGIC_HEADER "CESAR:"
@@ -110,6 +112,7 @@ const ErrorResponse ERROR_DB_UNAVAILABLE = {503, "Service unavailable: all DB lo
 const ErrorResponse ERROR_DB_CONNECTION = {500, "DB connection error"};
 const ErrorResponse ERROR_INVALID_DB_RESPONSE = {500, "Invalid DB response"};
 const ErrorResponse ERROR_INVALID_CREDENTIALS = {401, "Invalid credentials"};
+const ErrorResponse ERROR_TOO_MANY_PENDING = {503, "Too many requests in flight"};
 
 const ActionValidation validation_rules[] = {
     {VALIDATE_USER, {"key", "password", NULL}},
@@ -123,6 +126,8 @@ const ActionValidation validation_rules[] = {
     {GET_CHAT_INFO, {"chat_id", NULL}},
     {REMOVE_FROM_CHAT, {"chat_id", "participant_ids", NULL}},
     {EXIT_CHAT, {"chat_id", NULL}},
+    {SUBSCRIBE, {NULL}},
+    {BATCH, {"requests", NULL}},
     {PING, {NULL}}
 };
 
@@ -134,7 +139,10 @@ void abort_handler(int sig) {
 }
 
 void sigchld_handler(int sig) {
-    while(waitpid(-1, NULL, WNOHANG) > 0);
+    pid_t pid;
+    while((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (server_load && pid != udp_daemon_pid) __atomic_sub_fetch(&server_load->clients, 1, __ATOMIC_RELAXED);
+    }
 }
 
 char* create_error_response(ErrorResponse error) {
@@ -146,46 +154,6 @@ char* create_error_response(ErrorResponse error) {
     return result;
 }
 
-// Function to decrypt using Cesar cipher
-void cesar_decrypt(char *text) {
-    if (!text) return;
-    
-    for (int i = 0; text[i] != '\0'; i++) {
-        char c = text[i];
-        
-        // Only process printable ASCII characters (32-126)
-        if (c >= 32 && c <= 126) {
-            // Shift backward in the printable ASCII range
-            int shifted = c - CESAR_SHIFT;
-            if (shifted < 32) {
-                shifted += 95; // 95 = range of printable characters (126-32+1)
-            }
-            text[i] = (char)shifted;
-        }
-        // Other characters remain unchanged
-    }
-}
-
-// Function to encrypt using Cesar cipher
-void cesar_encrypt(char *text) {
-    if (!text) return;
-    
-    for (int i = 0; text[i] != '\0'; i++) {
-        char c = text[i];
-        
-        // Only process printable ASCII characters (32-126)
-        if (c >= 32 && c <= 126) {
-            // Shift forward in the printable ASCII range
-            int shifted = c + CESAR_SHIFT;
-            if (shifted > 126) {
-                shifted -= 95; // 95 = range of printable characters
-            }
-            text[i] = (char)shifted;
-        }
-        // Other characters remain unchanged
-    }
-}
-
 // Helper function to encrypt and send response
 void send_encrypted_response(int sock, const char *response) {
     char *encrypted = strdup(response);
@@ -194,6 +162,11 @@ void send_encrypted_response(int sock, const char *response) {
     free(encrypted);
 }
 
+// Serializes a request for the data server in the encoding agreed on for db_link
+char *encode_db_request(const cJSON *request, size_t *len) {
+    return wire_encode(request, db_link.encoding, len);
+}
+
 bool validate_request(ACTIONS action, cJSON *json) {
     // Find validation rules for this action
     const ActionValidation *rules = NULL;
@@ -216,7 +189,46 @@ bool validate_request(ACTIONS action, cJSON *json) {
     return true;
 }
 
-char* process_client_request(const char *raw_json, int backend_fd, bool *handled_locally) {
+// Field each action takes the caller's identity in, NULL for the ones that take none
+static const char *identity_field(ACTIONS action) {
+    switch (action) {
+        case CREATE_CHAT: return "created_by";
+        case ADD_TO_GROUP_CHAT: return "added_by";
+        case SEND_MESSAGE: return "sender_id";
+        case REMOVE_FROM_CHAT: return "removed_by";
+        case GET_CHATS: case GET_CHAT_MESSAGES: case EXIT_CHAT: return "user_id";
+        default: return NULL;
+    }
+}
+
+// Every request of a BATCH acts as the token's user, as it would on its own. Logins,
+// sign-ups, subscriptions and nested batches can't be batched.
+static bool prepare_batch(cJSON *json, int user_id) {
+    cJSON *requests = cJSON_GetObjectItemCaseSensitive(json, "requests");
+    cJSON *request;
+    if (!cJSON_IsArray(requests)) return false;
+
+    cJSON_ArrayForEach(request, requests) {
+        cJSON *action_json = cJSON_GetObjectItemCaseSensitive(request, "action");
+        if (!cJSON_IsObject(request) || !cJSON_IsNumber(action_json)) return false;
+
+        ACTIONS action = (ACTIONS)action_json->valueint;
+        const char *field = identity_field(action);
+        if (!field && action != GET_USER_INFO && action != GET_CHAT_INFO) return false;
+        if (!validate_request(action, request)) return false;
+
+        cJSON_DeleteItemFromObject(request, "token");
+        if (field) {
+            cJSON_DeleteItemFromObject(request, field);
+            cJSON_AddNumberToObject(request, field, user_id);
+        }
+    }
+    return true;
+}
+
+// Returns the response for the client when handled locally, otherwise the request to
+// forward to the DB, whose length is set in db_len
+char* process_client_request(const char *raw_json, PendingRequest *pending, bool *handled_locally, size_t *db_len) {
     cJSON *json = cJSON_Parse(raw_json);
     if (!json) {
         log_warn("Invalid JSON from client");
@@ -253,14 +265,9 @@ char* process_client_request(const char *raw_json, int backend_fd, bool *handled
             case VALIDATE_USER: {
                 log_info("Handling VALIDATE_USER");
                 
-                // Clear any previous request
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = VALIDATE_USER;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = VALIDATE_USER;
+                pending->request_json = cJSON_Duplicate(json, 1);
 
                 // Create DB query (without password)
                 cJSON *db_query = cJSON_CreateObject();
@@ -271,7 +278,8 @@ char* process_client_request(const char *raw_json, int backend_fd, bool *handled
                 }
 
                 *handled_locally = false;
-                char *out = cJSON_PrintUnformatted(db_query);
+                cJSON_AddNumberToObject(db_query, "request_id", pending->request_id);
+                char *out = encode_db_request(db_query, db_len);
                 cJSON_Delete(json);
                 cJSON_Delete(db_query);
                 return out;
@@ -280,14 +288,11 @@ char* process_client_request(const char *raw_json, int backend_fd, bool *handled
             case CREATE_USER: {
                 *handled_locally = false;
 
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = CREATE_USER;
-                current_request.request_json = cJSON_Duplicate(json, 1);
-                char *out = cJSON_PrintUnformatted(json);
+                pending->action = CREATE_USER;
+                pending->request_json = cJSON_Duplicate(json, 1);
+                cJSON_AddNumberToObject(json, "request_id", pending->request_id);
+                char *out = encode_db_request(json, db_len);
                 cJSON_Delete(json);
                 return out;
             }
@@ -326,64 +331,44 @@ char* process_client_request(const char *raw_json, int backend_fd, bool *handled
                 // GET_USER_INFO no necesita user_id según la documentación
                 // Solo requiere "key": "username_or_email"
                 // No inyectamos nada
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = GET_USER_INFO;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = GET_USER_INFO;
+                pending->request_json = cJSON_Duplicate(json, 1);
                 log_info("GET_USER_INFO: no injection needed");
                 break;
                 
             case CREATE_CHAT:
                 // Para CREATE_CHAT, inyectar como "created_by"
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = CREATE_CHAT;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = CREATE_CHAT;
+                pending->request_json = cJSON_Duplicate(json, 1);
                 cJSON_ReplaceItemInObject(json, "created_by", cJSON_CreateNumber(user_id));
                 log_info("CREATE_CHAT: injected created_by=%d", user_id);
                 break;
                 
             case ADD_TO_GROUP_CHAT:
                 // Para ADD_TO_GROUP_CHAT, inyectar como "added_by"
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = ADD_TO_GROUP_CHAT;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = ADD_TO_GROUP_CHAT;
+                pending->request_json = cJSON_Duplicate(json, 1);
                 cJSON_ReplaceItemInObject(json, "added_by", cJSON_CreateNumber(user_id));
                 log_info("ADD_TO_GROUP_CHAT: injected added_by=%d", user_id);
                 break;
                 
             case SEND_MESSAGE:
                 // Para SEND_MESSAGE, inyectar como "sender_id"
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = SEND_MESSAGE;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = SEND_MESSAGE;
+                pending->request_json = cJSON_Duplicate(json, 1);
                 cJSON_ReplaceItemInObject(json, "sender_id", cJSON_CreateNumber(user_id));
                 log_info("SEND_MESSAGE: injected sender_id=%d", user_id);
                 break;
                 
             case GET_CHATS:
                 // Para GET_CHATS, inyectar como "user_id"
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = GET_CHATS;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = GET_CHATS;
+                pending->request_json = cJSON_Duplicate(json, 1);
                 cJSON_ReplaceItemInObject(json, "user_id", cJSON_CreateNumber(user_id));
                 log_info("GET_CHATS: injected user_id=%d", user_id);// Handle NULL timestamp case
 				cJSON *timestampChats = cJSON_GetObjectItem(json, "last_update_timestamp");
@@ -400,13 +385,9 @@ char* process_client_request(const char *raw_json, int backend_fd, bool *handled
                 // GET_CHAT_MESSAGES no necesita user_id según la documentación
                 // Solo requiere "chat_id" y opcionalmente "last_update_timestamp"
                 // Pero podríamos inyectar user_id para validación de permisos en el backend
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = GET_CHAT_MESSAGES;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = GET_CHAT_MESSAGES;
+                pending->request_json = cJSON_Duplicate(json, 1);
                 cJSON_AddNumberToObject(json, "user_id", user_id);
                 log_info("GET_CHAT_MESSAGES: injected user_id=%d for permission validation", user_id);
 				cJSON *timestampMessages = cJSON_GetObjectItem(json, "last_update_timestamp");
@@ -420,35 +401,42 @@ char* process_client_request(const char *raw_json, int backend_fd, bool *handled
                 break;
                 
             case GET_CHAT_INFO:
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = GET_CHAT_INFO;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = GET_CHAT_INFO;
+                pending->request_json = cJSON_Duplicate(json, 1);
                 break;
 			case REMOVE_FROM_CHAT:
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = REMOVE_FROM_CHAT;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = REMOVE_FROM_CHAT;
+                pending->request_json = cJSON_Duplicate(json, 1);
                 cJSON_AddNumberToObject(json, "removed_by", user_id);
                 log_info("GET_CHAT_MESSAGES: injected user_id=%d for permission validation", user_id);
                 break;
 			case EXIT_CHAT:
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                }
-                
                 // Store current request
-                current_request.action = EXIT_CHAT;
-                current_request.request_json = cJSON_Duplicate(json, 1);
+                pending->action = EXIT_CHAT;
+                pending->request_json = cJSON_Duplicate(json, 1);
                 cJSON_AddNumberToObject(json, "user_id", user_id);
                 log_info("GET_CHAT_MESSAGES: injected user_id=%d for permission validation", user_id);
+                break;
+			case SUBSCRIBE:
+                // Pushes for this subscription keep coming under its request_id
+                pending->action = SUBSCRIBE;
+                pending->request_json = cJSON_Duplicate(json, 1);
+                cJSON_DeleteItemFromObject(json, "user_id");
+                cJSON_AddNumberToObject(json, "user_id", user_id);
+                log_info("SUBSCRIBE: injected user_id=%d", user_id);
+                break;
+			case BATCH:
+                if (!prepare_batch(json, user_id)) {
+                    log_warn("BATCH holds a request that can't be batched");
+                    cJSON_Delete(json);
+                    *handled_locally = true;
+                    return create_error_response(ERROR_MISSING_FIELDS);
+                }
+                pending->action = BATCH;
+                pending->request_json = cJSON_Duplicate(json, 1);
+                log_info("BATCH: injected user_id=%d into every request", user_id);
                 break;
             default:
                 // Para acciones no especificadas, inyectar como "user_id" por defecto
@@ -457,11 +445,19 @@ char* process_client_request(const char *raw_json, int backend_fd, bool *handled
                 break;
         }
 
+        // Reads may be served by a replica; the position of this client's last write makes
+        // it catch up first, so nobody misses what they just wrote
+        bool is_read = action == GET_USER_INFO || action == GET_CHATS || action == GET_CHAT_MESSAGES || action == GET_CHAT_INFO;
+        if (is_read && db_link.position[0] && !cJSON_HasObjectItem(json, "position")) {
+            cJSON_AddStringToObject(json, "position", db_link.position);
+        }
+
         // Reenviar al backend
         *handled_locally = false;
-        char *forward_json = cJSON_PrintUnformatted(json);
+        cJSON_AddNumberToObject(json, "request_id", pending->request_id);
+        char *forward = encode_db_request(json, db_len);
         cJSON_Delete(json);
-        return forward_json;
+        return forward;
     }
 
     // No debería llegar aquí
@@ -507,8 +503,64 @@ int connect_to_db_balancers(const char **hosts, const int *ports, int count) {
     return -1;
 }
 
-void handle_db_response(int client_sock, char* buffer, int bytes_received, struct pollfd *fds) {
-    cJSON *db_json = cJSON_Parse(buffer);
+// Pending requests are keyed by the request_id sent with them, so responses can be
+// matched no matter the order in which the data server completes them.
+PendingRequest *pending_acquire() {
+    if (db_link.pending_count >= MAX_PENDING_REQUESTS) return NULL;
+
+    for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
+        PendingRequest *pending = &db_link.pending[i];
+        if (!pending->in_use) {
+            memset(pending, 0, sizeof(*pending));
+            pending->in_use = true;
+            pending->request_id = ++db_link.next_request_id;
+            db_link.pending_count++;
+            return pending;
+        }
+    }
+    return NULL;
+}
+
+PendingRequest *pending_find(uint32_t request_id) {
+    for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
+        if (db_link.pending[i].in_use && db_link.pending[i].request_id == request_id) {
+            return &db_link.pending[i];
+        }
+    }
+    return NULL;
+}
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// In flight from here until the DB answers it
+void pending_forwarded(PendingRequest *pending) {
+    if (!pending->forwarded_us && server_load) __atomic_add_fetch(&server_load->in_flight, 1, __ATOMIC_RELAXED);
+    pending->forwarded_us = now_us();
+}
+
+// Records the round trip; pushes to a subscription come unasked and are not counted
+void pending_answered(PendingRequest *pending) {
+    if (!pending->forwarded_us) return;
+
+    server_load_record(now_us() - pending->forwarded_us);
+    if (server_load) __atomic_sub_fetch(&server_load->in_flight, 1, __ATOMIC_RELAXED);
+    pending->forwarded_us = 0;
+}
+
+void pending_release(PendingRequest *pending) {
+    if (pending->forwarded_us && server_load) __atomic_sub_fetch(&server_load->in_flight, 1, __ATOMIC_RELAXED);
+    if (pending->key) free(pending->key);
+    if (pending->request_json) cJSON_Delete(pending->request_json);
+    memset(pending, 0, sizeof(*pending));
+    db_link.pending_count--;
+}
+
+void handle_db_response(int client_sock, const char* buffer, int bytes_received) {
+    cJSON *db_json = wire_decode(buffer, bytes_received);
     if (!db_json) {
         log_warn("Failed to parse DB response");
         char *error_response = create_error_response(ERROR_DB_CONNECTION);
@@ -521,22 +573,38 @@ void handle_db_response(int client_sock, char* buffer, int bytes_received, struc
     cJSON *response_code = cJSON_GetObjectItem(db_json, "response_code");
     bool is_success = response_code && cJSON_IsNumber(response_code) && response_code->valueint == 200;
 
-    // Check if we have a current request
-    if (!current_request.request_json) {
-        log_warn("No current request found for DB response");
+    // Match the response with the request that produced it
+    cJSON *request_id = cJSON_GetObjectItem(db_json, "request_id");
+    PendingRequest *pending = cJSON_IsNumber(request_id) ? pending_find((uint32_t)request_id->valuedouble) : NULL;
+    if (!pending && cJSON_IsNumber(request_id) && request_id->valuedouble == 0) {
+        // A HELLO answer that came after negotiate_db_encoding gave up on it
+        cJSON_Delete(db_json);
+        return;
+    }
+    if (!pending) {
+        log_warn("No pending request found for DB response");
         char *error_response = create_error_response(ERROR_DB_CONNECTION);
 		send_encrypted_response(client_sock, error_response);
         free(error_response);
         cJSON_Delete(db_json);
         return;
     }
+    cJSON_DeleteItemFromObject(db_json, "request_id");
+    pending_answered(pending);
+    bool keep_pending = false;
+
+    // Writes answer with the data server's position once it has replicas
+    cJSON *position = cJSON_GetObjectItem(db_json, "position");
+    if (is_success && cJSON_IsString(position)) {
+        snprintf(db_link.position, sizeof(db_link.position), "%s", position->valuestring);
+    }
 
     // Handle VALIDATE_USER action with different states
-    if (current_request.action == VALIDATE_USER) {
-        switch (current_request.auth_state) {
+    if (pending->action == VALIDATE_USER) {
+        switch (pending->auth_state) {
             case AUTH_STATE_INITIAL: {
                 // First step - validate credentials
-                cJSON *client_password = cJSON_GetObjectItem(current_request.request_json, "password");
+                cJSON *client_password = cJSON_GetObjectItem(pending->request_json, "password");
                 cJSON *db_password = cJSON_GetObjectItem(db_json, "password_hash");
 
                 // Validate credentials
@@ -558,44 +626,34 @@ void handle_db_response(int client_sock, char* buffer, int bytes_received, struc
                 }
 
                 // Store username for next request
-                cJSON *user_key = cJSON_GetObjectItem(current_request.request_json, "key");
+                cJSON *user_key = cJSON_GetObjectItem(pending->request_json, "key");
                 if (user_key && cJSON_IsString(user_key)) {
-                    if (current_request.key) free(current_request.key);
-                    current_request.key = strdup(user_key->valuestring);
+                    if (pending->key) free(pending->key);
+                    pending->key = strdup(user_key->valuestring);
                 }
 
-                // Close current DB connection
-                if (current_request.current_db_sock >= 0) {
-                    close(current_request.current_db_sock);
-                }
+                // Prepare GET_USER_INFO request on the same connection, under the same request_id
+                cJSON *user_info_request = cJSON_CreateObject();
+                cJSON_AddNumberToObject(user_info_request, "action", GET_USER_INFO);
+                cJSON_AddStringToObject(user_info_request, "key", pending->key);
+                cJSON_AddNumberToObject(user_info_request, "request_id", pending->request_id);
 
-                // Create new DB connection for GET_USER_INFO
-                int new_db_sock = connect_to_db_balancers(db_ips, db_ports_tcp, LB_COUNT);
-                if (new_db_sock < 0) {
-                    log_err("Failed to connect to DB for user info");
+                size_t request_len = 0;
+                char *request_str = encode_db_request(user_info_request, &request_len);
+                if (!request_str || frame_send(db_link.sock, request_str, request_len, DB_SEND_TIMEOUT_MS) != 0) {
+                    log_err("Failed to request user info from DB");
                     char *error_response = create_error_response(ERROR_DB_UNAVAILABLE);
 					send_encrypted_response(client_sock, error_response);
                     free(error_response);
-                    break;
+                } else {
+                    // Move to next state
+                    pending->auth_state = AUTH_STATE_VALIDATED;
+                    pending_forwarded(pending);
+                    keep_pending = true;
                 }
 
-                // Update current DB socket and pollfd
-                current_request.current_db_sock = new_db_sock;
-                fds[1].fd = new_db_sock;
-
-                // Prepare GET_USER_INFO request
-                cJSON *user_info_request = cJSON_CreateObject();
-                cJSON_AddNumberToObject(user_info_request, "action", GET_USER_INFO);
-                cJSON_AddStringToObject(user_info_request, "key", current_request.key);
-
-                char *request_str = cJSON_PrintUnformatted(user_info_request);
-                write(new_db_sock, request_str, strlen(request_str));
-                
                 free(request_str);
                 cJSON_Delete(user_info_request);
-
-                // Move to next state
-                current_request.auth_state = AUTH_STATE_VALIDATED;
                 break;
             }
 
@@ -635,17 +693,6 @@ void handle_db_response(int client_sock, char* buffer, int bytes_received, struc
                 free(response_str);
                 cJSON_Delete(response);
 
-                // Clean up
-                if (current_request.key) {
-                    free(current_request.key);
-                    current_request.key = NULL;
-                }
-                if (current_request.request_json) {
-                    cJSON_Delete(current_request.request_json);
-                    current_request.request_json = NULL;
-                }
-                current_request.action = 0;
-                current_request.auth_state = AUTH_STATE_INITIAL;
                 break;
             }
 
@@ -657,18 +704,69 @@ void handle_db_response(int client_sock, char* buffer, int bytes_received, struc
         char *modified = cJSON_PrintUnformatted(db_json);
 		send_encrypted_response(client_sock, modified);
         free(modified);
+
+        // An accepted subscription is answered again with every push, for as long as the link lasts
+        if (pending->action == SUBSCRIBE && is_success) keep_pending = true;
     }
-    
+
+    if (!keep_pending) pending_release(pending);
     cJSON_Delete(db_json);
 }
 
+// Asks the data server for db_encoding before any request goes out. The HELLO itself is
+// JSON, which every data server reads; one that doesn't know it answers 404 and the link
+// stays on JSON, as it does when DB_ENCODING=json.
+void negotiate_db_encoding(void) {
+    db_link.encoding = WIRE_JSON;
+    if (db_encoding == WIRE_JSON) return;
+
+    cJSON *hello = cJSON_CreateObject();
+    cJSON_AddNumberToObject(hello, "action", HELLO);
+    cJSON_AddNumberToObject(hello, "request_id", 0);
+    char *hello_str = cJSON_PrintUnformatted(hello);
+    cJSON_Delete(hello);
+
+    int sent = hello_str && frame_send(db_link.sock, hello_str, strlen(hello_str), DB_SEND_TIMEOUT_MS) == 0;
+    free(hello_str);
+    if (!sent) {
+        log_warn("Failed to send HELLO to DB, using JSON");
+        return;
+    }
+
+    // Nothing else is in flight yet, so the first frame back is the answer
+    struct pollfd pfd = { .fd = db_link.sock, .events = POLLIN };
+    const char *payload;
+    uint32_t payload_len;
+    int status;
+    while ((status = frame_buffer_next(&db_link.input, &payload, &payload_len)) == 0) {
+        if (poll(&pfd, 1, TIMEOUT * 1000) <= 0 || frame_buffer_read(&db_link.input, db_link.sock) <= 0) {
+            log_warn("No HELLO answer from DB, using JSON");
+            return;
+        }
+    }
+    if (status < 0) return;
+
+    cJSON *reply = wire_decode(payload, payload_len);
+    cJSON *encodings = cJSON_GetObjectItem(reply, "encodings");
+    cJSON *name;
+    cJSON_ArrayForEach(name, encodings) {
+        WireEncoding offered;
+        if (cJSON_IsString(name) && wire_encoding_parse(name->valuestring, &offered) == 0 && offered == db_encoding) {
+            db_link.encoding = offered;
+        }
+    }
+    cJSON_Delete(reply);
+
+    log_info("DB link encoding: %s", wire_encoding_name(db_link.encoding));
+}
+
 void handle_client(int client_sock) {
     char buffer[BUFFER_SIZE];
     int bytes_received;
 
-    // Initialize current request
-    current_request.current_db_sock = connect_to_db_balancers(db_ips, db_ports_tcp, LB_COUNT);
-    if (current_request.current_db_sock < 0) {
+    // One DB connection carries every request of this client, several may be in flight
+    db_link.sock = connect_to_db_balancers(db_ips, db_ports_tcp, LB_COUNT);
+    if (db_link.sock < 0) {
         log_err("Failed to connect to DB");
         char *error_response = create_error_response(ERROR_DB_UNAVAILABLE);
 		send_encrypted_response(client_sock, error_response);
@@ -681,13 +779,15 @@ void handle_client(int client_sock) {
     struct timeval tv;
     tv.tv_sec = 15;
     tv.tv_usec = 0;
-    setsockopt(current_request.current_db_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(current_request.current_db_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(db_link.sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(db_link.sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    negotiate_db_encoding();
 
     struct pollfd fds[2];
     fds[0].fd = client_sock;
     fds[0].events = POLLIN;
-    fds[1].fd = current_request.current_db_sock;
+    fds[1].fd = db_link.sock;
     fds[1].events = POLLIN;
 
     while (1) {
@@ -719,18 +819,36 @@ void handle_client(int client_sock) {
 
             log_info("CESAR: Decrypted JSON: %s", decrypted_message);
 
+            PendingRequest *pending = pending_acquire();
+            if (!pending) {
+                log_warn("Pending request table full");
+                char *error_response = create_error_response(ERROR_TOO_MANY_PENDING);
+				send_encrypted_response(client_sock, error_response);
+                free(error_response);
+                free(decrypted_message);
+                continue;
+            }
+
             bool handled_locally = false;
-            char *response = process_client_request(buffer, current_request.current_db_sock, &handled_locally);
+            size_t db_len = 0;
+            char *response = process_client_request(buffer, pending, &handled_locally, &db_len);
         
             if (handled_locally) {
                 // Respuesta manejada localmente
 				send_encrypted_response(client_sock, response);
                 log_info("Sent local response to client: %s", response);
-                free(response);
+                pending_release(pending);
+            } else if (!response || frame_send(db_link.sock, response, db_len, DB_SEND_TIMEOUT_MS) != 0) {
+                log_err("Failed to forward request to DB");
+                char *error_response = create_error_response(ERROR_DB_UNAVAILABLE);
+				send_encrypted_response(client_sock, error_response);
+                free(error_response);
+                pending_release(pending);
             } else {
                 // Reenviar al backend
-                write(current_request.current_db_sock, response, strlen(response));
-                log_info("Forwarded to DB: %s", response);
+                pending_forwarded(pending);
+                log_info("Forwarded to DB (request %u, action %d, %zu bytes of %s)", pending->request_id,
+                         pending->action, db_len, wire_encoding_name(db_link.encoding));
             }
 
             free(response);
@@ -739,7 +857,7 @@ void handle_client(int client_sock) {
 
         // Datos del backend
         if (fds[1].revents & POLLIN) {
-            bytes_received = recv(fds[1].fd, buffer, BUFFER_SIZE - 1, 0);
+            bytes_received = frame_buffer_read(&db_link.input, fds[1].fd);
             if (bytes_received <= 0) {
                 if (errno == EWOULDBLOCK || errno == EAGAIN) {
                     log_warn("DB response timeout");
@@ -751,26 +869,36 @@ void handle_client(int client_sock) {
                 }
                 break;
             }
-            buffer[bytes_received] = '\0';
 
-            log_info("Received response from DB: %s", buffer);
+            // A single recv may hold part of a response or several of them
+            const char *payload;
+            uint32_t payload_len;
+            int status;
+            while ((status = frame_buffer_next(&db_link.input, &payload, &payload_len)) == 1) {
+                if (wire_detect(payload, payload_len) == WIRE_JSON) {
+                    log_info("Received response from DB: %.*s", (int)payload_len, payload);
+                } else {
+                    log_info("Received %u bytes of msgpack from DB", payload_len);
+                }
 
-            // Pass the pollfd structure to handle_db_response
-            handle_db_response(client_sock, buffer, bytes_received, fds);
+                handle_db_response(client_sock, payload, payload_len);
+            }
+            if (status < 0) {
+                log_err("Oversized frame from DB");
+                break;
+            }
         }
     }
 
     // Clean up
-    if (current_request.current_db_sock >= 0) {
-        close(current_request.current_db_sock);
-    }
-    if (current_request.key) {
-        free(current_request.key);
+    if (db_link.sock >= 0) {
+        close(db_link.sock);
     }
-    if (current_request.request_json) {
-        cJSON_Delete(current_request.request_json);
+    for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
+        if (db_link.pending[i].in_use) pending_release(&db_link.pending[i]);
     }
-    memset(&current_request, 0, sizeof(current_request));
+    frame_buffer_free(&db_link.input);
+    memset(&db_link, 0, sizeof(db_link));
 
     close(client_sock);
     log_info("Client handler process exiting");
@@ -826,6 +954,11 @@ int main() {
 
     log_info("Starting Logic Server...");
 
+    const char *encoding = getenv("DB_ENCODING");
+    if (encoding && wire_encoding_parse(encoding, &db_encoding) != 0) {
+        log_warn("Unknown DB_ENCODING %s, using %s", encoding, wire_encoding_name(db_encoding));
+    }
+
     if (signal(SIGINT, abort_handler) == SIG_ERR) {
         log_err("Could not set SIGINT handler");
         return 1;
@@ -864,8 +997,13 @@ int main() {
         return 1;
     }
 
+    if (server_load_init() != 0) {
+        log_warn("Shared load counters unavailable, heartbeats will carry no load");
+    }
+
     // Fork para el daemon UDP
     pid = fork();
+    udp_daemon_pid = pid;
     if (pid == 0) {
         log_info("Starting UDP LB daemon");
         udp_lb_daemon();
@@ -902,6 +1040,7 @@ int main() {
             handle_client(client_sock);
         } else {
             // Proceso padre - cerrar socket del cliente
+            if (server_load) __atomic_add_fetch(&server_load->clients, 1, __ATOMIC_RELAXED);
             close(client_sock);
         }
     }
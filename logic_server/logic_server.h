@@ -1,5 +1,7 @@
 #include "../dbg.h"
 #include "../lib/cjson/cJSON.h"
+#include "../lib/frame/frame.h"
+#include "../lib/wire/wire.h"
 //#include "bcrypt.h"
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -29,7 +31,11 @@
 #define LB_COUNT 2
 #define TIMEOUT 2
 #define MAX_PENDING_REQUESTS 100
+#define DB_SEND_TIMEOUT_MS 15000
+#define DB_POSITION_MAX 256
 #define CESAR_SHIFT 3 
+#define CLIENT_CAPACITY 256       // Clients one server is sized for, what utilization is measured against
+#define LOAD_LATENCY_BUCKETS 128
 
 
 #define STRINGIFY(x) #x
@@ -59,6 +65,9 @@ typedef enum {
 	GET_CHAT_INFO = 9,
 	REMOVE_FROM_CHAT = 10,
 	EXIT_CHAT = 11,
+	HELLO = 12,
+	SUBSCRIBE = 13,
+	BATCH = 14,
   	PING = 100,
 } ACTIONS;
 
@@ -89,14 +98,38 @@ typedef struct {
 } ActionValidation;
 
 typedef struct {
+    bool in_use;
+    uint32_t request_id;  // Sent to the DB and echoed back in its response
     ACTIONS action;
     cJSON *request_json;  // Original request from client
     AuthState auth_state; // For tracking authentication flow
-    char *key;       // Store username between requests
-    int current_db_sock;  // Track the current DB socket
-} CurrentRequest;
+    char *key;            // Store username between requests
+    uint64_t forwarded_us; // When it last went to the DB, 0 once answered
+} PendingRequest;
+
+typedef struct {
+    int sock;             // Persistent connection to the DB load balancer
+    FrameBuffer input;    // Reassembles framed DB responses
+    WireEncoding encoding; // What requests are sent in, agreed on with HELLO
+    uint32_t next_request_id;
+    int pending_count;
+    PendingRequest pending[MAX_PENDING_REQUESTS];
+    char position[DB_POSITION_MAX]; // Last write position the DB returned, sent with reads
+} DbLink;
+
+// Load shared by every process of the server: mapped before the first fork, updated by the
+// accept loop and the client handlers, and reported by the UDP daemon with each heartbeat
+typedef struct {
+    int clients;          // Client handler processes alive
+    int in_flight;        // Requests forwarded to the DB and not answered yet
+    unsigned long latency[LOAD_LATENCY_BUCKETS]; // DB round trips in microseconds, log-bucketed
+} ServerLoad;
+
+extern ServerLoad *server_load;
 
 void udp_lb_daemon();
+int server_load_init(void);
+void server_load_record(uint64_t us);
 bool validate_token(const char *jwt, int *out_user_id);
 char *create_token(int user_id);
 bool verify_password(const char *input_pass, const char *hashed_pass);
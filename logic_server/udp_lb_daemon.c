@@ -1,11 +1,87 @@
 // udp_lb_daemon.c
 
 #include "logic_server.h"
+#include <netinet/tcp.h>
+#include <sys/mman.h>
 
 #define MESSAGE_INTERVAL 1  // seconds between messages
 
 UdpLoadBalancer db_lbs[LB_COUNT];
 UdpLoadBalancer client_lbs[LB_COUNT];
+ServerLoad *server_load;
+
+extern int sd;
+
+int server_load_init(void) {
+    server_load = mmap(NULL, sizeof(ServerLoad), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (server_load == MAP_FAILED) {
+        server_load = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Every power of two is split in 4 steps, below 8 us each microsecond has its own bucket
+static int latency_bucket(uint64_t us) {
+    if (us < 8) return (int)us;
+
+    int exponent = 63 - __builtin_clzll(us);
+    int index = (exponent - 1) * 4 + (int)((us >> (exponent - 2)) & 3);
+    return index < LOAD_LATENCY_BUCKETS ? index : LOAD_LATENCY_BUCKETS - 1;
+}
+
+// Exclusive upper edge of a bucket
+static unsigned long latency_limit(int index) {
+    if (index < 8) return index + 1;
+
+    int exponent = index / 4 + 1;
+    return (4 + index % 4 + 1) * (1ul << (exponent - 2));
+}
+
+void server_load_record(uint64_t us) {
+    if (server_load) __atomic_add_fetch(&server_load->latency[latency_bucket(us)], 1, __ATOMIC_RELAXED);
+}
+
+// p99 of the round trips recorded since the previous call, 0 when there were none
+static unsigned long recent_p99(void) {
+    static unsigned long seen[LOAD_LATENCY_BUCKETS];
+    unsigned long delta[LOAD_LATENCY_BUCKETS], count = 0;
+
+    for (int i = 0; i < LOAD_LATENCY_BUCKETS; i++) {
+        unsigned long now = __atomic_load_n(&server_load->latency[i], __ATOMIC_RELAXED);
+        delta[i] = now - seen[i];
+        seen[i] = now;
+        count += delta[i];
+    }
+    if (count == 0) return 0;
+
+    unsigned long rank = (count * 99 + 99) / 100, passed = 0;
+    for (int i = 0; i < LOAD_LATENCY_BUCKETS; i++) {
+        passed += delta[i];
+        if (passed >= rank) return latency_limit(i);
+    }
+    return latency_limit(LOAD_LATENCY_BUCKETS - 1);
+}
+
+// The heartbeat a paired load balancer gets: OK followed by the current load
+static void format_ok(char *message, size_t size) {
+    if (!server_load) {
+        snprintf(message, size, "OK");
+        return;
+    }
+
+    int clients = __atomic_load_n(&server_load->clients, __ATOMIC_RELAXED);
+    int utilization = clients * 100 / CLIENT_CAPACITY;
+
+    // For a listening socket the kernel reports its accept queue as the unacked count
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    int queue = getsockopt(sd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0 ? (int)info.tcpi_unacked : 0;
+
+    snprintf(message, size, "OK inflight=%d util=%d queue=%d p99_us=%lu",
+             __atomic_load_n(&server_load->in_flight, __ATOMIC_RELAXED),
+             utilization < 100 ? utilization : 100, queue, recent_p99());
+}
 
 
 void init_udp_load_balancers() {
@@ -30,6 +106,7 @@ void udp_lb_daemon() {
     int sockfd;
     struct sockaddr_in local_addr;
     char message[BUFFER_SIZE];
+    char ok_message[BUFFER_SIZE];
 
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         log_err("UDP socket");
@@ -59,6 +136,7 @@ void udp_lb_daemon() {
         time_t now = time(NULL);
         if (now - last_sent >= MESSAGE_INTERVAL) {
             snprintf(message, sizeof(message), "%s %s", string_tcp_addr, string_udp_addr);
+            format_ok(ok_message, sizeof(ok_message));
 
             for (int i = 0; i < LB_COUNT; i++) {
                 UdpLoadBalancer *lb[] = { &client_lbs[i], &db_lbs[i] };
@@ -68,9 +146,9 @@ void udp_lb_daemon() {
                                (struct sockaddr *)&lb[j]->addr, sizeof(lb[j]->addr));
 						log_info("Sent ADDRR to %s:%d", (char *)inet_ntoa(lb[j]->addr.sin_addr), ntohs(lb[j]->addr.sin_port));
                     } else {
-                        sendto(sockfd, "OK", 2, 0,
+                        sendto(sockfd, ok_message, strlen(ok_message), 0,
                                (struct sockaddr *)&lb[j]->addr, sizeof(lb[j]->addr));
-						log_info("Sent OK to %s:%d", (char *)inet_ntoa(lb[j]->addr.sin_addr), ntohs(lb[j]->addr.sin_port));
+						log_info("Sent %s to %s:%d", ok_message, (char *)inet_ntoa(lb[j]->addr.sin_addr), ntohs(lb[j]->addr.sin_port));
                     }
                 }
             }